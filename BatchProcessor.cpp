@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#include "BatchProcessor.h"
+#include "FilterGraph.h"
+#include "FrameSource.h"
+#include "ThreadPool.h"
+#include "Video.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  const char *VIDEO_EXTENSIONS[] = { ".avi", ".mp4", ".mkv", ".mov", ".mpg", ".mpeg", ".m4v", ".wmv", ".webm" };
+  const char *IMAGE_EXTENSIONS[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff" };
+
+  // ".MP4" of "dir/clip.MP4" as ".mp4", empty if there is none
+  string extensionOf(const string &path)
+  {
+    const size_t slash = path.find_last_of("/\\");
+    const size_t dot = path.find_last_of('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+      return "";
+    string extension = path.substr(dot);
+    transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)tolower(c); });
+    return extension;
+  }
+
+  // "dir/clip.mp4" -> "clip"
+  string stemOf(const string &path)
+  {
+    const size_t slash = path.find_last_of("/\\");
+    const string name = slash == string::npos ? path : path.substr(slash + 1);
+    const size_t dot = name.find_last_of('.');
+    return dot == string::npos ? name : name.substr(0, dot);
+  }
+
+  template<size_t N>
+  bool hasExtension(const string &path, const char *(&extensions)[N])
+  {
+    const string extension = extensionOf(path);
+    return find(begin(extensions), end(extensions), extension) != end(extensions);
+  }
+
+  bool isVideo(const string &path)
+  {
+    return hasExtension(path, VIDEO_EXTENSIONS);
+  }
+
+  bool isImage(const string &path)
+  {
+    return hasExtension(path, IMAGE_EXTENSIONS);
+  }
+
+  bool isDirectory(const string &path)
+  {
+#ifdef _WIN32
+    struct _stat64 info;
+    return _stat64(path.c_str(), &info) == 0 && (info.st_mode & _S_IFDIR) != 0;
+#else
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+  }
+
+  // The size of a file, 0 if it isn't there
+  uint64_t fileBytes(const string &path)
+  {
+#ifdef _WIN32
+    struct _stat64 info;
+    return _stat64(path.c_str(), &info) == 0 ? (uint64_t)info.st_size : 0;
+#else
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? (uint64_t)info.st_size : 0;
+#endif
+  }
+
+  bool makeDirectory(const string &path)
+  {
+    if (isDirectory(path))
+      return true;
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+    return isDirectory(path);
+  }
+
+  /*
+  The manifest: a line per file that is done, input, its size, the frames and the output,
+  separated by tabs. A file is only taken as done when its size is still the same and the
+  output is still there.
+  */
+  struct ManifestEntry
+  {
+    uint64_t bytes = 0;
+    int64_t frames = 0;
+    string output;
+  };
+
+  map<string, ManifestEntry> readManifest(const string &path)
+  {
+    map<string, ManifestEntry> entries;
+    ifstream file(path);
+    string line;
+    while (getline(file, line))
+    {
+      if (line.empty() || line[0] == '#')
+        continue;
+      size_t tabs[3];
+      tabs[0] = line.find('\t');
+      tabs[1] = tabs[0] == string::npos ? string::npos : line.find('\t', tabs[0] + 1);
+      tabs[2] = tabs[1] == string::npos ? string::npos : line.find('\t', tabs[1] + 1);
+      // A line that was cut off halfway (the run was killed while writing it) doesn't count
+      if (tabs[2] == string::npos)
+        continue;
+      ManifestEntry entry;
+      entry.bytes = strtoull(line.substr(tabs[0] + 1, tabs[1] - tabs[0] - 1).c_str(), nullptr, 10);
+      entry.frames = strtoll(line.substr(tabs[1] + 1, tabs[2] - tabs[1] - 1).c_str(), nullptr, 10);
+      entry.output = line.substr(tabs[2] + 1);
+      entries[line.substr(0, tabs[0])] = entry;
+    }
+    return entries;
+  }
+
+  void processImage(BatchResult &result, const FilterGraph &graph)
+  {
+    Mat image = imread(result.input, IMREAD_COLOR);
+    if (image.empty())
+    {
+      result.error = "can't read the image";
+      return;
+    }
+
+    GraphValues values;
+    values.setText("label", stemOf(result.input));
+    values.set("frame", 0);
+    Mat output;
+    graph.run(image, output, values);
+    if (!imwrite(result.output, output))
+    {
+      result.error = "can't write " + result.output;
+      return;
+    }
+    result.frames = 1;
+  }
+
+  void processVideo(BatchResult &result, const FilterGraph &graph, const BatchSettings &settings)
+  {
+    Video video(result.output, make_shared<FileSource>(result.input));
+    video.setFourCC(settings.fourcc);
+    video.setFPS(settings.fps);
+
+    // The output needs the frame size, so read the first frame and start the input again for the pipeline
+    Mat first;
+    if (!video.initializeInput() || !video.read(first) || first.empty())
+    {
+      result.error = "can't read the video";
+      return;
+    }
+    video.closeInput();
+    if (!video.initializeInput() || !video.initializeOutput(first.size()))
+    {
+      result.error = "can't write " + result.output;
+      return;
+    }
+
+    // One worker, so the values are only used by one thread
+    GraphValues values;
+    values.setText("label", stemOf(result.input));
+    int64_t frame_number = 0;
+    const FrameProcessor processor = [&graph, &values, &frame_number](Mat &frame)
+    {
+      values.set("frame", (double)frame_number++);
+      graph.run(frame, frame, values);
+    };
+
+    PipelineSettings pipeline_settings;
+    pipeline_settings.queue_depth = settings.queue_depth;
+    pipeline_settings.workers = 1;
+    pipeline_settings.back_pressure = BackPressure::Block;
+    if (!video.startPipeline(processor, pipeline_settings))
+    {
+      result.error = "can't start the pipeline";
+      return;
+    }
+    // The pipeline ends by itself at the end of the input
+    while (video.isPipelineRunning())
+      this_thread::sleep_for(chrono::milliseconds(10));
+    video.stopPipeline();
+
+    const PipelineStats stats = video.getPipelineStats();
+    result.frames = stats.encoded;
+    if (!stats.error.empty())
+      result.error = stats.error;
+    if (!video.closeOutput() && result.error.empty())
+      result.error = "can't write " + result.output;
+    video.closeInput();
+  }
+}
+
+vector<string> collectBatchInputs(const vector<string> &paths)
+{
+  vector<string> inputs;
+  for (const string &path : paths)
+  {
+    if (!path.empty() && path[0] == '@')
+    {
+      // A list of files, one per line (directories in it are expanded too)
+      ifstream list(path.substr(1));
+      vector<string> listed;
+      string line;
+      while (getline(list, line))
+      {
+        if (!line.empty() && line.back() == '\r')
+          line.pop_back();
+        if (!line.empty() && line[0] != '#')
+          listed.push_back(line);
+      }
+      const vector<string> expanded = collectBatchInputs(listed);
+      inputs.insert(inputs.end(), expanded.begin(), expanded.end());
+    }
+    else if (isDirectory(path))
+    {
+      vector<String> found;
+      glob(path + "/*", found, true);
+      sort(found.begin(), found.end());
+      for (const String &file : found)
+      {
+        if (isVideo(file) || isImage(file))
+          inputs.push_back(file);
+      }
+    }
+    else
+      inputs.push_back(path);
+  }
+  return inputs;
+}
+
+BatchReport runBatch(const vector<string> &inputs, const BatchSettings &settings, const BatchProgress &progress)
+{
+  const auto start = chrono::steady_clock::now();
+  BatchReport report;
+
+  // One graph for the images, and one that makes sure the videos get color frames
+  FilterGraph graph, video_graph;
+  string error;
+  if (!graph.parse(settings.filters, error) || !video_graph.parse(settings.filters, error))
+  {
+    report.error = "wrong filters: " + error;
+    return report;
+  }
+  if (video_graph.outputType(CV_8UC3) != CV_8UC3 && !video_graph.parse("bgr", error))
+  {
+    report.error = "wrong filters: " + error;
+    return report;
+  }
+
+  if (!makeDirectory(settings.output_directory))
+  {
+    report.error = "can't make " + settings.output_directory;
+    return report;
+  }
+  const string manifest_path = settings.manifest.empty() ? settings.output_directory + "/batch.manifest" : settings.manifest;
+  const map<string, ManifestEntry> done = settings.resume ? readManifest(manifest_path) : map<string, ManifestEntry>();
+  const bool new_manifest = !settings.resume || fileBytes(manifest_path) == 0;
+  ofstream manifest(manifest_path, new_manifest ? ios::trunc : ios::app);
+  if (!manifest)
+  {
+    report.error = "can't write " + manifest_path;
+    return report;
+  }
+  if (new_manifest)
+    manifest << "# input\tbytes\tframes\toutput" << endl;
+
+  // Plan the outputs first, the same inputs in the same order get the same names every run
+  map<string, int> names;
+  for (const string &input : inputs)
+  {
+    BatchResult result;
+    result.input = input;
+    result.bytes = fileBytes(input);
+    const string stem = stemOf(input);
+    const int count = ++names[stem];
+    result.output = settings.output_directory + "/" + stem + (count > 1 ? "_" + to_string(count) : "") +
+      (isVideo(input) ? settings.video_extension : extensionOf(input));
+
+    if (!isVideo(input) && !isImage(input))
+      result.error = "not a video or an image";
+    else if (result.bytes == 0)
+      result.error = "can't read the file";
+    else
+    {
+      const auto entry = done.find(input);
+      if (entry != done.end() && entry->second.bytes == result.bytes && entry->second.output == result.output &&
+        fileBytes(result.output) > 0)
+      {
+        result.resumed = true;
+        result.frames = entry->second.frames;
+      }
+    }
+    report.results.push_back(result);
+  }
+
+  const int total = (int)report.results.size();
+  int finished = 0;
+  mutex progress_mutex;
+  auto complete = [&](const BatchResult &result)
+  {
+    lock_guard<mutex> lock(progress_mutex);
+    if (result.error.empty() && !result.resumed)
+      manifest << result.input << '\t' << result.bytes << '\t' << result.frames << '\t' << result.output << endl;
+    ++finished;
+    if (progress)
+      progress(result, finished, total);
+  };
+
+  // Every file has a decoding and an encoding thread of its own, so half the cores is enough
+  const int jobs = settings.jobs > 0 ? settings.jobs : max(1, (int)thread::hardware_concurrency() / 2);
+  ThreadPool pool(jobs);
+  for (BatchResult &result : report.results)
+  {
+    if (!result.error.empty() || result.resumed)
+    {
+      complete(result);
+      continue;
+    }
+
+    BatchResult *target = &result;
+    pool.submit([target, &graph, &video_graph, &settings, &complete]()
+    {
+      const auto file_start = chrono::steady_clock::now();
+      try
+      {
+        if (isVideo(target->input))
+          processVideo(*target, video_graph, settings);
+        else
+          processImage(*target, graph);
+      }
+      catch (const exception &e)
+      {
+        target->error = e.what();
+      }
+      target->seconds = chrono::duration<double>(chrono::steady_clock::now() - file_start).count();
+      complete(*target);
+    });
+  }
+  pool.wait();
+
+  for (const BatchResult &result : report.results)
+  {
+    if (result.resumed)
+      ++report.resumed;
+    else if (!result.error.empty())
+      ++report.failed;
+    else
+    {
+      ++report.processed;
+      report.frames += result.frames;
+      report.bytes += result.bytes;
+    }
+  }
+  report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return report;
+}
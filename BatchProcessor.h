@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+/*!
+  Settings for runBatch(..)
+*/
+struct BatchSettings
+{
+  //! The filter chain for every frame, see FilterGraph.h. $label is the name of the file, $frame the frame number
+  std::string filters = "pixelate(block=8, mirror=1) | text(text=$label, x=8, y=24, size=0.8)";
+  //! Where the outputs go, it is made if it isn't there
+  std::string output_directory = "batch_output";
+  //! The progress manifest, empty means "batch.manifest" in the output directory
+  std::string manifest;
+  //! Skip the files the manifest lists as done (and whose output is still there)
+  bool resume = true;
+  //! The amount of files that are processed at the same time, 0 means one per two cores
+  int jobs = 0;
+  //! The amount of frames each queue of the pipeline of a video can hold, see PipelineSettings
+  size_t queue_depth = 4;
+  //! The codec and frame rate of the video outputs, see Video::setFourCC(..)
+  int fourcc = CV_FOURCC('M', 'P', 'E', 'G');
+  int fps = 30;
+  //! The extension of the video outputs, images keep the one they have
+  std::string video_extension = ".avi";
+};
+
+/*!
+  The outcome of one file of runBatch(..)
+*/
+struct BatchResult
+{
+  std::string input;
+  std::string output;
+  int64_t frames = 0;
+  //! The size of the input file
+  uint64_t bytes = 0;
+  double seconds = 0;
+  //! Done by an earlier run, according to the manifest
+  bool resumed = false;
+  //! Empty, unless it failed
+  std::string error;
+};
+
+/*!
+  All files of runBatch(..) and the totals of the ones it processed
+*/
+struct BatchReport
+{
+  //! In the order of the inputs
+  std::vector<BatchResult> results;
+  //! The totals of this run: without the resumed and the failed files
+  int64_t frames = 0;
+  uint64_t bytes = 0;
+  int processed = 0;
+  int resumed = 0;
+  int failed = 0;
+  //! The wall time of the whole run
+  double seconds = 0;
+  //! Empty, unless the run couldn't start at all (a wrong chain, no output directory)
+  std::string error;
+
+  double framesPerSecond() const
+  {
+    return seconds > 0 ? frames / seconds : 0;
+  }
+
+  //! Megabytes of input files per second
+  double megabytesPerSecond() const
+  {
+    return seconds > 0 ? bytes / 1e6 / seconds : 0;
+  }
+};
+
+//! Called when a file is done, one call at a time
+typedef std::function<void(const BatchResult &result, const int done, const int total)> BatchProgress;
+
+/*!
+  The files to process: a video or an image file as it is, every video and image in a
+  directory (and the directories in it), and every line of "@list.txt". Sorted per
+  directory, so the order (and the output names) are the same every run.
+*/
+std::vector<std::string> collectBatchInputs(const std::vector<std::string> &paths);
+
+/*!
+  Run the same filter chain over many video and image files, offline and on all cores.
+
+  Every file is a job on a ThreadPool, 'jobs' files at the same time. A video runs
+  through the pipeline of a Video (see Video::startPipeline(..)): decoding, filtering
+  and encoding on their own threads, so the three overlap. The queues block instead of
+  dropping frames and hold 'queue_depth' frames each, so the memory of a run is about
+  jobs * 2 * queue_depth frames, whatever the length of the videos. An image is read,
+  filtered and written on the job thread.
+
+  The output of "dir/name.mp4" is "name.avi" in the output directory (name_2.avi, ...
+  when more inputs have that name). A file that is done is added to the manifest right
+  away: a run that is stopped halfway starts again at the files that weren't done, a
+  file that was halfway is done again.
+*/
+/*!
+/param inputs the files, see collectBatchInputs(..)
+/param settings chain, output, manifest and parallelism
+/param progress called for every file that is done, nullptr for none
+*/
+BatchReport runBatch(const std::vector<std::string> &inputs, const BatchSettings &settings = BatchSettings(),
+  const BatchProgress &progress = nullptr);
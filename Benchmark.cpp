@@ -0,0 +1,1792 @@
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ChangeDetector.h"
+#include "ChunkedRecording.h"
+#include "Compositor.h"
+#include "FilterGraph.h"
+#include "FramePyramid.h"
+#include "FrameSource.h"
+#include "KernelRegistry.h"
+#include "GrayConvert.h"
+#include "Helper.h"
+#include "LatencyHistogram.h"
+#include "OverlayRenderer.h"
+#include "Pixelate.h"
+#include "PixelKernels.h"
+#include "SharedFrameRing.h"
+#include "SnapshotService.h"
+#include "StreamManager.h"
+#include "StripeExecutor.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include "Video.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+A headless benchmark of the record loop in main.cpp. It needs no window, no
+keyboard and no camera: the frames are replayed from a raw file (see RawFileSource),
+so every run and every build gets exactly the same input.
+
+Every stage of the loop (capture, pixelate, flip, overlay, encode) is timed per frame
+into its own LatencyHistogram. The result is printed as a table and written as JSON,
+so two builds can be compared for regressions.
+
+--kernel reference runs the old resize/resize/flip steps, --kernel fused (the default,
+like main.cpp) runs pixelateFlip(..).
+
+Before the loop, every optimization is checked against the code it replaced, and both
+are timed on the same frame:
+
+  capture ring  retrieving frames into views reuses the buffers of the ring (checked only)
+  pixelate      pixelateFlip(..) against resize, resize and flip
+  gray          bgrToGray(..) (see GrayConvert.h) in every output format, against
+                cvtColor(..) + convertTo(..)
+  overlay       the labels of the OverlayRenderer against putText(..) (checked only)
+  wall          a wall of 4x4 streams built by a Compositor, against hconcat(..) and vconcat(..)
+  pyramid       a wall of the frame at several sizes from a FramePyramid, against resizes
+                of the full frame
+  graph         a FilterGraph of row filters (fused into one pass), against the same
+                filters one by one
+  snapshot      what a JPEG snapshot costs the loop: SnapshotService::submit(..) against imwrite(..)
+  gate          a filter chain on a mostly static scene through a ChangeGate, against the
+                whole frame
+  kernels       every variant of the pixel kernels (see PixelKernels.h) this CPU runs,
+                against the scalar one
+  shared ring   frames through the SharedFrameRing, to a reader that looks at them where
+                they are and to one that copies them
+
+Every check prints "<name> check: passed" (or FAILED), a failed check ends the benchmark
+with an error. Every section writes its own object into the JSON.
+
+Every mode reports the CPU, the instruction set level it supports and the variant each
+kernel runs. --cpu scalar|sse4.1|avx2|avx512 forces the kernels down to a level, to
+compare the variants in the whole loop or to test the scalar code on a new CPU.
+
+--trace FILE.json also writes a Chrome trace of the record loop (see Trace.h): every
+stage of every frame, to find out what made one particular frame slow.
+
+--streams N runs the multi-stream benchmark instead: 1, 2, 4, ... up to N synthetic
+streams side by side on one ThreadPool (see StreamManager.h), each with the steps of
+the record loop. It shows how the total frame rate scales with the amount of streams.
+
+--stripes N runs the filter chain of one frame (pixelate, blur and overlay) stripe by
+stripe on 1, 2, 4, ... up to N threads (see StripeExecutor.h), on a 4K frame unless
+--size says otherwise. Every run is checked against the chain on the whole frame.
+It shows how the latency of a single frame goes down with more threads.
+
+Usage: Benchmark [--frames N] [--size WxH] [--block B] [--input SOURCE] [--kernel reference|fused]
+                 [--output FILE.avi] [--json FILE.json] [--label NAME] [--cpu LEVEL] [--trace FILE.json]
+       Benchmark --streams N [--threads T] [--frames N] [--size WxH] [--block B] [--json FILE.json]
+       Benchmark --stripes N [--frames N] [--size WxH] [--block B] [--json FILE.json]
+*/
+
+namespace
+{
+  enum Stage
+  {
+    STAGE_CAPTURE,
+    STAGE_PIXELATE,
+    STAGE_FLIP,
+    STAGE_PIXELATE_FLIP,
+    STAGE_OVERLAY,
+    STAGE_ENCODE,
+    STAGE_TOTAL,
+    STAGE_COUNT
+  };
+
+  const char *STAGE_NAMES[STAGE_COUNT] = { "capture", "pixelate", "flip", "pixelate_flip", "overlay", "encode", "total" };
+
+  struct Options
+  {
+    int64_t frames = 300;
+    int warmup = 10;
+    Size size = Size(1920, 1080);
+    int block = 8;
+    string input;
+    bool fused = true;
+    string output = "benchmark.avi";
+    string json = "benchmark.json";
+    string label = "default";
+    //! Run the multi-stream benchmark with up to this many streams (0: the record loop)
+    int streams = 0;
+    //! The amount of pool threads for --streams (0: one per core)
+    int threads = 0;
+    //! Run the stripe benchmark with up to this many threads (0: the record loop)
+    int stripes = 0;
+    //! Whether --size was given
+    bool size_given = false;
+    //! Force the pixel kernels down to this level (see --cpu)
+    CpuLevel cpu = CpuLevel::AVX512;
+    //! Write a Chrome trace of the record loop to this file (empty: no trace)
+    string trace;
+  };
+
+  bool parseOptions(int argc, char **argv, Options &options)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const string argument = argv[i];
+      const bool has_value = i + 1 < argc;
+      if (argument == "--frames" && has_value)
+        options.frames = atoll(argv[++i]);
+      else if (argument == "--warmup" && has_value)
+        options.warmup = atoi(argv[++i]);
+      else if (argument == "--size" && has_value)
+      {
+        if (sscanf(argv[++i], "%dx%d", &options.size.width, &options.size.height) != 2)
+          return false;
+        options.size_given = true;
+      }
+      else if (argument == "--block" && has_value)
+        options.block = atoi(argv[++i]);
+      else if (argument == "--input" && has_value)
+        options.input = argv[++i];
+      else if (argument == "--kernel" && has_value)
+      {
+        const string kernel = argv[++i];
+        if (kernel != "reference" && kernel != "fused")
+          return false;
+        options.fused = kernel == "fused";
+      }
+      else if (argument == "--output" && has_value)
+        options.output = argv[++i];
+      else if (argument == "--json" && has_value)
+        options.json = argv[++i];
+      else if (argument == "--label" && has_value)
+        options.label = argv[++i];
+      else if (argument == "--streams" && has_value)
+        options.streams = atoi(argv[++i]);
+      else if (argument == "--threads" && has_value)
+        options.threads = atoi(argv[++i]);
+      else if (argument == "--stripes" && has_value)
+        options.stripes = atoi(argv[++i]);
+      else if (argument == "--trace" && has_value)
+        options.trace = argv[++i];
+      else if (argument == "--cpu" && has_value)
+      {
+        if (!parseCpuLevel(argv[++i], options.cpu))
+          return false;
+      }
+      else
+        return false;
+    }
+    return options.frames > 0 && options.block >= 0 && options.streams >= 0 && options.threads >= 0 && options.stripes >= 0;
+  }
+
+  uint64_t ticksToNanoseconds(const int64 ticks)
+  {
+    return (uint64_t)(ticks * (1e9 / getTickFrequency()));
+  }
+
+  // Times the scope it lives in into a histogram
+  class ScopedTimer
+  {
+    LatencyHistogram &m_histogram;
+    const int64 m_start;
+
+  public:
+    explicit ScopedTimer(LatencyHistogram &histogram) :
+      m_histogram(histogram),
+      m_start(getTickCount())
+    {
+    }
+
+    ~ScopedTimer()
+    {
+      m_histogram.record(ticksToNanoseconds(getTickCount() - m_start));
+    }
+  };
+
+  // Frames per second if the stage would be the only work
+  double stageFPS(const LatencyHistogram &histogram)
+  {
+    return histogram.sum() == 0 ? 0.0 : histogram.count() * 1e9 / histogram.sum();
+  }
+
+  // How many times faster 'optimized' is than 'reference', on average
+  double speedup(const LatencyHistogram &reference, const LatencyHistogram &optimized)
+  {
+    return reference.mean() / max(1.0, optimized.mean());
+  }
+
+  // The last line of every check, returns 'ok'
+  bool reportCheck(const string &check, const bool ok)
+  {
+    cout << check << " check: " << (ok ? "passed" : "FAILED") << endl;
+    return ok;
+  }
+
+  // The members every JSON file starts with, the caller writes the rest and the closing brace
+  void writeJSONHeader(ostream &json, const char *benchmark, const Options &options)
+  {
+    json << fixed << setprecision(3);
+    json << "{\n";
+    json << "  \"benchmark\": \"" << benchmark << "\",\n";
+    json << "  \"label\": \"" << options.label << "\",\n";
+    json << "  \"build\": \"" << __DATE__ << " " << __TIME__ << "\",\n";
+    json << "  \"width\": " << options.size.width << ",\n";
+    json << "  \"height\": " << options.size.height << ",\n";
+    json << "  \"block\": " << options.block << ",\n";
+  }
+
+  // A member of the top level object: the section writes its own value, an object or an array
+  template <typename Section>
+  void writeJSONSection(ostream &json, const char *name, const Section &section, const bool last = false)
+  {
+    json << "  \"" << name << "\": ";
+    section.writeJSON(json);
+    json << (last ? "\n" : ",\n");
+  }
+
+  // An array of results that write themselves on one line each
+  template <typename Result>
+  void writeJSONArray(ostream &json, const vector<Result> &results, const char *indent)
+  {
+    json << "[\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      json << indent << "  ";
+      results[i].writeJSON(json);
+      json << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << indent << "]";
+  }
+
+  // The record loop as it used to be: resize down, resize up (INTER_NEAREST) and flip
+  void pixelateFlipReference(Mat &frame, const int block)
+  {
+    if (block > 1)
+    {
+      double scale = 1 / (double)block;
+      resize(frame, frame, Size(), scale, scale);
+      resize(frame, frame, Size(), 1 / scale, 1 / scale, INTER_NEAREST);
+    }
+    flip(frame, frame, 1);
+  }
+
+  /*
+  Check pixelateFlip(..) against the reference steps for a range of block sizes.
+  The frame is cropped to a multiple of the block, otherwise the resize pair changes
+  the image size. Colors may differ by 1 (rounding of the two center pixels for even
+  blocks). The pixels on the edge of a block are not compared: the INTER_NEAREST
+  resize computes its source position in floating point, so it may pick the
+  neighbouring block there.
+  */
+  bool verifyPixelate(const Mat &frame)
+  {
+    bool ok = true;
+    for (int block = 2; block <= 17; ++block)
+    {
+      const Rect crop(0, 0, frame.cols - frame.cols % block, frame.rows - frame.rows % block);
+      Mat reference = frame(crop).clone();
+      pixelateFlipReference(reference, block);
+      Mat fused;
+      pixelateFlip(frame(crop), fused, block, true, PixelateMode::Sample);
+
+      if (reference.size() != fused.size())
+      {
+        cerr << "pixelate check: block " << block << " size " << fused.size() << " != " << reference.size() << endl;
+        ok = false;
+        continue;
+      }
+
+      int64_t differing = 0, inner_differing = 0;
+      for (int y = 0; y < fused.rows; ++y)
+      {
+        const Vec3b *expected = reference.ptr<Vec3b>(y);
+        const Vec3b *actual = fused.ptr<Vec3b>(y);
+        const bool edge_row = y % block == 0 || y % block == block - 1;
+        for (int x = 0; x < fused.cols; ++x)
+        {
+          const int distance = max(abs(expected[x][0] - actual[x][0]),
+            max(abs(expected[x][1] - actual[x][1]), abs(expected[x][2] - actual[x][2])));
+          if (distance <= 1)
+            continue;
+          ++differing;
+          const int xm = (fused.cols - 1 - x) % block;
+          if (!edge_row && xm != 0 && xm != block - 1)
+            ++inner_differing;
+        }
+      }
+      if (inner_differing != 0)
+        ok = false;
+      if (differing != 0)
+        cout << "pixelate check: block " << block << ", " << differing << " edge pixels differ, "
+          << inner_differing << " inner pixels differ" << endl;
+    }
+    return reportCheck("pixelate", ok);
+  }
+
+  // The reference steps and the fused kernel, on the same frame
+  struct PixelateResult
+  {
+    int block = 0;
+    LatencyHistogram reference;
+    LatencyHistogram fused;
+
+    void print() const
+    {
+      cout << "Pixelate+flip, block " << block << ": reference " << reference.mean() / 1e3 << "us, fused "
+        << fused.mean() / 1e3 << "us (" << speedup(reference, fused) << "x)" << endl;
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\n";
+      json << "    \"reference_p50_us\": " << reference.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"fused_p50_us\": " << fused.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"speedup\": " << speedup(reference, fused) << "\n";
+      json << "  }";
+    }
+  };
+
+  void comparePixelate(const Mat &frame, const int block, const int iterations, PixelateResult &result)
+  {
+    result.block = block;
+    Mat work, fused;
+    for (int i = 0; i < iterations; ++i)
+    {
+      frame.copyTo(work);
+      {
+        ScopedTimer timer(result.reference);
+        pixelateFlipReference(work, block);
+      }
+      ScopedTimer timer(result.fused);
+      pixelateFlip(frame, fused, block, true);
+    }
+  }
+
+  const GrayFormat GRAY_FORMATS[] = { GrayFormat::Float32, GrayFormat::Float16, GrayFormat::Fixed8_8 };
+  const char *GRAY_FORMAT_NAMES[] = { "float32", "float16", "fixed8.8" };
+  const int GRAY_FORMAT_COUNT = 3;
+
+  // The gray image as main.cpp used to make it: 8 bit gray first, then a second pass to float
+  void grayFloatReference(const Mat &frame, Mat &gray, Mat &gray_float)
+  {
+    cvtColor(frame, gray, COLOR_BGR2GRAY);
+    gray.convertTo(gray_float, CV_32F, 1 / 255.0);
+  }
+
+  // A pixel of any bgrToGray(..) output as a value in [0 .. 1]
+  float normalizedGray(const Mat &gray, const GrayFormat format, const int y, const int x)
+  {
+    if (format == GrayFormat::Float16)
+      return halfToFloat(gray.ptr<uint16_t>(y)[x]);
+    if (format == GrayFormat::Fixed8_8)
+      return gray.ptr<uint16_t>(y)[x] / (255.0f * 256.0f);
+    return gray.ptr<float>(y)[x];
+  }
+
+  /*
+  Check bgrToGray(..) against the two steps it replaces. Floats must be the same (the
+  same integer gray level times the same scale), halves may be off by their precision
+  (1/4096 below 1) and 8.8 fixed point by the rounding the 8 bit gray level does (half
+  a gray level) plus its own (half of 1/256 of a gray level).
+  */
+  bool verifyGray(const Mat &frame)
+  {
+    Mat gray, reference;
+    grayFloatReference(frame, gray, reference);
+
+    const double tolerances[GRAY_FORMAT_COUNT] = { 1e-6, 1 / 4096.0, (0.5 + 0.5 / 256) / 255 };
+    bool ok = true;
+    for (int f = 0; f < GRAY_FORMAT_COUNT; ++f)
+    {
+      Mat fused;
+      bgrToGray(frame, fused, GRAY_FORMATS[f]);
+      double max_error = 0;
+      for (int y = 0; y < frame.rows; ++y)
+      {
+        const float *expected = reference.ptr<float>(y);
+        for (int x = 0; x < frame.cols; ++x)
+          max_error = max(max_error, (double)abs(normalizedGray(fused, GRAY_FORMATS[f], y, x) - expected[x]));
+      }
+      const bool passed = max_error <= tolerances[f];
+      ok = ok && passed;
+      cout << "gray check: " << GRAY_FORMAT_NAMES[f] << " max error " << max_error << " (allowed " << tolerances[f] << ")"
+        << (passed ? "" : " FAILED") << endl;
+    }
+    return reportCheck("gray", ok);
+  }
+
+  /*
+  Check the labels of the OverlayRenderer against the two putText(..) calls it replaces:
+  black with thickness 2, then white with thickness 1. The glyphs are rasterized by putText
+  too, but the renderer puts them on 1/16 pixel positions and blends them itself, so a
+  pixel may be off by a few levels: at most 8, for every printable character at every size.
+  */
+  bool verifyOverlay(const Mat &frame)
+  {
+    const int tolerance = 8;
+    const double sizes[] = { 0.5, 0.8, 1.0, 1.5, 2.0 };
+    vector<string> texts = { "12s [30fps]" };
+    for (int c = ' '; c <= '~'; c += 24)
+    {
+      string text;
+      for (int i = c; i < c + 24 && i <= '~'; ++i)
+        text += (char)i;
+      texts.push_back(text);
+    }
+
+    OverlayRenderer renderer;
+    bool ok = true;
+    for (const double size : sizes)
+    {
+      double max_error = 0;
+      for (const string &text : texts)
+      {
+        // An odd x, and a label that runs over the right edge
+        for (const Point &location : { Point(13, frame.rows / 2), Point(frame.cols - 40, frame.rows / 3) })
+        {
+          Mat reference = frame.clone(), rendered = frame.clone();
+          putText(reference, text, location, FONT_HERSHEY_PLAIN, size, Scalar::all(0), 2, CV_AA);
+          putText(reference, text, location, FONT_HERSHEY_PLAIN, size, Scalar::all(255), 1, CV_AA);
+          renderer.drawText(text, location, size, rendered);
+          max_error = max(max_error, norm(reference, rendered, NORM_INF));
+        }
+      }
+      const bool passed = max_error <= tolerance;
+      ok = ok && passed;
+      cout << "overlay check: size " << size << " max error " << max_error << " (allowed " << tolerance << ")"
+        << (passed ? "" : " FAILED") << endl;
+    }
+    return reportCheck("overlay", ok);
+  }
+
+  /*
+  The memory traffic of one conversion per pixel: the two steps read BGR (3 bytes),
+  write and read the gray image (2 bytes) and write a float (4 bytes). The fused kernel
+  reads BGR and writes its output once.
+  */
+  double grayBytesPerPixel(const int format)
+  {
+    if (format < 0)
+      return 3 + 1 + 1 + 4;
+    return 3 + (GRAY_FORMATS[format] == GrayFormat::Float32 ? 4 : 2);
+  }
+
+  // The two steps and the fused kernel in every format, on the same frame. Format -1 is the two steps.
+  struct GrayResult
+  {
+    double pixels = 0;
+    LatencyHistogram reference;
+    LatencyHistogram fused[GRAY_FORMAT_COUNT];
+
+    const LatencyHistogram &histogram(const int format) const
+    {
+      return format < 0 ? reference : fused[format];
+    }
+
+    const char *name(const int format) const
+    {
+      return format < 0 ? "cvtColor+convertTo" : GRAY_FORMAT_NAMES[format];
+    }
+
+    double gigabytesPerSecond(const int format) const
+    {
+      return pixels * grayBytesPerPixel(format) / max(1.0, histogram(format).mean());
+    }
+
+    void print() const
+    {
+      for (int f = -1; f < GRAY_FORMAT_COUNT; ++f)
+      {
+        cout << "Gray " << name(f) << ": " << histogram(f).mean() / 1e3 << "us, " << gigabytesPerSecond(f) << " GB/s ("
+          << speedup(reference, histogram(f)) << "x)" << endl;
+      }
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "[\n";
+      for (int f = -1; f < GRAY_FORMAT_COUNT; ++f)
+      {
+        json << "    {\"name\": \"" << name(f) << "\", \"p50_us\": " << histogram(f).percentile(0.50) / 1e3
+          << ", \"mean_us\": " << histogram(f).mean() / 1e3 << ", \"bytes_per_pixel\": " << grayBytesPerPixel(f)
+          << ", \"gb_per_second\": " << gigabytesPerSecond(f) << ", \"speedup\": " << speedup(reference, histogram(f)) << "}"
+          << (f + 1 < GRAY_FORMAT_COUNT ? "," : "") << "\n";
+      }
+      json << "  ]";
+    }
+  };
+
+  void compareGray(const Mat &frame, const int iterations, GrayResult &result)
+  {
+    result.pixels = (double)frame.total();
+    Mat gray, reference, fused[GRAY_FORMAT_COUNT];
+    for (int i = 0; i < iterations; ++i)
+    {
+      {
+        ScopedTimer timer(result.reference);
+        grayFloatReference(frame, gray, reference);
+      }
+      for (int f = 0; f < GRAY_FORMAT_COUNT; ++f)
+      {
+        ScopedTimer timer(result.fused[f]);
+        bgrToGray(frame, fused[f], GRAY_FORMATS[f]);
+      }
+    }
+  }
+
+  const int WALL_COLUMNS = 4;
+  const int WALL_ROWS = 4;
+
+  /*
+  The panel of stream i on the monitoring wall: the frame scaled down to a quarter, the
+  odd streams are gray (every panel of the wall is BGR, so they have to be converted)
+  */
+  const Mat &wallSource(const Mat &frame, const Mat &gray, const int i)
+  {
+    return i % 2 == 0 ? frame : gray;
+  }
+
+  // The wall with hconcat(..) per row of panels and vconcat(..) of the rows
+  void wallReference(const Mat &frame, const Mat &gray, const Size &panel, Mat &wall)
+  {
+    vector<Mat> rows;
+    for (int row = 0; row < WALL_ROWS; ++row)
+    {
+      vector<Mat> panels;
+      for (int column = 0; column < WALL_COLUMNS; ++column)
+      {
+        Mat scaled;
+        const Mat &source = wallSource(frame, gray, row * WALL_COLUMNS + column);
+        resize(source, scaled, panel, 0, 0, INTER_AREA);
+        if (scaled.channels() == 1)
+          cvtColor(scaled, scaled, COLOR_GRAY2BGR);
+        panels.push_back(scaled);
+      }
+      Mat row_image;
+      hconcat(panels, row_image);
+      rows.push_back(row_image);
+    }
+    vconcat(rows, wall);
+  }
+
+  void wallCompositor(const Mat &frame, const Mat &gray, Compositor &compositor)
+  {
+    for (int i = 0; i < compositor.getPanelCount(); ++i)
+      compositor.put(i, wallSource(frame, gray, i), INTER_AREA);
+  }
+
+  // The wall from concatenated panels and from a Compositor
+  struct WallResult
+  {
+    LatencyHistogram concat;
+    LatencyHistogram compositor;
+
+    void print() const
+    {
+      cout << "Wall of " << WALL_COLUMNS * WALL_ROWS << " panels: concat " << concat.mean() / 1e3 << "us, compositor "
+        << compositor.mean() / 1e3 << "us (" << speedup(concat, compositor) << "x)" << endl;
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\n";
+      json << "    \"panels\": " << WALL_COLUMNS * WALL_ROWS << ",\n";
+      json << "    \"concat_p50_us\": " << concat.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"compositor_p50_us\": " << compositor.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"speedup\": " << speedup(concat, compositor) << "\n";
+      json << "  }";
+    }
+  };
+
+  /*
+  Check the Compositor wall against the concatenated one (they must be the same) and time
+  both. The Compositor is made once, like a monitoring wall would, so only the panels are
+  written per iteration.
+  */
+  bool compareWall(const Mat &frame, const int iterations, WallResult &result)
+  {
+    Mat gray, reference;
+    cvtColor(frame, gray, COLOR_BGR2GRAY);
+    const Size panel(frame.cols / WALL_COLUMNS, frame.rows / WALL_ROWS);
+    Compositor compositor = Compositor::grid(panel, WALL_COLUMNS, WALL_ROWS);
+
+    wallReference(frame, gray, panel, reference);
+    wallCompositor(frame, gray, compositor);
+    const bool ok = reportCheck("wall", norm(reference, compositor.getCanvas(), NORM_INF) == 0);
+
+    for (int i = 0; i < iterations; ++i)
+    {
+      {
+        ScopedTimer timer(result.concat);
+        wallReference(frame, gray, panel, reference);
+      }
+      ScopedTimer timer(result.compositor);
+      wallCompositor(frame, gray, compositor);
+    }
+    return ok;
+  }
+
+  // The panels of the multi-view wall, as a fraction of the frame: a large view and thumbnails
+  const int PYRAMID_DIVISORS[] = { 2, 3, 4, 4, 6, 6, 8, 8 };
+  const int PYRAMID_PANELS = sizeof(PYRAMID_DIVISORS) / sizeof(PYRAMID_DIVISORS[0]);
+
+  // The panels next to each other, at the top of a canvas as high as the largest
+  Compositor pyramidCompositor(const Size &frame)
+  {
+    vector<Rect> rects;
+    int x = 0;
+    for (int i = 0; i < PYRAMID_PANELS; ++i)
+    {
+      const Size size(frame.width / PYRAMID_DIVISORS[i], frame.height / PYRAMID_DIVISORS[i]);
+      rects.push_back(Rect(Point(x, 0), size));
+      x += size.width;
+    }
+    return Compositor(Size(x, rects[0].height), rects);
+  }
+
+  // Every panel resized from the frame, and from a FramePyramid
+  struct PyramidResult
+  {
+    LatencyHistogram direct;
+    LatencyHistogram pyramid;
+    PyramidStats stats;
+
+    void print() const
+    {
+      cout << "Multi-view of " << PYRAMID_PANELS << " sizes: from the frame " << direct.mean() / 1e3 << "us, pyramid "
+        << pyramid.mean() / 1e3 << "us (" << speedup(direct, pyramid) << "x), " << stats.hits << " levels shared, "
+        << stats.pixels_read * 100 / max<int64_t>(1, stats.pixels_read_direct) << "% of the pixels read" << endl;
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\n";
+      json << "    \"panels\": " << PYRAMID_PANELS << ",\n";
+      json << "    \"direct_p50_us\": " << direct.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"pyramid_p50_us\": " << pyramid.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"speedup\": " << speedup(direct, pyramid) << ",\n";
+      json << "    \"builds\": " << stats.builds << ",\n";
+      json << "    \"hits\": " << stats.hits << ",\n";
+      json << "    \"read_ratio\": " << stats.pixels_read / max(1.0, (double)stats.pixels_read_direct) << "\n";
+      json << "  }";
+    }
+  };
+
+  /*
+  A wall that shows the frame at several sizes: every panel resized from the full frame,
+  against every panel from a FramePyramid. The pyramid is a bit different (its levels are
+  made from smaller levels), so the check is on the PSNR, not on equality.
+  */
+  bool comparePyramid(const Mat &frame, const int iterations, PyramidResult &result)
+  {
+    Compositor reference = pyramidCompositor(frame.size());
+    Compositor levels = pyramidCompositor(frame.size());
+    FramePyramid pyramid;
+
+    for (int i = 0; i < PYRAMID_PANELS; ++i)
+      reference.put(i, frame, INTER_AREA);
+    pyramid.setFrame(frame);
+    for (int i = 0; i < PYRAMID_PANELS; ++i)
+      levels.put(i, pyramid);
+    const double psnr = PSNR(reference.getCanvas(), levels.getCanvas());
+    cout << "pyramid check: PSNR " << psnr << " dB (at least 35)" << endl;
+    const bool ok = reportCheck("pyramid", psnr >= 35);
+
+    for (int n = 0; n < iterations; ++n)
+    {
+      {
+        ScopedTimer timer(result.direct);
+        for (int i = 0; i < PYRAMID_PANELS; ++i)
+          reference.put(i, frame, INTER_AREA);
+      }
+      ScopedTimer timer(result.pyramid);
+      pyramid.setFrame(frame);
+      for (int i = 0; i < PYRAMID_PANELS; ++i)
+        levels.put(i, pyramid);
+    }
+    result.stats = pyramid.getStats();
+    return ok;
+  }
+
+  // Row filters that the FilterGraph fuses into one pass, and the same as whole-frame steps
+  const char *GRAPH_CHAIN = "flip | adjust(gain=1.25, offset=-16) | invert";
+
+  void graphReference(const Mat &frame, Mat &output)
+  {
+    flip(frame, output, 1);
+    output.convertTo(output, -1, 1.25, -16);
+    bitwise_not(output, output);
+  }
+
+  // The steps, the graph on the calling thread and the graph stripe by stripe on a ThreadPool
+  struct GraphResult
+  {
+    LatencyHistogram steps;
+    LatencyHistogram serial;
+    LatencyHistogram parallel;
+
+    void print() const
+    {
+      cout << "Graph " << GRAPH_CHAIN << ": steps " << steps.mean() / 1e3 << "us, fused " << serial.mean() / 1e3 << "us ("
+        << speedup(steps, serial) << "x), fused in parallel " << parallel.mean() / 1e3 << "us (" << speedup(steps, parallel)
+        << "x)" << endl;
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\n";
+      json << "    \"chain\": \"" << GRAPH_CHAIN << "\",\n";
+      json << "    \"steps_p50_us\": " << steps.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"serial_p50_us\": " << serial.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"parallel_p50_us\": " << parallel.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"serial_speedup\": " << speedup(steps, serial) << ",\n";
+      json << "    \"parallel_speedup\": " << speedup(steps, parallel) << "\n";
+      json << "  }";
+    }
+  };
+
+  // Check the graph against the steps and time them all
+  bool compareGraph(const Mat &frame, const int iterations, GraphResult &result)
+  {
+    FilterGraph graph;
+    string error;
+    if (!graph.parse(GRAPH_CHAIN, error))
+    {
+      cerr << "graph check: " << error << endl;
+      return false;
+    }
+    cout << "graph plan:" << endl << graph.describe(frame.type());
+
+    const GraphValues values;
+    Mat reference, serial, parallel;
+    graphReference(frame, reference);
+    graph.run(frame, serial, values);
+    graph.setExecutor(make_shared<StripeExecutor>(make_shared<ThreadPool>()));
+    graph.run(frame, parallel, values);
+    const bool ok = reportCheck("graph", norm(reference, serial, NORM_INF) == 0 && norm(reference, parallel, NORM_INF) == 0);
+
+    for (int i = 0; i < iterations; ++i)
+    {
+      {
+        ScopedTimer timer(result.steps);
+        graphReference(frame, reference);
+      }
+      {
+        ScopedTimer timer(result.parallel);
+        graph.run(frame, parallel, values);
+      }
+    }
+    graph.setExecutor(nullptr);
+    for (int i = 0; i < iterations; ++i)
+    {
+      ScopedTimer timer(result.serial);
+      graph.run(frame, serial, values);
+    }
+    return ok;
+  }
+
+  // What a snapshot costs the thread that takes it, with imwrite(..) and with a SnapshotService
+  struct SnapshotResult
+  {
+    LatencyHistogram imwrite;
+    LatencyHistogram submit;
+
+    void print() const
+    {
+      cout << "Snapshot on the loop: imwrite " << imwrite.mean() / 1e3 << "us, submit " << submit.mean() / 1e3
+        << "us (p99 " << submit.percentile(0.99) / 1e3 << "us)" << endl;
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\n";
+      json << "    \"imwrite_p50_us\": " << imwrite.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"submit_p50_us\": " << submit.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"submit_p99_us\": " << submit.percentile(0.99) / 1e3 << "\n";
+      json << "  }";
+    }
+  };
+
+  /*
+  What a JPEG snapshot costs the thread that takes it: imwrite(..) encodes and writes on
+  it, a SnapshotService only queues the frame. The queue blocks when it's full, so every
+  snapshot is written and the encoding time can't hide in dropped ones.
+  */
+  void compareSnapshot(const Mat &frame, const int iterations, SnapshotResult &result)
+  {
+    const string path = "benchmark_snapshot.jpg";
+    for (int i = 0; i < iterations; ++i)
+    {
+      ScopedTimer timer(result.imwrite);
+      imwrite(path, frame);
+    }
+
+    SnapshotSettings settings;
+    settings.overflow = SnapshotOverflow::Block;
+    SnapshotService snapshots(settings);
+    for (int i = 0; i < iterations; ++i)
+    {
+      ScopedTimer timer(result.submit);
+      snapshots.submit(frame, path);
+    }
+    snapshots.wait();
+    remove(path.c_str());
+  }
+
+  // A chain with an alignment (the blocks), a halo (the blur) and a label, the gate has to get all three right
+  const char *GATE_CHAIN = "pixelate(block=8) | blur(ksize=5) | text(text=$label, x=8, y=24)";
+
+  // The chain on every whole frame and through a ChangeGate, and the recording of the scene
+  struct GateResult
+  {
+    LatencyHistogram full;
+    LatencyHistogram gated;
+    ChangeStats change;
+    //! The tiles the chunked recording stored as repeats
+    double repeated_ratio = 0;
+
+    void print() const
+    {
+      cout << "Static scene " << GATE_CHAIN << ": whole frame " << full.mean() / 1e3 << "us, gated " << gated.mean() / 1e3
+        << "us (" << speedup(full, gated) << "x), unchanged tiles " << change.tileSkipRatio() * 100 << "%, rows skipped "
+        << change.skipRatio() * 100 << "%, repeated in the recording " << repeated_ratio * 100 << "%" << endl;
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\n";
+      json << "    \"chain\": \"" << GATE_CHAIN << "\",\n";
+      json << "    \"full_p50_us\": " << full.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"gated_p50_us\": " << gated.percentile(0.50) / 1e3 << ",\n";
+      json << "    \"speedup\": " << speedup(full, gated) << ",\n";
+      json << "    \"tile_skip_ratio\": " << change.tileSkipRatio() << ",\n";
+      json << "    \"row_skip_ratio\": " << change.skipRatio() << ",\n";
+      json << "    \"saved_ms\": " << change.savedNanoseconds() / 1e6 << ",\n";
+      json << "    \"overhead_ms\": " << change.overhead_ns / 1e6 << ",\n";
+      json << "    \"repeated_tile_ratio\": " << repeated_ratio << "\n";
+      json << "  }";
+    }
+  };
+
+  /*
+  A mostly static scene: the frame with a small square that moves over it. Every frame
+  goes through the chain completely and through a ChangeGate that filters only the rows
+  with a changed tile. With a threshold of 0 the two must be exactly the same. The scene
+  is also recorded to a chunked recording, which stores the unchanged tiles as repeats:
+  the frames it reads back must be the same too, in order and backwards.
+  */
+  bool compareGate(const Mat &frame, const int iterations, GateResult &result)
+  {
+    FilterGraph graph;
+    string error;
+    if (!graph.parse(GATE_CHAIN, error))
+    {
+      cerr << "gate check: " << error << endl;
+      return false;
+    }
+    GraphValues values;
+    values.setText("label", "static scene");
+
+    // The frames are made up front, so drawing the square isn't timed
+    vector<Mat> scene(16);
+    const int square = max(8, frame.rows / 16);
+    for (size_t i = 0; i < scene.size(); ++i)
+    {
+      scene[i] = frame.clone();
+      const int x = (int)i * (frame.cols - square) / (int)scene.size();
+      rectangle(scene[i], Rect(x, frame.rows / 2, square, square), Scalar(0, 0, 255), FILLED);
+    }
+
+    ChangeGate gate(Size(64, 32), 0);
+    const string path = "benchmark_gate.cvchunk";
+    ChunkedFrameWriter writer;
+    writer.open(path, frame.size(), frame.type());
+    bool ok = true;
+    Mat full, gated;
+    for (int i = 0; i < iterations; ++i)
+    {
+      const Mat &input = scene[i % scene.size()];
+      {
+        ScopedTimer timer(result.full);
+        graph.run(input, full, values);
+      }
+      {
+        ScopedTimer timer(result.gated);
+        gate.run(input, gated, 0, graph.drawnRows(input.size(), values), [&](const Mat &src, Mat &result, const vector<Range> &rows)
+        {
+          graph.runRows(src, result, rows, values);
+        });
+      }
+      ok = ok && norm(full, gated, NORM_INF) == 0;
+      writer.write(input, i);
+    }
+    result.change = gate.getStats();
+    result.repeated_ratio = writer.getRepeatedTileCount() / (double)max<int64_t>(1, writer.getTileCount());
+    bool is_recording_ok = writer.close();
+
+    ChunkedFrameReader reader;
+    is_recording_ok = is_recording_ok && reader.open(path) && reader.getFrameCount() == iterations;
+    Mat decoded;
+    for (int i = 0; i < iterations && is_recording_ok; ++i)
+      is_recording_ok = reader.read(i, decoded) && norm(decoded, scene[i % scene.size()], NORM_INF) == 0;
+    for (int i = iterations; i-- > 0 && is_recording_ok;)
+      is_recording_ok = reader.read(i, decoded) && norm(decoded, scene[i % scene.size()], NORM_INF) == 0;
+    reader.close();
+    remove(path.c_str());
+
+    const bool is_gate_ok = reportCheck("gate", ok);
+    return reportCheck("repeated tiles", is_recording_ok) && is_gate_ok;
+  }
+
+  // One variant of a pixel kernel, timed on the frame
+  struct KernelResult
+  {
+    string kernel;
+    CpuLevel level = CpuLevel::Scalar;
+    double mean_ns = 0;
+    bool identical = false;
+  };
+
+  // Every variant of the pixel kernels this CPU runs, and the CPU
+  struct KernelsResult
+  {
+    vector<KernelResult> variants;
+
+    // The mean of the scalar variant of a kernel, for the speedup of the others
+    double scalarMean(const string &kernel) const
+    {
+      for (const KernelResult &result : variants)
+      {
+        if (result.kernel == kernel && result.level == CpuLevel::Scalar)
+          return result.mean_ns;
+      }
+      return 0;
+    }
+
+    void print() const
+    {
+      for (const KernelResult &result : variants)
+      {
+        cout << "Kernel " << result.kernel << " " << cpuLevelName(result.level) << ": " << result.mean_ns / 1e3 << "us ("
+          << scalarMean(result.kernel) / max(1.0, result.mean_ns) << "x)" << endl;
+      }
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      const CpuFeatures &cpu = CpuFeatures::host();
+      json << "{\n";
+      json << "    \"brand\": \"" << cpu.brand << "\",\n";
+      json << "    \"host_level\": \"" << cpuLevelName(cpu.level()) << "\",\n";
+      json << "    \"max_level\": \"" << cpuLevelName(KernelRegistry::getMaxLevel()) << "\",\n";
+      json << "    \"selected\": {";
+      const vector<KernelBase *> kernels = KernelRegistry::kernels();
+      for (size_t k = 0; k < kernels.size(); ++k)
+        json << (k == 0 ? "" : ", ") << "\"" << kernels[k]->getName() << "\": \"" << cpuLevelName(kernels[k]->getLevel()) << "\"";
+      json << "},\n";
+      json << "    \"variants\": [\n";
+      for (size_t r = 0; r < variants.size(); ++r)
+      {
+        const KernelResult &result = variants[r];
+        json << "      {\"kernel\": \"" << result.kernel << "\", \"level\": \"" << cpuLevelName(result.level)
+          << "\", \"mean_us\": " << result.mean_ns / 1e3
+          << ", \"speedup\": " << scalarMean(result.kernel) / max(1.0, result.mean_ns)
+          << ", \"identical\": " << (result.identical ? "true" : "false") << "}"
+          << (r + 1 < variants.size() ? "," : "") << "\n";
+      }
+      json << "    ]\n";
+      json << "  }";
+    }
+  };
+
+  // The CPU and the variant every kernel runs, on the console
+  void printKernels()
+  {
+    const CpuFeatures &cpu = CpuFeatures::host();
+    cout << "CPU: " << (cpu.brand.empty() ? "unknown" : cpu.brand) << ", supports " << cpuLevelName(cpu.level())
+      << ", kernels up to " << cpuLevelName(KernelRegistry::getMaxLevel()) << ":";
+    for (const KernelBase *kernel : KernelRegistry::kernels())
+      cout << " " << kernel->getName() << "=" << cpuLevelName(kernel->getLevel());
+    cout << endl;
+  }
+
+  /*
+  Every variant of the pixel kernels that this CPU runs, on every row of the frame, against
+  the scalar variant. They must give exactly the same result, also for every length of the
+  tail (0 to 130 bytes) that the wide variants handle in a different way.
+  */
+  bool compareKernels(const Mat &frame, const int block, const int iterations, KernelsResult &kernels)
+  {
+    vector<KernelResult> &results = kernels.variants;
+    const CpuLevel host_level = CpuFeatures::host().level();
+    const int bytes = frame.cols * (int)frame.elemSize();
+    Mat shifted;
+    // The rows compared by sad_row: the frame against itself one row down
+    vconcat(frame.rowRange(1, frame.rows), frame.row(0), shifted);
+    vector<uint32_t> sums(bytes), expected_sums(bytes);
+    vector<uchar> filled(bytes + 3 * 64), expected_filled(bytes + 3 * 64);
+    const uchar color[3] = { 17, 128, 250 };
+    const int pixels = bytes / 3;
+
+    bool ok = true;
+    for (int level = 0; level <= (int)host_level; ++level)
+    {
+      const CpuLevel cpu_level = (CpuLevel)level;
+
+      // sad_row
+      const SadRowFunction sad = PixelKernels::sad_row.variant(cpu_level);
+      if (sad != nullptr)
+      {
+        const SadRowFunction scalar = PixelKernels::sad_row.variant(CpuLevel::Scalar);
+        KernelResult result;
+        result.kernel = PixelKernels::sad_row.getName();
+        result.level = cpu_level;
+        result.identical = true;
+        for (int y = 0; y < frame.rows; ++y)
+          result.identical = result.identical && sad(frame.ptr(y), shifted.ptr(y), bytes) == scalar(frame.ptr(y), shifted.ptr(y), bytes);
+        for (int tail = 0; tail <= 130 && tail <= bytes; ++tail)
+          result.identical = result.identical && sad(frame.ptr(0), shifted.ptr(0), tail) == scalar(frame.ptr(0), shifted.ptr(0), tail);
+        LatencyHistogram histogram;
+        for (int i = 0; i < iterations; ++i)
+        {
+          ScopedTimer timer(histogram);
+          for (int y = 0; y < frame.rows; ++y)
+            sad(frame.ptr(y), shifted.ptr(y), bytes);
+        }
+        result.mean_ns = histogram.mean();
+        results.push_back(result);
+      }
+
+      // accumulate_row
+      const AccumulateRowFunction accumulate = PixelKernels::accumulate_row.variant(cpu_level);
+      if (accumulate != nullptr)
+      {
+        const AccumulateRowFunction scalar = PixelKernels::accumulate_row.variant(CpuLevel::Scalar);
+        KernelResult result;
+        result.kernel = PixelKernels::accumulate_row.getName();
+        result.level = cpu_level;
+        fill(sums.begin(), sums.end(), 0);
+        fill(expected_sums.begin(), expected_sums.end(), 0);
+        for (int y = 0; y < frame.rows; ++y)
+        {
+          const int length = max(0, bytes - y % 131);
+          accumulate(frame.ptr(y), sums.data(), length);
+          scalar(frame.ptr(y), expected_sums.data(), length);
+        }
+        result.identical = sums == expected_sums;
+        LatencyHistogram histogram;
+        for (int i = 0; i < iterations; ++i)
+        {
+          ScopedTimer timer(histogram);
+          for (int y = 0; y < frame.rows; ++y)
+            accumulate(frame.ptr(y), sums.data(), bytes);
+        }
+        result.mean_ns = histogram.mean();
+        results.push_back(result);
+      }
+
+      // fill_bgr: runs of every length up to 70 pixels, then the blocks of a row
+      const FillBgrFunction fill_bgr = PixelKernels::fill_bgr.variant(cpu_level);
+      if (fill_bgr != nullptr)
+      {
+        const FillBgrFunction scalar = PixelKernels::fill_bgr.variant(CpuLevel::Scalar);
+        KernelResult result;
+        result.kernel = PixelKernels::fill_bgr.getName();
+        result.level = cpu_level;
+        result.identical = true;
+        for (int count = 0; count <= 70 && count <= pixels; ++count)
+        {
+          fill(filled.begin(), filled.end(), 0);
+          fill(expected_filled.begin(), expected_filled.end(), 0);
+          fill_bgr(filled.data() + 1, count, color);
+          scalar(expected_filled.data() + 1, count, color);
+          result.identical = result.identical && filled == expected_filled;
+        }
+        LatencyHistogram histogram;
+        for (int i = 0; i < iterations; ++i)
+        {
+          ScopedTimer timer(histogram);
+          for (int y = 0; y < frame.rows; ++y)
+          {
+            for (int x = 0; x < pixels; x += block)
+              fill_bgr(filled.data() + 3 * x, min(block, pixels - x), frame.ptr(y));
+          }
+        }
+        result.mean_ns = histogram.mean();
+        results.push_back(result);
+      }
+    }
+
+    for (const KernelResult &result : results)
+      ok = ok && result.identical;
+    return reportCheck("kernel variants", ok);
+  }
+
+  /*
+  grab(..) and retrieve(..) with one view at a time: once the ring is there, every frame
+  must reuse one of its buffers, the ring and the allocations of the pool stay the same
+  */
+  bool checkCaptureRing(const Size &size, const int frames)
+  {
+    Video video("", make_shared<SyntheticSource>(size, frames));
+    video.initializeInput();
+    FrameView view;
+    size_t ring_size = 0;
+    int64_t allocations = 0;
+    bool ok = true;
+    for (int i = 0; i < frames; ++i)
+    {
+      if (!video.grab() || !video.retrieve(view))
+      {
+        ok = false;
+        break;
+      }
+      // The first frame makes the ring, the second one is the first from it
+      if (i == 1)
+      {
+        ring_size = video.getCaptureRingSize();
+        allocations = video.getFramePool().getStats().allocations;
+      }
+    }
+    ok = ok && video.getCaptureRingSize() == ring_size && video.getFramePool().getStats().allocations == allocations;
+    cout << "capture ring check: " << video.getCaptureRingSize() << " buffers, " << video.getFramePool().getStats().allocations
+      << " allocations after " << frames << " frames" << endl;
+    return reportCheck("capture ring", ok);
+  }
+
+  // A publisher and a reader of the shared frame ring
+  struct SharedReaderResult
+  {
+    string consumer;
+    int64_t published = 0;
+    int64_t received = 0;
+    int64_t skipped = 0;
+    int64_t torn = 0;
+    double seconds = 0;
+    double frame_bytes = 0;
+
+    double framesPerSecond() const
+    {
+      return seconds > 0 ? published / seconds : 0;
+    }
+
+    double gigabytesPerSecond() const
+    {
+      return seconds > 0 ? published * frame_bytes / 1e9 / seconds : 0;
+    }
+
+    void print() const
+    {
+      cout << "Shared ring, " << consumer << " reader: " << framesPerSecond() << " frames/s (" << gigabytesPerSecond()
+        << " GB/s), received " << received << ", skipped " << skipped << ", torn " << torn << endl;
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\"consumer\": \"" << consumer << "\", \"frames_per_second\": " << framesPerSecond()
+        << ", \"gb_per_second\": " << gigabytesPerSecond() << ", \"received\": " << received
+        << ", \"skipped\": " << skipped << ", \"torn\": " << torn << "}";
+    }
+  };
+
+  // The ring with a reader that keeps up, and with one that copies every frame (and may have to skip some)
+  struct SharedRingResult
+  {
+    SharedReaderResult zero_copy;
+    SharedReaderResult copy;
+
+    void print() const
+    {
+      zero_copy.print();
+      copy.print();
+    }
+
+    void writeJSON(ostream &json) const
+    {
+      writeJSONArray(json, vector<SharedReaderResult>{ zero_copy, copy }, "  ");
+    }
+  };
+
+  // The id of a frame in its first and its last 8 bytes, a torn frame has two different ones
+  void stampFrame(Mat &image, const int64_t id)
+  {
+    memcpy(image.ptr(0), &id, sizeof(id));
+    memcpy(image.ptr(image.rows - 1) + image.cols * image.elemSize() - sizeof(id), &id, sizeof(id));
+  }
+
+  bool hasStamp(const Mat &image, const int64_t id)
+  {
+    int64_t first, last;
+    memcpy(&first, image.ptr(0), sizeof(first));
+    memcpy(&last, image.ptr(image.rows - 1) + image.cols * image.elemSize() - sizeof(last), sizeof(last));
+    return first == id && last == id;
+  }
+
+  /*
+  Publish frames into the shared memory ring as fast as possible and read them on another
+  thread (through the shared memory of the system, like another process would). The reader
+  looks at every frame where it is, or copies it out with read(..). Every frame it takes as
+  intact must be the one it says it is, and come after the one before.
+  */
+  bool measureSharedRing(const Mat &frame, const int64_t frames, const bool copy, SharedReaderResult &result)
+  {
+    const string name = "opencv_tutorial_benchmark";
+    SharedFramePublisher publisher;
+    SharedFrameReader reader;
+    if (!publisher.create(name, frame.size(), frame.type()) || !reader.open(name))
+    {
+      cerr << "shared ring check: can't make the shared memory " << name << endl;
+      return false;
+    }
+
+    atomic<bool> done(false);
+    bool ok = true;
+    thread consumer([&]()
+    {
+      int64_t previous = -1;
+      Mat copied;
+      SharedFrame shared;
+      while (true)
+      {
+        // Taken before the last try, so the frames published before 'done' are all seen
+        const bool finished = done;
+        const bool has_frame = copy ? reader.read(copied, shared) : reader.next(shared);
+        if (!has_frame)
+        {
+          if (finished)
+            break;
+          this_thread::yield();
+          continue;
+        }
+        const bool stamped = hasStamp(copy ? copied : shared.image, shared.id);
+        if (!copy && !reader.isIntact(shared))
+          continue;
+        ok = ok && stamped && shared.id > previous;
+        previous = shared.id;
+      }
+    });
+
+    const auto start = chrono::steady_clock::now();
+    for (int64_t i = 0; i < frames; ++i)
+    {
+      // Straight into the slot, like a processing step that writes its output there
+      Mat slot = publisher.claim();
+      frame.copyTo(slot);
+      stampFrame(slot, i);
+      publisher.commit(i, 0);
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    done = true;
+    consumer.join();
+
+    const SharedReaderStats stats = reader.getStats();
+    result.consumer = copy ? "copy" : "zero-copy";
+    result.published = publisher.getPublished();
+    result.received = stats.received;
+    result.skipped = stats.skipped;
+    result.torn = stats.torn;
+    result.frame_bytes = (double)frame.total() * frame.elemSize();
+    // Every frame is either received or skipped, the reader starts at the first one
+    ok = ok && stats.received > 0 && stats.received + stats.skipped == result.published;
+    return reportCheck("shared ring (" + result.consumer + ")", ok);
+  }
+
+  // The record loop itself: every stage per frame
+  struct RecordLoopResult
+  {
+    string input;
+    bool fused = true;
+    LatencyHistogram stages[STAGE_COUNT];
+    double wall_seconds = 0;
+
+    void print(const Options &options) const
+    {
+      cout << "Input: " << input << " [" << options.size.width << "x" << options.size.height << "], block " << options.block << endl;
+      cout << left << setw(10) << "stage" << right << setw(8) << "frames" << setw(10) << "fps"
+        << setw(11) << "mean[us]" << setw(11) << "p50[us]" << setw(11) << "p99[us]" << setw(11) << "max[us]" << endl;
+      cout << fixed << setprecision(1);
+      for (int stage = 0; stage < STAGE_COUNT; ++stage)
+      {
+        const LatencyHistogram &histogram = stages[stage];
+        if (histogram.count() == 0)
+          continue;
+        cout << left << setw(10) << STAGE_NAMES[stage] << right << setw(8) << histogram.count()
+          << setw(10) << stageFPS(histogram) << setw(11) << histogram.mean() / 1e3
+          << setw(11) << histogram.percentile(0.50) / 1e3 << setw(11) << histogram.percentile(0.99) / 1e3
+          << setw(11) << histogram.max() / 1e3 << endl;
+      }
+      cout << "Wall time: " << wall_seconds << "s (" << stages[STAGE_TOTAL].count() / wall_seconds << " fps)" << endl;
+    }
+
+    // The members of the loop, then the stages
+    void writeJSON(ostream &json) const
+    {
+      json << "  \"input\": \"" << input << "\",\n";
+      json << "  \"frames\": " << stages[STAGE_TOTAL].count() << ",\n";
+      json << "  \"kernel\": \"" << (fused ? "fused" : "reference") << "\",\n";
+      json << "  \"wall_seconds\": " << wall_seconds << ",\n";
+      json << "  \"stages\": [\n";
+      for (int stage = 0; stage < STAGE_COUNT; ++stage)
+      {
+        const LatencyHistogram &histogram = stages[stage];
+        json << "    {\n";
+        json << "      \"name\": \"" << STAGE_NAMES[stage] << "\",\n";
+        json << "      \"count\": " << histogram.count() << ",\n";
+        json << "      \"fps\": " << stageFPS(histogram) << ",\n";
+        json << "      \"mean_us\": " << histogram.mean() / 1e3 << ",\n";
+        json << "      \"min_us\": " << histogram.min() / 1e3 << ",\n";
+        json << "      \"p50_us\": " << histogram.percentile(0.50) / 1e3 << ",\n";
+        json << "      \"p99_us\": " << histogram.percentile(0.99) / 1e3 << ",\n";
+        json << "      \"max_us\": " << histogram.max() / 1e3 << ",\n";
+        json << "      \"histogram_us\": [";
+        const vector<pair<uint64_t, uint64_t>> buckets = histogram.buckets();
+        for (size_t b = 0; b < buckets.size(); ++b)
+          json << (b == 0 ? "" : ", ") << "[" << buckets[b].first / 1e3 << ", " << buckets[b].second << "]";
+        json << "]\n";
+        json << "    }" << (stage + 1 < STAGE_COUNT ? "," : "") << "\n";
+      }
+      json << "  ],\n";
+    }
+  };
+
+  // Everything the record loop benchmark measures, a section per comparison
+  struct RecordLoopReport
+  {
+    RecordLoopResult loop;
+    PixelateResult pixelate;
+    GrayResult gray;
+    WallResult wall;
+    PyramidResult pyramid;
+    GraphResult graph;
+    SnapshotResult snapshot;
+    GateResult gate;
+    KernelsResult kernels;
+    SharedRingResult shared_ring;
+
+    void print(const Options &options) const
+    {
+      loop.print(options);
+      pixelate.print();
+      gray.print();
+      wall.print();
+      pyramid.print();
+      graph.print();
+      snapshot.print();
+      gate.print();
+      kernels.print();
+      shared_ring.print();
+    }
+
+    void writeJSON(const string &path, const Options &options) const
+    {
+      ofstream json(path);
+      writeJSONHeader(json, "record_loop", options);
+      loop.writeJSON(json);
+      writeJSONSection(json, "pixelate_comparison", pixelate);
+      writeJSONSection(json, "gray_comparison", gray);
+      writeJSONSection(json, "wall_comparison", wall);
+      writeJSONSection(json, "pyramid_comparison", pyramid);
+      writeJSONSection(json, "graph_comparison", graph);
+      writeJSONSection(json, "snapshot_comparison", snapshot);
+      writeJSONSection(json, "gate_comparison", gate);
+      writeJSONSection(json, "shared_ring", shared_ring);
+      writeJSONSection(json, "cpu", kernels, true);
+      json << "}\n";
+    }
+  };
+
+  struct StreamsResult
+  {
+    int streams = 0;
+    int64_t frames = 0;
+    double wall_seconds = 0;
+    double fps = 0;
+    double speedup = 0;
+    double efficiency = 0;
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\"streams\": " << streams << ", \"frames\": " << frames << ", \"wall_seconds\": " << wall_seconds
+        << ", \"fps\": " << fps << ", \"speedup\": " << speedup << ", \"efficiency\": " << efficiency << "}";
+    }
+  };
+
+  /*
+  The multi-stream benchmark: the same steps as the record loop, for 1, 2, 4, ... streams
+  at the same time, every stream with its own synthetic source and video file. The pool
+  has a thread per core, so up to that many streams the total frame rate should grow
+  (nearly) linearly: the efficiency is the speedup over 1 stream divided by the ideal one.
+  */
+  int runStreams(const Options &options)
+  {
+    SThreadPool pool = make_shared<ThreadPool>(options.threads);
+    const int block = options.block + 1;
+    cout << "Streams of " << options.size.width << "x" << options.size.height << ", " << options.frames
+      << " frames each, block " << block << ", " << pool->size() << " pool threads" << endl;
+    cout << right << setw(8) << "streams" << setw(10) << "frames" << setw(10) << "wall[s]" << setw(12) << "total fps"
+      << setw(12) << "stream fps" << setw(10) << "speedup" << setw(12) << "efficiency" << endl;
+    cout << fixed << setprecision(2);
+
+    vector<StreamsResult> results;
+    for (int count = 1; ; count = min(count * 2, options.streams))
+    {
+      StreamManager manager(pool);
+      for (int i = 0; i < count; ++i)
+      {
+        manager.addStream(make_shared<SyntheticSource>(options.size, options.frames), [block](Mat &frame)
+        {
+          pixelateFlip(frame, frame, block, true);
+          Helper::putPrettyText("stream", Point(8, 24), 0.8, frame);
+        }, "stream" + to_string(i) + ".avi");
+      }
+
+      const int64 start = getTickCount();
+      if (manager.start() != count)
+      {
+        for (const StreamStats &stats : manager.getStats())
+        {
+          if (!stats.error.empty())
+            cerr << stats.name << ": " << stats.error << endl;
+        }
+        return EXIT_FAILURE;
+      }
+      manager.wait();
+
+      StreamsResult result;
+      result.streams = count;
+      result.wall_seconds = (getTickCount() - start) / getTickFrequency();
+      for (const StreamStats &stats : manager.getStats())
+        result.frames += stats.frames;
+      result.fps = result.frames / result.wall_seconds;
+      result.speedup = results.empty() ? 1.0 : result.fps / results.front().fps;
+      result.efficiency = result.speedup / min(count, pool->size());
+      results.push_back(result);
+
+      cout << setw(8) << count << setw(10) << result.frames << setw(10) << result.wall_seconds << setw(12) << result.fps
+        << setw(12) << result.fps / count << setw(10) << result.speedup << setw(12) << result.efficiency << endl;
+
+      if (count == options.streams)
+        break;
+    }
+
+    const ThreadPoolStats pool_stats = pool->getStats();
+    cout << "Pool: " << pool_stats.executed << " frame tasks, " << pool_stats.stolen << " stolen" << endl;
+
+    ofstream json(options.json);
+    writeJSONHeader(json, "streams", options);
+    json << "  \"threads\": " << pool->size() << ",\n";
+    json << "  \"runs\": ";
+    writeJSONArray(json, results, "  ");
+    json << "\n}\n";
+    cout << "Results written to " << options.json << endl;
+    return EXIT_SUCCESS;
+  }
+
+  struct StripesResult
+  {
+    int threads = 0;
+    double mean_ms = 0;
+    double p50_ms = 0;
+    double p99_ms = 0;
+    double speedup = 0;
+    double efficiency = 0;
+    bool identical = false;
+
+    void writeJSON(ostream &json) const
+    {
+      json << "{\"threads\": " << threads << ", \"mean_ms\": " << mean_ms << ", \"p50_ms\": " << p50_ms
+        << ", \"p99_ms\": " << p99_ms << ", \"speedup\": " << speedup << ", \"efficiency\": " << efficiency
+        << ", \"identical\": " << (identical ? "true" : "false") << "}";
+    }
+  };
+
+  /*
+  The stripe benchmark: the filters of one frame, split over 1, 2, 4, ... threads.
+  "whole frame" is the chain as it was: every filter over the whole frame, one after
+  the other, on one thread. With 1 thread the stripes already win a little, because
+  the frame comes from memory only once instead of once per filter.
+  */
+  int runStripes(Options options)
+  {
+    if (!options.size_given)
+      options.size = Size(3840, 2160);
+    const int block = options.block + 1;
+
+    SyntheticSource source(options.size, 1);
+    Mat frame;
+    if (!source.open() || !source.read(frame))
+    {
+      cerr << "Could not create a synthetic frame" << endl;
+      return EXIT_FAILURE;
+    }
+
+    // The steps of the record loop, plus a blur to have a filter that needs a halo
+    const Point base_location(8, 24);
+    StripeFilter overlay;
+    overlay.name = "overlay";
+    overlay.apply = [&base_location](const Mat &in, Mat &out, const int y)
+    {
+      in.copyTo(out);
+      // The band starts at image row y, the text is clipped to the band
+      Helper::putPrettyText("stripes", Point(base_location.x, base_location.y - y), 0.8, out);
+    };
+    const vector<StripeFilter> chain = { StripeFilters::pixelate(block), StripeFilters::gaussianBlur(5), overlay };
+
+    auto timeRuns = [&options, &frame, &chain](const StripeExecutor &executor, Mat &output, LatencyHistogram &histogram)
+    {
+      for (int64_t i = -options.warmup; i < options.frames; ++i)
+      {
+        const int64 start = getTickCount();
+        executor.run(frame, output, chain);
+        if (i >= 0)
+          histogram.record(ticksToNanoseconds(getTickCount() - start));
+      }
+    };
+
+    // The whole frame through every filter in turn: one stripe of (at least) the full frame
+    Mat reference;
+    LatencyHistogram whole_frame;
+    timeRuns(StripeExecutor(nullptr, (frame.rows + block) * frame.cols * frame.elemSize()), reference, whole_frame);
+
+    cout << "Stripes of " << options.size.width << "x" << options.size.height << ", " << options.frames
+      << " frames, block " << block << ", " << StripeExecutor(nullptr).stripeRows(frame.cols * frame.elemSize(), chain)
+      << " rows per stripe" << endl;
+    cout << fixed << setprecision(2);
+    cout << "whole frame, 1 thread: mean " << whole_frame.mean() / 1e6 << " ms, p99 " << whole_frame.percentile(0.99) / 1e6 << " ms" << endl;
+    cout << right << setw(8) << "threads" << setw(11) << "mean[ms]" << setw(11) << "p50[ms]" << setw(11) << "p99[ms]"
+      << setw(10) << "speedup" << setw(12) << "efficiency" << setw(11) << "identical" << endl;
+
+    vector<StripesResult> results;
+    bool all_identical = true;
+    for (int threads = 1; ; threads = min(threads * 2, options.stripes))
+    {
+      // The caller works on the stripes too, so the pool has one thread less
+      StripeExecutor executor(threads > 1 ? make_shared<ThreadPool>(threads - 1) : nullptr);
+      Mat output;
+      LatencyHistogram histogram;
+      timeRuns(executor, output, histogram);
+
+      StripesResult result;
+      result.threads = threads;
+      result.mean_ms = histogram.mean() / 1e6;
+      result.p50_ms = histogram.percentile(0.50) / 1e6;
+      result.p99_ms = histogram.percentile(0.99) / 1e6;
+      result.speedup = whole_frame.mean() / max(1.0, histogram.mean());
+      result.efficiency = results.empty() ? 1.0 : results.front().mean_ms / result.mean_ms / threads;
+      result.identical = output.size() == reference.size() && output.type() == reference.type();
+      for (int y = 0; y < output.rows && result.identical; ++y)
+        result.identical = memcmp(output.ptr(y), reference.ptr(y), output.cols * output.elemSize()) == 0;
+      all_identical = all_identical && result.identical;
+      results.push_back(result);
+
+      cout << setw(8) << threads << setw(11) << result.mean_ms << setw(11) << result.p50_ms << setw(11) << result.p99_ms
+        << setw(10) << result.speedup << setw(12) << result.efficiency << setw(11) << (result.identical ? "yes" : "NO") << endl;
+
+      if (threads >= options.stripes)
+        break;
+    }
+
+    ofstream json(options.json);
+    writeJSONHeader(json, "stripes", options);
+    json << "  \"whole_frame_mean_ms\": " << whole_frame.mean() / 1e6 << ",\n";
+    json << "  \"runs\": ";
+    writeJSONArray(json, results, "  ");
+    json << "\n}\n";
+    cout << "Results written to " << options.json << endl;
+    return reportCheck("stripes", all_identical) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  if (!parseOptions(argc, argv, options))
+  {
+    cerr << "Usage: " << argv[0] << " [--frames N] [--warmup N] [--size WxH] [--block B] [--input SOURCE]" << endl;
+    cerr << "       [--output FILE.avi] [--json FILE.json] [--label NAME] [--cpu scalar|sse4.1|avx2|avx512]" << endl;
+    cerr << "       [--trace FILE.json]" << endl;
+    cerr << "   or: " << argv[0] << " --streams N [--threads T] [--frames N] [--size WxH] [--block B] [--json FILE.json]" << endl;
+    cerr << "   or: " << argv[0] << " --stripes N [--frames N] [--size WxH] [--block B] [--json FILE.json]" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // Not above what this CPU runs, setMaxLevel(..) takes care of that
+  KernelRegistry::setMaxLevel(options.cpu);
+  printKernels();
+
+  if (options.streams > 0)
+    return runStreams(options);
+  if (options.stripes > 0)
+    return runStripes(options);
+
+  /*
+  Without an explicit input we record the synthetic pattern to a raw file once and
+  replay that. Replaying costs one memcpy per frame, so the capture stage measures
+  the loop and not some decoder.
+  */
+  string input = options.input;
+  if (input.empty())
+  {
+    const string raw_path = "benchmark.raw";
+    const int64_t raw_frames = min<int64_t>(options.frames, 120);
+    SyntheticSource synthetic(options.size, raw_frames);
+    if (!synthetic.open() || RawFileSource::record(raw_path, synthetic, raw_frames) != raw_frames)
+    {
+      cerr << "Could not create the replay file " << raw_path << endl;
+      return EXIT_FAILURE;
+    }
+    input = "raw:" + raw_path;
+  }
+
+  SFrameSource source = createFrameSource(input);
+  if (source == nullptr || !source->open())
+  {
+    cerr << "Could not open the input " << input << endl;
+    return EXIT_FAILURE;
+  }
+
+  Video video(options.output, source);
+  Mat frame;
+  if (!video.read(frame))
+  {
+    cerr << "The input " << input << " has no frames" << endl;
+    return EXIT_FAILURE;
+  }
+  options.size = frame.size();
+
+  // Retrieving frames into views must not allocate once the capture ring is there
+  if (!checkCaptureRing(frame.size(), 50))
+    return EXIT_FAILURE;
+
+  // Every optimization against what it replaced, see the list at the top. The fused kernels
+  // must give the same picture as the steps they replace, so the checks go first.
+  RecordLoopReport report;
+  report.loop.input = input;
+  report.loop.fused = options.fused;
+  if (!verifyPixelate(frame) || !verifyGray(frame) || !verifyOverlay(frame))
+    return EXIT_FAILURE;
+  comparePixelate(frame, options.block + 1, 50, report.pixelate);
+  compareGray(frame, 50, report.gray);
+  compareSnapshot(frame, 20, report.snapshot);
+  if (!compareWall(frame, 50, report.wall) || !comparePyramid(frame, 50, report.pyramid) ||
+    !compareGraph(frame, 50, report.graph) || !compareGate(frame, 50, report.gate) ||
+    !compareKernels(frame, options.block + 1, 20, report.kernels) ||
+    !measureSharedRing(frame, 300, false, report.shared_ring.zero_copy) ||
+    !measureSharedRing(frame, 300, true, report.shared_ring.copy))
+    return EXIT_FAILURE;
+
+  const bool can_encode = video.initializeOutput(frame.size());
+  if (!can_encode)
+    cerr << "Could not open " << options.output << " for writing, the encode stage is skipped" << endl;
+
+  LatencyHistogram (&histograms)[STAGE_COUNT] = report.loop.stages;
+  const Point base_location(8, 24);
+  // The captured frames are read-only views on the capture ring of the video, the
+  // processing writes into 'frame' (see Video::retrieve(..))
+  FrameView view;
+  const int64 t0 = getTickCount();
+  int64 counter = 0;
+
+  /*
+  The same steps as the record loop in main.cpp, every step in its own timed scope.
+  The first 'warmup' frames are not counted (caches, lazy allocations, codec setup).
+  */
+  const int64_t total_frames = options.frames + options.warmup;
+  if (!options.trace.empty())
+  {
+    Trace::setThreadName("record loop");
+    Trace::start();
+  }
+  int64 wall_start = getTickCount();
+  for (int64_t i = 0; i < total_frames; ++i)
+  {
+    if (i == options.warmup)
+    {
+      for (LatencyHistogram &histogram : histograms)
+        histogram.reset();
+      wall_start = getTickCount();
+    }
+
+    ScopedTimer total(histograms[STAGE_TOTAL]);
+    {
+      ScopedTimer timer(histograms[STAGE_CAPTURE]);
+      if (!video.grab() || !video.retrieve(view))
+        break;
+    }
+    // The steps below (and the encoder in Video::write(..)) trace themselves with this frame
+    TraceFrame trace_frame(view.sequence());
+
+    if (options.fused)
+    {
+      ScopedTimer timer(histograms[STAGE_PIXELATE_FLIP]);
+      TraceScope trace("pixelate_flip");
+      pixelateFlip(view.image(), frame, options.block + 1, true);
+    }
+    else
+    {
+      // The first step reads the view and writes 'frame', the rest works in place
+      const Mat *source = &view.image();
+      if (options.block != 0)
+      {
+        ScopedTimer timer(histograms[STAGE_PIXELATE]);
+        TraceScope trace("pixelate");
+        double scale = 1 / (double)(options.block + 1);
+        Mat small;
+        resize(*source, small, Size(), scale, scale);
+        resize(small, frame, source->size(), 0, 0, INTER_NEAREST);
+        source = &frame;
+      }
+
+      ScopedTimer timer(histograms[STAGE_FLIP]);
+      TraceScope trace("flip");
+      flip(*source, frame, 1);
+    }
+
+    {
+      ScopedTimer timer(histograms[STAGE_OVERLAY]);
+      TraceScope trace("overlay");
+      double time_spent = (getTickCount() - t0) / getTickFrequency();
+      double fps = counter++ / time_spent;
+      char text[64];
+      snprintf(text, sizeof(text), "%ds [%dfps]", cvRound(time_spent), cvRound(fps));
+      Helper::putPrettyText(text, base_location, 0.8, frame);
+    }
+
+    if (can_encode)
+    {
+      ScopedTimer timer(histograms[STAGE_ENCODE]);
+      video.write(frame);
+    }
+    Trace::recordFrame(view.sequence(), view.timestamp(), Trace::now());
+  }
+  report.loop.wall_seconds = (getTickCount() - wall_start) / getTickFrequency();
+  report.print(options);
+
+  if (!options.trace.empty())
+  {
+    Trace::stop();
+    const TraceStats trace_stats = Trace::getStats();
+    if (!Trace::writeChromeJSON(options.trace))
+    {
+      cerr << "Could not write the trace " << options.trace << endl;
+      return EXIT_FAILURE;
+    }
+    cout << "Trace of " << trace_stats.events << " events written to " << options.trace << " (" << trace_stats.dropped
+      << " did not fit)" << endl;
+  }
+
+  report.writeJSON(options.json, options);
+  cout << "Results written to " << options.json << endl;
+
+  return EXIT_SUCCESS;
+}
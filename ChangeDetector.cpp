@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include "ChangeDetector.h"
+#include "PixelKernels.h"
+#include "Trace.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  int64_t nowNanoseconds()
+  {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Overlapping and touching runs of rows become one, sorted from the top
+  vector<Range> mergeRanges(vector<Range> ranges)
+  {
+    ranges.erase(remove_if(ranges.begin(), ranges.end(), [](const Range &range) { return range.empty(); }), ranges.end());
+    sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b) { return a.start < b.start; });
+    vector<Range> merged;
+    for (const Range &range : ranges)
+    {
+      if (!merged.empty() && range.start <= merged.back().end)
+        merged.back().end = max(merged.back().end, range.end);
+      else
+        merged.push_back(range);
+    }
+    return merged;
+  }
+}
+
+Rect TileMask::rect(const int index) const
+{
+  const Rect tile_rect((index % columns) * tile.width, (index / columns) * tile.height, tile.width, tile.height);
+  return tile_rect & Rect(Point(), image);
+}
+
+int TileMask::dirtyCount() const
+{
+  return (int)count_if(dirty.begin(), dirty.end(), [](const uint8_t flag) { return flag != 0; });
+}
+
+vector<Range> TileMask::dirtyRows() const
+{
+  vector<Range> ranges;
+  for (int row = 0; row < rows; ++row)
+  {
+    const uint8_t *flags = dirty.data() + row * columns;
+    if (find(flags, flags + columns, 1) == flags + columns)
+      continue;
+    const int top = row * tile.height;
+    ranges.push_back(Range(top, min(top + tile.height, image.height)));
+  }
+  return mergeRanges(ranges);
+}
+
+ChangeDetector::ChangeDetector(const Size &tile, const double threshold) :
+  m_tile(max(1, tile.width), max(1, tile.height)),
+  m_threshold(max(0.0, threshold))
+{
+}
+
+void ChangeDetector::reset()
+{
+  m_reference.release();
+}
+
+uint64_t ChangeDetector::sumOfAbsoluteDifferences(const Mat &a, const Mat &b, const uint64_t limit)
+{
+  CV_Assert(a.size() == b.size() && a.type() == b.type() && a.depth() == CV_8U);
+  const int bytes = a.cols * (int)a.elemSize();
+  const SadRowFunction rowSAD = PixelKernels::sad_row.get();
+  uint64_t sum = 0;
+  for (int y = 0; y < a.rows && sum <= limit; ++y)
+    sum += rowSAD(a.ptr(y), b.ptr(y), bytes);
+  return sum;
+}
+
+const TileMask &ChangeDetector::detect(const Mat &frame, const bool all)
+{
+  m_mask.image = frame.size();
+  m_mask.tile = m_tile;
+  m_mask.columns = (frame.cols + m_tile.width - 1) / m_tile.width;
+  m_mask.rows = (frame.rows + m_tile.height - 1) / m_tile.height;
+  m_mask.dirty.resize(m_mask.columns * m_mask.rows);
+
+  const bool comparable = frame.depth() == CV_8U && m_reference.size() == frame.size() && m_reference.type() == frame.type();
+  if (all || !comparable)
+  {
+    fill(m_mask.dirty.begin(), m_mask.dirty.end(), 1);
+    if (frame.depth() == CV_8U)
+      frame.copyTo(m_reference);
+    else
+      m_reference.release();
+    return m_mask;
+  }
+
+  for (int index = 0; index < m_mask.count(); ++index)
+  {
+    const Rect rect = m_mask.rect(index);
+    const Mat tile = frame(rect);
+    Mat reference = m_reference(rect);
+    // The integer part of the limit: threshold 0 makes any difference dirty
+    const uint64_t limit = (uint64_t)(m_threshold * rect.area() * frame.elemSize());
+    const bool is_dirty = sumOfAbsoluteDifferences(tile, reference, limit) > limit;
+    m_mask.dirty[index] = is_dirty ? 1 : 0;
+    if (is_dirty)
+      tile.copyTo(reference);
+  }
+  return m_mask;
+}
+
+ChangeGate::ChangeGate(const Size &tile, const double threshold) :
+  m_detector(tile, threshold),
+  m_key(0),
+  m_type(-1),
+  m_drawn(0, 0),
+  m_frames(0),
+  m_tiles(0),
+  m_dirty_tiles(0),
+  m_rows(0),
+  m_processed_rows(0),
+  m_process_ns(0),
+  m_overhead_ns(0),
+  m_detect_stage(nullptr)
+{
+}
+
+ChangeGate::~ChangeGate()
+{
+  setMetrics(nullptr);
+}
+
+void ChangeGate::reset()
+{
+  lock_guard<mutex> lock(m_mutex);
+  m_result.release();
+}
+
+void ChangeGate::run(const Mat &src, Mat &dst, const double key, const Range &drawn, const Processing &processing)
+{
+  lock_guard<mutex> lock(m_mutex);
+  const int64_t start = nowNanoseconds();
+
+  const bool refresh = m_result.empty() || key != m_key || src.type() != m_type ||
+    m_detector.getMask().image != src.size();
+  const TileMask *mask;
+  {
+    StageTimer timer(m_metrics.get(), m_detect_stage);
+    TraceScope trace("gate.detect");
+    mask = &m_detector.detect(src, refresh);
+  }
+
+  const Range clipped_drawn = drawn.empty() ? Range(0, 0) : Range(max(0, drawn.start), min(src.rows, drawn.end));
+  vector<Range> rows;
+  if (refresh)
+  {
+    m_result.release();
+    rows.push_back(Range(0, src.rows));
+  }
+  else
+  {
+    // The rows drawn on the last frame too, or what was drawn there stays behind
+    rows = mask->dirtyRows();
+    rows.push_back(clipped_drawn);
+    rows.push_back(m_drawn);
+    rows = mergeRanges(rows);
+  }
+  m_key = key;
+  m_type = src.type();
+  m_drawn = clipped_drawn;
+
+  int processed = 0;
+  for (const Range &range : rows)
+    processed += range.size();
+
+  const int64_t process_start = nowNanoseconds();
+  if (!rows.empty())
+    processing(src, m_result, rows);
+  const int64_t process_end = nowNanoseconds();
+  m_result.copyTo(dst);
+
+  ++m_frames;
+  m_tiles += mask->count();
+  m_dirty_tiles += mask->dirtyCount();
+  m_rows += src.rows;
+  m_processed_rows += processed;
+  m_process_ns += process_end - process_start;
+  m_overhead_ns += (process_start - start) + (nowNanoseconds() - process_end);
+}
+
+void ChangeGate::setMetrics(const SMetrics &metrics)
+{
+  lock_guard<mutex> lock(m_mutex);
+  if (m_metrics != nullptr)
+    m_metrics->removeGauges("gate.");
+  m_metrics = metrics;
+  m_detect_stage = nullptr;
+  if (m_metrics == nullptr)
+    return;
+
+  m_detect_stage = &m_metrics->stage("gate.detect");
+  m_metrics->setGauge("gate.skip_ratio", [this]() { return getStats().skipRatio(); });
+  m_metrics->setGauge("gate.tile_skip_ratio", [this]() { return getStats().tileSkipRatio(); });
+  m_metrics->setGauge("gate.saved_ms", [this]() { return getStats().savedNanoseconds() / 1e6; });
+  m_metrics->setGauge("gate.overhead_ms", [this]() { return getStats().overhead_ns / 1e6; });
+}
+
+ChangeStats ChangeGate::getStats() const
+{
+  ChangeStats stats;
+  stats.frames = m_frames;
+  stats.tiles = m_tiles;
+  stats.dirty_tiles = m_dirty_tiles;
+  stats.rows = m_rows;
+  stats.processed_rows = m_processed_rows;
+  stats.process_ns = m_process_ns;
+  stats.overhead_ns = m_overhead_ns;
+  return stats;
+}
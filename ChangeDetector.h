@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "Metrics.h"
+
+/*!
+  A frame cut into a grid of tiles, with a flag per tile that tells whether it changed
+*/
+struct TileMask
+{
+  cv::Size image;
+  cv::Size tile;
+  int columns = 0;
+  int rows = 0;
+  //! One per tile, row by row: 1 changed (dirty), 0 the same as before
+  std::vector<uint8_t> dirty;
+
+  int count() const
+  {
+    return (int)dirty.size();
+  }
+
+  //! The tile in image coordinates, the last column and row of tiles may be smaller
+  cv::Rect rect(const int index) const;
+
+  int dirtyCount() const;
+
+  //! The runs of image rows that have at least one dirty tile, from top to bottom
+  std::vector<cv::Range> dirtyRows() const;
+};
+
+//!  Finds the tiles of a frame that changed since the previous frame
+/*!
+  A camera on a static scene, a screen recording or a wall of mostly idle streams
+  changes in a few places per frame. Per tile the sum of absolute differences (SAD)
+  with the previous frame is computed with SSE2 (_mm_sad_epu8 sums 16 bytes in one
+  instruction), which runs at the speed of memory. Tiles whose mean difference per
+  byte is at most the threshold are clean: whatever was made of them last time can be
+  used again.
+
+  Only dirty tiles are copied into the reference. A clean tile keeps the pixels it was
+  last compared against, so a slow drift (a sunrise) adds up until the tile turns dirty,
+  instead of slipping through one small step at a time.
+
+  Only 8 bit images are compared, with any amount of channels. Other depths are always
+  completely dirty.
+*/
+class ChangeDetector
+{
+  cv::Size m_tile;
+  double m_threshold;
+  cv::Mat m_reference;
+  TileMask m_mask;
+
+public:
+  /*!
+  /param tile the size of a tile in pixels
+  /param threshold the mean absolute difference per byte up to which a tile is clean,
+    0: any difference makes it dirty (lossless)
+  */
+  explicit ChangeDetector(const cv::Size &tile = cv::Size(64, 32), const double threshold = 2);
+
+  /*!
+    Compare a frame with the reference and update it. The first frame, a frame of another
+    size or type and all = true give a mask that is completely dirty.
+  */
+  const TileMask &detect(const cv::Mat &frame, const bool all = false);
+
+  //! Forget the reference, the next frame is completely dirty
+  void reset();
+
+  const TileMask &getMask() const
+  {
+    return m_mask;
+  }
+
+  double getThreshold() const
+  {
+    return m_threshold;
+  }
+
+  /*!
+    The sum of absolute differences of two 8 bit images of the same size and type.
+    It stops early once it's over 'limit'.
+  */
+  static uint64_t sumOfAbsoluteDifferences(const cv::Mat &a, const cv::Mat &b, const uint64_t limit = UINT64_MAX);
+};
+
+/*!
+  A snapshot of the counters of a ChangeGate
+*/
+struct ChangeStats
+{
+  int64_t frames = 0;
+  int64_t tiles = 0;
+  int64_t dirty_tiles = 0;
+  //! All rows of all frames, and the changed ones given to the processing (it may make a few more, see FilterGraph::runRows(..))
+  int64_t rows = 0;
+  int64_t processed_rows = 0;
+  //! The time of the processing, and of the detection plus copying the cached result out
+  int64_t process_ns = 0;
+  int64_t overhead_ns = 0;
+
+  //! The share of the rows that wasn't processed
+  double skipRatio() const
+  {
+    return rows > 0 ? 1 - processed_rows / (double)rows : 0;
+  }
+
+  //! The share of the tiles that didn't change
+  double tileSkipRatio() const
+  {
+    return tiles > 0 ? 1 - dirty_tiles / (double)tiles : 0;
+  }
+
+  //! The processing time of the skipped rows, at the mean time per processed row
+  int64_t savedNanoseconds() const
+  {
+    return processed_rows > 0 ? (int64_t)((rows - processed_rows) * (process_ns / (double)processed_rows)) : 0;
+  }
+};
+
+//!  Processes only the rows of a frame that changed, the rest comes from the previous result
+/*!
+  The processing gets the source and the cached result of the frames before, and the
+  runs of rows to make again: the rows with a dirty tile, plus 'drawn' rows that change
+  whatever the input is (a label, see FilterGraph::drawnRows(..)). Whole rows, because
+  filters like a mirror move pixels along the row. FilterGraph::runRows(..) is such a
+  processing.
+
+  When the key changes (a setting of the processing, like the block size), everything is
+  processed again. Frames go through one at a time, in any order: a clean tile is close
+  to its reference, whatever frame it came from. run(..) holds a lock from the detection
+  until the result is copied out, processing included, because every result builds on
+  the one before: calling it from several threads doesn't make it faster, give the
+  processing itself more threads instead (see FilterGraph::setExecutor(..)). With
+  setMetrics(..) the detection is timed as the stage "gate.detect", the skip ratios and
+  the time saved are the gauges "gate.*".
+*/
+class ChangeGate
+{
+public:
+  /*!
+    Make the given rows of 'result' out of 'src'. The first time and after a change of
+    the key that's all rows, then 'result' is empty or has to be created anew.
+  */
+  typedef std::function<void(const cv::Mat &src, cv::Mat &result, const std::vector<cv::Range> &rows)> Processing;
+
+private:
+  std::mutex m_mutex;
+  ChangeDetector m_detector;
+  cv::Mat m_result;
+  double m_key;
+  int m_type;
+  cv::Range m_drawn;
+
+  std::atomic<int64_t> m_frames;
+  std::atomic<int64_t> m_tiles;
+  std::atomic<int64_t> m_dirty_tiles;
+  std::atomic<int64_t> m_rows;
+  std::atomic<int64_t> m_processed_rows;
+  std::atomic<int64_t> m_process_ns;
+  std::atomic<int64_t> m_overhead_ns;
+
+  SMetrics m_metrics;
+  StageMetrics *m_detect_stage;
+
+public:
+  //! See ChangeDetector
+  explicit ChangeGate(const cv::Size &tile = cv::Size(64, 32), const double threshold = 2);
+  ~ChangeGate();
+
+  ChangeGate(const ChangeGate &) = delete;
+  ChangeGate &operator=(const ChangeGate &) = delete;
+
+  /*!
+    Process a frame
+  */
+  /*!
+  /param src the input frame
+  /param dst receives the result, it may be src
+  /param key the settings of the processing, another value processes everything
+  /param drawn rows that are processed on every frame, an empty range for none
+  /param processing makes the rows of the result, see Processing
+  */
+  void run(const cv::Mat &src, cv::Mat &dst, const double key, const cv::Range &drawn, const Processing &processing);
+
+  //! Process everything on the next frame
+  void reset();
+
+  //! Report to these metrics (see above), nullptr stops reporting
+  void setMetrics(const SMetrics &metrics);
+
+  ChangeStats getStats() const;
+};
+
+typedef std::shared_ptr<ChangeGate> SChangeGate;
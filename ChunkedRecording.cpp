@@ -0,0 +1,536 @@
+#include <algorithm>
+#include <cstring>
+
+#include "ChunkedRecording.h"
+#include "TileCompression.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  const char FILE_MAGIC[8] = { 'C', 'V', 'C', 'H', 'U', 'N', 'K', '1' };
+  const char FOOTER_MAGIC[8] = { 'C', 'V', 'C', 'H', 'K', 'E', 'N', 'D' };
+  const uint32_t CHUNK_MAGIC = 0x4D415246; // "FRAM"
+  const uint32_t INDEX_MAGIC = 0x58444E49; // "INDX"
+  //! Version 2 added repeated tiles and the key interval, version 1 files are still read
+  const uint32_t VERSION = 2;
+  //! The high bit of a tile size: the tile is stored uncompressed
+  const uint32_t RAW_TILE = 0x80000000u;
+  //! The second highest bit: the tile is the same as in the frame before, nothing is stored
+  const uint32_t REPEAT_TILE = 0x40000000u;
+
+  struct FileHeader
+  {
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t type;
+    int32_t tile_rows;
+    uint16_t compression;
+    //! Every so many frames all tiles are stored, 0: always (version 1 had 32 bits of compression here)
+    uint16_t key_interval;
+  };
+
+  struct ChunkHeader
+  {
+    uint32_t magic;
+    uint32_t tile_count;
+    int64_t frame_index;
+    int64_t timestamp;
+    //! The tile sizes plus the tiles
+    uint64_t payload_bytes;
+  };
+
+  struct IndexHeader
+  {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t count;
+  };
+
+  struct Footer
+  {
+    uint64_t index_offset;
+    char magic[8];
+  };
+
+  static_assert(sizeof(FileHeader) == 32 && sizeof(ChunkHeader) == 32 &&
+    sizeof(IndexHeader) == 16 && sizeof(Footer) == 16, "the file layout must not have padding");
+
+  // 64 bit file offsets, also on Windows where long is 32 bit
+  bool seekTo(FILE *file, const uint64_t offset)
+  {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+  }
+
+  uint64_t fileSize(FILE *file)
+  {
+#ifdef _WIN32
+    _fseeki64(file, 0, SEEK_END);
+    return (uint64_t)_ftelli64(file);
+#else
+    fseeko(file, 0, SEEK_END);
+    return (uint64_t)ftello(file);
+#endif
+  }
+
+  int tileCount(const int rows, const int tile_rows)
+  {
+    return (rows + tile_rows - 1) / tile_rows;
+  }
+
+  // A frame type OpenCV knows, with tiles whose size fits next to the flags of the tile table
+  bool isTileLayout(const FileHeader &header)
+  {
+    if (header.type < 0 || header.type != CV_MAT_TYPE(header.type))
+      return false;
+    const uint64_t row_bytes = (uint64_t)header.width * CV_ELEM_SIZE(header.type);
+    return row_bytes * min(header.tile_rows, header.height) < REPEAT_TILE;
+  }
+}
+
+ChunkedFrameWriter::ChunkedFrameWriter() :
+  m_file(nullptr),
+  m_type(0),
+  m_tile_rows(16),
+  m_compression(ChunkCompression::Tiles),
+  m_key_interval(0),
+  m_buffer_used(0),
+  m_buffer_offset(0),
+  m_failed(false),
+  m_tiles(0),
+  m_repeated_tiles(0)
+{
+}
+
+ChunkedFrameWriter::~ChunkedFrameWriter()
+{
+  close();
+}
+
+bool ChunkedFrameWriter::open(const string &path, const Size &size, const int type,
+  const ChunkCompression compression, const int tile_rows, const int key_interval)
+{
+  if (m_file != nullptr || size.width <= 0 || size.height <= 0 || tile_rows <= 0 || key_interval < 0 || key_interval > 0xFFFF)
+    return false;
+
+  m_file = fopen(path.c_str(), "wb");
+  if (m_file == nullptr)
+    return false;
+  // We buffer ourselves, in large blocks
+  setvbuf(m_file, nullptr, _IONBF, 0);
+
+  m_size = size;
+  m_type = type;
+  m_tile_rows = tile_rows;
+  m_compression = compression;
+  m_key_interval = key_interval;
+  m_tiles = 0;
+  m_repeated_tiles = 0;
+  m_previous.release();
+  if (key_interval > 0)
+    m_previous.create(size, type);
+  m_index.clear();
+  // Room for a full buffer and the worst case of one more frame, so writing never makes the buffer grow
+  const size_t tile_bytes = size.width * CV_ELEM_SIZE(type) * tile_rows;
+  const int tiles = tileCount(size.height, tile_rows);
+  m_buffer.resize(WRITE_SIZE + sizeof(ChunkHeader) + tiles * (sizeof(uint32_t) + maxCompressedTileSize(tile_bytes)));
+  m_buffer_used = 0;
+
+  FileHeader header;
+  memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  header.version = VERSION;
+  header.width = size.width;
+  header.height = size.height;
+  header.type = type;
+  header.tile_rows = tile_rows;
+  header.compression = (uint16_t)compression;
+  header.key_interval = (uint16_t)key_interval;
+  memcpy(reserve(sizeof(header)), &header, sizeof(header));
+  m_buffer_used = sizeof(header);
+  m_buffer_offset = 0;
+  m_failed = false;
+  return true;
+}
+
+bool ChunkedFrameWriter::write(const Mat &frame, const int64_t timestamp)
+{
+  if (m_file == nullptr || m_failed || frame.size() != m_size || frame.type() != m_type)
+    return false;
+
+  // The tiles are runs of whole rows, so the rows must be back to back
+  const Mat image = frame.isContinuous() ? frame : frame.clone();
+  const size_t row_bytes = image.cols * image.elemSize();
+  const int tiles = tileCount(image.rows, m_tile_rows);
+  const size_t tile_bytes = row_bytes * m_tile_rows;
+
+  // Make room for the worst case, then compress straight into the buffer
+  const size_t chunk_start = m_buffer_used;
+  const size_t table_bytes = tiles * sizeof(uint32_t);
+  reserve(sizeof(ChunkHeader) + table_bytes + tiles * maxCompressedTileSize(tile_bytes));
+
+  /*
+  Between key frames a tile that is exactly the same as in the frame before isn't stored
+  at all: a static scene costs neither compression nor disk. We compare with our own copy
+  of the frame before, it's what the reader has when it gets to this frame.
+  */
+  const bool is_key = m_key_interval == 0 || m_index.size() % m_key_interval == 0;
+
+  size_t out = chunk_start + sizeof(ChunkHeader) + table_bytes;
+  for (int tile = 0; tile < tiles; ++tile)
+  {
+    const int y = tile * m_tile_rows;
+    const size_t bytes = row_bytes * min(m_tile_rows, image.rows - y);
+    const uint8_t *source = image.ptr(y);
+    ++m_tiles;
+
+    if (m_key_interval > 0)
+    {
+      if (!is_key && memcmp(m_previous.ptr(y), source, bytes) == 0)
+      {
+        const uint32_t entry = REPEAT_TILE;
+        memcpy(m_buffer.data() + chunk_start + sizeof(ChunkHeader) + tile * sizeof(uint32_t), &entry, sizeof(entry));
+        ++m_repeated_tiles;
+        continue;
+      }
+      memcpy(m_previous.ptr(y), source, bytes);
+    }
+
+    size_t stored = 0;
+    if (m_compression == ChunkCompression::Tiles)
+      stored = compressTile(source, bytes, m_buffer.data() + out, bytes - 1);
+
+    uint32_t entry;
+    if (stored == 0)
+    {
+      // Didn't get smaller, keep it as it is
+      memcpy(m_buffer.data() + out, source, bytes);
+      stored = bytes;
+      entry = (uint32_t)stored | RAW_TILE;
+    }
+    else
+      entry = (uint32_t)stored;
+
+    memcpy(m_buffer.data() + chunk_start + sizeof(ChunkHeader) + tile * sizeof(uint32_t), &entry, sizeof(entry));
+    out += stored;
+  }
+
+  ChunkHeader header;
+  header.magic = CHUNK_MAGIC;
+  header.tile_count = (uint32_t)tiles;
+  header.frame_index = (int64_t)m_index.size();
+  header.timestamp = timestamp;
+  header.payload_bytes = out - chunk_start - sizeof(ChunkHeader);
+  memcpy(m_buffer.data() + chunk_start, &header, sizeof(header));
+  m_buffer_used = out;
+
+  IndexEntry entry;
+  entry.offset = m_buffer_offset + chunk_start;
+  entry.timestamp = timestamp;
+  m_index.push_back(entry);
+
+  if (m_buffer_used >= WRITE_SIZE)
+    return flush();
+  return true;
+}
+
+uint8_t *ChunkedFrameWriter::reserve(const size_t bytes)
+{
+  if (m_buffer_used + bytes > m_buffer.size())
+    m_buffer.resize(max(m_buffer_used + bytes, 2 * m_buffer.size()));
+  return m_buffer.data() + m_buffer_used;
+}
+
+bool ChunkedFrameWriter::flush()
+{
+  if (m_buffer_used == 0)
+    return true;
+
+  // After a short write the offsets of the index would be wrong, so nothing is written anymore
+  if (fwrite(m_buffer.data(), 1, m_buffer_used, m_file) != m_buffer_used)
+  {
+    m_failed = true;
+    return false;
+  }
+  m_buffer_offset += m_buffer_used;
+  m_buffer_used = 0;
+  return true;
+}
+
+bool ChunkedFrameWriter::close()
+{
+  if (m_file == nullptr)
+    return false;
+
+  // Without the index the reader finds the chunks that made it to the file by walking them
+  bool written = !m_failed && writeIndex();
+  written = fclose(m_file) == 0 && written;
+  m_file = nullptr;
+  m_index.clear();
+  m_buffer = vector<uint8_t>();
+  m_buffer_used = 0;
+  m_previous.release();
+  return written;
+}
+
+bool ChunkedFrameWriter::writeIndex()
+{
+  // The index and the footer go through the same buffer, as the last append
+  const uint64_t index_offset = m_buffer_offset + m_buffer_used;
+  IndexHeader index;
+  index.magic = INDEX_MAGIC;
+  index.reserved = 0;
+  index.count = m_index.size();
+  Footer footer;
+  footer.index_offset = index_offset;
+  memcpy(footer.magic, FOOTER_MAGIC, sizeof(FOOTER_MAGIC));
+
+  const size_t entries_bytes = m_index.size() * sizeof(IndexEntry);
+  uint8_t *tail = reserve(sizeof(index) + entries_bytes + sizeof(footer));
+  memcpy(tail, &index, sizeof(index));
+  if (entries_bytes > 0)
+    memcpy(tail + sizeof(index), m_index.data(), entries_bytes);
+  memcpy(tail + sizeof(index) + entries_bytes, &footer, sizeof(footer));
+  m_buffer_used += sizeof(index) + entries_bytes + sizeof(footer);
+  return flush();
+}
+
+ChunkedFrameReader::ChunkedFrameReader() :
+  m_file(nullptr),
+  m_type(0),
+  m_tile_rows(0),
+  m_key_interval(0),
+  m_decoded_index(-1)
+{
+}
+
+ChunkedFrameReader::~ChunkedFrameReader()
+{
+  close();
+}
+
+bool ChunkedFrameReader::open(const string &path)
+{
+  if (m_file != nullptr)
+    return false;
+
+  m_file = fopen(path.c_str(), "rb");
+  if (m_file == nullptr)
+    return false;
+
+  FileHeader header;
+  const bool valid = fread(&header, sizeof(header), 1, m_file) == 1 &&
+    memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) == 0 && header.version >= 1 && header.version <= VERSION &&
+    header.width > 0 && header.height > 0 && header.tile_rows > 0 && isTileLayout(header);
+  if (!valid)
+  {
+    close();
+    return false;
+  }
+  m_size = Size(header.width, header.height);
+  m_type = header.type;
+  m_tile_rows = header.tile_rows;
+  m_key_interval = header.version >= 2 ? header.key_interval : 0;
+  m_decoded_index = -1;
+
+  // Without an index the recording was not closed properly, find the chunks ourselves
+  m_index.clear();
+  if (!readIndex() && !scanChunks())
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool ChunkedFrameReader::readIndex()
+{
+  const uint64_t size = fileSize(m_file);
+  Footer footer;
+  if (size < sizeof(FileHeader) + sizeof(IndexHeader) + sizeof(Footer) ||
+      !seekTo(m_file, size - sizeof(Footer)) || fread(&footer, sizeof(footer), 1, m_file) != 1 ||
+      memcmp(footer.magic, FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) != 0)
+    return false;
+
+  IndexHeader index;
+  if (!seekTo(m_file, footer.index_offset) || fread(&index, sizeof(index), 1, m_file) != 1 ||
+      index.magic != INDEX_MAGIC || footer.index_offset + sizeof(index) + index.count * sizeof(IndexEntry) > size)
+    return false;
+
+  m_index.resize((size_t)index.count);
+  return index.count == 0 || fread(m_index.data(), sizeof(IndexEntry), m_index.size(), m_file) == m_index.size();
+}
+
+bool ChunkedFrameReader::scanChunks()
+{
+  m_index.clear();
+  const uint64_t size = fileSize(m_file);
+  uint64_t offset = sizeof(FileHeader);
+
+  ChunkHeader header;
+  while (seekTo(m_file, offset) && fread(&header, sizeof(header), 1, m_file) == 1)
+  {
+    // Stop at the first chunk that is damaged or was not written completely
+    if (header.magic != CHUNK_MAGIC || offset + sizeof(header) + header.payload_bytes > size)
+      break;
+
+    IndexEntry entry;
+    entry.offset = offset;
+    entry.timestamp = header.timestamp;
+    m_index.push_back(entry);
+    offset += sizeof(header) + header.payload_bytes;
+  }
+  return true;
+}
+
+void ChunkedFrameReader::close()
+{
+  if (m_file != nullptr)
+    fclose(m_file);
+  m_file = nullptr;
+  m_index.clear();
+  m_decoded.release();
+  m_decoded_index = -1;
+}
+
+bool ChunkedFrameReader::read(const int64_t index, Mat &frame)
+{
+  if (m_file == nullptr || index < 0 || index >= getFrameCount())
+    return false;
+
+  // Without repeated tiles every chunk is a whole frame
+  if (m_key_interval == 0)
+  {
+    frame.create(m_size, m_type);
+    return decode(index, frame, false);
+  }
+
+  /*
+  Repeated tiles are in the frame before: decode from the key frame on, or from the frame
+  we decoded last when it's between the key frame and this one (reading in order).
+  */
+  const int64_t key = index / m_key_interval * m_key_interval;
+  int64_t next = key;
+  if (m_decoded_index >= key && m_decoded_index <= index)
+    next = m_decoded_index + 1;
+  m_decoded.create(m_size, m_type);
+  for (; next <= index; ++next)
+  {
+    if (!decode(next, m_decoded, next != key))
+    {
+      m_decoded_index = -1;
+      return false;
+    }
+    m_decoded_index = next;
+  }
+  m_decoded.copyTo(frame);
+  return true;
+}
+
+bool ChunkedFrameReader::decode(const int64_t index, Mat &frame, const bool has_previous)
+{
+  ChunkHeader header;
+  if (!seekTo(m_file, m_index[(size_t)index].offset) || fread(&header, sizeof(header), 1, m_file) != 1 ||
+      header.magic != CHUNK_MAGIC || (int)header.tile_count != tileCount(m_size.height, m_tile_rows))
+    return false;
+
+  m_payload.resize((size_t)header.payload_bytes);
+  if (fread(m_payload.data(), 1, m_payload.size(), m_file) != m_payload.size())
+    return false;
+
+  const size_t row_bytes = frame.cols * frame.elemSize();
+  const uint8_t *table = m_payload.data();
+  size_t in = header.tile_count * sizeof(uint32_t);
+  if (in > m_payload.size())
+    return false;
+
+  for (uint32_t tile = 0; tile < header.tile_count; ++tile)
+  {
+    uint32_t entry;
+    memcpy(&entry, table + tile * sizeof(uint32_t), sizeof(entry));
+    if (entry & REPEAT_TILE)
+    {
+      // The tile of the frame before is still there
+      if (!has_previous || entry != REPEAT_TILE)
+        return false;
+      continue;
+    }
+    const size_t stored = entry & ~RAW_TILE;
+    if (in + stored > m_payload.size())
+      return false;
+
+    const int y = tile * m_tile_rows;
+    const size_t bytes = row_bytes * min(m_tile_rows, m_size.height - y);
+    // create(..) gives a continuous image, so a tile is one block of memory
+    uint8_t *destination = frame.ptr(y);
+    if (entry & RAW_TILE)
+    {
+      if (stored != bytes)
+        return false;
+      memcpy(destination, m_payload.data() + in, bytes);
+    }
+    else if (decompressTile(m_payload.data() + in, stored, destination, bytes) != bytes)
+      return false;
+    in += stored;
+  }
+  return true;
+}
+
+ChunkedFileSource::ChunkedFileSource(const string &path, const bool loop) :
+  m_path(path),
+  m_loop(loop),
+  m_next(0),
+  m_grabbed(-1)
+{
+}
+
+bool ChunkedFileSource::open()
+{
+  m_next = 0;
+  m_grabbed = -1;
+  return m_reader.open(m_path) && m_reader.getFrameCount() > 0;
+}
+
+bool ChunkedFileSource::grab()
+{
+  m_grabbed = -1;
+  if (!m_reader.isOpened())
+    return false;
+
+  if (m_next >= m_reader.getFrameCount())
+  {
+    if (!m_loop)
+      return false;
+    m_next = 0;
+  }
+
+  m_grabbed = m_next++;
+  return true;
+}
+
+bool ChunkedFileSource::retrieve(Mat &frame)
+{
+  return m_grabbed >= 0 && m_reader.read(m_grabbed, frame);
+}
+
+bool ChunkedFileSource::isOpened() const
+{
+  return m_reader.isOpened();
+}
+
+void ChunkedFileSource::release()
+{
+  m_reader.close();
+  m_grabbed = -1;
+}
+
+string ChunkedFileSource::describe() const
+{
+  return "chunked:" + m_path;
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "FrameSource.h"
+
+/*!
+  How the tiles of a chunked recording are stored
+*/
+enum class ChunkCompression
+{
+  None,  //!< as they are, recording costs nothing but the disk bandwidth
+  Tiles  //!< every tile compressed on its own with the fast LZ codec of TileCompression.h
+};
+
+/*
+A chunked recording is a container for frames that is cheap to write while recording,
+so no real-time video encoding competes with the processing for CPU. Convert it to a
+normal video file later on, with transcodeChunkedFiles(..) (see Transcoder.h).
+
+The layout of the file (all numbers little endian):
+
+  file header   "CVCHUNK1", version, width, height, type, rows per tile, compression (16 bit),
+                key interval (16 bit)
+  chunk         one per frame: "FRAM", tile count, frame index, timestamp, payload size,
+                then per tile its stored size (the high bit set: stored uncompressed, the
+                next bit set: the same as in the frame before, nothing stored), then the tiles
+  ...
+  index         "INDX", frame count, then per frame: file offset and timestamp
+  footer        index offset, "CVCHKEND"
+
+Every key interval frames (frame index 0, N, 2N, ...) all tiles are stored, so a frame can be
+decoded starting at the key frame before it. A key interval of 0 stores all tiles of every frame.
+
+The index is written when the recording is closed. A file without one (the recorder
+crashed) can still be read: the reader then finds the chunks by walking from the first one.
+*/
+
+//!  Writes frames to a chunked recording
+/*!
+  Chunks are collected in a large buffer and written with one big sequential append
+  when it's full, so the disk sees few, large writes.
+
+  Tiles that are exactly the same as in the frame before are only marked as repeated,
+  they cost no compression and no disk space: a static scene records almost for free.
+*/
+class ChunkedFrameWriter
+{
+  FILE *m_file;
+  cv::Size m_size;
+  int m_type;
+  int m_tile_rows;
+  ChunkCompression m_compression;
+  int m_key_interval;
+  //! The frame as the reader will have it, to find the repeated tiles
+  cv::Mat m_previous;
+
+  //! Chunks that are not written to the file yet: the first m_buffer_used bytes, the rest is room
+  std::vector<uint8_t> m_buffer;
+  size_t m_buffer_used;
+  //! The file offset of m_buffer[0]
+  uint64_t m_buffer_offset;
+  //! A write to the file failed, the rest of the recording is lost
+  bool m_failed;
+
+  int64_t m_tiles;
+  int64_t m_repeated_tiles;
+
+  struct IndexEntry
+  {
+    uint64_t offset;
+    int64_t timestamp;
+  };
+  std::vector<IndexEntry> m_index;
+
+  //! Room for 'bytes' more after the used part of m_buffer, it only grows for a large index
+  uint8_t *reserve(const size_t bytes);
+  bool flush();
+  //! Append the index and the footer, and flush
+  bool writeIndex();
+
+public:
+  //! Buffered chunks are written once they reach this size
+  static const size_t WRITE_SIZE = 8 * 1024 * 1024;
+
+  ChunkedFrameWriter();
+  //! Closes the file (and writes the index)
+  ~ChunkedFrameWriter();
+
+  ChunkedFrameWriter(const ChunkedFrameWriter &) = delete;
+  ChunkedFrameWriter &operator=(const ChunkedFrameWriter &) = delete;
+
+  /*!
+    Create the file
+  */
+  /*!
+  /param path the file to create (an existing file is overwritten)
+  /param size the size of every frame
+  /param type the type of every frame, e.g. CV_8UC3
+  /param compression whether to compress the tiles
+  /param tile_rows the amount of image rows per tile
+  /param key_interval every so many frames all tiles are stored, 0: no repeated tiles at all
+  returns false if the file can't be created
+  */
+  bool open(const std::string &path, const cv::Size &size, const int type,
+    const ChunkCompression compression = ChunkCompression::Tiles, const int tile_rows = 16, const int key_interval = 30);
+
+  bool isOpened() const
+  {
+    return m_file != nullptr;
+  }
+
+  /*!
+    Append a frame
+  */
+  /*!
+  /param frame an image of the size and type given to open(..)
+  /param timestamp when the frame was captured, in nanoseconds (see Frame::timestamp)
+  returns false if the frame doesn't fit the recording or it can't be written, and for
+  every frame after a write to the file failed
+  */
+  bool write(const cv::Mat &frame, const int64_t timestamp);
+
+  //! The amount of frames written so far
+  int64_t getFrameCount() const
+  {
+    return (int64_t)m_index.size();
+  }
+
+  //! The amount of tiles written so far, and how many of them were repeated
+  int64_t getTileCount() const
+  {
+    return m_tiles;
+  }
+
+  int64_t getRepeatedTileCount() const
+  {
+    return m_repeated_tiles;
+  }
+
+  /*!
+    Write what is buffered and the index, and close the file
+  */
+  /*!
+  returns false if a write failed (then there is no index, the frames before the failure
+  are still read) or the recording wasn't open
+  */
+  bool close();
+};
+
+typedef std::shared_ptr<ChunkedFrameWriter> SChunkedFrameWriter;
+
+//!  Reads the frames of a chunked recording, in any order
+/*!
+  Reading them in order is the fastest: a frame with repeated tiles is decoded from the
+  frame before it, otherwise from the key frame before it.
+*/
+class ChunkedFrameReader
+{
+  FILE *m_file;
+  cv::Size m_size;
+  int m_type;
+  int m_tile_rows;
+  int m_key_interval;
+
+  struct IndexEntry
+  {
+    uint64_t offset;
+    int64_t timestamp;
+  };
+  std::vector<IndexEntry> m_index;
+
+  //! The last frame that was decoded, with repeated tiles the next one starts from it
+  cv::Mat m_decoded;
+  int64_t m_decoded_index;
+
+  //! The payload of the chunk that is being decoded, kept so it doesn't reallocate
+  std::vector<uint8_t> m_payload;
+
+  bool readIndex();
+  bool scanChunks();
+  bool decode(const int64_t index, cv::Mat &frame, const bool has_previous);
+
+public:
+  ChunkedFrameReader();
+  ~ChunkedFrameReader();
+
+  ChunkedFrameReader(const ChunkedFrameReader &) = delete;
+  ChunkedFrameReader &operator=(const ChunkedFrameReader &) = delete;
+
+  /*!
+    Open a recording, returns false if it's not a chunked recording
+  */
+  bool open(const std::string &path);
+
+  bool isOpened() const
+  {
+    return m_file != nullptr;
+  }
+
+  void close();
+
+  int64_t getFrameCount() const
+  {
+    return (int64_t)m_index.size();
+  }
+
+  cv::Size getFrameSize() const
+  {
+    return m_size;
+  }
+
+  int getFrameType() const
+  {
+    return m_type;
+  }
+
+  //! The timestamp of a frame in nanoseconds, as it was given to ChunkedFrameWriter::write(..)
+  int64_t getTimestamp(const int64_t index) const
+  {
+    return m_index[(size_t)index].timestamp;
+  }
+
+  /*!
+    Decode a frame
+  */
+  /*!
+  /param index the number of the frame
+  /param frame receives the image (its buffer is reused if it has the right size and type)
+  returns false if the index is out of range or the chunk is damaged
+  */
+  bool read(const int64_t index, cv::Mat &frame);
+};
+
+/*!
+  A chunked recording as a frame source, so it can be replayed like any other input
+*/
+class ChunkedFileSource : public FrameSource
+{
+  ChunkedFrameReader m_reader;
+  const std::string m_path;
+  const bool m_loop;
+  int64_t m_next;
+  int64_t m_grabbed;
+
+public:
+  /*!
+  /param path the chunked recording
+  /param loop start again at the first frame after the last one
+  */
+  ChunkedFileSource(const std::string &path, const bool loop = false);
+
+  bool open() override;
+  bool grab() override;
+  bool retrieve(cv::Mat &frame) override;
+  bool isOpened() const override;
+  void release() override;
+  std::string describe() const override;
+};
@@ -0,0 +1,146 @@
+#include "Compositor.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  // The cvtColor(..) code from one amount of channels to another (1 gray, 3 BGR, 4 BGRA)
+  int channelConversion(const int from, const int to)
+  {
+    if (from == 1)
+      return to == 4 ? COLOR_GRAY2BGRA : COLOR_GRAY2BGR;
+    if (from == 3)
+      return to == 4 ? COLOR_BGR2BGRA : COLOR_BGR2GRAY;
+    CV_Assert(from == 4);
+    return to == 1 ? COLOR_BGRA2GRAY : COLOR_BGRA2BGR;
+  }
+
+  // A float image is in [0 .. 1], for 8 bit that is [0 .. 255]
+  double depthScale(const int from, const int to)
+  {
+    const bool from_float = from == CV_32F || from == CV_64F;
+    const bool to_float = to == CV_32F || to == CV_64F;
+    if (from_float && !to_float)
+      return 255.0;
+    if (!from_float && to_float)
+      return 1 / 255.0;
+    return 1.0;
+  }
+}
+
+Compositor::Compositor(const Size &size, const vector<Rect> &rects, const int type, const Scalar &background) :
+  m_canvas(size, type, background),
+  m_rects(rects),
+  m_background(background),
+  m_scratch(rects.size())
+{
+  const Rect canvas(Point(0, 0), size);
+  for (const Rect &rect : m_rects)
+    CV_Assert((rect & canvas) == rect && rect.area() > 0);
+}
+
+Compositor Compositor::grid(const Size &panel, const int columns, const int rows, const int gap, const int type,
+  const Scalar &background)
+{
+  CV_Assert(columns > 0 && rows > 0 && gap >= 0);
+  vector<Rect> rects;
+  for (int row = 0; row < rows; ++row)
+    for (int column = 0; column < columns; ++column)
+      rects.push_back(Rect(gap + column * (panel.width + gap), gap + row * (panel.height + gap), panel.width, panel.height));
+
+  const Size size(gap + columns * (panel.width + gap), gap + rows * (panel.height + gap));
+  return Compositor(size, rects, type, background);
+}
+
+Mat Compositor::panel(const int index)
+{
+  return m_canvas(m_rects[index]);
+}
+
+void Compositor::convertInto(const Mat &image, Mat &target, Mat &scratch)
+{
+  CV_Assert(image.size() == target.size());
+  const uchar *data = target.data;
+  const double scale = depthScale(image.depth(), target.depth());
+
+  if (image.type() == target.type())
+    image.copyTo(target);
+  else if (image.channels() == target.channels())
+    image.convertTo(target, target.type(), scale);
+  else if (image.depth() == target.depth())
+    cvtColor(image, target, channelConversion(image.channels(), target.channels()));
+  else
+  {
+    // Both differ: the depth first, cvtColor(..) can't change it
+    image.convertTo(scratch, CV_MAKETYPE(target.depth(), image.channels()), scale);
+    cvtColor(scratch, target, channelConversion(image.channels(), target.channels()));
+  }
+
+  // The view still points into the canvas, so it was written in place
+  CV_Assert(target.data == data);
+}
+
+void Compositor::put(const int index, const Mat &image, const int interpolation)
+{
+  CV_Assert(!image.empty());
+  Mat target = panel(index);
+  Scratch &scratch = m_scratch[index];
+  const uchar *data = target.data;
+
+  if (image.size() == target.size())
+    convertInto(image, target, scratch.converted);
+  else if (image.type() == target.type())
+    resize(image, target, target.size(), 0, 0, interpolation);
+  else if (image.total() < target.total())
+  {
+    // Scaling up: convert the small image, then resize straight into the panel
+    scratch.resized.create(image.size(), target.type());
+    convertInto(image, scratch.resized, scratch.converted);
+    resize(scratch.resized, target, target.size(), 0, 0, interpolation);
+  }
+  else
+  {
+    // Scaling down: resize first, so there are fewer pixels to convert
+    resize(image, scratch.resized, target.size(), 0, 0, interpolation);
+    convertInto(scratch.resized, target, scratch.converted);
+  }
+
+  CV_Assert(target.data == data);
+}
+
+void Compositor::put(const int index, FramePyramid &pyramid)
+{
+  put(index, pyramid.get(getRect(index).size()));
+}
+
+void Compositor::put(const int index, const Mat &image, const TileMask &changed)
+{
+  Mat target = panel(index);
+  if (image.size() != target.size() || changed.image != image.size())
+  {
+    put(index, image);
+    return;
+  }
+
+  // The panel still has the clean tiles from before, only the dirty ones are written
+  Scratch &scratch = m_scratch[index];
+  for (int tile = 0; tile < changed.count(); ++tile)
+  {
+    if (!changed.dirty[tile])
+      continue;
+    const Rect rect = changed.rect(tile);
+    Mat tile_target = target(rect);
+    convertInto(image(rect), tile_target, scratch.converted);
+  }
+}
+
+void Compositor::fill(const int index, const Scalar &color)
+{
+  m_canvas(m_rects[index]).setTo(color);
+}
+
+void Compositor::clear()
+{
+  m_canvas.setTo(m_background);
+}
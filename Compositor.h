@@ -0,0 +1,124 @@
+#pragma once
+
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "ChangeDetector.h"
+#include "FramePyramid.h"
+
+//!  Builds an image out of panels on one preallocated canvas
+/*!
+  Sticking images together with hconcat(..) and vconcat(..) allocates a new, larger
+  image for every step and copies everything that is already there into it again.
+  With many streams on a wall that is most of the work of a frame.
+
+  A Compositor allocates the whole canvas once, from a layout: a grid or a list of
+  rectangles. panel(..) hands out a view (an ROI) of a panel, so whatever makes the
+  image of a panel can write it there directly. put(..) does that for an image that
+  has another size or amount of channels: it resizes and converts (gray to BGR, for
+  instance) straight into the panel, without an intermediate image of panel size.
+
+  Panels that don't overlap can be written from different threads at the same time.
+*/
+class Compositor
+{
+  cv::Mat m_canvas;
+  std::vector<cv::Rect> m_rects;
+  cv::Scalar m_background;
+
+  //! The temporary images of put(..) when it has to convert and resize, kept per panel
+  struct Scratch
+  {
+    cv::Mat converted;
+    cv::Mat resized;
+  };
+  std::vector<Scratch> m_scratch;
+
+  //! Write 'image' into the view 'target' of the same size, converting its channels and depth
+  static void convertInto(const cv::Mat &image, cv::Mat &target, cv::Mat &scratch);
+
+public:
+  /*!
+    A canvas with panels at the given rectangles, the parts not covered by a
+    panel are filled with the background color
+  */
+  /*!
+  /param size the size of the canvas
+  /param rects the panels, they must lie within the canvas
+  /param type the type of the canvas, normally a BGR image (CV_8UC3)
+  /param background the color of the canvas where there are no panels
+  */
+  Compositor(const cv::Size &size, const std::vector<cv::Rect> &rects, const int type = CV_8UC3,
+    const cv::Scalar &background = cv::Scalar::all(0));
+
+  /*!
+    A grid of equal panels, numbered row by row
+  */
+  /*!
+  /param panel the size of one panel
+  /param columns the amount of panels next to each other
+  /param rows the amount of panels on top of each other
+  /param gap the amount of pixels between the panels (and around them)
+  /param type the type of the canvas
+  /param background the color of the gaps
+  */
+  static Compositor grid(const cv::Size &panel, const int columns, const int rows, const int gap = 0,
+    const int type = CV_8UC3, const cv::Scalar &background = cv::Scalar::all(0));
+
+  /*!
+    A view of a panel: writing it writes the canvas. Don't give it to functions that
+    may create(..) it with another size or type, they'd get an image of their own.
+  */
+  cv::Mat panel(const int index);
+
+  /*!
+    Write an image into a panel. A different size is resized with the given interpolation,
+    a different amount of channels is converted (1 gray, 3 BGR, 4 BGRA) and a float image
+    is taken to be in [0 .. 1]. Nothing is allocated once a panel was filled before.
+  */
+  /*!
+  /param index the panel
+  /param image the image for it
+  /param interpolation for resize(..), INTER_AREA is the best for scaling down
+  */
+  void put(const int index, const cv::Mat &image, const int interpolation = cv::INTER_LINEAR);
+
+  /*!
+    Write only the tiles of an image that changed since it was last put into the panel,
+    for a stream that is mostly static (see ChangeDetector). The mask must be of this
+    image and the image of the size of the panel, otherwise the whole image is put(..).
+  */
+  void put(const int index, const cv::Mat &image, const TileMask &changed);
+
+  /*!
+    Write the frame of a pyramid into a panel, from the level of the size of the panel.
+    Panels of the same size share that level, and it is made from a smaller octave than
+    the frame when there is one, instead of resizing the whole frame for every panel.
+  */
+  void put(const int index, FramePyramid &pyramid);
+
+  //! Fill the panel with a color
+  void fill(const int index, const cv::Scalar &color);
+
+  //! Fill the whole canvas with the background color
+  void clear();
+
+  //! The canvas with all panels, it stays the same image as long as the Compositor lives
+  const cv::Mat &getCanvas() const
+  {
+    return m_canvas;
+  }
+
+  const cv::Rect &getRect(const int index) const
+  {
+    return m_rects[index];
+  }
+
+  int getPanelCount() const
+  {
+    return (int)m_rects.size();
+  }
+};
+
+typedef std::shared_ptr<Compositor> SCompositor;
@@ -0,0 +1,130 @@
+#include <cstdint>
+#include <cstring>
+
+#include "CpuFeatures.h"
+
+#ifdef CPU_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+using namespace std;
+
+namespace
+{
+  const char *LEVEL_NAMES[CPU_LEVEL_COUNT] = { "scalar", "sse4.1", "avx2", "avx512" };
+
+#ifdef CPU_X86
+  // EAX, EBX, ECX, EDX of a CPUID leaf
+  void cpuid(const uint32_t leaf, const uint32_t subleaf, uint32_t (&registers)[4])
+  {
+#ifdef _MSC_VER
+    int values[4];
+    __cpuidex(values, (int)leaf, (int)subleaf);
+    for (int i = 0; i < 4; ++i)
+      registers[i] = (uint32_t)values[i];
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+  }
+
+  // The register state the OS saves (XCR0), only valid when CPUID says OSXSAVE
+  uint64_t xgetbv()
+  {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+  }
+
+  CpuFeatures detect()
+  {
+    CpuFeatures features;
+    uint32_t registers[4];
+    cpuid(0, 0, registers);
+    const uint32_t max_leaf = registers[0];
+    if (max_leaf < 1)
+      return features;
+
+    cpuid(1, 0, registers);
+    features.sse2 = (registers[3] & (1u << 26)) != 0;
+    features.sse41 = features.sse2 && (registers[2] & (1u << 19)) != 0;
+    const bool osxsave = (registers[2] & (1u << 27)) != 0;
+    const bool avx = (registers[2] & (1u << 28)) != 0;
+
+    // XMM and YMM state (bits 1 and 2), for AVX-512 also the mask and ZMM state (bits 5 to 7)
+    const uint64_t xcr0 = osxsave ? xgetbv() : 0;
+    const bool ymm_saved = (xcr0 & 0x6) == 0x6;
+    const bool zmm_saved = (xcr0 & 0xE6) == 0xE6;
+
+    if (max_leaf >= 7)
+    {
+      cpuid(7, 0, registers);
+      features.avx2 = avx && ymm_saved && (registers[1] & (1u << 5)) != 0;
+      features.avx512f = zmm_saved && (registers[1] & (1u << 16)) != 0;
+      features.avx512bw = features.avx512f && (registers[1] & (1u << 30)) != 0;
+    }
+
+    cpuid(0x80000000, 0, registers);
+    if (registers[0] >= 0x80000004)
+    {
+      char brand[49] = {};
+      for (int i = 0; i < 3; ++i)
+      {
+        cpuid(0x80000002 + i, 0, registers);
+        memcpy(brand + 16 * i, registers, 16);
+      }
+      features.brand = brand;
+      // Some CPUs pad the brand string at the front
+      features.brand.erase(0, features.brand.find_first_not_of(' '));
+    }
+    return features;
+  }
+#else
+  CpuFeatures detect()
+  {
+    return CpuFeatures();
+  }
+#endif
+}
+
+const char *cpuLevelName(const CpuLevel level)
+{
+  return LEVEL_NAMES[(int)level];
+}
+
+bool parseCpuLevel(const string &name, CpuLevel &level)
+{
+  for (int i = 0; i < CPU_LEVEL_COUNT; ++i)
+  {
+    if (name == LEVEL_NAMES[i])
+    {
+      level = (CpuLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+CpuLevel CpuFeatures::level() const
+{
+  if (avx512f && avx512bw && avx2)
+    return CpuLevel::AVX512;
+  if (avx2 && sse41)
+    return CpuLevel::AVX2;
+  if (sse41)
+    return CpuLevel::SSE41;
+  return CpuLevel::Scalar;
+}
+
+const CpuFeatures &CpuFeatures::host()
+{
+  static const CpuFeatures features = detect();
+  return features;
+}
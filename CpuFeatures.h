@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+
+/*!
+  The instruction set levels that kernels have variants for, each includes the ones before
+*/
+enum class CpuLevel
+{
+  Scalar, //!< plain C++, runs everywhere
+  SSE41,  //!< SSE2 up to SSE4.1, every x64 CPU of the last 15 years
+  AVX2,   //!< AVX2 (256 bit integer vectors), Haswell and Zen on
+  AVX512  //!< AVX-512 F and BW (512 bit byte vectors), Skylake-SP, Ice Lake, Zen 4
+};
+
+const int CPU_LEVEL_COUNT = 4;
+
+//! "scalar", "sse4.1", "avx2" or "avx512"
+const char *cpuLevelName(const CpuLevel level);
+
+/*!
+  The level with that name (see cpuLevelName(..)), returns false for an unknown name
+*/
+bool parseCpuLevel(const std::string &name, CpuLevel &level);
+
+//!  What the processor we run on can do, from CPUID
+/*!
+  A feature only counts when the operating system also saves its registers on a thread
+  switch (XGETBV): a CPU with AVX on an OS that doesn't know AVX can't use it.
+*/
+struct CpuFeatures
+{
+  bool sse2 = false;
+  bool sse41 = false;
+  bool avx2 = false;
+  bool avx512f = false;
+  bool avx512bw = false;
+  //! The brand string, e.g. "Intel(R) Core(TM) i7-8700 CPU @ 3.20GHz", empty if unknown
+  std::string brand;
+
+  //! The highest level this CPU runs
+  CpuLevel level() const;
+
+  //! The features of this computer, detected once
+  static const CpuFeatures &host();
+};
+
+/*
+The compiler has to be allowed to use the instructions of a level in the functions of
+that level only, the rest of the program must run on every x64 CPU. MSVC emits any
+intrinsic without /arch, GCC and Clang need the target on the function. So the variant
+files get no /arch (or -mavx2) of their own: the inline functions of the headers they
+include would be compiled with it too, and the linker may keep that copy for everyone.
+*/
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
@@ -0,0 +1,153 @@
+#include <chrono>
+#include <opencv2/highgui.hpp>
+
+#include "DisplaySink.h"
+#include "Trace.h"
+
+using namespace cv;
+using namespace std;
+
+DisplaySink::DisplaySink(const string &window, const bool headless) :
+  m_window(window),
+  m_headless(headless),
+  m_running(false),
+  m_has_new(false),
+  m_offered(0),
+  m_shown_count(0),
+  m_replaced(0),
+  m_key_count(0)
+{
+}
+
+DisplaySink::~DisplaySink()
+{
+  stop();
+}
+
+int DisplaySink::addTrackbar(const string &name, const int max, const int value)
+{
+  unique_ptr<Trackbar> trackbar(new Trackbar());
+  trackbar->name = name;
+  trackbar->max = max;
+  trackbar->value = value;
+  trackbar->current = value;
+  m_trackbars.push_back(move(trackbar));
+  return (int)m_trackbars.size() - 1;
+}
+
+void DisplaySink::start()
+{
+  if (m_headless || m_running)
+    return;
+  m_running = true;
+  m_thread = thread(&DisplaySink::displayLoop, this);
+}
+
+void DisplaySink::stop()
+{
+  m_running = false;
+  if (m_thread.joinable())
+    m_thread.join();
+}
+
+void DisplaySink::show(const Frame &frame)
+{
+  ++m_offered;
+  if (m_headless)
+    return;
+
+  // The frame that is replaced lets go of its buffer after the lock
+  Frame replaced;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    if (m_has_new)
+      ++m_replaced;
+    replaced = move(m_newest);
+    m_newest = frame;
+    m_has_new = true;
+  }
+}
+
+int DisplaySink::waitKey(const int timeout_ms)
+{
+  unique_lock<mutex> lock(m_mutex);
+  m_key_pressed.wait_for(lock, chrono::milliseconds(max(0, timeout_ms)), [this]() { return !m_keys.empty(); });
+  if (m_keys.empty())
+    return -1;
+  const int key = m_keys.front();
+  m_keys.pop_front();
+  return key;
+}
+
+int DisplaySink::getTrackbar(const int index) const
+{
+  return m_trackbars[index]->current.load(memory_order_relaxed);
+}
+
+Frame DisplaySink::getShown()
+{
+  lock_guard<mutex> lock(m_mutex);
+  return m_shown;
+}
+
+DisplayStats DisplaySink::getStats() const
+{
+  DisplayStats stats;
+  stats.offered = m_offered;
+  stats.shown = m_shown_count;
+  stats.replaced = m_replaced;
+  stats.keys = m_key_count;
+  return stats;
+}
+
+void DisplaySink::displayLoop()
+{
+  Trace::setThreadName("display");
+
+  // All HighGUI calls of the window happen on this thread
+  namedWindow(m_window, CV_WINDOW_FREERATIO);
+  for (const unique_ptr<Trackbar> &trackbar : m_trackbars)
+    createTrackbar(trackbar->name, m_window, &trackbar->value, trackbar->max);
+
+  while (m_running)
+  {
+    Frame frame;
+    {
+      lock_guard<mutex> lock(m_mutex);
+      if (m_has_new)
+      {
+        frame = m_newest;
+        m_has_new = false;
+      }
+    }
+
+    if (!frame.image.empty())
+    {
+      TraceScope trace("display", frame.id);
+      imshow(m_window, frame.image);
+      ++m_shown_count;
+      lock_guard<mutex> lock(m_mutex);
+      m_shown = frame;
+    }
+
+    // waitKey(..) also lets the window paint and handle its events
+    const int key = cv::waitKey(frame.image.empty() ? 5 : 1);
+    for (const unique_ptr<Trackbar> &trackbar : m_trackbars)
+      trackbar->current.store(trackbar->value, memory_order_relaxed);
+    if (key != -1)
+    {
+      ++m_key_count;
+      {
+        lock_guard<mutex> lock(m_mutex);
+        if (m_keys.size() == MAX_KEYS)
+          m_keys.pop_front();
+        m_keys.push_back(key);
+      }
+      m_key_pressed.notify_all();
+    }
+  }
+
+  destroyWindow(m_window);
+  // Let the window really go away
+  cv::waitKey(1);
+}
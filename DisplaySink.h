@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FramePool.h"
+
+/*!
+  A snapshot of the counters of a DisplaySink
+*/
+struct DisplayStats
+{
+  //! Frames given to show(..)
+  int64_t offered = 0;
+  //! Frames that made it to the window
+  int64_t shown = 0;
+  //! Frames that were replaced by a newer one before the window got to them
+  int64_t replaced = 0;
+  //! Keys pressed in the window
+  int64_t keys = 0;
+};
+
+//!  Shows frames in a window on a thread of its own
+/*!
+  imshow(..) and waitKey(..) on the thread of the frame loop tie the loop to the event
+  loop of HighGUI: waitKey(10) alone caps it below 100 frames per second, and a window
+  that is dragged around stalls the recording. The sink owns the window on its own
+  thread instead. show(..) only hands over the frame and never waits: the window shows
+  the newest frame, a frame that wasn't shown yet when a newer one arrives is replaced,
+  not queued. Keys and trackbars are read on the display thread and picked up with
+  waitKey(..) and getTrackbar(..) from any thread.
+
+  Headless, there is no window and no thread at all: show(..) only counts the frame and
+  not one HighGUI function is called. waitKey(..) simply waits for its time out, so the
+  same loop runs on a server without a display.
+
+  HighGUI wants all calls of a window on one thread, so don't touch the window of a
+  running sink from another thread.
+*/
+class DisplaySink
+{
+  struct Trackbar
+  {
+    std::string name;
+    int max;
+    //! Written by HighGUI on the display thread
+    int value;
+    std::atomic<int> current;
+  };
+
+  const std::string m_window;
+  const bool m_headless;
+
+  std::thread m_thread;
+  std::atomic<bool> m_running;
+
+  std::mutex m_mutex;
+  std::condition_variable m_key_pressed;
+  //! The newest frame, and whether the window has it already
+  Frame m_newest;
+  bool m_has_new;
+  //! The frame that is in the window right now (for a snapshot of it)
+  Frame m_shown;
+  std::deque<int> m_keys;
+
+  // unique_ptr: HighGUI keeps a pointer to 'value'
+  std::vector<std::unique_ptr<Trackbar>> m_trackbars;
+
+  std::atomic<int64_t> m_offered;
+  std::atomic<int64_t> m_shown_count;
+  std::atomic<int64_t> m_replaced;
+  std::atomic<int64_t> m_key_count;
+
+  void displayLoop();
+
+public:
+  //! Keys waiting for waitKey(..), older ones are forgotten
+  static const size_t MAX_KEYS = 16;
+
+  /*!
+  /param window the name (and title) of the window
+  /param headless no window, no thread, no HighGUI
+  */
+  DisplaySink(const std::string &window, const bool headless = false);
+
+  //! Closes the window
+  ~DisplaySink();
+
+  DisplaySink(const DisplaySink &) = delete;
+  DisplaySink &operator=(const DisplaySink &) = delete;
+
+  /*!
+    Add a trackbar to the window, before start()
+  */
+  /*!
+  /param name the label of the trackbar
+  /param max the highest value, the lowest is 0
+  /param value the value it starts with
+  returns the index for getTrackbar(..)
+  */
+  int addTrackbar(const std::string &name, const int max, const int value = 0);
+
+  //! Open the window and start the display thread (headless: does nothing)
+  void start();
+
+  //! Close the window and join the display thread
+  void stop();
+
+  /*!
+    Show this frame as soon as the display thread gets to it, returns right away. The
+    Frame keeps its pooled buffer in use until it's replaced, don't write into the image.
+  */
+  void show(const Frame &frame);
+
+  /*!
+    Wait for a key pressed in the window
+  */
+  /*!
+  /param timeout_ms how long to wait at most, 0: don't wait
+  returns the key, or -1 if none was pressed in time
+  */
+  int waitKey(const int timeout_ms);
+
+  //! The current value of a trackbar (headless: the value it started with)
+  int getTrackbar(const int index) const;
+
+  //! The frame in the window right now (empty if none)
+  Frame getShown();
+
+  bool isHeadless() const
+  {
+    return m_headless;
+  }
+
+  DisplayStats getStats() const;
+};
+
+typedef std::shared_ptr<DisplaySink> SDisplaySink;
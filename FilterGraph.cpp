@@ -0,0 +1,978 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+
+#include "FilterGraph.h"
+#include "Helper.h"
+#include "Pixelate.h"
+
+using namespace cv;
+using namespace std;
+
+void GraphValues::set(const string &name, const double value)
+{
+  for (pair<string, double> &number : m_numbers)
+  {
+    if (number.first == name)
+    {
+      number.second = value;
+      return;
+    }
+  }
+  m_numbers.push_back(make_pair(name, value));
+}
+
+void GraphValues::setText(const string &name, const string &text)
+{
+  // Assigning to the string that's there reuses its memory
+  for (pair<string, string> &entry : m_texts)
+  {
+    if (entry.first == name)
+    {
+      entry.second = text;
+      return;
+    }
+  }
+  m_texts.push_back(make_pair(name, text));
+}
+
+double GraphValues::get(const string &name, const double fallback) const
+{
+  for (const pair<string, double> &number : m_numbers)
+    if (number.first == name)
+      return number.second;
+  return fallback;
+}
+
+const string &GraphValues::getText(const string &name) const
+{
+  static const string empty;
+  for (const pair<string, string> &entry : m_texts)
+    if (entry.first == name)
+      return entry.second;
+  return empty;
+}
+
+double GraphValue::get(const GraphValues &values) const
+{
+  return variable.empty() ? number : values.get(variable, number);
+}
+
+string GraphValue::getText(const GraphValues &values) const
+{
+  return variable.empty() ? text : values.getText(variable);
+}
+
+StageOptions::StageOptions(const map<string, string> &options) :
+  m_options(options)
+{
+}
+
+GraphValue StageOptions::number(const string &key, const double fallback) const
+{
+  GraphValue value;
+  value.number = fallback;
+  const auto option = m_options.find(key);
+  if (option == m_options.end())
+    return value;
+
+  m_used.insert(key);
+  const string &text = option->second;
+  if (!text.empty() && text[0] == '$')
+  {
+    value.variable = text.substr(1);
+    return value;
+  }
+  char *end = nullptr;
+  value.number = strtod(text.c_str(), &end);
+  if (text.empty() || *end != '\0')
+    m_error = "'" + key + "' is not a number: " + text;
+  return value;
+}
+
+GraphValue StageOptions::text(const string &key, const string &fallback) const
+{
+  GraphValue value;
+  value.text = fallback;
+  const auto option = m_options.find(key);
+  if (option == m_options.end())
+    return value;
+
+  m_used.insert(key);
+  if (!option->second.empty() && option->second[0] == '$')
+    value.variable = option->second.substr(1);
+  else
+    value.text = option->second;
+  return value;
+}
+
+string StageOptions::error() const
+{
+  if (!m_error.empty())
+    return m_error;
+  for (const pair<const string, string> &option : m_options)
+    if (m_used.count(option.first) == 0)
+      return "unknown option '" + option.first + "'";
+  return string();
+}
+
+namespace
+{
+  // A row of pixels as a cv::Mat, so the OpenCV functions can work on it
+  Mat rowHeader(const uchar *row, const int width, const int type)
+  {
+    return Mat(1, width, type, const_cast<uchar *>(row));
+  }
+
+  /*
+  The row stages loop over the pixels of 8 bit rows themselves: a call of cvtColor(..) or
+  convertTo(..) per row costs its dispatch on every row of every stage, more than the work
+  on a row. Other depths go through OpenCV.
+  */
+
+  // The weights of cvtColor(..) BGR2GRAY for 8 bit, in 1/32768
+  const int GRAY_SHIFT = 15;
+  const int GRAY_B = 3735, GRAY_G = 19235, GRAY_R = 9798;
+
+  void convertRow8u(const uchar *in, uchar *out, const int width, const int in_channels, const int out_channels)
+  {
+    if (in_channels == out_channels)
+    {
+      memcpy(out, in, (size_t)width * in_channels);
+      return;
+    }
+    for (int x = 0; x < width; ++x, in += in_channels, out += out_channels)
+    {
+      if (in_channels == 1)
+      {
+        out[0] = out[1] = out[2] = in[0];
+        if (out_channels == 4)
+          out[3] = 255;
+      }
+      else if (out_channels == 1)
+        out[0] = (uchar)((in[0] * GRAY_B + in[1] * GRAY_G + in[2] * GRAY_R + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT);
+      else
+      {
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+        if (out_channels == 4)
+          out[3] = 255;
+      }
+    }
+  }
+
+  class FlipStage : public GraphStage
+  {
+  public:
+    FlipStage() :
+      GraphStage("flip")
+    {
+    }
+
+    bool isRowStage() const override
+    {
+      return true;
+    }
+
+    bool canRunInPlace() const override
+    {
+      return true;
+    }
+
+    void applyRow(const uchar *in, uchar *out, const int width, const int type, const GraphValues &) const override
+    {
+      const size_t pixel = CV_ELEM_SIZE(type);
+      if (in == out)
+      {
+        // Swap the pixels of the left half with those of the right half
+        for (int x = 0; x < width / 2; ++x)
+          swap_ranges(out + x * pixel, out + (x + 1) * pixel, out + (width - 1 - x) * pixel);
+        return;
+      }
+      for (int x = 0; x < width; ++x)
+        copy(in + x * pixel, in + (x + 1) * pixel, out + (width - 1 - x) * pixel);
+    }
+  };
+
+  // A color conversion to 'channels' channels, the input may have 1, 3 or 4
+  class ChannelStage : public GraphStage
+  {
+    int m_channels;
+
+  public:
+    ChannelStage(const string &name, const int channels) :
+      GraphStage(name),
+      m_channels(channels)
+    {
+    }
+
+    bool isRowStage() const override
+    {
+      return true;
+    }
+
+    int outputType(const int type) const override
+    {
+      return CV_MAKETYPE(CV_MAT_DEPTH(type), m_channels);
+    }
+
+    void applyRow(const uchar *in, uchar *out, const int width, const int type, const GraphValues &) const override
+    {
+      const int channels = CV_MAT_CN(type);
+      if (CV_MAT_DEPTH(type) == CV_8U)
+      {
+        convertRow8u(in, out, width, channels, m_channels);
+        return;
+      }
+      Mat out_row = rowHeader(out, width, outputType(type));
+      if (channels == m_channels)
+        rowHeader(in, width, type).copyTo(out_row);
+      else if (channels == 1)
+        cvtColor(rowHeader(in, width, type), out_row, m_channels == 4 ? COLOR_GRAY2BGRA : COLOR_GRAY2BGR);
+      else if (channels == 3)
+        cvtColor(rowHeader(in, width, type), out_row, m_channels == 4 ? COLOR_BGR2BGRA : COLOR_BGR2GRAY);
+      else
+        cvtColor(rowHeader(in, width, type), out_row, m_channels == 1 ? COLOR_BGRA2GRAY : COLOR_BGRA2BGR);
+    }
+  };
+
+  class AdjustStage : public GraphStage
+  {
+    GraphValue m_gain;
+    GraphValue m_offset;
+
+  public:
+    AdjustStage(const GraphValue &gain, const GraphValue &offset) :
+      GraphStage("adjust"),
+      m_gain(gain),
+      m_offset(offset)
+    {
+    }
+
+    bool isRowStage() const override
+    {
+      return true;
+    }
+
+    bool canRunInPlace() const override
+    {
+      return true;
+    }
+
+    void applyRow(const uchar *in, uchar *out, const int width, const int type, const GraphValues &values) const override
+    {
+      if (CV_MAT_DEPTH(type) == CV_8U)
+      {
+        // A table of the 256 results, like convertTo(..) computes them for 8 bit: in float
+        const float gain = (float)m_gain.get(values), offset = (float)m_offset.get(values);
+        uchar table[256];
+        for (int v = 0; v < 256; ++v)
+          table[v] = saturate_cast<uchar>(v * gain + offset);
+        const int count = width * CV_MAT_CN(type);
+        for (int i = 0; i < count; ++i)
+          out[i] = table[in[i]];
+        return;
+      }
+      Mat out_row = rowHeader(out, width, type);
+      rowHeader(in, width, type).convertTo(out_row, -1, m_gain.get(values), m_offset.get(values));
+    }
+  };
+
+  class InvertStage : public GraphStage
+  {
+  public:
+    InvertStage() :
+      GraphStage("invert")
+    {
+    }
+
+    bool isRowStage() const override
+    {
+      return true;
+    }
+
+    bool canRunInPlace() const override
+    {
+      return true;
+    }
+
+    void applyRow(const uchar *in, uchar *out, const int width, const int type, const GraphValues &) const override
+    {
+      const size_t count = (size_t)width * CV_ELEM_SIZE(type);
+      for (size_t i = 0; i < count; ++i)
+        out[i] = (uchar)~in[i];
+    }
+  };
+
+  class PixelateStage : public GraphStage
+  {
+    GraphValue m_block;
+    GraphValue m_mirror;
+
+    int block(const GraphValues &values) const
+    {
+      return max(1, cvRound(m_block.get(values)));
+    }
+
+  public:
+    PixelateStage(const GraphValue &block, const GraphValue &mirror) :
+      GraphStage("pixelate"),
+      m_block(block),
+      m_mirror(mirror)
+    {
+    }
+
+    bool canRunInPlace() const override
+    {
+      return true;
+    }
+
+    int alignment(const GraphValues &values) const override
+    {
+      return block(values);
+    }
+
+    void apply(const Mat &in, Mat &out, const int, const GraphValues &values) const override
+    {
+      pixelateFlip(in, out, block(values), m_mirror.get(values) != 0);
+    }
+  };
+
+  class BlurStage : public GraphStage
+  {
+    GraphValue m_ksize;
+    GraphValue m_sigma;
+
+    // An odd kernel size of at least 1
+    int ksize(const GraphValues &values) const
+    {
+      return max(1, cvRound(m_ksize.get(values))) | 1;
+    }
+
+  public:
+    BlurStage(const GraphValue &ksize, const GraphValue &sigma) :
+      GraphStage("blur"),
+      m_ksize(ksize),
+      m_sigma(sigma)
+    {
+    }
+
+    bool canRunInPlace() const override
+    {
+      return true;
+    }
+
+    int halo(const GraphValues &values) const override
+    {
+      return ksize(values) / 2;
+    }
+
+    void apply(const Mat &in, Mat &out, const int, const GraphValues &values) const override
+    {
+      const int size = ksize(values);
+      const double sigma = m_sigma.get(values);
+      GaussianBlur(in, out, Size(size, size), sigma, sigma, BORDER_REPLICATE);
+    }
+  };
+
+  class TextStage : public GraphStage
+  {
+    GraphValue m_text;
+    GraphValue m_x;
+    GraphValue m_y;
+    GraphValue m_size;
+
+  public:
+    TextStage(const GraphValue &text, const GraphValue &x, const GraphValue &y, const GraphValue &size) :
+      GraphStage("text"),
+      m_text(text),
+      m_x(x),
+      m_y(y),
+      m_size(size)
+    {
+    }
+
+    bool canRunInPlace() const override
+    {
+      return true;
+    }
+
+    void apply(const Mat &in, Mat &out, const int y, const GraphValues &values) const override
+    {
+      if (out.data != in.data)
+        in.copyTo(out);
+      const string text = m_text.getText(values);
+      if (text.empty())
+        return;
+      // The band starts at image row y, the text is clipped to the band
+      const Point location(cvRound(m_x.get(values)), cvRound(m_y.get(values)) - y);
+      Helper::putPrettyText(text, location, m_size.get(values), out);
+    }
+
+    Rect drawnArea(const Size &size, const GraphValues &values) const override
+    {
+      const string text = m_text.getText(values);
+      if (text.empty())
+        return Rect();
+      // The size of the outlined text of putPrettyText(..), with a few pixels to spare for the anti-aliasing
+      int baseline = 0;
+      const Size extent = getTextSize(text, FONT_HERSHEY_PLAIN, m_size.get(values), 2, &baseline);
+      const Point location(cvRound(m_x.get(values)), cvRound(m_y.get(values)));
+      const Rect area(location.x - 4, location.y - extent.height - 4, extent.width + 8, extent.height + baseline + 8);
+      return area & Rect(Point(), size);
+    }
+  };
+
+  // A stage without options
+  template<typename STAGE>
+  StageFactory plainStage()
+  {
+    return [](const StageOptions &)
+    {
+      return make_shared<STAGE>();
+    };
+  }
+
+  struct Registry
+  {
+    mutex lock;
+    map<string, StageFactory> factories;
+
+    Registry()
+    {
+      factories["flip"] = plainStage<FlipStage>();
+      factories["invert"] = plainStage<InvertStage>();
+      factories["gray"] = [](const StageOptions &)
+      {
+        return make_shared<ChannelStage>("gray", 1);
+      };
+      factories["bgr"] = [](const StageOptions &)
+      {
+        return make_shared<ChannelStage>("bgr", 3);
+      };
+      factories["adjust"] = [](const StageOptions &options)
+      {
+        return make_shared<AdjustStage>(options.number("gain", 1), options.number("offset", 0));
+      };
+      factories["pixelate"] = [](const StageOptions &options)
+      {
+        return make_shared<PixelateStage>(options.number("block", 1), options.number("mirror", 1));
+      };
+      factories["blur"] = [](const StageOptions &options)
+      {
+        return make_shared<BlurStage>(options.number("ksize", 5), options.number("sigma", 0));
+      };
+      factories["text"] = [](const StageOptions &options)
+      {
+        return make_shared<TextStage>(options.text("text"), options.number("x", 8), options.number("y", 24),
+          options.number("size", 0.8));
+      };
+    }
+  };
+
+  Registry &registry()
+  {
+    static Registry instance;
+    return instance;
+  }
+
+  string trim(const string &text)
+  {
+    const size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == string::npos)
+      return string();
+    const size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+  }
+
+  // Split at 'separator', but not within quotes or parentheses
+  vector<string> split(const string &text, const char separator)
+  {
+    vector<string> parts(1);
+    int depth = 0;
+    bool quoted = false;
+    for (const char c : text)
+    {
+      if (c == '"')
+        quoted = !quoted;
+      else if (!quoted && c == '(')
+        ++depth;
+      else if (!quoted && c == ')')
+        --depth;
+      if (c == separator && !quoted && depth == 0)
+        parts.push_back(string());
+      else
+        parts.back() += c;
+    }
+    return parts;
+  }
+
+  string unquote(const string &text)
+  {
+    if (text.size() >= 2 && text.front() == '"' && text.back() == '"')
+      return text.substr(1, text.size() - 2);
+    return text;
+  }
+}
+
+namespace StageRegistry
+{
+  void add(const string &name, const StageFactory &factory)
+  {
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    instance.factories[name] = factory;
+  }
+
+  SGraphStage create(const string &name, const StageOptions &options)
+  {
+    StageFactory factory;
+    {
+      Registry &instance = registry();
+      lock_guard<mutex> lock(instance.lock);
+      const auto found = instance.factories.find(name);
+      if (found == instance.factories.end())
+        return nullptr;
+      factory = found->second;
+    }
+    return factory(options);
+  }
+
+  vector<string> names()
+  {
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    vector<string> result;
+    for (const pair<const string, StageFactory> &factory : instance.factories)
+      result.push_back(factory.first);
+    return result;
+  }
+}
+
+bool FilterGraph::parse(const string &description, string &error)
+{
+  // Comments out, new lines become separators
+  string chain;
+  istringstream lines(description);
+  string line;
+  while (getline(lines, line))
+    chain += line.substr(0, line.find('#')) + "|";
+
+  vector<SGraphStage> stages;
+  for (const string &part : split(chain, '|'))
+  {
+    const string text = trim(part);
+    if (text.empty())
+      continue;
+
+    // name or name(key=value, ...)
+    const size_t open = text.find('(');
+    const string name = trim(text.substr(0, open));
+    map<string, string> options;
+    if (open != string::npos)
+    {
+      if (text.back() != ')')
+      {
+        error = "missing ) after the options of " + name;
+        return false;
+      }
+      for (const string &option : split(text.substr(open + 1, text.size() - open - 2), ','))
+      {
+        if (trim(option).empty())
+          continue;
+        const size_t equals = option.find('=');
+        if (equals == string::npos)
+        {
+          error = name + ": option '" + trim(option) + "' has no value (key=value)";
+          return false;
+        }
+        options[trim(option.substr(0, equals))] = unquote(trim(option.substr(equals + 1)));
+      }
+    }
+
+    const StageOptions stage_options(options);
+    SGraphStage stage = StageRegistry::create(name, stage_options);
+    if (stage == nullptr)
+    {
+      error = "unknown stage '" + name + "'";
+      return false;
+    }
+    const string options_error = stage_options.error();
+    if (!options_error.empty())
+    {
+      error = name + ": " + options_error;
+      return false;
+    }
+    stages.push_back(stage);
+  }
+
+  for (const SGraphStage &stage : stages)
+    add(stage);
+  return true;
+}
+
+bool FilterGraph::load(const string &path, string &error)
+{
+  ifstream file(path);
+  if (!file)
+  {
+    error = "can't read " + path;
+    return false;
+  }
+  stringstream contents;
+  contents << file.rdbuf();
+  return parse(contents.str(), error);
+}
+
+void FilterGraph::add(const SGraphStage &stage)
+{
+  lock_guard<mutex> lock(m_mutex);
+  m_stages.push_back(stage);
+  // The plans are for the old chain
+  m_plans.clear();
+}
+
+void FilterGraph::setExecutor(const SStripeExecutor &executor)
+{
+  m_executor = executor;
+}
+
+int FilterGraph::outputType(const int type) const
+{
+  int result = type;
+  for (const SGraphStage &stage : m_stages)
+    result = stage->outputType(result);
+  return result;
+}
+
+FilterGraph::Plan FilterGraph::makePlan(const int type, const bool in_place) const
+{
+  Plan plan;
+
+  // The steps: every band stage on its own, adjacent row stages together
+  int step_type = type;
+  for (size_t i = 0; i < m_stages.size();)
+  {
+    Step step;
+    step.first = i;
+    step.rows = m_stages[i]->isRowStage();
+    while (step.rows && i + step.count < m_stages.size() && m_stages[i + step.count]->isRowStage())
+      ++step.count;
+
+    const int input_type = step_type;
+    for (size_t k = i; k < i + step.count; ++k)
+      step_type = m_stages[k]->outputType(step_type);
+    step.type = step_type;
+    /*
+    A fused run of 2 or more row stages can always write the row it reads: the first
+    stage reads it into a row buffer and only the last one writes it. A single stage
+    must be able to do that itself.
+    */
+    step.in_place = step_type == input_type && (step.count > 1 || m_stages[i]->canRunInPlace());
+
+    plan.steps.push_back(step);
+    i += step.count;
+  }
+
+  // The buffers. When dst is src, the frame starts in dst.
+  vector<bool> busy;
+  int current = in_place ? DESTINATION : SOURCE;
+  for (size_t s = 0; s < plan.steps.size(); ++s)
+  {
+    Step &step = plan.steps[s];
+    const bool rest_in_place = all_of(plan.steps.begin() + s + 1, plan.steps.end(), [](const Step &next)
+    {
+      return next.in_place;
+    });
+
+    step.input = current;
+    if (step.in_place && current != SOURCE)
+      step.output = current;
+    else if (current != DESTINATION && rest_in_place)
+      step.output = DESTINATION;
+    else
+    {
+      // A scratch buffer of the right type that isn't in use, or a new one
+      step.output = -1;
+      for (size_t b = 0; b < busy.size() && step.output < 0; ++b)
+        if (!busy[b] && plan.buffer_types[b] == step.type)
+          step.output = (int)b;
+      if (step.output < 0)
+      {
+        step.output = (int)busy.size();
+        busy.push_back(false);
+        plan.buffer_types.push_back(step.type);
+      }
+      busy[step.output] = true;
+    }
+
+    // The input is used up
+    if (current >= 0 && current != step.output)
+      busy[current] = false;
+    current = step.output;
+  }
+  plan.result = current;
+  return plan;
+}
+
+shared_ptr<const FilterGraph::Plan> FilterGraph::plan(const int type, const bool in_place) const
+{
+  lock_guard<mutex> lock(m_mutex);
+  shared_ptr<const Plan> &plan = m_plans[make_pair(type, in_place)];
+  if (plan == nullptr)
+    plan = make_shared<const Plan>(makePlan(type, in_place));
+  return plan;
+}
+
+void FilterGraph::runStep(const Step &step, const Mat &in, Mat &out, const int y, const GraphValues &values) const
+{
+  if (!step.rows)
+  {
+    m_stages[step.first]->apply(in, out, y, values);
+    return;
+  }
+
+  out.create(in.size(), step.type);
+
+  // The type of the input of every stage, and the largest row in between
+  static thread_local vector<int> types;
+  types.resize(step.count);
+  size_t row_bytes = 0;
+  int type = in.type();
+  for (size_t k = 0; k < step.count; ++k)
+  {
+    types[k] = type;
+    type = m_stages[step.first + k]->outputType(type);
+    row_bytes = max(row_bytes, in.cols * (size_t)CV_ELEM_SIZE(type));
+  }
+
+  // Between the stages a row lives in one of two row buffers, they stay in the L1 cache
+  static thread_local vector<uchar> row_buffers[2];
+  for (vector<uchar> &buffer : row_buffers)
+    if (buffer.size() < row_bytes)
+      buffer.resize(row_bytes);
+
+  for (int r = 0; r < in.rows; ++r)
+  {
+    const uchar *row_in = in.ptr(r);
+    for (size_t k = 0; k < step.count; ++k)
+    {
+      uchar *row_out = k + 1 == step.count ? out.ptr(r) : row_buffers[k % 2].data();
+      m_stages[step.first + k]->applyRow(row_in, row_out, in.cols, types[k], values);
+      row_in = row_out;
+    }
+  }
+}
+
+void FilterGraph::runStripes(const Plan &plan, const Mat &src, Mat &dst, const int y, const GraphValues &values) const
+{
+  // Every step is a filter of the executor, which takes care of the buffers per stripe
+  vector<StripeFilter> filters;
+  for (const Step &step : plan.steps)
+  {
+    const GraphStage &stage = *m_stages[step.first];
+    StripeFilter filter;
+    filter.name = stage.getName();
+    if (!step.rows)
+    {
+      filter.halo = stage.halo(values);
+      filter.alignment = stage.alignment(values);
+    }
+    filter.apply = [this, &step, &values, y](const Mat &in, Mat &out, const int band_y)
+    {
+      runStep(step, in, out, y + band_y, values);
+    };
+    filters.push_back(filter);
+  }
+  m_executor->run(src, dst, filters, outputType(src.type()));
+}
+
+void FilterGraph::runSerial(const Plan &plan, const Mat &src, Mat &dst, const int y, const GraphValues &values) const
+{
+  // The scratch buffers of an earlier run, or new ones
+  unique_ptr<vector<Mat>> buffers;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_free_buffers.empty())
+    {
+      buffers = move(m_free_buffers.back());
+      m_free_buffers.pop_back();
+    }
+  }
+  if (buffers == nullptr)
+    buffers.reset(new vector<Mat>());
+  buffers->resize(max(buffers->size(), plan.buffer_types.size()));
+
+  // A band of runRows(..) works in the top rows of a buffer, so bands and frames don't reallocate each other
+  static thread_local vector<Mat> views;
+  views.resize(plan.buffer_types.size());
+  for (size_t b = 0; b < plan.buffer_types.size(); ++b)
+  {
+    Mat &scratch = (*buffers)[b];
+    if (scratch.rows < src.rows || scratch.cols != src.cols || scratch.type() != plan.buffer_types[b])
+      scratch.create(src.size(), plan.buffer_types[b]);
+    views[b] = scratch.rowRange(0, src.rows);
+  }
+
+  Mat input = src;
+  dst.create(src.size(), outputType(src.type()));
+  auto buffer = [&](const int id) -> Mat &
+  {
+    if (id == SOURCE)
+      return input;
+    if (id == DESTINATION)
+      return dst;
+    return views[id];
+  };
+
+  for (const Step &step : plan.steps)
+    runStep(step, buffer(step.input), buffer(step.output), y, values);
+  if (plan.result != DESTINATION)
+    buffer(plan.result).copyTo(dst);
+  views.clear();
+
+  lock_guard<mutex> lock(m_mutex);
+  m_free_buffers.push_back(move(buffers));
+}
+
+void FilterGraph::run(const Mat &src, Mat &dst, const GraphValues &values) const
+{
+  const int type = outputType(src.type());
+
+  /*
+  dst may be src: then the chain starts in dst. If it shares memory with src in
+  another way, the steps could overwrite what they still have to read. A dst of
+  another size or type gets a buffer of its own, 'input' keeps the one of src.
+  */
+  Mat input = src;
+  bool in_place = false;
+  if (!dst.empty() && dst.datastart == src.datastart && dst.size() == src.size() && dst.type() == type)
+  {
+    if (dst.data == src.data)
+      in_place = true;
+    else
+    {
+      // Per thread, so it's allocated once
+      static thread_local Mat overlap_buffer;
+      src.copyTo(overlap_buffer);
+      input = overlap_buffer;
+    }
+  }
+
+  const shared_ptr<const Plan> graph_plan = plan(input.type(), in_place);
+  if (m_executor != nullptr && !graph_plan->steps.empty())
+    runStripes(*graph_plan, input, dst, 0, values);
+  else
+    runSerial(*graph_plan, input, dst, 0, values);
+}
+
+void FilterGraph::runRows(const Mat &src, Mat &dst, const vector<Range> &rows, const GraphValues &values) const
+{
+  if (dst.size() != src.size() || dst.type() != outputType(src.type()))
+  {
+    run(src, dst, values);
+    return;
+  }
+  CV_Assert(dst.datastart != src.datastart);
+
+  /*
+  The halo of the whole chain, worked out like the StripeExecutor does: back from the
+  last stage, every stage adds its halo and rounds up to its alignment. A band must
+  also start at a multiple of every alignment (a pixelation block).
+
+  The other way around, a changed row reaches the output rows within the halo of every
+  stage, and the whole block of a stage with an alignment.
+  */
+  int halo = 0;
+  int alignment = 1;
+  int reach = 0;
+  for (size_t k = m_stages.size(); k-- > 0;)
+  {
+    const int stage_alignment = max(1, m_stages[k]->alignment(values));
+    const int stage_halo = max(0, m_stages[k]->halo(values));
+    halo = (halo + stage_halo + stage_alignment - 1) / stage_alignment * stage_alignment;
+    alignment = alignment / gcd(alignment, stage_alignment) * stage_alignment;
+    reach += stage_halo + stage_alignment - 1;
+  }
+
+  // The output rows to make, aligned, without making rows twice where they meet
+  vector<Range> bands;
+  for (const Range &range : rows)
+  {
+    if (range.empty())
+      continue;
+    const int y0 = max(0, (range.start - reach) / alignment * alignment);
+    const int y1 = min(src.rows, (range.end + reach + alignment - 1) / alignment * alignment);
+    if (!bands.empty() && y0 <= bands.back().end)
+      bands.back().end = max(bands.back().end, y1);
+    else if (y0 < y1)
+      bands.push_back(Range(y0, y1));
+  }
+
+  const shared_ptr<const Plan> graph_plan = plan(src.type(), false);
+  // The output of the bands, per thread and of frame size, so it's allocated once
+  static thread_local Mat band_buffer;
+  if (band_buffer.rows < src.rows || band_buffer.cols != src.cols || band_buffer.type() != dst.type())
+    band_buffer.create(src.size(), dst.type());
+  for (const Range &rows_out : bands)
+  {
+    // The band with the halo rows it needs around the rows we keep, its blocks are whole blocks of the frame
+    const int y0 = rows_out.start;
+    const int y1 = rows_out.end;
+    const int b0 = max(0, (y0 - halo) / alignment * alignment);
+    const int b1 = min(src.rows, (y1 + halo + alignment - 1) / alignment * alignment);
+
+    const Mat band = src.rowRange(b0, b1);
+    Mat band_output = band_buffer.rowRange(0, b1 - b0);
+    if (m_executor != nullptr && !graph_plan->steps.empty())
+      runStripes(*graph_plan, band, band_output, b0, values);
+    else
+      runSerial(*graph_plan, band, band_output, b0, values);
+    band_output.rowRange(y0 - b0, y1 - b0).copyTo(dst.rowRange(y0, y1));
+  }
+}
+
+Range FilterGraph::drawnRows(const Size &size, const GraphValues &values) const
+{
+  Range drawn(0, 0);
+  for (const SGraphStage &stage : m_stages)
+  {
+    const Rect area = stage->drawnArea(size, values);
+    if (area.empty())
+      continue;
+    const Range rows(max(0, area.y), min(size.height, area.y + area.height));
+    drawn = drawn.empty() ? rows : Range(min(drawn.start, rows.start), max(drawn.end, rows.end));
+  }
+  return drawn;
+}
+
+string FilterGraph::describe(const int type, const bool in_place) const
+{
+  const shared_ptr<const Plan> graph_plan = plan(type, in_place);
+  auto bufferName = [](const int id)
+  {
+    if (id == SOURCE)
+      return string("src");
+    if (id == DESTINATION)
+      return string("dst");
+    return "buffer " + to_string(id);
+  };
+
+  ostringstream text;
+  for (const Step &step : graph_plan->steps)
+  {
+    for (size_t k = 0; k < step.count; ++k)
+      text << (k == 0 ? "" : " + ") << m_stages[step.first + k]->getName();
+    text << (step.rows && step.count > 1 ? " (fused)" : "") << ": " << bufferName(step.input) << " -> "
+      << bufferName(step.output) << (step.input == step.output ? " (in place)" : "") << ", "
+      << CV_MAT_CN(step.type) << " channel(s)\n";
+  }
+  if (graph_plan->result != DESTINATION)
+    text << "copy: " << bufferName(graph_plan->result) << " -> dst\n";
+  return text.str();
+}
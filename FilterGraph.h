@@ -0,0 +1,343 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "StripeExecutor.h"
+
+/*!
+  The values a FilterGraph reads while it runs: the block size of the trackbar, the
+  text with the frame rate, ... Stage options refer to them as $name. A GraphValues
+  is made per frame (or kept and updated), so different frames can run with different
+  values at the same time.
+*/
+class GraphValues
+{
+  std::vector<std::pair<std::string, double>> m_numbers;
+  std::vector<std::pair<std::string, std::string>> m_texts;
+
+public:
+  void set(const std::string &name, const double value);
+  void setText(const std::string &name, const std::string &text);
+
+  //! The value of a number, 'fallback' when it was never set
+  double get(const std::string &name, const double fallback = 0) const;
+
+  //! The value of a text, empty when it was never set
+  const std::string &getText(const std::string &name) const;
+};
+
+/*!
+  An option of a stage: a constant from the chain description, or $name for a value
+  that is looked up in the GraphValues of every run
+*/
+struct GraphValue
+{
+  double number = 0;
+  std::string text;
+  //! The name after the $, empty for a constant
+  std::string variable;
+
+  double get(const GraphValues &values) const;
+  std::string getText(const GraphValues &values) const;
+};
+
+/*!
+  The options of a stage in a chain description: pixelate(block=$block, mirror=1)
+*/
+class StageOptions
+{
+  std::map<std::string, std::string> m_options;
+  mutable std::set<std::string> m_used;
+  mutable std::string m_error;
+
+public:
+  StageOptions() {}
+  explicit StageOptions(const std::map<std::string, std::string> &options);
+
+  //! A number option, 'fallback' when it isn't given
+  GraphValue number(const std::string &key, const double fallback) const;
+
+  //! A text option, 'fallback' when it isn't given
+  GraphValue text(const std::string &key, const std::string &fallback = "") const;
+
+  /*!
+    What is wrong with the options, after the stage took what it needs: an option
+    that is not a number, or one that was given but never asked for (a typo).
+    Empty if nothing is wrong.
+  */
+  std::string error() const;
+};
+
+//!  One step of a FilterGraph
+/*!
+  A stage is one of two kinds:
+
+    row stages   work row by row: an output row only depends on the same input row
+                 (flip, a color conversion, brightness). Adjacent row stages are fused:
+                 a row goes through all of them while it is in the L1 cache, in one pass
+                 over the frame.
+    band stages  get a band of rows at once (the whole frame, or a stripe of it when
+                 the graph runs in parallel), with a halo and alignment like a StripeFilter.
+
+  Stages are shared by all threads that run the graph, so apply(..) and applyRow(..)
+  must be const and thread safe.
+*/
+class GraphStage
+{
+  std::string m_name;
+
+public:
+  explicit GraphStage(const std::string &name) :
+    m_name(name)
+  {
+  }
+
+  virtual ~GraphStage() {}
+
+  const std::string &getName() const
+  {
+    return m_name;
+  }
+
+  //! Row stages implement applyRow(..), band stages apply(..)
+  virtual bool isRowStage() const
+  {
+    return false;
+  }
+
+  /*!
+    May the output be the same image as the input? Only for stages that keep the type.
+    The planner then works in the buffer of the previous stage instead of taking another.
+  */
+  virtual bool canRunInPlace() const
+  {
+    return false;
+  }
+
+  //! The type of the output for an input of type 'type'
+  virtual int outputType(const int type) const
+  {
+    return type;
+  }
+
+  //! See StripeFilter::halo
+  virtual int halo(const GraphValues &values) const
+  {
+    return 0;
+  }
+
+  //! See StripeFilter::alignment
+  virtual int alignment(const GraphValues &values) const
+  {
+    return 1;
+  }
+
+  /*!
+    The part of a frame of 'size' that the stage draws on whatever the input is (a label),
+    empty for stages that only depend on their input. A ChangeGate makes those rows again
+    on every frame, even where the input didn't change.
+  */
+  virtual cv::Rect drawnArea(const cv::Size &size, const GraphValues &values) const
+  {
+    return cv::Rect();
+  }
+
+  /*!
+    Band stages: filter a band of rows that starts at image row 'y' into 'out', which
+    the stage creates (it may already have the right size and type, then it's written
+    in place). If canRunInPlace(), out may be in.
+  */
+  virtual void apply(const cv::Mat &in, cv::Mat &out, const int y, const GraphValues &values) const
+  {
+  }
+
+  /*!
+    Row stages: one row of 'width' pixels, 'type' is the type of the input row. If
+    canRunInPlace(), out may be in.
+  */
+  virtual void applyRow(const uchar *in, uchar *out, const int width, const int type, const GraphValues &values) const
+  {
+  }
+};
+
+typedef std::shared_ptr<GraphStage> SGraphStage;
+
+//! Makes a stage from its options, it returns nullptr when the options are wrong
+typedef std::function<SGraphStage(const StageOptions &options)> StageFactory;
+
+/*!
+  The stages a chain description can use, by name. The built-in stages are:
+
+    pixelate(block=1, mirror=1)               pixelateFlip(..), see Pixelate.h
+    flip                                      mirror every row
+    gray                                      BGR to gray (CV_8UC1)
+    bgr                                       gray to BGR
+    adjust(gain=1, offset=0)                  pixel * gain + offset
+    invert                                    255 - pixel
+    blur(ksize=5, sigma=0)                    GaussianBlur(..)
+    text(text=, x=8, y=24, size=0.8)          a label with an outline, see OverlayRenderer
+*/
+namespace StageRegistry
+{
+  //! Add a stage, or replace the one with the same name
+  void add(const std::string &name, const StageFactory &factory);
+
+  //! A new stage, nullptr if there is no stage with that name or the options are wrong
+  SGraphStage create(const std::string &name, const StageOptions &options);
+
+  std::vector<std::string> names();
+}
+
+//!  A chain of named filter stages, planned once and run on every frame
+/*!
+  The processing of a frame is described as a chain, in a string or a file:
+
+    pixelate(block=$block) | blur(ksize=3) | text(text=$label, y=24)
+
+  Stages are separated by | or by new lines, # starts a comment. $name is looked up in
+  the GraphValues given to run(..).
+
+  The first time a graph runs on a type of frame, it is planned:
+
+  - adjacent row stages are fused into one step, that takes every row through all of
+    them in one pass
+  - every step gets a buffer for its output: the same buffer as its input when it can
+    run in place, dst when the rest of the chain can stay there, otherwise a scratch
+    buffer (of its type) that isn't in use anymore. So a chain of one type needs 2
+    scratch buffers at most, and they are reused from frame to frame.
+
+  Without an executor the steps run one after the other on the whole frame. With a
+  StripeExecutor (setExecutor(..)) the same steps run stripe by stripe on its threads.
+
+  run(..) may be called from several threads at once, the stages are added before that.
+*/
+class FilterGraph
+{
+public:
+  //! Buffer numbers of a plan, scratch buffers are 0, 1, ...
+  static const int SOURCE = -1;
+  static const int DESTINATION = -2;
+
+  //! A step of a plan: one band stage, or a run of fused row stages
+  struct Step
+  {
+    size_t first = 0;
+    size_t count = 1;
+    bool rows = false;
+    int input = SOURCE;
+    int output = DESTINATION;
+    //! The type of the output
+    int type = 0;
+    bool in_place = false;
+  };
+
+  struct Plan
+  {
+    std::vector<Step> steps;
+    //! The type of every scratch buffer
+    std::vector<int> buffer_types;
+    //! Not DESTINATION when the last step can't write dst: copy this buffer to it at the end
+    int result = DESTINATION;
+  };
+
+private:
+  std::vector<SGraphStage> m_stages;
+  SStripeExecutor m_executor;
+
+  mutable std::mutex m_mutex;
+  //! Per input type, and whether dst is src
+  mutable std::map<std::pair<int, bool>, std::shared_ptr<const Plan>> m_plans;
+  //! The scratch buffers of the runs that aren't running now
+  mutable std::vector<std::unique_ptr<std::vector<cv::Mat>>> m_free_buffers;
+
+  Plan makePlan(const int type, const bool in_place) const;
+  void runStep(const Step &step, const cv::Mat &in, cv::Mat &out, const int y, const GraphValues &values) const;
+  void runSerial(const Plan &plan, const cv::Mat &src, cv::Mat &dst, const int y, const GraphValues &values) const;
+  void runStripes(const Plan &plan, const cv::Mat &src, cv::Mat &dst, const int y, const GraphValues &values) const;
+
+public:
+  FilterGraph() {}
+
+  /*!
+    Add the stages of a chain description (see above) at the end of the graph
+  */
+  /*!
+  /param description the chain
+  /param error receives what is wrong with it
+  /return false if the description is wrong, then nothing is added
+  */
+  bool parse(const std::string &description, std::string &error);
+
+  //! parse(..) the contents of a file
+  bool load(const std::string &path, std::string &error);
+
+  //! Add a stage at the end of the graph
+  void add(const SGraphStage &stage);
+
+  /*!
+    Run on the threads of an executor, nullptr: on the calling thread
+  */
+  void setExecutor(const SStripeExecutor &executor);
+
+  /*!
+    Run the chain
+  */
+  /*!
+  /param src the input frame
+  /param dst receives the output, it may be src. A chain that changes the type gives
+    dst a new buffer, add "bgr" to a chain ending in gray to keep frames in their pool
+  /param values the values of the $names in the options
+  */
+  void run(const cv::Mat &src, cv::Mat &dst, const GraphValues &values) const;
+
+  /*!
+    Run the chain again for the rows of src that changed, the other rows of dst keep what
+    they have: the processing of a ChangeGate (see ChangeDetector.h). The output rows that
+    a changed row reaches (through halos and blocks) are made again, in bands with the halo
+    rows they need, so they come out the same as with run(..).
+  */
+  /*!
+  /param src the input frame
+  /param dst the output of an earlier run, it can't be src. When it's empty or doesn't have
+    the size and type of the output, the whole chain runs as run(..).
+  /param rows the runs of rows of src that changed, sorted and not overlapping
+  /param values the values of the $names in the options
+  */
+  void runRows(const cv::Mat &src, cv::Mat &dst, const std::vector<cv::Range> &rows, const GraphValues &values) const;
+
+  /*!
+    The rows that stages draw on whatever the input is (see GraphStage::drawnArea(..)),
+    an empty range if there are none. Give them to runRows(..) as changed rows.
+  */
+  cv::Range drawnRows(const cv::Size &size, const GraphValues &values) const;
+
+  /*!
+    The plan for a frame type, made the first time it's needed
+  */
+  /*!
+  /param type the type of the input frames
+  /param in_place whether dst is src
+  */
+  std::shared_ptr<const Plan> plan(const int type, const bool in_place = false) const;
+
+  //! The type of the output for an input of type 'type'
+  int outputType(const int type) const;
+
+  //! One line per step: its stages, buffers and type
+  std::string describe(const int type, const bool in_place = false) const;
+
+  const std::vector<SGraphStage> &getStages() const
+  {
+    return m_stages;
+  }
+};
+
+typedef std::shared_ptr<FilterGraph> SFilterGraph;
@@ -0,0 +1,127 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "FramePool.h"
+
+using namespace cv;
+using namespace std;
+
+FrameBuffer::FrameBuffer(const size_t bytes) :
+  m_data(nullptr),
+  m_bytes(bytes)
+{
+  // Round up, so the last SIMD load or store of a row never touches a neighbour
+  const size_t rounded = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+#ifdef _WIN32
+  m_data = _aligned_malloc(rounded, ALIGNMENT);
+#else
+  if (posix_memalign(&m_data, ALIGNMENT, rounded) != 0)
+    m_data = nullptr;
+#endif
+  if (m_data == nullptr)
+    throw bad_alloc();
+}
+
+FrameBuffer::~FrameBuffer()
+{
+#ifdef _WIN32
+  _aligned_free(m_data);
+#else
+  free(m_data);
+#endif
+}
+
+FramePool::FramePool() :
+  m_allocations(0),
+  m_reuses(0),
+  m_bytes_allocated(0)
+{
+}
+
+SFrameBuffer FramePool::take(const size_t bytes)
+{
+  lock_guard<mutex> lock(m_mutex);
+
+  vector<SFrameBuffer> &buffers = m_buffers[bytes];
+  for (const SFrameBuffer &buffer : buffers)
+  {
+    // Only the pool holds it, so nobody uses it anymore. The last user dropped its
+    // reference with release semantics, the fence makes its writes visible to us.
+    if (buffer.use_count() == 1)
+    {
+      atomic_thread_fence(memory_order_acquire);
+      ++m_reuses;
+      return buffer;
+    }
+  }
+
+  // All buffers of this size are in use, add one
+  buffers.push_back(make_shared<FrameBuffer>(bytes));
+  ++m_allocations;
+  m_bytes_allocated += bytes;
+  return buffers.back();
+}
+
+Frame FramePool::acquire(const Size &size, const int type)
+{
+  Frame frame;
+  const size_t bytes = (size_t)size.width * size.height * CV_ELEM_SIZE(type);
+  if (bytes == 0)
+    return frame;
+
+  frame.buffer = take(bytes);
+  frame.image = Mat(size, type, frame.buffer->data());
+  return frame;
+}
+
+Frame FramePool::acquireScratch(const size_t bytes)
+{
+  return acquire(Size((int)bytes, 1), CV_8U);
+}
+
+void FramePool::reserve(const Size &size, const int type, const int count)
+{
+  // Hold on to them while acquiring, otherwise we'd get the same buffer every time
+  vector<Frame> frames;
+  for (int i = 0; i < count; ++i)
+    frames.push_back(acquire(size, type));
+}
+
+void FramePool::trim()
+{
+  lock_guard<mutex> lock(m_mutex);
+  for (auto &entry : m_buffers)
+  {
+    vector<SFrameBuffer> &buffers = entry.second;
+    for (size_t i = 0; i < buffers.size();)
+    {
+      if (buffers[i].use_count() == 1)
+      {
+        m_bytes_allocated -= buffers[i]->bytes();
+        buffers.erase(buffers.begin() + i);
+      }
+      else
+        ++i;
+    }
+  }
+}
+
+FramePoolStats FramePool::getStats() const
+{
+  lock_guard<mutex> lock(m_mutex);
+  FramePoolStats stats;
+  stats.allocations = m_allocations;
+  stats.reuses = m_reuses;
+  stats.bytes_allocated = m_bytes_allocated;
+  for (const auto &entry : m_buffers)
+  {
+    for (const SFrameBuffer &buffer : entry.second)
+    {
+      ++stats.buffers;
+      if (buffer.use_count() > 1)
+        ++stats.in_use;
+    }
+  }
+  return stats;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/*!
+  A block of aligned memory, owned by a FramePool
+*/
+class FrameBuffer
+{
+  void *m_data;
+  const size_t m_bytes;
+
+public:
+  //! The alignment of every buffer, a cache line (and enough for any SIMD load)
+  static const size_t ALIGNMENT = 64;
+
+  explicit FrameBuffer(const size_t bytes);
+  ~FrameBuffer();
+
+  FrameBuffer(const FrameBuffer &) = delete;
+  FrameBuffer &operator=(const FrameBuffer &) = delete;
+
+  void *data() const
+  {
+    return m_data;
+  }
+
+  size_t bytes() const
+  {
+    return m_bytes;
+  }
+};
+
+typedef std::shared_ptr<FrameBuffer> SFrameBuffer;
+
+/*!
+  An image together with the pooled buffer it lives in. A cv::Mat on outside memory
+  doesn't count references, so always pass the Frame around (not just its image):
+  as long as a copy of the Frame exists, the pool won't hand out the buffer again.
+*/
+struct Frame
+{
+  //! The image, a header on the memory of 'buffer' (or a normal cv::Mat if buffer is empty)
+  cv::Mat image;
+  //! Keeps the pooled memory in use
+  SFrameBuffer buffer;
+  //! When the frame was captured, in nanoseconds of std::chrono::steady_clock (0 if unknown)
+  int64_t timestamp = 0;
+  //! The number of the frame in capture order, from 0 (-1 if unknown), see Trace.h
+  int64_t id = -1;
+};
+
+/*!
+  A snapshot of the counters of a FramePool. In steady state 'allocations' stops
+  growing: every frame is served from a buffer that came back ('reuses').
+*/
+struct FramePoolStats
+{
+  int64_t allocations = 0;
+  int64_t reuses = 0;
+  int64_t bytes_allocated = 0;
+  int64_t buffers = 0;
+  int64_t in_use = 0;
+};
+
+//!  A pool of pre-allocated, aligned frame and scratch buffers
+/*!
+  Buffers are kept per byte size. acquire(..) hands out a free buffer of the right
+  size, or allocates a new one when all of them are in use. There is no release():
+  the pool keeps a reference to every buffer, so a buffer is free again as soon as
+  the pool holds the only reference, i.e. when the last Frame using it is gone.
+  That way handing out and returning a buffer never allocates anything, not even
+  a shared_ptr control block.
+
+  All functions are thread safe (they take a short lock).
+*/
+class FramePool
+{
+  mutable std::mutex m_mutex;
+  //! All buffers, per byte size
+  std::map<size_t, std::vector<SFrameBuffer>> m_buffers;
+
+  int64_t m_allocations;
+  int64_t m_reuses;
+  int64_t m_bytes_allocated;
+
+  SFrameBuffer take(const size_t bytes);
+
+public:
+  FramePool();
+
+  FramePool(const FramePool &) = delete;
+  FramePool &operator=(const FramePool &) = delete;
+
+  /*!
+    Get a frame of the given size and type. The contents of the image are undefined.
+  */
+  /*!
+  /param size the width and height of the image
+  /param type the cv::Mat type, e.g. CV_8UC3
+  */
+  Frame acquire(const cv::Size &size, const int type);
+
+  /*!
+    Get a scratch buffer: a 1 row CV_8U image of (at least) the given amount of bytes
+  */
+  Frame acquireScratch(const size_t bytes);
+
+  /*!
+    Allocate 'count' buffers of the given size up front, so not even the first
+    frames allocate
+  */
+  void reserve(const cv::Size &size, const int type, const int count);
+
+  //! Free all buffers that are not in use
+  void trim();
+
+  //! The counters, see FramePoolStats
+  FramePoolStats getStats() const;
+};
+
+typedef std::shared_ptr<FramePool> SFramePool;
@@ -0,0 +1,175 @@
+#include <algorithm>
+
+#include "FramePyramid.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  // Whether an image of size 'a' can be resized down to 'b'
+  bool covers(const Size &a, const Size &b)
+  {
+    return a.width >= b.width && a.height >= b.height;
+  }
+}
+
+FramePyramid::FramePyramid(const int interpolation) :
+  m_frame(0),
+  m_interpolation(interpolation),
+  m_queries(0),
+  m_hits(0),
+  m_builds(0),
+  m_pixels_read(0),
+  m_pixels_read_direct(0)
+{
+}
+
+void FramePyramid::setFrame(const Mat &frame)
+{
+  lock_guard<mutex> lock(m_mutex);
+  // Another size makes other octaves, the levels of other sizes can stay (their memory is reused)
+  if (frame.size() != m_base.size())
+    m_octaves.clear();
+  m_base = frame;
+  ++m_frame;
+}
+
+Mat FramePyramid::base() const
+{
+  lock_guard<mutex> lock(m_mutex);
+  return m_base;
+}
+
+Size FramePyramid::octaveSize(const int n) const
+{
+  Size size = m_base.size();
+  for (int i = 0; i < n; ++i)
+    size = Size((size.width + 1) / 2, (size.height + 1) / 2);
+  return size;
+}
+
+void FramePyramid::build(Level &level, const Mat &source)
+{
+  resize(source, level.image, level.size, 0, 0, m_interpolation);
+  level.frame = m_frame;
+  ++m_builds;
+  m_pixels_read += (int64_t)source.total();
+  m_pixels_read_direct += (int64_t)m_base.total();
+}
+
+const Mat &FramePyramid::buildOctave(const int n)
+{
+  if (n == 0)
+    return m_base;
+
+  while ((int)m_octaves.size() < n)
+  {
+    unique_ptr<Level> level(new Level());
+    level->size = octaveSize((int)m_octaves.size() + 1);
+    m_octaves.push_back(move(level));
+  }
+  Level &level = *m_octaves[n - 1];
+  if (level.frame == m_frame)
+  {
+    ++m_hits;
+    return level.image;
+  }
+  build(level, buildOctave(n - 1));
+  return level.image;
+}
+
+Mat FramePyramid::octave(const int n)
+{
+  lock_guard<mutex> lock(m_mutex);
+  CV_Assert(!m_base.empty() && n >= 0);
+  ++m_queries;
+  // An octave of 1x1 can't get any smaller
+  int last = 0;
+  while (last < n && octaveSize(last) != Size(1, 1))
+    ++last;
+  return buildOctave(last);
+}
+
+Mat FramePyramid::get(const Size &size)
+{
+  lock_guard<mutex> lock(m_mutex);
+  CV_Assert(!m_base.empty() && size.width > 0 && size.height > 0);
+  ++m_queries;
+  if (size == m_base.size())
+    return m_base;
+  if (!covers(m_base.size(), size))
+  {
+    // Scaling up, the pyramid has nothing to offer
+    Mat larger;
+    resize(m_base, larger, size, 0, 0, INTER_LINEAR);
+    return larger;
+  }
+
+  // The deepest octave that still covers the size: an octave itself, or the source of the level
+  int n = 0;
+  while (covers(octaveSize(n + 1), size) && octaveSize(n + 1) != octaveSize(n))
+    ++n;
+  if (octaveSize(n) == size)
+    return buildOctave(n);
+
+  Level *level = nullptr;
+  // Between that octave and the size, a level of this frame may be closer
+  const Mat *source = nullptr;
+  Size source_size = octaveSize(n);
+  for (const unique_ptr<Level> &candidate : m_levels)
+  {
+    if (candidate->size == size)
+    {
+      level = candidate.get();
+      continue;
+    }
+    if (candidate->frame == m_frame && covers(candidate->size, size) && covers(source_size, candidate->size))
+    {
+      source = &candidate->image;
+      source_size = candidate->size;
+    }
+  }
+
+  if (level == nullptr)
+  {
+    m_levels.emplace_back(new Level());
+    level = m_levels.back().get();
+    level->size = size;
+  }
+  else if (level->frame == m_frame)
+  {
+    ++m_hits;
+    return level->image;
+  }
+
+  build(*level, source != nullptr ? *source : buildOctave(n));
+  return level->image;
+}
+
+Mat FramePyramid::scaled(const double scale)
+{
+  const Size size = base().size();
+  CV_Assert(scale > 0 && scale <= 1);
+  return get(Size(max(1, cvRound(size.width * scale)), max(1, cvRound(size.height * scale))));
+}
+
+PyramidStats FramePyramid::getStats() const
+{
+  lock_guard<mutex> lock(m_mutex);
+  PyramidStats stats;
+  stats.queries = m_queries;
+  stats.hits = m_hits;
+  stats.builds = m_builds;
+  stats.pixels_read = m_pixels_read;
+  stats.pixels_read_direct = m_pixels_read_direct;
+  return stats;
+}
+
+void FramePyramid::clear()
+{
+  lock_guard<mutex> lock(m_mutex);
+  m_octaves.clear();
+  m_levels.clear();
+  m_base.release();
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/*!
+  A snapshot of the counters of a FramePyramid
+*/
+struct PyramidStats
+{
+  //! Calls of get(..), octave(..) and scaled(..), also the ones for the full size
+  int64_t queries = 0;
+  //! Queries that found their level already made for this frame
+  int64_t hits = 0;
+  //! Levels resized this frame or before
+  int64_t builds = 0;
+  //! The pixels the builds read
+  int64_t pixels_read = 0;
+  //! The pixels the builds would have read, each from the full frame
+  int64_t pixels_read_direct = 0;
+};
+
+//!  Smaller copies of one frame, made on demand and shared by everything that wants one
+/*!
+  A thumbnail, a panel of a monitoring wall, an effect that works at a lower resolution:
+  each of them used to resize the full frame on its own, and every one of those resizes
+  reads all pixels of the frame. The pyramid makes a level the first time somebody asks
+  for its size, from the nearest finer level it has, and hands the same image to everyone
+  else who asks for that size during the frame.
+
+  The octaves (1/2, 1/4, 1/8, ... of the frame) are made each from the one before, so an
+  octave costs a quarter of the one above it. A level of any other size is made from the
+  smallest level that is still at least as large in both directions, the octaves that it
+  needs included: 1/6 of a 4K frame reads the 1/4 octave, a sixteenth of the frame.
+
+  setFrame(..) starts the next frame: the levels are made again when asked for, in the
+  memory they had, so a pyramid that is reused frame after frame doesn't allocate. The
+  images returned for a frame are only valid until the next setFrame(..).
+
+  A level is an INTER_AREA resize of its source (the average of the pixels it covers).
+  A level made via the octaves may differ by a rounding step or two from a direct resize.
+
+  All functions are thread safe: a level is made once under a lock, the threads that ask
+  for it at the same moment wait for it.
+*/
+class FramePyramid
+{
+  struct Level
+  {
+    cv::Size size;
+    cv::Mat image;
+    //! The frame the image was made for, see m_frame
+    int64_t frame = -1;
+  };
+
+  mutable std::mutex m_mutex;
+  cv::Mat m_base;
+  int64_t m_frame;
+  const int m_interpolation;
+  //! unique_ptr, so a level stays where it is when more are added
+  std::vector<std::unique_ptr<Level>> m_octaves;
+  std::vector<std::unique_ptr<Level>> m_levels;
+
+  int64_t m_queries;
+  int64_t m_hits;
+  int64_t m_builds;
+  int64_t m_pixels_read;
+  int64_t m_pixels_read_direct;
+
+  //! The size of octave n, the image of octave 0 is the frame itself
+  cv::Size octaveSize(const int n) const;
+  const cv::Mat &buildOctave(const int n);
+  void build(Level &level, const cv::Mat &source);
+
+public:
+  /*!
+  /param interpolation how a level is made from its source, INTER_AREA is best for scaling down
+  */
+  explicit FramePyramid(const int interpolation = cv::INTER_AREA);
+
+  FramePyramid(const FramePyramid &) = delete;
+  FramePyramid &operator=(const FramePyramid &) = delete;
+
+  /*!
+    Start a new frame, the levels of the previous one are outdated. The frame isn't
+    copied, don't change it while the pyramid is used for it.
+  */
+  void setFrame(const cv::Mat &frame);
+
+  //! The frame itself
+  cv::Mat base() const;
+
+  /*!
+    Octave n: 1/2^n of the frame in both directions (rounded up), octave 0 is the frame
+  */
+  cv::Mat octave(const int n);
+
+  /*!
+    The frame at exactly this size. Larger than the frame is a plain resize of the frame,
+    the pyramid is for scaling down.
+  */
+  cv::Mat get(const cv::Size &size);
+
+  /*!
+    The frame scaled by 'scale' (0 < scale <= 1) in both directions, e.g. 1.0 / block
+  */
+  cv::Mat scaled(const double scale);
+
+  PyramidStats getStats() const;
+
+  //! Forget the levels and their memory
+  void clear();
+};
+
+typedef std::shared_ptr<FramePyramid> SFramePyramid;
@@ -0,0 +1,153 @@
+#include <algorithm>
+
+#include "FrameScheduler.h"
+
+using namespace std;
+
+FrameScheduler::FrameScheduler(const SchedulerSettings &settings) :
+  m_settings(settings),
+  m_level(0),
+  m_late_streak(0),
+  m_early_streak(0),
+  m_encode_credit(0),
+  m_display_credit(0),
+  m_frames(0),
+  m_late(0),
+  m_escalations(0),
+  m_relaxations(0),
+  m_overlay_skipped(0),
+  m_resolution_reduced(0),
+  m_encode_dropped(0),
+  m_display_dropped(0)
+{
+}
+
+FrameScheduler::~FrameScheduler()
+{
+  // The gauges read our counters
+  setMetrics(nullptr);
+}
+
+bool FrameScheduler::isShed(const ShedAction action, const int level) const
+{
+  const int steps = min(level, (int)m_settings.ladder.size());
+  return find(m_settings.ladder.begin(), m_settings.ladder.begin() + steps, action) != m_settings.ladder.begin() + steps;
+}
+
+bool FrameScheduler::keep(double &credit)
+{
+  /*
+  Every frame earns keep_ratio credit, a frame is kept when there is a whole one.
+  With 0.5 that's every other frame, with 0.25 every fourth: always evenly spaced.
+  */
+  const bool kept = credit >= 1;
+  if (kept)
+    credit -= 1;
+  credit += min(1.0, max(0.0, m_settings.keep_ratio));
+  return kept;
+}
+
+FrameDecision FrameScheduler::decide()
+{
+  FrameDecision decision;
+  decision.level = m_level.load(memory_order_relaxed);
+  ++m_frames;
+
+  if (isShed(ShedAction::SkipOverlay, decision.level))
+  {
+    decision.overlay = false;
+    ++m_overlay_skipped;
+  }
+  if (isShed(ShedAction::ReduceResolution, decision.level))
+  {
+    decision.scale = 0.5;
+    ++m_resolution_reduced;
+  }
+
+  // Start counting afresh when dropping starts, so the first frame is kept
+  if (!isShed(ShedAction::DropEncode, decision.level))
+    m_encode_credit = 1;
+  else if (!keep(m_encode_credit))
+  {
+    decision.encode = false;
+    ++m_encode_dropped;
+  }
+  if (!isShed(ShedAction::DropDisplay, decision.level))
+    m_display_credit = 1;
+  else if (!keep(m_display_credit))
+  {
+    decision.display = false;
+    ++m_display_dropped;
+  }
+  return decision;
+}
+
+void FrameScheduler::complete(const double latency_ms)
+{
+  const int level = m_level.load(memory_order_relaxed);
+  if (latency_ms > m_settings.budget_ms)
+  {
+    ++m_late;
+    m_early_streak = 0;
+    if (++m_late_streak >= m_settings.escalate_after && level < (int)m_settings.ladder.size())
+    {
+      m_level.store(level + 1, memory_order_relaxed);
+      ++m_escalations;
+      // Give the new level time to take effect: the frames already in flight were decided at the old one
+      m_late_streak = 0;
+    }
+    return;
+  }
+
+  m_late_streak = 0;
+  if (latency_ms > m_settings.budget_ms * m_settings.relax_ratio)
+  {
+    // Within the budget, but not by enough to be sure we can afford more work
+    m_early_streak = 0;
+    return;
+  }
+  if (++m_early_streak >= m_settings.relax_after && level > 0)
+  {
+    m_level.store(level - 1, memory_order_relaxed);
+    ++m_relaxations;
+    m_early_streak = 0;
+  }
+}
+
+SchedulerStats FrameScheduler::getStats() const
+{
+  SchedulerStats stats;
+  stats.frames = m_frames;
+  stats.late = m_late;
+  stats.escalations = m_escalations;
+  stats.relaxations = m_relaxations;
+  stats.overlay_skipped = m_overlay_skipped;
+  stats.resolution_reduced = m_resolution_reduced;
+  stats.encode_dropped = m_encode_dropped;
+  stats.display_dropped = m_display_dropped;
+  stats.level = m_level;
+  return stats;
+}
+
+void FrameScheduler::setMetrics(const SMetrics &metrics)
+{
+  if (m_metrics != nullptr)
+    m_metrics->removeGauges("scheduler.");
+  m_metrics = metrics;
+  if (m_metrics == nullptr)
+    return;
+
+  auto addGauge = [this](const string &name, const atomic<int64_t> *counter)
+  {
+    m_metrics->setGauge("scheduler." + name, [counter]() { return (double)counter->load(memory_order_relaxed); });
+  };
+  addGauge("late", &m_late);
+  addGauge("escalations", &m_escalations);
+  addGauge("relaxations", &m_relaxations);
+  addGauge("overlay_skipped", &m_overlay_skipped);
+  addGauge("resolution_reduced", &m_resolution_reduced);
+  addGauge("encode_dropped", &m_encode_dropped);
+  addGauge("display_dropped", &m_display_dropped);
+  const atomic<int> *level = &m_level;
+  m_metrics->setGauge("scheduler.level", [level]() { return (double)level->load(memory_order_relaxed); });
+}
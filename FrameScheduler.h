@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Metrics.h"
+
+/*!
+  The kinds of work a FrameScheduler can shed when the frames don't make their latency budget
+*/
+enum class ShedAction
+{
+  SkipOverlay,      //!< don't paint the text and shapes on the frame
+  ReduceResolution, //!< process the frame at half the resolution
+  DropEncode,       //!< don't write every frame to the video file (but still show it)
+  DropDisplay       //!< don't show every frame (but still write it to the video file)
+};
+
+/*!
+  What to do with one frame, see FrameScheduler::decide(..)
+*/
+struct FrameDecision
+{
+  //! Paint the overlay
+  bool overlay = true;
+  //! Process at a fraction of the resolution: 1 is full, 0.5 is half the width and height
+  double scale = 1;
+  //! Write the frame to the output
+  bool encode = true;
+  //! Show the frame
+  bool display = true;
+  //! The shedding level the decision was made at, 0 means nothing is shed
+  int level = 0;
+};
+
+/*!
+  Settings of a FrameScheduler
+*/
+struct SchedulerSettings
+{
+  //! The time a frame may take from capture until it is done, in milliseconds
+  double budget_ms = 100;
+  /*!
+    What to shed, in order: the first step goes at level 1, the first two at level 2
+    and so on. Put DropDisplay before DropEncode to favour the recording over the
+    screen, or the other way around to keep the screen smooth.
+  */
+  std::vector<ShedAction> ladder = { ShedAction::SkipOverlay, ShedAction::ReduceResolution,
+    ShedAction::DropDisplay, ShedAction::DropEncode };
+  //! Go one level up after this many frames in a row over the budget
+  int escalate_after = 5;
+  //! Go one level down after this many frames in a row under relax_ratio * budget
+  int relax_after = 60;
+  //! The fraction of the budget a frame must stay under to count towards relaxing
+  double relax_ratio = 0.7;
+  //! The fraction of the frames that is still encoded or shown while it is being dropped
+  double keep_ratio = 0.5;
+};
+
+/*!
+  A snapshot of the counters of a FrameScheduler
+*/
+struct SchedulerStats
+{
+  int64_t frames = 0;
+  //! Frames that took longer than the budget
+  int64_t late = 0;
+  int64_t escalations = 0;
+  int64_t relaxations = 0;
+  int64_t overlay_skipped = 0;
+  int64_t resolution_reduced = 0;
+  int64_t encode_dropped = 0;
+  int64_t display_dropped = 0;
+  int level = 0;
+};
+
+//!  Decides per frame what work to shed, so the frames keep up with a latency budget
+/*!
+  Without it, a pipeline that can't keep up simply falls behind: every frame arrives
+  a bit later than the one before, until the queues are full and the capture stalls.
+  The scheduler decides what to give up instead, in the order of its ladder.
+
+  It's used from two places, each a single thread:
+  - decide(..) before a frame is processed (the capture thread of the pipeline)
+  - complete(..) when the frame is done, with the time it took since capture (the encoder)
+
+  The level only goes up after several late frames in a row, and only comes down after
+  many frames comfortably under the budget. Without that hysteresis it would flip between
+  two levels on every frame, which looks worse than either of them.
+
+  Dropped frames are spread evenly (with keep_ratio 0.5 exactly every other frame is
+  kept), so the recording keeps a steady cadence instead of stuttering in bursts.
+*/
+class FrameScheduler
+{
+  const SchedulerSettings m_settings;
+
+  //! Written by complete(..), read by decide(..)
+  std::atomic<int> m_level;
+
+  //! Only used by complete(..)
+  int m_late_streak;
+  int m_early_streak;
+
+  //! Only used by decide(..): spreads the kept frames evenly
+  double m_encode_credit;
+  double m_display_credit;
+
+  std::atomic<int64_t> m_frames;
+  std::atomic<int64_t> m_late;
+  std::atomic<int64_t> m_escalations;
+  std::atomic<int64_t> m_relaxations;
+  std::atomic<int64_t> m_overlay_skipped;
+  std::atomic<int64_t> m_resolution_reduced;
+  std::atomic<int64_t> m_encode_dropped;
+  std::atomic<int64_t> m_display_dropped;
+
+  SMetrics m_metrics;
+
+  //! Whether the action is on the ladder at or below the level
+  bool isShed(const ShedAction action, const int level) const;
+  bool keep(double &credit);
+
+public:
+  /*!
+  /param settings the budget, the ladder and the hysteresis
+  */
+  explicit FrameScheduler(const SchedulerSettings &settings = SchedulerSettings());
+  //! Removes its gauges from the metrics
+  ~FrameScheduler();
+
+  FrameScheduler(const FrameScheduler &) = delete;
+  FrameScheduler &operator=(const FrameScheduler &) = delete;
+
+  /*!
+    Decide what to do with the next frame. Call it once per frame, in frame order.
+  */
+  FrameDecision decide();
+
+  /*!
+    Report a finished frame. Call it once per frame, from one thread.
+  */
+  /*!
+  /param latency_ms the time from capture until the frame was done
+  */
+  void complete(const double latency_ms);
+
+  //! The current shedding level, 0 up to the length of the ladder
+  int getLevel() const
+  {
+    return m_level;
+  }
+
+  const SchedulerSettings &getSettings() const
+  {
+    return m_settings;
+  }
+
+  SchedulerStats getStats() const;
+
+  /*!
+    Show the counters and the level as "scheduler.<name>" gauges in the metrics
+  */
+  /*!
+  /param metrics the metrics to report to, or nullptr to stop reporting
+  */
+  void setMetrics(const SMetrics &metrics);
+};
+
+typedef std::shared_ptr<FrameScheduler> SFrameScheduler;
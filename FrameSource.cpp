@@ -0,0 +1,551 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <opencv2/opencv.hpp>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ChunkedRecording.h"
+#include "FrameSource.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  const char RAW_MAGIC[8] = { 'C', 'V', 'R', 'A', 'W', 'F', 'R', '1' };
+
+  // The header of a raw replay file, see RawFileSource
+  struct RawHeader
+  {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t type;
+    int32_t frame_count;
+  };
+
+  // A camera device number: all of 'text' a number from 0 up, that fits an int
+  bool parseDevice(const string &text, int &device)
+  {
+    if (text.empty() || !isdigit((unsigned char)text[0]))
+      return false;
+    char *end = nullptr;
+    errno = 0;
+    const long value = strtol(text.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || value > INT_MAX)
+      return false;
+    device = (int)value;
+    return true;
+  }
+}
+
+CameraSource::CameraSource(const int device) :
+  m_device(device)
+{
+}
+
+bool CameraSource::open()
+{
+  if (!m_capture.open(m_device))
+    return false;
+
+  // Wait for the webcam to fire up (give 250ms). A sleep, not waitKey(1): that needs
+  // HighGUI, and there may be no window (or no display) at all
+  int timeout = 0;
+  Mat dummy;
+  while (dummy.empty() && timeout++ < 250)
+  {
+    m_capture >> dummy;
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+
+  return m_capture.isOpened();
+}
+
+bool CameraSource::grab()
+{
+  return m_capture.grab();
+}
+
+bool CameraSource::retrieve(Mat &frame)
+{
+  return m_capture.retrieve(frame) && !frame.empty();
+}
+
+bool CameraSource::isOpened() const
+{
+  return m_capture.isOpened();
+}
+
+void CameraSource::release()
+{
+  m_capture.release();
+}
+
+string CameraSource::describe() const
+{
+  return "camera:" + to_string(m_device);
+}
+
+FileSource::FileSource(const string &path, const bool loop) :
+  m_path(path),
+  m_loop(loop)
+{
+}
+
+bool FileSource::open()
+{
+  return m_capture.open(m_path);
+}
+
+bool FileSource::grab()
+{
+  if (m_capture.grab())
+    return true;
+
+  if (!m_loop)
+    return false;
+
+  // Rewind and try once more (an empty file would loop forever otherwise)
+  m_capture.set(CV_CAP_PROP_POS_FRAMES, 0);
+  return m_capture.grab();
+}
+
+bool FileSource::retrieve(Mat &frame)
+{
+  return m_capture.retrieve(frame) && !frame.empty();
+}
+
+bool FileSource::isOpened() const
+{
+  return m_capture.isOpened();
+}
+
+void FileSource::release()
+{
+  m_capture.release();
+}
+
+string FileSource::describe() const
+{
+  return "file:" + m_path;
+}
+
+ImageSequenceSource::ImageSequenceSource(const string &directory, const bool loop) :
+  m_directory(directory),
+  m_loop(loop),
+  m_next(0),
+  m_grabbed(-1),
+  m_is_open(false)
+{
+}
+
+bool ImageSequenceSource::open()
+{
+  m_files.clear();
+  const char *patterns[] = { "*.png", "*.jpg", "*.jpeg", "*.bmp", "*.tif", "*.tiff" };
+  for (const char *pattern : patterns)
+  {
+    vector<String> found;
+    glob(m_directory + "/" + pattern, found, false);
+    m_files.insert(m_files.end(), found.begin(), found.end());
+  }
+  // cv::glob sorts per pattern, we want one order over all of them
+  sort(m_files.begin(), m_files.end());
+
+  m_next = 0;
+  m_grabbed = -1;
+  m_is_open = !m_files.empty();
+  return m_is_open;
+}
+
+bool ImageSequenceSource::grab()
+{
+  m_grabbed = -1;
+  if (!m_is_open)
+    return false;
+
+  if (m_next >= m_files.size())
+  {
+    if (!m_loop)
+      return false;
+    m_next = 0;
+  }
+
+  m_grabbed = (int64_t)m_next++;
+  return true;
+}
+
+bool ImageSequenceSource::retrieve(Mat &frame)
+{
+  if (m_grabbed < 0)
+    return false;
+
+  Mat image = imread(m_files[(size_t)m_grabbed], IMREAD_COLOR);
+  if (image.empty())
+    return false;
+
+  // copyTo reuses the buffer of 'frame' if it fits, plain operator= would throw it away
+  image.copyTo(frame);
+  return true;
+}
+
+bool ImageSequenceSource::isOpened() const
+{
+  return m_is_open;
+}
+
+void ImageSequenceSource::release()
+{
+  m_files.clear();
+  m_grabbed = -1;
+  m_is_open = false;
+}
+
+string ImageSequenceSource::describe() const
+{
+  return "images:" + m_directory;
+}
+
+SyntheticSource::SyntheticSource(const Size &size, const int64_t frame_count) :
+  m_size(size),
+  m_frame_count(frame_count),
+  m_next(0),
+  m_grabbed(-1)
+{
+}
+
+bool SyntheticSource::open()
+{
+  if (m_size.width <= 0 || m_size.height <= 0)
+    return false;
+
+  /*
+  Render a pattern twice as wide as a frame once. Frame n is the window that starts
+  at column (n * 4) mod width, so the pattern scrolls, but every run is identical.
+  */
+  const int width = m_size.width;
+  const int height = m_size.height;
+  m_pattern.create(height, 2 * width, CV_8UC3);
+  for (int y = 0; y < height; ++y)
+  {
+    Vec3b *row = m_pattern.ptr<Vec3b>(y);
+    for (int x = 0; x < width; ++x)
+    {
+      // A smooth color gradient with a checkerboard on top, so both flat and busy areas exist
+      const bool checker = ((x / 32) + (y / 32)) % 2 == 0;
+      const uchar b = saturate_cast<uchar>(255 * x / width);
+      const uchar g = saturate_cast<uchar>(255 * y / height);
+      const uchar r = checker ? 200 : 40;
+      row[x] = Vec3b(b, g, r);
+      row[x + width] = row[x];
+    }
+  }
+
+  m_next = 0;
+  m_grabbed = -1;
+  return true;
+}
+
+bool SyntheticSource::grab()
+{
+  m_grabbed = -1;
+  if (m_pattern.empty())
+    return false;
+
+  if (m_frame_count > 0 && m_next >= m_frame_count)
+    return false;
+
+  m_grabbed = m_next++;
+  return true;
+}
+
+bool SyntheticSource::retrieve(Mat &frame)
+{
+  if (m_pattern.empty() || m_grabbed < 0)
+    return false;
+
+  const int offset = (int)((m_grabbed * 4) % m_size.width);
+  frame.create(m_size, CV_8UC3);
+  m_pattern(Rect(offset, 0, m_size.width, m_size.height)).copyTo(frame);
+
+  // A moving white bar, so also vertical motion can be seen
+  const int bar_y = (int)((m_grabbed * 2) % m_size.height);
+  frame.row(bar_y).setTo(Scalar::all(255));
+  return true;
+}
+
+bool SyntheticSource::isOpened() const
+{
+  return !m_pattern.empty();
+}
+
+void SyntheticSource::release()
+{
+  m_pattern.release();
+}
+
+string SyntheticSource::describe() const
+{
+  return "synthetic:" + to_string(m_size.width) + "x" + to_string(m_size.height);
+}
+
+RawFileSource::RawFileSource(const string &path, const bool loop) :
+  m_path(path),
+  m_loop(loop),
+  m_mapping(nullptr),
+  m_mapping_size(0),
+  m_file_handle(-1),
+  m_map_handle(-1),
+  m_type(0),
+  m_frame_count(0),
+  m_frame_bytes(0),
+  m_next(0),
+  m_grabbed(-1)
+{
+}
+
+RawFileSource::~RawFileSource()
+{
+  release();
+}
+
+bool RawFileSource::open()
+{
+  if (isOpened())
+    return false; // already open
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(m_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER file_size;
+  HANDLE mapping = nullptr;
+  if (GetFileSizeEx(file, &file_size) && file_size.QuadPart >= (LONGLONG)sizeof(RawHeader))
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr)
+  {
+    CloseHandle(file);
+    return false;
+  }
+
+  m_mapping = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (m_mapping == nullptr)
+  {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  m_mapping_size = (size_t)file_size.QuadPart;
+  m_file_handle = (intptr_t)file;
+  m_map_handle = (intptr_t)mapping;
+#else
+  int file = ::open(m_path.c_str(), O_RDONLY);
+  if (file < 0)
+    return false;
+
+  struct stat file_stat;
+  if (fstat(file, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(RawHeader))
+  {
+    ::close(file);
+    return false;
+  }
+
+  void *mapping = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED, file, 0);
+  if (mapping == MAP_FAILED)
+  {
+    ::close(file);
+    return false;
+  }
+  // We read front to back, let the kernel read ahead aggressively
+  madvise(mapping, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+
+  m_mapping = mapping;
+  m_mapping_size = (size_t)file_stat.st_size;
+  m_file_handle = file;
+#endif
+
+  // Check the header and that all frames it promises are really in the file
+  RawHeader header;
+  memcpy(&header, m_mapping, sizeof(header));
+  m_size = Size(header.width, header.height);
+  m_type = header.type;
+  m_frame_count = header.frame_count;
+  m_frame_bytes = (size_t)header.width * header.height * CV_ELEM_SIZE(header.type);
+  m_next = 0;
+  m_grabbed = -1;
+
+  const bool valid = memcmp(header.magic, RAW_MAGIC, sizeof(RAW_MAGIC)) == 0 &&
+    header.width > 0 && header.height > 0 && header.frame_count > 0 &&
+    sizeof(RawHeader) + m_frame_bytes * m_frame_count <= m_mapping_size;
+  if (!valid)
+  {
+    release();
+    return false;
+  }
+  return true;
+}
+
+const Mat RawFileSource::view(const int64_t index) const
+{
+  if (m_mapping == nullptr || index < 0 || index >= m_frame_count)
+    return Mat();
+
+  // A Mat header on the mapped memory, no data is copied
+  uchar *data = (uchar *)m_mapping + sizeof(RawHeader) + m_frame_bytes * index;
+  return Mat(m_size, m_type, data);
+}
+
+bool RawFileSource::grab()
+{
+  m_grabbed = -1;
+  if (m_mapping == nullptr)
+    return false;
+
+  if (m_next >= m_frame_count)
+  {
+    if (!m_loop)
+      return false;
+    m_next = 0;
+  }
+
+  m_grabbed = m_next++;
+  return true;
+}
+
+bool RawFileSource::retrieve(Mat &frame)
+{
+  if (m_mapping == nullptr || m_grabbed < 0)
+    return false;
+
+  // The only cost of a frame: one copy out of the page cache
+  view(m_grabbed).copyTo(frame);
+  return true;
+}
+
+bool RawFileSource::isOpened() const
+{
+  return m_mapping != nullptr;
+}
+
+void RawFileSource::release()
+{
+#ifdef _WIN32
+  if (m_mapping != nullptr)
+    UnmapViewOfFile(m_mapping);
+  if (m_map_handle != -1)
+    CloseHandle((HANDLE)m_map_handle);
+  if (m_file_handle != -1)
+    CloseHandle((HANDLE)m_file_handle);
+#else
+  if (m_mapping != nullptr)
+    munmap(m_mapping, m_mapping_size);
+  if (m_file_handle != -1)
+    ::close((int)m_file_handle);
+#endif
+  m_mapping = nullptr;
+  m_mapping_size = 0;
+  m_file_handle = -1;
+  m_map_handle = -1;
+}
+
+string RawFileSource::describe() const
+{
+  return "raw:" + m_path;
+}
+
+int64_t RawFileSource::record(const string &path, FrameSource &source, const int64_t frame_count)
+{
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    return 0;
+
+  // Write a header with 0 frames first, we patch the count when we know it
+  RawHeader header;
+  memcpy(header.magic, RAW_MAGIC, sizeof(RAW_MAGIC));
+  header.width = 0;
+  header.height = 0;
+  header.type = 0;
+  header.frame_count = 0;
+  fwrite(&header, sizeof(header), 1, file);
+
+  int64_t written = 0;
+  Mat frame;
+  while (written < frame_count && source.read(frame))
+  {
+    if (written == 0)
+    {
+      header.width = frame.cols;
+      header.height = frame.rows;
+      header.type = frame.type();
+    }
+    else if (frame.cols != header.width || frame.rows != header.height || frame.type() != header.type)
+    {
+      break; // a raw file can only hold frames of one size and type
+    }
+
+    // Write row by row, a frame from a ROI doesn't have to be continuous
+    const size_t row_bytes = frame.cols * frame.elemSize();
+    for (int y = 0; y < frame.rows; ++y)
+      fwrite(frame.ptr(y), 1, row_bytes, file);
+    ++written;
+  }
+
+  header.frame_count = (int32_t)written;
+  fseek(file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, file);
+  fclose(file);
+  return written;
+}
+
+SFrameSource createFrameSource(const string &description)
+{
+  const size_t colon = description.find(':');
+  const string kind = description.substr(0, colon);
+  const string argument = colon == string::npos ? "" : description.substr(colon + 1);
+
+  // A plain number is a camera device
+  int device = 0;
+  if (parseDevice(description, device))
+    return make_shared<CameraSource>(device);
+
+  if (kind == "camera")
+  {
+    if (!argument.empty() && !parseDevice(argument, device))
+      return nullptr;
+    return make_shared<CameraSource>(device);
+  }
+  if (kind == "file")
+    return make_shared<FileSource>(argument);
+  if (kind == "images")
+    return make_shared<ImageSequenceSource>(argument);
+  if (kind == "raw")
+    return make_shared<RawFileSource>(argument);
+  if (kind == "chunked")
+    return make_shared<ChunkedFileSource>(argument);
+  if (kind == "synthetic")
+  {
+    int width = 640, height = 480;
+    if (!argument.empty() && sscanf(argument.c_str(), "%dx%d", &width, &height) != 2)
+      return nullptr;
+    return make_shared<SyntheticSource>(Size(width, height));
+  }
+  return nullptr;
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+//!  Where the frames of a Video come from
+/*!
+  A frame source hides the difference between a webcam, a video file, a folder
+  of images, a generated test pattern and a raw replay file. Video only ever
+  calls open(), grab(), retrieve() (or read(), which is both) and release(), so
+  the processing loop can be driven by any of them, also on machines without a camera.
+
+  Like cv::VideoCapture, getting a frame is split in two: grab() moves on to the
+  next frame (cheap, for a camera it doesn't even decode) and retrieve(..) decodes
+  it into a buffer. That way the caller decides where the frame goes.
+
+  A source is used by one thread at a time (the capture thread in pipelined mode).
+*/
+class FrameSource
+{
+public:
+  virtual ~FrameSource() {}
+
+  /*!
+    Open the source, returns false if it can't be opened
+  */
+  virtual bool open() = 0;
+
+  /*!
+    Move on to the next frame, without decoding it yet
+  */
+  /*!
+  returns false at the end of the source (or on an error)
+  */
+  virtual bool grab() = 0;
+
+  /*!
+    Decode the frame that was grabbed last. If 'frame' already has the right size
+    and type, the frame is written into its buffer, so a reused cv::Mat doesn't reallocate.
+  */
+  /*!
+  /param frame receives the image
+  returns false if there is no grabbed frame (or on an error)
+  */
+  virtual bool retrieve(cv::Mat &frame) = 0;
+
+  /*!
+    Grab and retrieve the next frame
+  */
+  /*!
+  /param frame receives the next image, see retrieve(..)
+  returns false at the end of the source (or on an error)
+  */
+  virtual bool read(cv::Mat &frame)
+  {
+    return grab() && retrieve(frame);
+  }
+
+  //! True between a successful open() and release()
+  virtual bool isOpened() const = 0;
+
+  //! Close the source, open() may be called again afterwards
+  virtual void release() = 0;
+
+  //! A short human readable description, e.g. for logging
+  virtual std::string describe() const = 0;
+};
+
+typedef std::shared_ptr<FrameSource> SFrameSource;
+
+/*!
+  A webcam (or any other capture device OpenCV knows by number)
+*/
+class CameraSource : public FrameSource
+{
+  cv::VideoCapture m_capture;
+  const int m_device;
+
+public:
+  /*!
+  /param device the number of the capture device, 0 is the default webcam
+  */
+  explicit CameraSource(const int device = 0);
+
+  bool open() override;
+  bool grab() override;
+  bool retrieve(cv::Mat &frame) override;
+  bool isOpened() const override;
+  void release() override;
+  std::string describe() const override;
+};
+
+/*!
+  A video file, decoded with cv::VideoCapture
+*/
+class FileSource : public FrameSource
+{
+  cv::VideoCapture m_capture;
+  const std::string m_path;
+  const bool m_loop;
+
+public:
+  /*!
+  /param path the video file to read
+  /param loop start again at the first frame when the end of the file is reached
+  */
+  FileSource(const std::string &path, const bool loop = false);
+
+  bool open() override;
+  bool grab() override;
+  bool retrieve(cv::Mat &frame) override;
+  bool isOpened() const override;
+  void release() override;
+  std::string describe() const override;
+};
+
+/*!
+  All images in a directory, in alphabetical order (so name them frame_0001.png, frame_0002.png, ...)
+*/
+class ImageSequenceSource : public FrameSource
+{
+  const std::string m_directory;
+  const bool m_loop;
+  std::vector<std::string> m_files;
+  size_t m_next;
+  //! The index of the grabbed image, or -1 if there is none
+  int64_t m_grabbed;
+  bool m_is_open;
+
+public:
+  /*!
+  /param directory the directory with .png, .jpg, .bmp or .tif images
+  /param loop start again at the first image after the last one
+  */
+  ImageSequenceSource(const std::string &directory, const bool loop = false);
+
+  bool open() override;
+  bool grab() override;
+  bool retrieve(cv::Mat &frame) override;
+  bool isOpened() const override;
+  void release() override;
+  std::string describe() const override;
+};
+
+/*!
+  A deterministic moving test pattern. Frame n always looks exactly the same,
+  so two runs (or two builds) process identical input. Generating a frame is a
+  single copy of a pre-rendered pattern, so it's nearly free.
+*/
+class SyntheticSource : public FrameSource
+{
+  const cv::Size m_size;
+  const int64_t m_frame_count;
+  cv::Mat m_pattern;
+  int64_t m_next;
+  //! The number of the grabbed frame, or -1 if there is none
+  int64_t m_grabbed;
+
+public:
+  /*!
+  /param size the size of the frames
+  /param frame_count the amount of frames to produce, 0 or less means endless
+  */
+  SyntheticSource(const cv::Size &size = cv::Size(640, 480), const int64_t frame_count = 0);
+
+  bool open() override;
+  bool grab() override;
+  bool retrieve(cv::Mat &frame) override;
+  bool isOpened() const override;
+  void release() override;
+  std::string describe() const override;
+};
+
+/*!
+  A replay of uncompressed frames from a memory-mapped file. There is no decoding
+  at all, a frame is one memcpy out of the page cache, so this replays at the speed
+  of your memory. Use RawFileSource::record(..) to create such a file from any other source.
+
+  The file is a small header followed by the frames, back to back:
+  "CVRAWFR1" | width | height | type | frame count (all 32 bit) | frame data ...
+*/
+class RawFileSource : public FrameSource
+{
+  const std::string m_path;
+  const bool m_loop;
+
+  // The mapping (see the platform specific code in FrameSource.cpp)
+  void *m_mapping;
+  size_t m_mapping_size;
+  intptr_t m_file_handle;
+  intptr_t m_map_handle;
+
+  cv::Size m_size;
+  int m_type;
+  int64_t m_frame_count;
+  size_t m_frame_bytes;
+  int64_t m_next;
+  //! The index of the grabbed frame, or -1 if there is none
+  int64_t m_grabbed;
+
+public:
+  /*!
+  /param path the raw replay file
+  /param loop start again at the first frame after the last one
+  */
+  RawFileSource(const std::string &path, const bool loop = true);
+  ~RawFileSource();
+
+  bool open() override;
+  bool grab() override;
+  bool retrieve(cv::Mat &frame) override;
+  bool isOpened() const override;
+  void release() override;
+  std::string describe() const override;
+
+  /*!
+    A read-only view straight into the mapping, without any copy.
+    Don't write into it and don't keep it after release()!
+  */
+  /*!
+  /param index the number of the frame
+  */
+  const cv::Mat view(const int64_t index) const;
+
+  //! The amount of frames in the file
+  int64_t getFrameCount() const
+  {
+    return m_frame_count;
+  }
+
+  /*!
+    Write 'frame_count' frames from 'source' to a raw replay file.
+    All frames must have the same size and type as the first one.
+  */
+  /*!
+  /param path the file to create (an existing file is overwritten)
+  /param source an opened frame source
+  /param frame_count the maximal amount of frames to write
+  returns the amount of frames written
+  */
+  static int64_t record(const std::string &path, FrameSource &source, const int64_t frame_count);
+};
+
+/*!
+  Create a frame source from a short text description, handy for command line arguments:
+
+  camera:0                    the webcam with device number 0 (a plain number also works)
+  file:path/to/video.avi      a video file
+  images:path/to/directory    a directory of images
+  synthetic:1280x720          a generated test pattern of the given size
+  raw:path/to/frames.raw      a memory-mapped raw replay file
+  chunked:path/to/rec.cvchunk a chunked recording (see ChunkedRecording.h)
+
+  returns nullptr for a description it doesn't understand
+*/
+SFrameSource createFrameSource(const std::string &description);
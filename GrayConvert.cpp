@@ -0,0 +1,283 @@
+#include <cstring>
+#include <opencv2/opencv.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define GRAY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "GrayConvert.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  // The weights of cvtColor(.., COLOR_BGR2GRAY) in 14 bit fixed point, they add up to 1 << 14
+  const int GRAY_SHIFT = 14;
+  const int WEIGHT_B = 1868;
+  const int WEIGHT_G = 9617;
+  const int WEIGHT_R = 4899;
+
+  // Fixed8_8 keeps 8 of the 14 fraction bits
+  const int FIXED_SHIFT = GRAY_SHIFT - 8;
+
+  // What convertTo(.., CV_32F, 1 / 255.0) multiplies with
+  const float FLOAT_SCALE = (float)(1 / 255.0);
+
+  // The weighted sum of a pixel, before it's shifted down
+  inline int graySum(const uchar *bgr)
+  {
+    return bgr[0] * WEIGHT_B + bgr[1] * WEIGHT_G + bgr[2] * WEIGHT_R;
+  }
+
+  // The gray level cvtColor(..) makes, rounded to 8 bits
+  inline int grayLevel(const uchar *bgr)
+  {
+    return (graySum(bgr) + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT;
+  }
+
+  // There are only 256 gray levels, so the halves are a table
+  struct HalfTable
+  {
+    uint16_t values[256];
+
+    HalfTable()
+    {
+      for (int level = 0; level < 256; ++level)
+        values[level] = floatToHalf(level * FLOAT_SCALE);
+    }
+  };
+
+#ifdef GRAY_SSE2
+  /*
+  Split 32 BGR pixels (96 bytes in 6 registers) into 2 registers per channel. Every
+  round interleaves the bytes of the first half with the second half, after 5 rounds
+  every byte is back with the bytes of its channel (the SSE2 version of what SSSE3
+  does with a shuffle).
+  */
+  inline void deinterleaveBGR(__m128i &v0, __m128i &v1, __m128i &v2, __m128i &v3, __m128i &v4, __m128i &v5)
+  {
+    for (int round = 0; round < 5; ++round)
+    {
+      const __m128i a0 = _mm_unpacklo_epi8(v0, v3);
+      const __m128i a1 = _mm_unpackhi_epi8(v0, v3);
+      const __m128i a2 = _mm_unpacklo_epi8(v1, v4);
+      const __m128i a3 = _mm_unpackhi_epi8(v1, v4);
+      const __m128i a4 = _mm_unpacklo_epi8(v2, v5);
+      const __m128i a5 = _mm_unpackhi_epi8(v2, v5);
+      v0 = a0;
+      v1 = a1;
+      v2 = a2;
+      v3 = a3;
+      v4 = a4;
+      v5 = a5;
+    }
+  }
+
+  /*
+  The weighted sums of 8 pixels (16 bit channels) plus 'rounding', shifted down: two
+  _mm_madd_epi16 per 4 pixels, one for B and G, one for R and the rounding
+  */
+  inline void graySums(const __m128i &b, const __m128i &g, const __m128i &r, const int rounding, const int shift,
+    __m128i &low, __m128i &high)
+  {
+    const __m128i weights_bg = _mm_set1_epi32((WEIGHT_G << 16) | WEIGHT_B);
+    const __m128i weights_r1 = _mm_set1_epi32((1 << 16) | WEIGHT_R);
+    const __m128i round = _mm_set1_epi16((short)rounding);
+    low = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b, g), weights_bg), _mm_madd_epi16(_mm_unpacklo_epi16(r, round), weights_r1));
+    high = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b, g), weights_bg), _mm_madd_epi16(_mm_unpackhi_epi16(r, round), weights_r1));
+    // A shift by a register, the count isn't a compile time constant here
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    low = _mm_srl_epi32(low, count);
+    high = _mm_srl_epi32(high, count);
+  }
+
+  // 4 x 32 bit to 4 x 16 bit unsigned, without SSE4.1's _mm_packus_epi32: shift into the signed range and back
+  inline __m128i packUnsigned16(const __m128i &low, const __m128i &high)
+  {
+    const __m128i bias32 = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(low, bias32), _mm_sub_epi32(high, bias32)), bias16);
+  }
+#endif
+
+  template<GrayFormat FORMAT>
+  void convertRow(const uchar *src, void *dst, const int width, const HalfTable &halves)
+  {
+    float *out_float = (float *)dst;
+    uint16_t *out_16 = (uint16_t *)dst;
+    int x = 0;
+
+#ifdef GRAY_SSE2
+    // Fixed8_8 keeps fraction bits, the others round to the gray level of cvtColor(..)
+    const int shift = FORMAT == GrayFormat::Fixed8_8 ? FIXED_SHIFT : GRAY_SHIFT;
+    const int rounding = 1 << (shift - 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(FLOAT_SCALE);
+
+    for (; x + 32 <= width; x += 32)
+    {
+      const __m128i *in = (const __m128i *)(src + 3 * x);
+      __m128i v0 = _mm_loadu_si128(in + 0), v1 = _mm_loadu_si128(in + 1), v2 = _mm_loadu_si128(in + 2);
+      __m128i v3 = _mm_loadu_si128(in + 3), v4 = _mm_loadu_si128(in + 4), v5 = _mm_loadu_si128(in + 5);
+      deinterleaveBGR(v0, v1, v2, v3, v4, v5);
+      // Now v0/v1 are B, v2/v3 are G, v4/v5 are R, 16 pixels each
+      const __m128i channels[3][2] = { { v0, v1 }, { v2, v3 }, { v4, v5 } };
+
+      for (int half = 0; half < 2; ++half)
+      {
+        for (int part = 0; part < 2; ++part)
+        {
+          // 8 pixels with 16 bit channels
+          const __m128i b = part == 0 ? _mm_unpacklo_epi8(channels[0][half], zero) : _mm_unpackhi_epi8(channels[0][half], zero);
+          const __m128i g = part == 0 ? _mm_unpacklo_epi8(channels[1][half], zero) : _mm_unpackhi_epi8(channels[1][half], zero);
+          const __m128i r = part == 0 ? _mm_unpacklo_epi8(channels[2][half], zero) : _mm_unpackhi_epi8(channels[2][half], zero);
+          __m128i low, high;
+          graySums(b, g, r, rounding, shift, low, high);
+
+          const int offset = x + half * 16 + part * 8;
+          if (FORMAT == GrayFormat::Float32)
+          {
+            _mm_storeu_ps(out_float + offset, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+            _mm_storeu_ps(out_float + offset + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+          }
+          else if (FORMAT == GrayFormat::Fixed8_8)
+            _mm_storeu_si128((__m128i *)(out_16 + offset), packUnsigned16(low, high));
+          else
+          {
+            // SSE2 can't make halves, but the gray levels are only 8 bits: look them up
+            int32_t levels[8];
+            _mm_storeu_si128((__m128i *)levels, low);
+            _mm_storeu_si128((__m128i *)(levels + 4), high);
+            for (int i = 0; i < 8; ++i)
+              out_16[offset + i] = halves.values[levels[i]];
+          }
+        }
+      }
+    }
+#endif
+
+    for (; x < width; ++x)
+    {
+      const uchar *pixel = src + 3 * x;
+      if (FORMAT == GrayFormat::Float32)
+        out_float[x] = grayLevel(pixel) * FLOAT_SCALE;
+      else if (FORMAT == GrayFormat::Fixed8_8)
+        out_16[x] = (uint16_t)((graySum(pixel) + (1 << (FIXED_SHIFT - 1))) >> FIXED_SHIFT);
+      else
+        out_16[x] = halves.values[grayLevel(pixel)];
+    }
+  }
+}
+
+int grayFormatType(const GrayFormat format)
+{
+  switch (format)
+  {
+  case GrayFormat::Float16:
+#ifdef CV_16F
+    return CV_16FC1;
+#else
+    return CV_16SC1;
+#endif
+  case GrayFormat::Fixed8_8:
+    return CV_16UC1;
+  default:
+    return CV_32FC1;
+  }
+}
+
+void bgrToGray(const Mat &src, Mat &dst, const GrayFormat format)
+{
+  CV_Assert(src.type() == CV_8UC3);
+
+  // A header of its own, in case dst is src: create(..) then gives dst a new buffer
+  const Mat input = src;
+  dst.create(input.size(), grayFormatType(format));
+
+  static const HalfTable halves;
+  for (int y = 0; y < input.rows; ++y)
+  {
+    const uchar *in = input.ptr(y);
+    void *out = dst.ptr(y);
+    switch (format)
+    {
+    case GrayFormat::Float16:
+      convertRow<GrayFormat::Float16>(in, out, input.cols, halves);
+      break;
+    case GrayFormat::Fixed8_8:
+      convertRow<GrayFormat::Fixed8_8>(in, out, input.cols, halves);
+      break;
+    default:
+      convertRow<GrayFormat::Float32>(in, out, input.cols, halves);
+      break;
+    }
+  }
+}
+
+uint16_t floatToHalf(const float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+  uint32_t mantissa = bits & 0x7FFFFF;
+
+  if (((bits >> 23) & 0xFF) == 0xFF)
+    return (uint16_t)(sign | 0x7C00 | (mantissa != 0 ? 0x200 : 0)); // infinity or NaN
+  if (exponent >= 31)
+    return (uint16_t)(sign | 0x7C00); // too large: infinity
+
+  if (exponent <= 0)
+  {
+    // A subnormal half (or zero): shift the mantissa, with its hidden bit, into place
+    if (exponent < -10)
+      return (uint16_t)sign;
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    uint32_t result = mantissa >> shift;
+    if (rest > halfway || (rest == halfway && (result & 1)))
+      ++result;
+    return (uint16_t)(sign | result);
+  }
+
+  // Round the 23 bit mantissa to 10 bits, to nearest even. A carry into the exponent is fine.
+  uint32_t result = ((uint32_t)exponent << 10) | (mantissa >> 13);
+  const uint32_t rest = mantissa & 0x1FFF;
+  if (rest > 0x1000 || (rest == 0x1000 && (result & 1)))
+    ++result;
+  return (uint16_t)(sign | result);
+}
+
+float halfToFloat(const uint16_t half)
+{
+  const uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  const int exponent = (half >> 10) & 0x1F;
+  uint32_t mantissa = half & 0x3FF;
+  uint32_t bits;
+
+  if (exponent == 0x1F)
+    bits = sign | 0x7F800000 | (mantissa << 13); // infinity or NaN
+  else if (exponent != 0)
+    bits = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+  else if (mantissa == 0)
+    bits = sign; // zero
+  else
+  {
+    // Subnormal: normalize it
+    int e = -1;
+    do
+    {
+      mantissa <<= 1;
+      ++e;
+    } while ((mantissa & 0x400) == 0);
+    bits = sign | ((uint32_t)(127 - 15 - e) << 23) | ((mantissa & 0x3FF) << 13);
+  }
+
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+
+/*!
+  The output of bgrToGray(..)
+*/
+enum class GrayFormat
+{
+  /*!
+    CV_32FC1 in [0 .. 1]: the same values as cvtColor(.., COLOR_BGR2GRAY) followed by
+    convertTo(.., CV_32F, 1 / 255.0), 4 bytes per pixel
+  */
+  Float32,
+  /*!
+    The same values as half precision floats, 2 bytes per pixel. Stored as CV_16FC1
+    where OpenCV has it (4.x), otherwise as CV_16SC1 holding the bits of the halves,
+    which is what cv::convertFp16(..) of OpenCV 3 expects. Every gray level of 8 bits
+    is exact to within 1/4096.
+  */
+  Float16,
+  /*!
+    CV_16UC1 with the gray level in 8.8 fixed point: the gray level times 256. It keeps
+    8 bits of the fraction that the 8 bit gray image rounds away, 2 bytes per pixel.
+    Divide by 255 * 256 for [0 .. 1].
+  */
+  Fixed8_8
+};
+
+/*!
+  Convert a BGR image straight to a normalized gray image, in one pass. It replaces
+
+    cvtColor(frame, gray, COLOR_BGR2GRAY);
+    gray.convertTo(gray_float, CV_32F, 1 / 255.0);
+
+  which writes an 8 bit gray image and then reads it again, and it can write halves
+  or 8.8 fixed point instead of floats, so the next step reads half the bytes.
+
+  The gray level is the one of cvtColor(..): 0.114 B + 0.587 G + 0.299 R, in 14 bit
+  fixed point (1868, 9617 and 4899), with SSE2 on 32 pixels at a time where available.
+*/
+/*!
+/param src a CV_8UC3 image (BGR)
+/param dst receives the gray image, of the type given by format
+/param format float, half or 8.8 fixed point
+*/
+void bgrToGray(const cv::Mat &src, cv::Mat &dst, const GrayFormat format = GrayFormat::Float32);
+
+//! The cv::Mat type bgrToGray(..) makes for a format
+int grayFormatType(const GrayFormat format);
+
+//! A float as a half precision float (round to nearest even), for Float16 images
+uint16_t floatToHalf(const float value);
+
+//! A half precision float as a float, to read Float16 images
+float halfToFloat(const uint16_t half);
@@ -1,82 +1,194 @@
-#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <unordered_set>
 #include <opencv2/opencv.hpp>
 
 #include "Helper.h"
+#include "OverlayRenderer.h"
 
 using namespace cv;
 using namespace std;
 
-Helper::Helper(void)
+// The type table is made by the compiler, so it can be checked by the compiler too
+static_assert(Helper::showCVMatType(CV_8U) == "CV_8U", "1 channel types have no channel suffix");
+static_assert(Helper::showCVMatType(CV_8UC4) == "CV_8UC4", "");
+static_assert(Helper::showCVMatType(CV_MAKETYPE(CV_16U, 3)) == "CV_16UC3", "");
+static_assert(Helper::showCVMatType(CV_64FC(512)) == "CV_64FC512", "");
+static_assert(Helper::showCVMatType(-1) == "CV_???", "");
+static_assert(Helper::cvMatElemSize(CV_32FC3) == 12, "");
+
+namespace
 {
-  // Reserve some memory
-  m_cvmat2str.reserve(19);
-
-  // Emplace all string interpretations (R) into the vector with the correct type macro (L)
-  m_cvmat2str.emplace_back(pair<int, string>(-1, (string) "CV_???"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_8U, (string) "CV_8U"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_8UC3, (string) "CV_8UC3"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_8S, (string) "CV_8S"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_16U, (string) "CV_16U"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_16S, (string) "CV_16S"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_32S, (string) "CV_32S"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_32F, (string) "CV_32F"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_32FC2, (string) "CV_32FC2"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_32FC3, (string) "CV_32FC3"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_32FC4, (string) "CV_32FC4"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_32FC(5), (string) "CV_32FC5"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_64F, (string) "CV_64F"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_64FC2, (string) "CV_64FC2"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_64FC3, (string) "CV_64FC3"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_64FC4, (string) "CV_64FC4"));
-  m_cvmat2str.emplace_back(pair<int, string>(CV_64FC(5), (string) "CV_64FC5"));
+	/*
+	Robert Floyd's sampling: 'count' unique numbers from [0, range). For every j in the last
+	'count' numbers of the range, draw t from [0, j]. If t was chosen already, take j
+	itself (it can't have been chosen yet, all earlier draws were below j). Every subset
+	comes out with the same chance, the order is shuffled afterwards.
+	*/
+	vector<int64_t> floydSample(const int64_t count, const int64_t range, mt19937 &generator)
+	{
+		vector<int64_t> result;
+		if (count <= 0 || range <= 0)
+			return result;
+		const int64_t k = min(count, range);
+		result.reserve((size_t)k);
+		unordered_set<int64_t> chosen;
+		chosen.reserve((size_t)k * 2);
+		for (int64_t j = range - k; j < range; ++j)
+		{
+			const int64_t t = uniform_int_distribution<int64_t>(0, j)(generator);
+			const int64_t value = chosen.insert(t).second ? t : j;
+			chosen.insert(value);
+			result.push_back(value);
+		}
+		shuffle(result.begin(), result.end(), generator);
+		return result;
+	}
 }
 
-Helper::~Helper(void)
+Helper::Helper(void) :
+	m_generator(random_device{}())
 {
 }
 
-const string Helper::showCVMatType(int type)
+Helper::~Helper(void)
 {
-  // We use a lambda function predicate to find the mapping of the type integer to its string description
-  // We catch the type variable to make it available in the lambda function
-  // std::find_if return a const_iterator that points to its current content
-  vector<pair<int, string>>::const_iterator type_iterator = 
-    find_if(m_cvmat2str.begin(), m_cvmat2str.end(), [type](const pair<int, string> &str_type)
-  {
-    return str_type.first == type;
-  });
-
-  // If the iterator is not at the end of the vector, we've found the right interpretation
-  if (type_iterator != m_cvmat2str.end())
-  {
-    // to get to the content of the const_iterator, we need to use the pointer (->)
-    return type_iterator->second;
-  }
-
-  // Else we didn't find the right interpretation, so we return "CV_???"
-  return m_cvmat2str.front().second;
 }
 
 void Helper::putPrettyText(const string &text, const Point &location, const double text_size, Mat &canvas)
 {
-	const int thickness1 = 2;
-	// FONT_HERSHEY_PLAIN is the font type
-	// Color_BLACK is the paint color
-	// CV_AA means the text is anti-aliased
-	putText(canvas, text, location, FONT_HERSHEY_PLAIN, text_size, Color_BLACK, thickness1, CV_AA);
-
-	const int thickness2 = 1;
-	putText(canvas, text, location, FONT_HERSHEY_PLAIN, text_size, Color_WHITE, thickness2, CV_AA);
+	// The black outline and the white text on top are rasterized once per character and
+	// font size by the OverlayRenderer, after that a label is just a blend of cached glyphs.
+	// Every thread gets its own renderer, so the pipeline workers can draw at the same time.
+	static thread_local OverlayRenderer renderer;
+	renderer.drawText(text, location, text_size, canvas);
+}
+
+void Helper::initRandomIntVector(const int size, const int offset, const int count)
+{
+	// Only draw the numbers we need, instead of a list 0, 1, 2, 3, ... that we shuffle completely
+	m_random_numbers = sampleUnique(count < 0 ? size : min(count, size), offset, offset + size);
+}
+
+vector<int> Helper::sampleUnique(const int count, const int lower, const int upper)
+{
+	vector<int> result;
+	for (const int64_t value : floydSample(count, (int64_t)upper - lower, m_generator))
+		result.push_back((int)(lower + value));
+	return result;
+}
+
+vector<Point> Helper::samplePixels(const int count, const Size &size)
+{
+	// A pixel location is a number in [0, width * height), so it's the same problem
+	vector<Point> result;
+	for (const int64_t index : floydSample(count, (int64_t)size.width * size.height, m_generator))
+		result.push_back(Point((int)(index % size.width), (int)(index / size.width)));
+	return result;
+}
+
+Scalar Helper::sampleMean(const Mat &image, const vector<Point> &locations)
+{
+	CV_Assert(image.type() == CV_8UC1 || image.type() == CV_8UC3);
+	Scalar sum;
+	if (locations.empty())
+		return sum;
+	for (const Point &location : locations)
+	{
+		if (image.channels() == 1)
+			sum[0] += image.at<uchar>(location.y, location.x);
+		else
+		{
+			const Vec3b &color = image.at<Vec3b>(location.y, location.x);
+			sum[0] += color[0];
+			sum[1] += color[1];
+			sum[2] += color[2];
+		}
+	}
+	return sum * (1.0 / locations.size());
+}
+
+PixelReservoir::PixelReservoir(const size_t capacity, const uint32_t seed) :
+	m_capacity(max<size_t>(1, capacity)),
+	m_generator(seed),
+	m_uniform(0.0, 1.0)
+{
+	reset();
+}
+
+void PixelReservoir::reset()
+{
+	m_samples.clear();
+	m_samples.reserve(m_capacity);
+	m_seen = 0;
+	m_frames = 0;
+	// The first 'capacity' pixels all go in, Algorithm L starts after them
+	m_weight = exp(log(randomOpen()) / m_capacity);
+	m_next = (int64_t)m_capacity;
+	skip();
+}
+
+double PixelReservoir::randomOpen()
+{
+	double value = 0;
+	while (value <= 0)
+		value = m_uniform(m_generator);
+	return value;
+}
+
+void PixelReservoir::skip()
+{
+	// The amount of pixels to pass over is geometric with chance 'weight' of taking one
+	const double gap = floor(log(randomOpen()) / log1p(-m_weight));
+	const double room = (double)(numeric_limits<int64_t>::max() - m_next - 1);
+	m_next += gap < room ? (int64_t)gap : (int64_t)room;
+	m_weight *= exp(log(randomOpen()) / m_capacity);
+}
+
+void PixelReservoir::add(const Mat &frame)
+{
+	CV_Assert(frame.type() == CV_8UC3);
+	const int64_t pixels = (int64_t)frame.rows * frame.cols;
+	const int64_t first = m_seen;
+	const int64_t end = m_seen + pixels;
+
+	// Filling up: the first pixels of the stream go in as they are
+	for (int64_t i = first; i < end && m_samples.size() < m_capacity; ++i)
+	{
+		PixelSample sample;
+		sample.location = Point((int)((i - first) % frame.cols), (int)((i - first) / frame.cols));
+		sample.color = frame.at<Vec3b>(sample.location.y, sample.location.x);
+		sample.frame = m_frames;
+		m_samples.push_back(sample);
+	}
+
+	// Full: only visit the pixels Algorithm L picks, each replaces a random sample
+	for (; m_next < end; skip())
+	{
+		const int64_t index = m_next - first;
+		PixelSample &sample = m_samples[uniform_int_distribution<size_t>(0, m_capacity - 1)(m_generator)];
+		sample.location = Point((int)(index % frame.cols), (int)(index / frame.cols));
+		sample.color = frame.at<Vec3b>(sample.location.y, sample.location.x);
+		sample.frame = m_frames;
+		++m_next;
+	}
+
+	m_seen = end;
+	++m_frames;
 }
 
-void Helper::initRandomIntVector(const int size, const int offset)
+Scalar PixelReservoir::mean() const
 {
-	// Reset
-	m_random_numbers.clear();
-	// Allocate some space for some random numbers
-	m_random_numbers.resize(size);
-	// Generate a list start with: 0, 1, 2, 3, 4, 5, 6, ...
-	iota(m_random_numbers.begin(), m_random_numbers.end(), offset);
-	// Shuffle the list to make the order random (eg.): 5, 1, 9, 4, 6, 7, 0, ...  
-	random_shuffle(m_random_numbers.begin(), m_random_numbers.end());
+	Scalar sum;
+	if (m_samples.empty())
+		return sum;
+	for (const PixelSample &sample : m_samples)
+	{
+		sum[0] += sample.color[0];
+		sum[1] += sample.color[1];
+		sum[2] += sample.color[2];
+	}
+	return sum * (1.0 / m_samples.size());
 }
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <opencv2/opencv.hpp>
+#include <random>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #define IMAGE_WINDOW "Image window"
@@ -52,6 +56,61 @@ const static cv::Scalar Color_OLIVE = CV_RGB(0x6E, 0x75, 0x0E);
 const static cv::Scalar Color_COBALT = CV_RGB(0x1E, 0x48, 0x8F);
 const static cv::Scalar Color_KHAKI = CV_RGB(0xAA, 0xA6, 0x62);
 
+/*!
+  The readable names of all cv::Mat types, generated by the compiler.
+  A type is a depth (CV_8U, CV_32F, ...) plus the channel count minus one
+  shifted left by CV_CN_SHIFT, so every type number below
+  CV_DEPTH_MAX * CV_CN_MAX has its own slot and a lookup is an index.
+*/
+struct CVMatTypeNames
+{
+  //! Enough for the longest name, "CV_USRTYPE1C512"
+  static constexpr int NAME_SIZE = 16;
+  static constexpr int TYPE_COUNT = CV_DEPTH_MAX * CV_CN_MAX;
+
+  char names[TYPE_COUNT][NAME_SIZE];
+  unsigned char lengths[TYPE_COUNT];
+};
+
+//! The names of the depths, in the order of their numbers
+constexpr std::string_view CVMAT_DEPTH_NAMES[CV_DEPTH_MAX] =
+{
+#ifdef CV_16F
+  "CV_8U", "CV_8S", "CV_16U", "CV_16S", "CV_32S", "CV_32F", "CV_64F", "CV_16F"
+#else
+  "CV_8U", "CV_8S", "CV_16U", "CV_16S", "CV_32S", "CV_32F", "CV_64F", "CV_USRTYPE1"
+#endif
+};
+
+//! Builds the name of every type: the depth name, plus "C<channels>" if there is more than 1 channel
+constexpr CVMatTypeNames makeCVMatTypeNames()
+{
+  CVMatTypeNames table{};
+  for (int type = 0; type < CVMatTypeNames::TYPE_COUNT; ++type)
+  {
+    char *name = table.names[type];
+    int length = 0;
+    for (const char c : CVMAT_DEPTH_NAMES[CV_MAT_DEPTH(type)])
+      name[length++] = c;
+
+    const int channels = CV_MAT_CN(type);
+    if (channels > 1)
+    {
+      name[length++] = 'C';
+      // The digits come out backwards, so write them from the end
+      const int digits = channels >= 100 ? 3 : channels >= 10 ? 2 : 1;
+      for (int i = digits - 1, rest = channels; i >= 0; --i, rest /= 10)
+        name[length + i] = (char)('0' + rest % 10);
+      length += digits;
+    }
+    table.lengths[type] = (unsigned char)length;
+  }
+  return table;
+}
+
+//! The table itself, it ends up in the read-only data of the program
+inline constexpr CVMatTypeNames CVMAT_TYPE_NAMES = makeCVMatTypeNames();
+
 //!  A simple tutorial class
 /*!
   This class contains some helper functions. It also shows the basics
@@ -61,22 +120,67 @@ const static cv::Scalar Color_KHAKI = CV_RGB(0xAA, 0xA6, 0x62);
 */
 class Helper
 {
-  //! A vector of pairs to connect numbers to matrix type names
-  std::vector<std::pair<int, std::string>> m_cvmat2str;
   //! A vector of integers
   std::vector<int> m_random_numbers;
+  //! The random generator of all sampling functions, seeded from std::random_device (see seed(..))
+  std::mt19937 m_generator;
 
 public:
   Helper(void);
   ~Helper(void);
 
   /*!
-    This function converts a cv::Mat::type() to a readable string
+    Seed the random generator, the same seed gives the same random numbers every run
+  */
+  void seed(const uint32_t seed)
+  {
+    m_generator.seed(seed);
+  }
+
+  //! The random generator, for anything else that needs random numbers
+  std::mt19937 &getGenerator()
+  {
+    return m_generator;
+  }
+
+  /*!
+    This function converts a cv::Mat::type() to a readable string, e.g. "CV_8UC3".
+    It's a lookup in a table the compiler made, so it doesn't allocate and it can
+    even be used at compile time. Unknown types show up as "CV_???".
   */
   /*!
   /param type An integer with the cv::Mat type as it is returned from: cv::Mat matrix.type()
   */
-  const std::string showCVMatType(int type);
+  static constexpr std::string_view showCVMatType(const int type)
+  {
+    if (type < 0 || type >= CVMatTypeNames::TYPE_COUNT)
+      return "CV_???";
+    return std::string_view(CVMAT_TYPE_NAMES.names[type], CVMAT_TYPE_NAMES.lengths[type]);
+  }
+
+  //! The name of the depth of a cv::Mat type, e.g. "CV_8U" for CV_8UC3
+  static constexpr std::string_view cvMatDepthName(const int type)
+  {
+    return CVMAT_DEPTH_NAMES[CV_MAT_DEPTH(type)];
+  }
+
+  //! The number of channels of a cv::Mat type, e.g. 3 for CV_8UC3
+  static constexpr int cvMatChannels(const int type)
+  {
+    return CV_MAT_CN(type);
+  }
+
+  //! The size of one channel of one element in bytes, e.g. 4 for CV_32FC2
+  static constexpr size_t cvMatElemSize1(const int type)
+  {
+    return CV_ELEM_SIZE1(type);
+  }
+
+  //! The size of one element (all channels) in bytes, e.g. 8 for CV_32FC2
+  static constexpr size_t cvMatElemSize(const int type)
+  {
+    return CV_ELEM_SIZE(type);
+  }
 
   /*!
     This static function draws a white text with a black outline on an image, 
@@ -91,13 +195,44 @@ public:
   
   /*!
     This initializes the Tutorial class member m_random_numbers. It fills the 
-	vector with random numbers.
+	vector with unique random numbers from [offset, offset + size), see sampleUnique(..)
   */
   /*!
-  /param size A constant integer that sets the amount of random numbers in the vector
+  /param size A constant integer that sets the range of the random numbers
 	/param offset A constant integer that sets the lower boundary of the random numbers, which defaults to 0
+	/param count The amount of random numbers in the vector, -1 (the default) means all of them: a shuffled range
   */
-  void initRandomIntVector(const int size, const int offset = 0);
+  void initRandomIntVector(const int size, const int offset = 0, const int count = -1);
+
+  /*!
+    Draw 'count' unique random numbers from [lower, upper), in random order.
+
+    It uses Robert Floyd's algorithm: one random number per result and a set of the
+    numbers that were chosen already, so it takes O(count) time and memory, no matter
+    how large the range is. Filling a vector with the whole range and shuffling it
+    costs O(upper - lower), even when only a few numbers are used.
+  */
+  /*!
+  /param count the amount of numbers, at most upper - lower
+  /param lower the smallest number that may be drawn
+  /param upper one more than the largest number that may be drawn
+  */
+  std::vector<int> sampleUnique(const int count, const int lower, const int upper);
+
+  /*!
+    Draw 'count' unique random pixel locations of an image of the given size, in O(count)
+  */
+  std::vector<cv::Point> samplePixels(const int count, const cv::Size &size);
+
+  /*!
+    The mean color of an image at the given locations: a cheap estimate of the mean of
+    the whole image (with a few hundred samples it's within a few gray levels)
+  */
+  /*!
+  /param image a CV_8UC1 or CV_8UC3 image
+  /param locations pixel locations, e.g. from samplePixels(..)
+  */
+  static cv::Scalar sampleMean(const cv::Mat &image, const std::vector<cv::Point> &locations);
 
   //! Getter by reference for the random integer vector m_random_numbers
   const std::vector<int> &getRandomIntVector() const
@@ -112,3 +247,83 @@ public:
   }
 };
 
+/*!
+  A pixel kept by a PixelReservoir
+*/
+struct PixelSample
+{
+  cv::Vec3b color;
+  cv::Point location;
+  //! The number of the frame it came from, counted by the reservoir
+  int64_t frame = 0;
+};
+
+//!  A fixed-size, uniform random sample of all pixels of a stream of frames
+/*!
+  Reservoir sampling: after any amount of frames, every pixel that was ever added had
+  the same chance to be in the reservoir, so statistics over the samples (the mean
+  color, a histogram) estimate the statistics over all those frames together.
+
+  It uses Li's "Algorithm L": instead of a random number per pixel, it draws how many
+  pixels to skip until the next one that goes in. Once the reservoir is full, adding a
+  frame only touches the few pixels that are taken, and the longer the stream runs, the
+  fewer that are (about capacity * pixels / seen per frame).
+*/
+class PixelReservoir
+{
+  std::vector<PixelSample> m_samples;
+  size_t m_capacity;
+  std::mt19937 m_generator;
+  std::uniform_real_distribution<double> m_uniform;
+
+  //! The amount of pixels added so far
+  int64_t m_seen;
+  //! The index (counted over all pixels) of the next pixel that goes in
+  int64_t m_next;
+  //! The current weight of Algorithm L
+  double m_weight;
+  int64_t m_frames;
+
+  //! A random number in (0, 1), never 0 because its logarithm is taken
+  double randomOpen();
+  //! Move m_next on to the next pixel to take
+  void skip();
+
+public:
+  /*!
+  /param capacity the amount of pixels to keep
+  /param seed the seed of the random generator
+  */
+  explicit PixelReservoir(const size_t capacity, const uint32_t seed = std::random_device{}());
+
+  /*!
+    Add all pixels of a frame to the stream
+  */
+  /*!
+  /param frame a CV_8UC3 image
+  */
+  void add(const cv::Mat &frame);
+
+  //! The pixels in the reservoir, in no particular order
+  const std::vector<PixelSample> &getSamples() const
+  {
+    return m_samples;
+  }
+
+  //! The mean color of the pixels in the reservoir
+  cv::Scalar mean() const;
+
+  //! The amount of pixels added so far
+  int64_t getSeen() const
+  {
+    return m_seen;
+  }
+
+  int64_t getFrames() const
+  {
+    return m_frames;
+  }
+
+  //! Empty the reservoir and start a new stream
+  void reset();
+};
@@ -0,0 +1,95 @@
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+
+#include "KernelRegistry.h"
+
+using namespace std;
+
+namespace
+{
+  struct Registry
+  {
+    mutex lock;
+    vector<KernelBase *> kernels;
+    CpuLevel max_level;
+
+    Registry() :
+      max_level(CpuFeatures::host().level())
+    {
+      // A lower level for testing, never a higher one than the CPU runs
+      const char *forced = getenv("OPENCV_TUTORIAL_CPU");
+      CpuLevel level;
+      if (forced != nullptr && parseCpuLevel(forced, level) && level < max_level)
+        max_level = level;
+    }
+  };
+
+  // Kernels register themselves while globals are constructed, so it's made on first use
+  Registry &registry()
+  {
+    static Registry instance;
+    return instance;
+  }
+}
+
+KernelBase::KernelBase(const char *name) :
+  m_name(name),
+  m_level(0)
+{
+  for (bool &has : m_has_variant)
+    has = false;
+}
+
+void KernelBase::select(const CpuLevel max_level)
+{
+  int level = (int)max_level;
+  while (level > 0 && !m_has_variant[level])
+    --level;
+  activate((CpuLevel)level);
+  m_level.store(level, memory_order_relaxed);
+}
+
+namespace KernelRegistry
+{
+  void add(KernelBase *kernel)
+  {
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    instance.kernels.push_back(kernel);
+    kernel->select(instance.max_level);
+  }
+
+  CpuLevel setMaxLevel(const CpuLevel level)
+  {
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    const CpuLevel host_level = CpuFeatures::host().level();
+    instance.max_level = level < host_level ? level : host_level;
+    for (KernelBase *kernel : instance.kernels)
+      kernel->select(instance.max_level);
+    return instance.max_level;
+  }
+
+  CpuLevel getMaxLevel()
+  {
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    return instance.max_level;
+  }
+
+  vector<KernelBase *> kernels()
+  {
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    return instance.kernels;
+  }
+
+  string describe()
+  {
+    ostringstream text;
+    for (const KernelBase *kernel : kernels())
+      text << kernel->getName() << ": " << cpuLevelName(kernel->getLevel()) << "\n";
+    return text.str();
+  }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "CpuFeatures.h"
+
+//!  The part of a Kernel the registry works with, whatever the type of its function
+class KernelBase
+{
+  const char *m_name;
+  std::atomic<int> m_level;
+
+protected:
+  bool m_has_variant[CPU_LEVEL_COUNT];
+
+  //! Make the variant of this level the one get() returns
+  virtual void activate(const CpuLevel level) = 0;
+
+public:
+  explicit KernelBase(const char *name);
+  virtual ~KernelBase() {}
+
+  const char *getName() const
+  {
+    return m_name;
+  }
+
+  //! The level of the variant in use
+  CpuLevel getLevel() const
+  {
+    return (CpuLevel)m_level.load(std::memory_order_relaxed);
+  }
+
+  bool hasVariant(const CpuLevel level) const
+  {
+    return m_has_variant[(int)level];
+  }
+
+  //! Use the best variant up to 'max_level', there is always a scalar one
+  void select(const CpuLevel max_level);
+};
+
+//!  A hot function with a variant per instruction set level, chosen at startup
+/*!
+  A binary for a fleet of different computers can't be compiled for the newest of them:
+  it would crash on the others. So a kernel is compiled once per level (see CpuLevel),
+  every variant in a file of its own with the instructions of its level, and the best
+  variant this CPU runs is picked when the program starts.
+
+  get() is one relaxed atomic load, take the function once per row or per image rather
+  than once per pixel. A variant that isn't there (nullptr) falls back to the level below.
+*/
+template<typename FUNCTION>
+class Kernel : public KernelBase
+{
+  FUNCTION m_variants[CPU_LEVEL_COUNT];
+  std::atomic<FUNCTION> m_active;
+
+  void activate(const CpuLevel level) override
+  {
+    m_active.store(m_variants[(int)level], std::memory_order_relaxed);
+  }
+
+public:
+  /*!
+  /param name the name in reports, e.g. "sad_row"
+  /param scalar the plain C++ variant, it must be there
+  /param sse41, avx2, avx512 the variants of the other levels, nullptr if there is none
+  */
+  Kernel(const char *name, const FUNCTION scalar, const FUNCTION sse41, const FUNCTION avx2, const FUNCTION avx512);
+
+  //! The variant in use
+  FUNCTION get() const
+  {
+    return m_active.load(std::memory_order_relaxed);
+  }
+
+  //! The variant of a level, nullptr if there is none (to compare them in a benchmark)
+  FUNCTION variant(const CpuLevel level) const
+  {
+    return m_variants[(int)level];
+  }
+};
+
+/*!
+  All kernels of the program. They start with the best variant for this CPU, or with the
+  level in the environment variable OPENCV_TUTORIAL_CPU (scalar, sse4.1, avx2 or avx512),
+  to test another variant without rebuilding.
+*/
+namespace KernelRegistry
+{
+  //! Called by every Kernel, it selects its variant right away
+  void add(KernelBase *kernel);
+
+  /*!
+    Force the variants of all kernels down to a level, e.g. to compare them or to test the
+    scalar code on a new CPU. Levels above what this CPU runs are lowered to what it runs.
+    Change it while no kernels are running.
+  */
+  /*!
+  /return the level that is used now
+  */
+  CpuLevel setMaxLevel(const CpuLevel level);
+
+  CpuLevel getMaxLevel();
+
+  std::vector<KernelBase *> kernels();
+
+  //! One line per kernel with the variant it uses, e.g. "sad_row: avx2"
+  std::string describe();
+}
+
+template<typename FUNCTION>
+Kernel<FUNCTION>::Kernel(const char *name, const FUNCTION scalar, const FUNCTION sse41, const FUNCTION avx2, const FUNCTION avx512) :
+  KernelBase(name),
+  m_variants{ scalar, sse41, avx2, avx512 },
+  m_active(scalar)
+{
+  for (int level = 0; level < CPU_LEVEL_COUNT; ++level)
+    m_has_variant[level] = m_variants[level] != nullptr;
+  KernelRegistry::add(this);
+}
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <limits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "LatencyHistogram.h"
+
+using namespace std;
+
+namespace
+{
+  // The index of the highest set bit, value must not be 0
+  int highestBit(uint64_t value)
+  {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+  }
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+  reset();
+}
+
+int LatencyHistogram::bucketOf(uint64_t value)
+{
+  // Small values each get their own bucket
+  if (value < (uint64_t)SUB_BUCKETS)
+    return (int)value;
+
+  const int bit = highestBit(value);
+  if (bit >= MAX_BITS)
+    return BUCKET_COUNT - 1;
+
+  // The SUB_BUCKET_BITS bits below the highest one pick the linear sub-bucket
+  const int group = bit - SUB_BUCKET_BITS + 1;
+  const int sub = (int)(value >> (bit - SUB_BUCKET_BITS)) - SUB_BUCKETS;
+  return group * SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::bucketLowerBound(const int bucket)
+{
+  if (bucket < SUB_BUCKETS)
+    return (uint64_t)bucket;
+
+  const int group = bucket / SUB_BUCKETS;
+  const int sub = bucket % SUB_BUCKETS;
+  return (uint64_t)(SUB_BUCKETS + sub) << (group - 1);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(const int bucket)
+{
+  if (bucket + 1 < BUCKET_COUNT)
+    return bucketLowerBound(bucket + 1) - 1;
+
+  // The last bucket also holds everything that is too large
+  return numeric_limits<uint64_t>::max();
+}
+
+void LatencyHistogram::record(const uint64_t nanoseconds)
+{
+  m_buckets[bucketOf(nanoseconds)].fetch_add(1, memory_order_relaxed);
+  m_count.fetch_add(1, memory_order_relaxed);
+  m_sum.fetch_add(nanoseconds, memory_order_relaxed);
+
+  // Lock-free min/max: only retry while our value is still better than the stored one
+  uint64_t current = m_min.load(memory_order_relaxed);
+  while (nanoseconds < current && !m_min.compare_exchange_weak(current, nanoseconds, memory_order_relaxed))
+  {
+  }
+  current = m_max.load(memory_order_relaxed);
+  while (nanoseconds > current && !m_max.compare_exchange_weak(current, nanoseconds, memory_order_relaxed))
+  {
+  }
+}
+
+void LatencyHistogram::reset()
+{
+  for (auto &bucket : m_buckets)
+    bucket.store(0, memory_order_relaxed);
+  m_count.store(0, memory_order_relaxed);
+  m_sum.store(0, memory_order_relaxed);
+  m_min.store(numeric_limits<uint64_t>::max(), memory_order_relaxed);
+  m_max.store(0, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::min() const
+{
+  return count() == 0 ? 0 : m_min.load(memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const
+{
+  const uint64_t n = count();
+  return n == 0 ? 0.0 : (double)sum() / n;
+}
+
+uint64_t LatencyHistogram::percentile(const double fraction) const
+{
+  const uint64_t n = count();
+  if (n == 0)
+    return 0;
+
+  // The rank of the measurement we're looking for (1 based)
+  const double clamped = std::min(1.0, std::max(0.0, fraction));
+  const uint64_t rank = std::max<uint64_t>(1, (uint64_t)(clamped * n + 0.5));
+
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+  {
+    seen += m_buckets[bucket].load(memory_order_relaxed);
+    if (seen >= rank)
+    {
+      // Never report more than what was really measured
+      return std::min(bucketUpperBound(bucket), max());
+    }
+  }
+  return max();
+}
+
+vector<pair<uint64_t, uint64_t>> LatencyHistogram::buckets() const
+{
+  vector<pair<uint64_t, uint64_t>> result;
+  for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+  {
+    const uint64_t bucket_count = m_buckets[bucket].load(memory_order_relaxed);
+    if (bucket_count != 0)
+      result.emplace_back(std::min(bucketUpperBound(bucket), max()), bucket_count);
+  }
+  return result;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+//!  A latency histogram with fixed log-linear buckets
+/*!
+  Every power of two is split in SUB_BUCKETS linear buckets, so a bucket is never
+  wider than 1/SUB_BUCKETS (about 6%) of the values in it, from 1 nanosecond up to
+  minutes. Recording a value is a few integer operations and one relaxed atomic
+  increment, so any thread may record into the same histogram without a lock.
+
+  Percentiles are read from the buckets (the highest value of the bucket the
+  percentile falls in), the minimum, maximum and mean are exact.
+*/
+class LatencyHistogram
+{
+public:
+  //! The amount of linear buckets per power of two (must be a power of two itself)
+  static const int SUB_BUCKET_BITS = 4;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  //! Values up to 2^MAX_BITS nanoseconds (about 18 minutes) get their own bucket
+  static const int MAX_BITS = 40;
+  static const int BUCKET_COUNT = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+private:
+  std::atomic<uint64_t> m_buckets[BUCKET_COUNT];
+  std::atomic<uint64_t> m_count;
+  std::atomic<uint64_t> m_sum;
+  std::atomic<uint64_t> m_min;
+  std::atomic<uint64_t> m_max;
+
+  static int bucketOf(uint64_t value);
+
+public:
+  LatencyHistogram();
+
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+  /*!
+    Add one measurement
+  */
+  /*!
+  /param nanoseconds the latency in nanoseconds
+  */
+  void record(const uint64_t nanoseconds);
+
+  //! Forget all measurements
+  void reset();
+
+  //! The amount of measurements
+  uint64_t count() const
+  {
+    return m_count.load(std::memory_order_relaxed);
+  }
+
+  //! The sum of all measurements in nanoseconds
+  uint64_t sum() const
+  {
+    return m_sum.load(std::memory_order_relaxed);
+  }
+
+  //! The smallest measurement (0 if there are none)
+  uint64_t min() const;
+
+  //! The largest measurement
+  uint64_t max() const
+  {
+    return m_max.load(std::memory_order_relaxed);
+  }
+
+  //! The average in nanoseconds
+  double mean() const;
+
+  /*!
+    The value below which the given fraction of the measurements fall
+  */
+  /*!
+  /param fraction between 0 and 1, e.g. 0.5 for the median, 0.99 for p99
+  */
+  uint64_t percentile(const double fraction) const;
+
+  /*!
+    All non-empty buckets as (highest value in nanoseconds, count) pairs, in increasing order
+  */
+  std::vector<std::pair<uint64_t, uint64_t>> buckets() const;
+
+  /*!
+    The lowest and the highest value that land in the given bucket
+  */
+  static uint64_t bucketLowerBound(const int bucket);
+  static uint64_t bucketUpperBound(const int bucket);
+};
@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+
+#include "Metrics.h"
+
+using namespace std;
+
+RateCounter::RateCounter()
+{
+  reset();
+}
+
+void RateCounter::add(const int64_t now_ns, const uint64_t events)
+{
+  const uint64_t slot = (uint64_t)(now_ns / SLOT_NANOSECONDS);
+  atomic<uint64_t> &word = m_slots[slot % SLOT_COUNT];
+
+  uint64_t current = word.load(memory_order_relaxed);
+  while (true)
+  {
+    // Still the same time slot: add to it, otherwise the old count is thrown away
+    const uint64_t count = (current >> COUNT_BITS) == slot ? (current & COUNT_MASK) + events : events;
+    const uint64_t updated = (slot << COUNT_BITS) | min<uint64_t>(count, +COUNT_MASK);
+    if (word.compare_exchange_weak(current, updated, memory_order_relaxed))
+      return;
+  }
+}
+
+double RateCounter::rate(const int64_t now_ns, const int window_slots) const
+{
+  const int window = max(1, min(window_slots, SLOT_COUNT - 1));
+  const uint64_t current_slot = (uint64_t)(now_ns / SLOT_NANOSECONDS);
+
+  uint64_t events = 0;
+  for (int i = 1; i <= window; ++i)
+  {
+    if (current_slot < (uint64_t)i)
+      break; // before the start of the clock
+    const uint64_t slot = current_slot - i;
+    const uint64_t word = m_slots[slot % SLOT_COUNT].load(memory_order_relaxed);
+    // A slot that wasn't touched in that time slot still holds an older one
+    if ((word >> COUNT_BITS) == slot)
+      events += word & COUNT_MASK;
+  }
+  return events * 1e9 / ((double)window * SLOT_NANOSECONDS);
+}
+
+void RateCounter::reset()
+{
+  // A time slot that can't come around again, so every slot reads as empty
+  for (atomic<uint64_t> &word : m_slots)
+    word.store(~0ull << COUNT_BITS, memory_order_relaxed);
+}
+
+double StageMetrics::fps(const int64_t now_ns) const
+{
+  return m_rate.rate(now_ns, Metrics::FPS_WINDOW_SLOTS);
+}
+
+Metrics::Metrics() :
+  m_start(chrono::steady_clock::now()),
+  m_exporting(false)
+{
+}
+
+Metrics::~Metrics()
+{
+  stopExport();
+}
+
+StageMetrics &Metrics::stage(const string &name)
+{
+  lock_guard<mutex> lock(m_mutex);
+  for (const unique_ptr<StageMetrics> &stage : m_stages)
+  {
+    if (stage->name() == name)
+      return *stage;
+  }
+  m_stages.emplace_back(new StageMetrics(name));
+  return *m_stages.back();
+}
+
+MetricsCounter &Metrics::counter(const string &name)
+{
+  lock_guard<mutex> lock(m_mutex);
+  for (const auto &counter : m_counters)
+  {
+    if (counter.first == name)
+      return *counter.second;
+  }
+  m_counters.emplace_back(name, unique_ptr<MetricsCounter>(new MetricsCounter(0)));
+  return *m_counters.back().second;
+}
+
+void Metrics::setGauge(const string &name, const function<double()> &read)
+{
+  lock_guard<mutex> lock(m_mutex);
+  for (auto &gauge : m_gauges)
+  {
+    if (gauge.first == name)
+    {
+      gauge.second = read;
+      return;
+    }
+  }
+  m_gauges.emplace_back(name, read);
+}
+
+void Metrics::removeGauges(const string &prefix)
+{
+  lock_guard<mutex> lock(m_mutex);
+  m_gauges.erase(remove_if(m_gauges.begin(), m_gauges.end(), [&prefix](const pair<string, function<double()>> &gauge)
+  {
+    return gauge.first.compare(0, prefix.size(), prefix) == 0;
+  }), m_gauges.end());
+}
+
+MetricsSnapshot Metrics::snapshot() const
+{
+  MetricsSnapshot snapshot;
+  const int64_t now_ns = now();
+  snapshot.time = now_ns / 1e9;
+
+  lock_guard<mutex> lock(m_mutex);
+  for (const unique_ptr<StageMetrics> &stage : m_stages)
+  {
+    const LatencyHistogram &latency = stage->latency();
+    MetricsSnapshot::Stage values;
+    values.name = stage->name();
+    values.count = (int64_t)latency.count();
+    values.fps = stage->fps(now_ns);
+    values.mean_ms = latency.mean() / 1e6;
+    values.p50_ms = latency.percentile(0.50) / 1e6;
+    values.p99_ms = latency.percentile(0.99) / 1e6;
+    values.max_ms = latency.max() / 1e6;
+    snapshot.stages.push_back(values);
+  }
+  for (const auto &counter : m_counters)
+    snapshot.counters.emplace_back(counter.first, counter.second->load(memory_order_relaxed));
+  for (const auto &gauge : m_gauges)
+    snapshot.gauges.emplace_back(gauge.first, gauge.second());
+  return snapshot;
+}
+
+void Metrics::reset()
+{
+  lock_guard<mutex> lock(m_mutex);
+  for (const unique_ptr<StageMetrics> &stage : m_stages)
+    stage->reset();
+  for (const auto &counter : m_counters)
+    counter.second->store(0, memory_order_relaxed);
+}
+
+namespace
+{
+  void writeCsv(ostream &out, const MetricsSnapshot &snapshot)
+  {
+    const double t = snapshot.time;
+    for (const MetricsSnapshot::Stage &stage : snapshot.stages)
+    {
+      out << t << "," << stage.name << ",count," << stage.count << "\n";
+      out << t << "," << stage.name << ",fps," << stage.fps << "\n";
+      out << t << "," << stage.name << ",mean_ms," << stage.mean_ms << "\n";
+      out << t << "," << stage.name << ",p50_ms," << stage.p50_ms << "\n";
+      out << t << "," << stage.name << ",p99_ms," << stage.p99_ms << "\n";
+      out << t << "," << stage.name << ",max_ms," << stage.max_ms << "\n";
+    }
+    for (const auto &counter : snapshot.counters)
+      out << t << "," << counter.first << ",count," << counter.second << "\n";
+    for (const auto &gauge : snapshot.gauges)
+      out << t << "," << gauge.first << ",value," << gauge.second << "\n";
+  }
+
+  void writeJson(ostream &out, const MetricsSnapshot &snapshot)
+  {
+    out << "{\"time\": " << snapshot.time << ", \"stages\": {";
+    for (size_t i = 0; i < snapshot.stages.size(); ++i)
+    {
+      const MetricsSnapshot::Stage &stage = snapshot.stages[i];
+      out << (i == 0 ? "" : ", ") << "\"" << stage.name << "\": {"
+        << "\"count\": " << stage.count
+        << ", \"fps\": " << stage.fps
+        << ", \"mean_ms\": " << stage.mean_ms
+        << ", \"p50_ms\": " << stage.p50_ms
+        << ", \"p99_ms\": " << stage.p99_ms
+        << ", \"max_ms\": " << stage.max_ms << "}";
+    }
+    out << "}, \"counters\": {";
+    for (size_t i = 0; i < snapshot.counters.size(); ++i)
+      out << (i == 0 ? "" : ", ") << "\"" << snapshot.counters[i].first << "\": " << snapshot.counters[i].second;
+    out << "}, \"gauges\": {";
+    for (size_t i = 0; i < snapshot.gauges.size(); ++i)
+      out << (i == 0 ? "" : ", ") << "\"" << snapshot.gauges[i].first << "\": " << snapshot.gauges[i].second;
+    out << "}}\n";
+  }
+}
+
+void Metrics::exportLoop(ostream &out, const MetricsFormat format, const chrono::milliseconds interval)
+{
+  out << fixed << setprecision(3);
+  if (format == MetricsFormat::Csv)
+    out << "time,metric,field,value\n";
+
+  unique_lock<mutex> lock(m_export_mutex);
+  bool last = false;
+  while (!last)
+  {
+    // Sleep for an interval, or until stopExport() wakes us up for the last snapshot
+    last = m_export_wakeup.wait_for(lock, interval, [this]() { return !m_exporting; });
+
+    // Don't hold the lock while writing, stopExport() may be waiting for it
+    lock.unlock();
+    const MetricsSnapshot values = snapshot();
+    if (format == MetricsFormat::Csv)
+      writeCsv(out, values);
+    else
+      writeJson(out, values);
+    out.flush();
+    lock.lock();
+  }
+}
+
+bool Metrics::startExport(const string &path, const MetricsFormat format, const chrono::milliseconds interval)
+{
+  lock_guard<mutex> lock(m_export_mutex);
+  if (m_exporting || m_export_thread.joinable())
+    return false;
+
+  shared_ptr<ofstream> out = make_shared<ofstream>(path);
+  if (!out->is_open())
+    return false;
+
+  m_exporting = true;
+  m_export_thread = thread([this, out, format, interval]()
+  {
+    exportLoop(*out, format, interval);
+  });
+  return true;
+}
+
+void Metrics::stopExport()
+{
+  {
+    lock_guard<mutex> lock(m_export_mutex);
+    m_exporting = false;
+  }
+  m_export_wakeup.notify_all();
+
+  if (m_export_thread.joinable())
+    m_export_thread.join();
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "LatencyHistogram.h"
+
+//!  Counts events in time slots, to get the rate over the last second(s)
+/*!
+  Every slot packs the number of the time slot it belongs to (upper bits) and the
+  amount of events in it (lower bits) into one 64 bit word, so counting an event
+  is one compare-and-swap, and a slot that is reused for a new time slot is reset
+  in the same operation. No lock, no thread, and nothing is lost when two threads
+  count at the same moment.
+*/
+class RateCounter
+{
+public:
+  //! The width of one time slot
+  static const int64_t SLOT_NANOSECONDS = 100 * 1000 * 1000;
+  //! The amount of slots, the longest window is one slot less than this
+  static const int SLOT_COUNT = 32;
+
+private:
+  static const int COUNT_BITS = 24;
+  static const uint64_t COUNT_MASK = (1ull << COUNT_BITS) - 1;
+
+  std::atomic<uint64_t> m_slots[SLOT_COUNT];
+
+public:
+  RateCounter();
+
+  RateCounter(const RateCounter &) = delete;
+  RateCounter &operator=(const RateCounter &) = delete;
+
+  /*!
+    Count 'events' events at the given time
+  */
+  /*!
+  /param now_ns the time in nanoseconds, see Metrics::now()
+  */
+  void add(const int64_t now_ns, const uint64_t events = 1);
+
+  /*!
+    The events per second over the last 'window_slots' complete time slots
+    (the slot that is still running is left out, so the rate doesn't jump around)
+  */
+  double rate(const int64_t now_ns, const int window_slots) const;
+
+  //! Forget all events
+  void reset();
+};
+
+/*!
+  The measurements of one stage of the frame loop (capture, a processing step, encode, ...)
+*/
+class StageMetrics
+{
+  const std::string m_name;
+  //! All durations since the last reset, for the percentiles
+  LatencyHistogram m_latency;
+  //! When the stage finished, for the rolling frames per second
+  RateCounter m_rate;
+
+public:
+  explicit StageMetrics(const std::string &name) :
+    m_name(name)
+  {
+  }
+
+  /*!
+    One frame went through this stage
+  */
+  /*!
+  /param now_ns the time the stage finished, see Metrics::now()
+  /param duration_ns how long it took
+  */
+  void record(const int64_t now_ns, const int64_t duration_ns)
+  {
+    m_latency.record(duration_ns < 0 ? 0 : (uint64_t)duration_ns);
+    m_rate.add(now_ns);
+  }
+
+  const std::string &name() const
+  {
+    return m_name;
+  }
+
+  const LatencyHistogram &latency() const
+  {
+    return m_latency;
+  }
+
+  /*!
+    The frames per second that went through this stage over the rolling window
+    (Metrics::FPS_WINDOW_SLOTS), see also Metrics::fps(..)
+  */
+  /*!
+  /param now_ns the current time, see Metrics::now()
+  */
+  double fps(const int64_t now_ns) const;
+
+  void reset()
+  {
+    m_latency.reset();
+    m_rate.reset();
+  }
+};
+
+//! A counter that only goes up, e.g. the amount of dropped frames
+typedef std::atomic<int64_t> MetricsCounter;
+
+/*!
+  The state of all metrics at one moment, see Metrics::snapshot()
+*/
+struct MetricsSnapshot
+{
+  struct Stage
+  {
+    std::string name;
+    int64_t count = 0;
+    double fps = 0;
+    double mean_ms = 0;
+    double p50_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+  };
+
+  //! Seconds since the Metrics were created
+  double time = 0;
+  std::vector<Stage> stages;
+  std::vector<std::pair<std::string, int64_t>> counters;
+  std::vector<std::pair<std::string, double>> gauges;
+};
+
+/*!
+  The file format of Metrics::startExport(..)
+*/
+enum class MetricsFormat
+{
+  Csv,  //!< one "time,metric,field,value" row per value
+  Json  //!< one JSON object per snapshot per line (JSON Lines)
+};
+
+//!  Runtime measurements of the frame loop, and a thread that writes them to a file
+/*!
+  There are three kinds of metrics:
+
+    stages:   durations and rolling frames per second (StageMetrics)
+    counters: values that only go up, like dropped frames (MetricsCounter)
+    gauges:   values that are read when a snapshot is taken, like the size of a queue
+
+  Stages and counters are looked up once by name, after that the threads of the
+  frame loop only touch atomics: recording is lock-free. The lock only protects
+  creating metrics and adding or removing gauges.
+
+  Everything that wants to show the numbers (the overlay on the video, the console,
+  a file) reads them from here, nothing is measured twice.
+*/
+class Metrics
+{
+  const std::chrono::steady_clock::time_point m_start;
+
+  mutable std::mutex m_mutex;
+  // unique_ptr, so the references that were handed out stay valid when the vectors grow
+  std::vector<std::unique_ptr<StageMetrics>> m_stages;
+  std::vector<std::pair<std::string, std::unique_ptr<MetricsCounter>>> m_counters;
+  std::vector<std::pair<std::string, std::function<double()>>> m_gauges;
+
+  std::thread m_export_thread;
+  std::mutex m_export_mutex;
+  std::condition_variable m_export_wakeup;
+  bool m_exporting;
+
+  void exportLoop(std::ostream &out, const MetricsFormat format, const std::chrono::milliseconds interval);
+
+public:
+  //! The amount of time slots the frames per second are averaged over (10 x 100ms = 1 second)
+  static const int FPS_WINDOW_SLOTS = 10;
+
+  Metrics();
+  ~Metrics();
+
+  Metrics(const Metrics &) = delete;
+  Metrics &operator=(const Metrics &) = delete;
+
+  //! Nanoseconds since the Metrics were created, the clock of all measurements
+  int64_t now() const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+  }
+
+  //! The rolling frames per second of a stage, right now
+  double fps(const StageMetrics &stage) const
+  {
+    return stage.fps(now());
+  }
+
+  /*!
+    Get the stage with the given name, it is created the first time. Keep the
+    reference instead of looking it up for every frame.
+  */
+  StageMetrics &stage(const std::string &name);
+
+  /*!
+    Get the counter with the given name, it is created (at 0) the first time
+  */
+  MetricsCounter &counter(const std::string &name);
+
+  /*!
+    Add a value that is read every time a snapshot is taken. It is read on the
+    thread that takes the snapshot, so it must be thread safe (an atomic load).
+  */
+  /*!
+  /param name the name, a gauge with the same name is replaced
+  /param read returns the current value
+  */
+  void setGauge(const std::string &name, const std::function<double()> &read);
+
+  /*!
+    Remove all gauges whose name starts with 'prefix', e.g. before the things they read disappear
+  */
+  void removeGauges(const std::string &prefix);
+
+  //! All current values
+  MetricsSnapshot snapshot() const;
+
+  //! Forget all durations, rates and counts (the gauges stay)
+  void reset();
+
+  /*!
+    Start a background thread that appends a snapshot to a file at a fixed interval.
+    The file is overwritten when the export starts.
+  */
+  /*!
+  /param path the file to write to
+  /param format CSV or JSON Lines
+  /param interval the time between two snapshots
+  returns false if an export is already running or the file can't be opened
+  */
+  bool startExport(const std::string &path, const MetricsFormat format,
+    const std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+  //! Write a last snapshot and stop the export thread
+  void stopExport();
+};
+
+typedef std::shared_ptr<Metrics> SMetrics;
+
+//!  Records the time between its construction and its destruction into a stage
+/*!
+  The stage may be null, then it does nothing: code can always time itself and
+  only pay for it when somebody is interested in the metrics.
+*/
+class StageTimer
+{
+  const Metrics *m_metrics;
+  StageMetrics *m_stage;
+  const int64_t m_start;
+
+public:
+  StageTimer(const Metrics *metrics, StageMetrics *stage) :
+    m_metrics(stage == nullptr ? nullptr : metrics),
+    m_stage(stage),
+    m_start(m_metrics == nullptr ? 0 : m_metrics->now())
+  {
+  }
+
+  ~StageTimer()
+  {
+    if (m_metrics == nullptr)
+      return;
+    const int64_t end = m_metrics->now();
+    m_stage->record(end, end - m_start);
+  }
+
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+};
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+
+#include "Helper.h"
+#include "OverlayRenderer.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  const int FONT = FONT_HERSHEY_PLAIN;
+  const int OUTLINE_THICKNESS = 2;
+  const int TEXT_THICKNESS = 1;
+  //! Room around a glyph for the outline and the anti-aliasing
+  const int PAD = 3;
+
+  //! putText computes positions in fixed point with 16 fractional bits
+  const int FIXED_SHIFT = 16;
+  const int64_t FIXED_ONE = (int64_t)1 << FIXED_SHIFT;
+  //! The sub-pixel positions glyphs are rasterized at
+  const int PHASE_SHIFT = 4;
+  const int PHASES = 1 << PHASE_SHIFT;
+
+  const int FIRST_CHAR = ' ';
+  const int LAST_CHAR = '~';
+  const int CHAR_COUNT = LAST_CHAR - FIRST_CHAR + 1;
+
+  // value / 255, rounded, exact for every value up to 255 * 255
+  inline int div255(const int value)
+  {
+    const int v = value + 128;
+    return (v + (v >> 8)) >> 8;
+  }
+
+  inline int glyphIndex(const char c)
+  {
+    const int code = (unsigned char)c;
+    if (code < FIRST_CHAR || code > LAST_CHAR)
+      return '?' - FIRST_CHAR;
+    return code - FIRST_CHAR;
+  }
+
+  // The part of 'rect' (placed at 'position') that falls inside the canvas, in canvas coordinates
+  Rect clipTo(const Rect &rect, const Point &position, const Mat &canvas)
+  {
+    return Rect(position.x, position.y, rect.width, rect.height) & Rect(0, 0, canvas.cols, canvas.rows);
+  }
+
+  // Blend 'value' into a BGR canvas with the coverage of 'source' in 'plane', placed at 'position'
+  void blendGlyph(const Mat &plane, const Rect &source, const Point &position, const int value, Mat &canvas)
+  {
+    const Rect target = clipTo(source, position, canvas);
+    for (int y = target.y; y < target.y + target.height; ++y)
+    {
+      const uchar *alpha = plane.ptr<uchar>(source.y + y - position.y) + source.x + target.x - position.x;
+      uchar *pixel = canvas.ptr<uchar>(y) + 3 * target.x;
+      for (int x = 0; x < target.width; ++x, pixel += 3)
+      {
+        const int a = alpha[x];
+        if (a == 0)
+          continue; // outside the glyph
+        pixel[0] = (uchar)div255(pixel[0] * (255 - a) + value * a);
+        pixel[1] = (uchar)div255(pixel[1] * (255 - a) + value * a);
+        pixel[2] = (uchar)div255(pixel[2] * (255 - a) + value * a);
+      }
+    }
+  }
+}
+
+OverlayRenderer::OverlayRenderer()
+{
+}
+
+OverlayRenderer::GlyphAtlas &OverlayRenderer::atlas(const double text_size)
+{
+  for (const unique_ptr<GlyphAtlas> &existing : m_atlases)
+  {
+    if (existing->text_size == text_size)
+      return *existing;
+  }
+
+  unique_ptr<GlyphAtlas> created(new GlyphAtlas());
+  GlyphAtlas &glyphs = *created;
+  glyphs.text_size = text_size;
+  glyphs.scale = cvRound(text_size * FIXED_ONE);
+  glyphs.units.resize(CHAR_COUNT);
+  glyphs.phases.resize(PHASES);
+
+  // The height of the tallest and lowest characters
+  string all_chars;
+  for (int c = FIRST_CHAR; c <= LAST_CHAR; ++c)
+    all_chars += (char)c;
+  int baseline = 0;
+  glyphs.ascent = getTextSize(all_chars, FONT, text_size, OUTLINE_THICKNESS, &baseline).height;
+  glyphs.descent = baseline;
+
+  // The advances of the Hershey font are whole font units, getTextSize only gives
+  // whole pixels: measure a long run of the same character
+  const int run = 256;
+  for (int i = 0; i < CHAR_COUNT; ++i)
+  {
+    const char c = (char)(FIRST_CHAR + i);
+    int unused = 0;
+    const int width = getTextSize(string(2 * run, c), FONT, text_size, 0, &unused).width -
+      getTextSize(string(run, c), FONT, text_size, 0, &unused).width;
+    glyphs.units[i] = cvRound(width / (run * text_size));
+  }
+
+  m_atlases.push_back(move(created));
+  return *m_atlases.back();
+}
+
+const OverlayRenderer::GlyphPhase &OverlayRenderer::phase(GlyphAtlas &glyphs, const int position)
+{
+  if (glyphs.phases[position])
+    return *glyphs.phases[position];
+
+  unique_ptr<GlyphPhase> created(new GlyphPhase());
+  GlyphPhase &glyph_phase = *created;
+  glyph_phase.rects.resize(CHAR_COUNT);
+  glyph_phase.offsets.resize(CHAR_COUNT);
+
+  /*
+  putText only takes whole pixels, a glyph lands at a fraction of a pixel when it comes
+  after other characters. So it is rasterized behind dots and spaces that add up to that
+  fraction, with the origin to the left of the cell: the dots are clipped away, and the
+  spaces keep their outlines out of the cell.
+  */
+  const int64_t target = (int64_t)position * FIXED_ONE / PHASES;
+  const int dot = glyphs.units['.' - FIRST_CHAR], space = glyphs.units[' ' - FIRST_CHAR];
+  const int min_spaces = max(1, cvCeil((PAD + 3) / (space * glyphs.text_size)));
+  int best_dots = 0, best_spaces = min_spaces;
+  int64_t best_error = FIXED_ONE;
+  for (int dots = 0; dots < 8; ++dots)
+  {
+    for (int spaces = min_spaces; spaces < min_spaces + 16; ++spaces)
+    {
+      const int64_t fraction = ((dots * dot + spaces * space) * glyphs.scale - target) & (FIXED_ONE - 1);
+      const int64_t error = min(fraction, FIXED_ONE - fraction);
+      if (error < best_error)
+      {
+        best_error = error;
+        best_dots = dots;
+        best_spaces = spaces;
+      }
+    }
+  }
+  const string prefix = string(best_dots, '.') + string(best_spaces, ' ');
+  const int64_t prefix_width = (best_dots * dot + best_spaces * space) * glyphs.scale;
+
+  // '[' and the outline reach higher than the height getTextSize gives
+  const int top_room = glyphs.ascent + glyphs.ascent / 2 + PAD;
+  const int cell_height = top_room + glyphs.descent + PAD;
+  const Point origin(PAD - (int)((prefix_width - target + FIXED_ONE / 2) >> FIXED_SHIFT), top_room);
+
+  vector<Mat> outlines(CHAR_COUNT), fills(CHAR_COUNT);
+  int atlas_width = 0;
+  for (int i = 0; i < CHAR_COUNT; ++i)
+  {
+    const string glyph = prefix + (char)(FIRST_CHAR + i);
+
+    // Rasterize the black outline and the white text the way putPrettyText did
+    const int cell_width = cvCeil(glyphs.units[i] * glyphs.text_size) + 2 * PAD + 3;
+    Mat outline = Mat::zeros(cell_height, cell_width, CV_8U);
+    Mat fill = Mat::zeros(cell_height, cell_width, CV_8U);
+    putText(outline, glyph, origin, FONT, glyphs.text_size, Scalar::all(255), OUTLINE_THICKNESS, CV_AA);
+    putText(fill, glyph, origin, FONT, glyphs.text_size, Scalar::all(255), TEXT_THICKNESS, CV_AA);
+
+    // Only keep the part of the cell that the glyph really covers
+    int top = cell_height, bottom = -1, left = cell_width, right = -1;
+    for (int y = 0; y < cell_height; ++y)
+    {
+      for (int x = 0; x < cell_width; ++x)
+      {
+        if (outline.at<uchar>(y, x) != 0 || fill.at<uchar>(y, x) != 0)
+        {
+          top = min(top, y);
+          bottom = max(bottom, y);
+          left = min(left, x);
+          right = max(right, x);
+        }
+      }
+    }
+    if (bottom < 0)
+      continue; // a space
+    const Rect used(left, top, right - left + 1, bottom - top + 1);
+    outlines[i] = outline(used);
+    fills[i] = fill(used);
+    glyph_phase.rects[i] = Rect(atlas_width, 0, used.width, used.height);
+    glyph_phase.offsets[i] = Point(used.x - PAD, used.y - top_room);
+    atlas_width += used.width;
+  }
+
+  // Put all glyphs side by side in the two planes
+  glyph_phase.outline = Mat::zeros(cell_height, max(1, atlas_width), CV_8U);
+  glyph_phase.fill = Mat::zeros(cell_height, max(1, atlas_width), CV_8U);
+  for (int i = 0; i < CHAR_COUNT; ++i)
+  {
+    if (glyph_phase.rects[i].area() == 0)
+      continue;
+    outlines[i].copyTo(glyph_phase.outline(glyph_phase.rects[i]));
+    fills[i].copyTo(glyph_phase.fill(glyph_phase.rects[i]));
+  }
+
+  glyphs.phases[position] = move(created);
+  return *glyphs.phases[position];
+}
+
+const OverlayRenderer::DiscSprite &OverlayRenderer::disc(const int radius)
+{
+  for (const unique_ptr<DiscSprite> &existing : m_discs)
+  {
+    if (existing->radius == radius)
+      return *existing;
+  }
+
+  unique_ptr<DiscSprite> created(new DiscSprite());
+  created->radius = radius;
+  // One pixel extra on every side for the anti-aliased edge
+  const int size = 2 * radius + 3;
+  created->alpha = Mat::zeros(size, size, CV_8U);
+  circle(created->alpha, Point(radius + 1, radius + 1), radius, Scalar::all(255), -1, CV_AA);
+
+  m_discs.push_back(move(created));
+  return *m_discs.back();
+}
+
+void OverlayRenderer::drawLabel(const Item &item, Mat &canvas)
+{
+  GlyphAtlas &glyphs = atlas(item.text_size);
+
+  // The pen moves in 1/65536 pixels like in putText, each glyph goes to the nearest 1/16 pixel
+  m_placed.clear();
+  int64_t pen = (int64_t)item.location.x << FIXED_SHIFT;
+  for (const char c : item.text)
+  {
+    const int index = glyphIndex(c);
+    const int64_t position = (pen * PHASES + FIXED_ONE / 2) >> FIXED_SHIFT;
+    const int whole = (int)(position >> PHASE_SHIFT);
+    const GlyphPhase &glyph_phase = phase(glyphs, (int)(position & (PHASES - 1)));
+    if (glyph_phase.rects[index].area() != 0)
+    {
+      const Point &offset = glyph_phase.offsets[index];
+      m_placed.push_back({ &glyph_phase, index, Point(whole + offset.x, item.location.y + offset.y) });
+    }
+    pen += glyphs.units[index] * glyphs.scale;
+  }
+
+  // All outlines first, so the outline of a character doesn't cover the text of the one before it
+  for (const PlacedGlyph &placed : m_placed)
+    blendGlyph(placed.phase->outline, placed.phase->rects[placed.index], placed.position, 0, canvas);
+  for (const PlacedGlyph &placed : m_placed)
+    blendGlyph(placed.phase->fill, placed.phase->rects[placed.index], placed.position, 255, canvas);
+}
+
+void OverlayRenderer::drawCircle(const Item &item, Mat &canvas)
+{
+  const DiscSprite &sprite = disc(item.radius);
+  const Point position(item.location.x - item.radius - 1, item.location.y - item.radius - 1);
+  const Rect target = clipTo(Rect(0, 0, sprite.alpha.cols, sprite.alpha.rows), position, canvas);
+  const int color[3] = { saturate_cast<uchar>(item.color[0]), saturate_cast<uchar>(item.color[1]), saturate_cast<uchar>(item.color[2]) };
+
+  for (int y = target.y; y < target.y + target.height; ++y)
+  {
+    const uchar *alpha = sprite.alpha.ptr<uchar>(y - position.y) + target.x - position.x;
+    uchar *pixel = canvas.ptr<uchar>(y) + 3 * target.x;
+    for (int x = 0; x < target.width; ++x, pixel += 3)
+    {
+      const int a = alpha[x];
+      if (a == 0)
+        continue;
+      for (int c = 0; c < 3; ++c)
+        pixel[c] = (uchar)div255(pixel[c] * (255 - a) + color[c] * a);
+    }
+  }
+}
+
+void OverlayRenderer::drawText(const string &text, const Point &location, const double text_size, Mat &canvas)
+{
+  if (canvas.type() != CV_8UC3)
+  {
+    // The atlas only knows how to blend into BGR images, do it the slow way
+    putText(canvas, text, location, FONT, text_size, Color_BLACK, OUTLINE_THICKNESS, CV_AA);
+    putText(canvas, text, location, FONT, text_size, Color_WHITE, TEXT_THICKNESS, CV_AA);
+    return;
+  }
+
+  Item item;
+  item.is_label = true;
+  item.text = text;
+  item.location = location;
+  item.text_size = text_size;
+  drawLabel(item, canvas);
+}
+
+void OverlayRenderer::addLabel(const string &text, const Point &location, const double text_size)
+{
+  Item item;
+  item.is_label = true;
+  item.text = text;
+  item.location = location;
+  item.text_size = text_size;
+  item.radius = 0;
+  m_items.push_back(item);
+}
+
+void OverlayRenderer::addCircle(const Point &center, const int radius, const Scalar &color)
+{
+  Item item;
+  item.is_label = false;
+  item.location = center;
+  item.text_size = 0;
+  item.radius = radius;
+  item.color = color;
+  m_items.push_back(item);
+}
+
+void OverlayRenderer::render(Mat &canvas)
+{
+  // In the order they were added: where items overlap, the later one is on top
+  for (const Item &item : m_items)
+  {
+    if (canvas.type() != CV_8UC3)
+    {
+      if (item.is_label)
+        drawText(item.text, item.location, item.text_size, canvas);
+      else
+        circle(canvas, item.location, item.radius, item.color, -1, CV_AA);
+    }
+    else if (item.is_label)
+      drawLabel(item, canvas);
+    else
+      drawCircle(item, canvas);
+  }
+  clear();
+}
+
+void OverlayRenderer::clear()
+{
+  m_items.clear();
+}
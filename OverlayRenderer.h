@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+//!  Draws outlined labels and dots onto frames, without rasterizing text every frame
+/*!
+  Helper::putPrettyText used to call putText twice per label per frame: a black
+  anti-aliased outline and white text on top. Here every printable character is
+  rasterized like that only once per font size and sub-pixel position, into a glyph
+  atlas with two alpha planes:
+
+    outline: the coverage of the black outline (putText with thickness 2)
+    fill:    the coverage of the white text (putText with thickness 1)
+
+  putText places the characters of a text at fractional pixel positions, so a glyph is
+  rasterized at each of the 1/16 pixel positions a label needs, the first time it needs it.
+  A label is drawn like putText draws it: first the outlines of all its characters, then
+  the fills on top, each a blend per pixel of only the rectangles of the glyphs. Filled
+  anti-aliased circles are cached the same way, as an alpha sprite per radius.
+
+  Labels and circles can be queued with addLabel(..) and addCircle(..) and then
+  drawn together with render(..), in the order they were added.
+
+  An OverlayRenderer is not thread safe, give every thread its own.
+*/
+class OverlayRenderer
+{
+  //! All glyphs of one font size at one sub-pixel position
+  struct GlyphPhase
+  {
+    //! The alpha planes of all glyphs, side by side
+    cv::Mat outline;
+    cv::Mat fill;
+    //! The part of the planes with the glyph of a character (empty for a space)
+    std::vector<cv::Rect> rects;
+    //! Where that part goes, relative to the whole pixel of the pen position on the baseline
+    std::vector<cv::Point> offsets;
+  };
+
+  //! All glyphs of one font size
+  struct GlyphAtlas
+  {
+    double text_size;
+    //! The font scale in 1/65536 pixels, the fixed point putText computes positions in
+    int64_t scale;
+    //! The height of the font above the baseline, and below it
+    int ascent;
+    int descent;
+    //! How far the pen moves after a character, in font units (of 'scale')
+    std::vector<int> units;
+    //! The glyphs per 1/16 pixel pen position, made when a label first needs them
+    std::vector<std::unique_ptr<GlyphPhase>> phases;
+  };
+
+  //! A character of a label, where drawLabel(..) blends it
+  struct PlacedGlyph
+  {
+    const GlyphPhase *phase;
+    int index;
+    cv::Point position;
+  };
+
+  //! An anti-aliased filled circle
+  struct DiscSprite
+  {
+    int radius;
+    cv::Mat alpha;
+  };
+
+  struct Item
+  {
+    bool is_label;
+    std::string text;
+    cv::Point location;
+    double text_size;
+    int radius;
+    cv::Scalar color;
+  };
+
+  std::vector<std::unique_ptr<GlyphAtlas>> m_atlases;
+  std::vector<std::unique_ptr<DiscSprite>> m_discs;
+  std::vector<Item> m_items;
+  //! The characters of the label being drawn, kept to not allocate them for every label
+  std::vector<PlacedGlyph> m_placed;
+
+  GlyphAtlas &atlas(const double text_size);
+  const GlyphPhase &phase(GlyphAtlas &glyphs, const int position);
+  const DiscSprite &disc(const int radius);
+
+  void drawLabel(const Item &item, cv::Mat &canvas);
+  void drawCircle(const Item &item, cv::Mat &canvas);
+
+public:
+  OverlayRenderer();
+
+  /*!
+    Draw a label right away: white text with a black outline, like putText(FONT_HERSHEY_PLAIN)
+    with thickness 2 in black and then with thickness 1 in white. The Benchmark checks that
+    no pixel of labels of size 0.5 to 2 is more than 8 levels off from those two calls,
+    other sizes can be a few tens of levels off on single edge pixels.
+  */
+  /*!
+  /param text the text, characters outside printable ASCII show as '?'
+  /param location the bottom-left corner of the text (on the baseline), like putText
+  /param text_size the font scale
+  /param canvas the image to draw on, a BGR image (CV_8UC3), others fall back to putText
+  */
+  void drawText(const std::string &text, const cv::Point &location, const double text_size, cv::Mat &canvas);
+
+  /*!
+    Queue a label for render(..), see drawText(..)
+  */
+  void addLabel(const std::string &text, const cv::Point &location, const double text_size);
+
+  /*!
+    Queue a filled anti-aliased circle for render(..)
+  */
+  /*!
+  /param center the center of the circle
+  /param radius the radius in pixels
+  /param color the fill color
+  */
+  void addCircle(const cv::Point &center, const int radius, const cv::Scalar &color);
+
+  /*!
+    Draw everything that was queued in the order it was added, so where items overlap
+    the one added last is on top, and empty the queue.
+  */
+  void render(cv::Mat &canvas);
+
+  //! Forget the queued items without drawing them
+  void clear();
+};
@@ -0,0 +1,68 @@
+#include <cstdlib>
+
+#include "PixelKernels.h"
+
+using namespace std;
+
+namespace
+{
+  uint64_t sadRowScalar(const uchar *a, const uchar *b, const int bytes)
+  {
+    uint64_t sum = 0;
+    for (int x = 0; x < bytes; ++x)
+      sum += abs(a[x] - b[x]);
+    return sum;
+  }
+
+  void accumulateRowScalar(const uchar *row, uint32_t *sums, const int bytes)
+  {
+    for (int x = 0; x < bytes; ++x)
+      sums[x] += row[x];
+  }
+
+  void fillBgrScalar(uchar *out, int count, const uchar *color)
+  {
+    for (; count > 0; --count, out += 3)
+    {
+      out[0] = color[0];
+      out[1] = color[1];
+      out[2] = color[2];
+    }
+  }
+}
+
+// The variants of the other levels, each in a file of its own: PixelKernelsSSE41.cpp etc.
+#ifdef CPU_X86
+namespace PixelKernelsSSE41
+{
+  uint64_t sadRow(const uchar *a, const uchar *b, const int bytes);
+  void accumulateRow(const uchar *row, uint32_t *sums, const int bytes);
+  void fillBgr(uchar *out, int count, const uchar *color);
+}
+
+namespace PixelKernelsAVX2
+{
+  uint64_t sadRow(const uchar *a, const uchar *b, const int bytes);
+  void accumulateRow(const uchar *row, uint32_t *sums, const int bytes);
+  void fillBgr(uchar *out, int count, const uchar *color);
+}
+
+namespace PixelKernelsAVX512
+{
+  uint64_t sadRow(const uchar *a, const uchar *b, const int bytes);
+  void accumulateRow(const uchar *row, uint32_t *sums, const int bytes);
+  void fillBgr(uchar *out, int count, const uchar *color);
+}
+
+#define PIXEL_KERNEL_VARIANTS(function) function##Scalar, PixelKernelsSSE41::function, \
+  PixelKernelsAVX2::function, PixelKernelsAVX512::function
+#else
+#define PIXEL_KERNEL_VARIANTS(function) function##Scalar, nullptr, nullptr, nullptr
+#endif
+
+namespace PixelKernels
+{
+  Kernel<SadRowFunction> sad_row("sad_row", PIXEL_KERNEL_VARIANTS(sadRow));
+  Kernel<AccumulateRowFunction> accumulate_row("accumulate_row", PIXEL_KERNEL_VARIANTS(accumulateRow));
+  Kernel<FillBgrFunction> fill_bgr("fill_bgr", PIXEL_KERNEL_VARIANTS(fillBgr));
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+
+#include "KernelRegistry.h"
+
+//! The SAD (sum of absolute differences) of 'bytes' bytes
+typedef uint64_t (*SadRowFunction)(const uchar *a, const uchar *b, const int bytes);
+//! Add 'bytes' bytes of a row to a row of 32 bit sums
+typedef void (*AccumulateRowFunction)(const uchar *row, uint32_t *sums, const int bytes);
+//! Fill 'count' BGR pixels with one color
+typedef void (*FillBgrFunction)(uchar *out, const int count, const uchar *color);
+
+/*!
+  The hot loops of our own filters, each with a variant per CpuLevel (see Kernel).
+  Call get() once per image and the function per row, e.g.
+
+    const SadRowFunction sad = PixelKernels::sad_row.get();
+    for (int y = 0; y < a.rows; ++y)
+      sum += sad(a.ptr(y), b.ptr(y), bytes);
+
+  All variants give exactly the same result.
+*/
+namespace PixelKernels
+{
+  //! Used by ChangeDetector
+  extern Kernel<SadRowFunction> sad_row;
+  //! Used by pixelateFlip(..) with PixelateMode::Average
+  extern Kernel<AccumulateRowFunction> accumulate_row;
+  //! Used by pixelateFlip(..) to write the blocks
+  extern Kernel<FillBgrFunction> fill_bgr;
+}
@@ -0,0 +1,92 @@
+#include <cstdlib>
+
+#include "PixelKernels.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+
+/*
+The AVX2 variants of PixelKernels, twice the width of the SSE4.1 ones. Only call them
+when CpuFeatures says avx2, the registry takes care of that. The tails use SSE, so
+short rows and small blocks don't lose against the SSE4.1 variants.
+*/
+namespace PixelKernelsAVX2
+{
+  TARGET_AVX2 uint64_t sadRow(const uchar *a, const uchar *b, const int bytes)
+  {
+    int x = 0;
+    __m256i sums = _mm256_setzero_si256();
+    for (; x + 32 <= bytes; x += 32)
+    {
+      const __m256i va = _mm256_loadu_si256((const __m256i *)(a + x));
+      const __m256i vb = _mm256_loadu_si256((const __m256i *)(b + x));
+      sums = _mm256_add_epi64(sums, _mm256_sad_epu8(va, vb));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    for (; x + 16 <= bytes; x += 16)
+    {
+      const __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+      const __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+      half = _mm_add_epi64(half, _mm_sad_epu8(va, vb));
+    }
+    // A row has far less than 2^32 / 255 bytes, so each half fits in 32 bits (also on x86)
+    uint64_t sum = (uint64_t)(uint32_t)_mm_cvtsi128_si32(half) + (uint64_t)(uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+    for (; x < bytes; ++x)
+      sum += std::abs(a[x] - b[x]);
+    return sum;
+  }
+
+  TARGET_AVX2 void accumulateRow(const uchar *row, uint32_t *sums, const int bytes)
+  {
+    int x = 0;
+    for (; x + 32 <= bytes; x += 32)
+    {
+      // Widen 8 bytes at a time straight to 32 bit
+      __m256i *acc = (__m256i *)(sums + x);
+      for (int i = 0; i < 4; ++i)
+      {
+        const __m256i wide = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + x + 8 * i)));
+        _mm256_storeu_si256(acc + i, _mm256_add_epi32(_mm256_loadu_si256(acc + i), wide));
+      }
+    }
+    for (; x < bytes; ++x)
+      sums[x] += row[x];
+  }
+
+  // 32 pixels are 96 bytes: 3 AVX registers, and the first half of them is the 16 pixel (48 byte) pattern
+  TARGET_AVX2 void fillBgr(uchar *out, int count, const uchar *color)
+  {
+    if (count >= 16)
+    {
+      uchar pattern[96];
+      for (int i = 0; i < 32; ++i)
+      {
+        pattern[3 * i + 0] = color[0];
+        pattern[3 * i + 1] = color[1];
+        pattern[3 * i + 2] = color[2];
+      }
+      const __m256i p0 = _mm256_loadu_si256((const __m256i *)(pattern + 0));
+      const __m256i p1 = _mm256_loadu_si256((const __m256i *)(pattern + 32));
+      const __m256i p2 = _mm256_loadu_si256((const __m256i *)(pattern + 64));
+      for (; count >= 32; count -= 32, out += 96)
+      {
+        _mm256_storeu_si256((__m256i *)(out + 0), p0);
+        _mm256_storeu_si256((__m256i *)(out + 32), p1);
+        _mm256_storeu_si256((__m256i *)(out + 64), p2);
+      }
+      for (; count >= 16; count -= 16, out += 48)
+      {
+        _mm_storeu_si128((__m128i *)(out + 0), _mm_loadu_si128((const __m128i *)(pattern + 0)));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_loadu_si128((const __m128i *)(pattern + 16)));
+        _mm_storeu_si128((__m128i *)(out + 32), _mm_loadu_si128((const __m128i *)(pattern + 32)));
+      }
+    }
+    for (; count > 0; --count, out += 3)
+    {
+      out[0] = color[0];
+      out[1] = color[1];
+      out[2] = color[2];
+    }
+  }
+}
+#endif
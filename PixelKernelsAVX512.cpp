@@ -0,0 +1,92 @@
+#include <cstdlib>
+
+#include "PixelKernels.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+
+/*
+The AVX-512 (F and BW) variants of PixelKernels. Only call them when CpuFeatures says
+avx512f and avx512bw, the registry takes care of that. Rows that aren't a multiple of
+64 bytes finish with a masked load instead of a scalar loop.
+*/
+namespace PixelKernelsAVX512
+{
+  TARGET_AVX512 uint64_t sadRow(const uchar *a, const uchar *b, const int bytes)
+  {
+    int x = 0;
+    __m512i sums = _mm512_setzero_si512();
+    for (; x + 64 <= bytes; x += 64)
+    {
+      const __m512i va = _mm512_loadu_si512((const void *)(a + x));
+      const __m512i vb = _mm512_loadu_si512((const void *)(b + x));
+      sums = _mm512_add_epi64(sums, _mm512_sad_epu8(va, vb));
+    }
+    if (x < bytes)
+    {
+      // The bytes past the end are loaded as 0 in both rows, their difference is 0
+      const __mmask64 tail = ~0ULL >> (64 - (bytes - x));
+      const __m512i va = _mm512_maskz_loadu_epi8(tail, (const void *)(a + x));
+      const __m512i vb = _mm512_maskz_loadu_epi8(tail, (const void *)(b + x));
+      sums = _mm512_add_epi64(sums, _mm512_sad_epu8(va, vb));
+    }
+    return (uint64_t)_mm512_reduce_add_epi64(sums);
+  }
+
+  TARGET_AVX512 void accumulateRow(const uchar *row, uint32_t *sums, const int bytes)
+  {
+    int x = 0;
+    for (; x + 64 <= bytes; x += 64)
+    {
+      // Widen 16 bytes at a time straight to 32 bit
+      for (int i = 0; i < 4; ++i)
+      {
+        const __m512i wide = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(row + x + 16 * i)));
+        uint32_t *acc = sums + x + 16 * i;
+        _mm512_storeu_si512((void *)acc, _mm512_add_epi32(_mm512_loadu_si512((const void *)acc), wide));
+      }
+    }
+    for (; x < bytes; ++x)
+      sums[x] += row[x];
+  }
+
+  // 64 pixels are 192 bytes: 3 registers. A shorter run is written with one masked store per register
+  TARGET_AVX512 void fillBgr(uchar *out, int count, const uchar *color)
+  {
+    if (count < 8)
+    {
+      for (; count > 0; --count, out += 3)
+      {
+        out[0] = color[0];
+        out[1] = color[1];
+        out[2] = color[2];
+      }
+      return;
+    }
+
+    uchar pattern[192];
+    for (int i = 0; i < 64; ++i)
+    {
+      pattern[3 * i + 0] = color[0];
+      pattern[3 * i + 1] = color[1];
+      pattern[3 * i + 2] = color[2];
+    }
+    const __m512i p0 = _mm512_loadu_si512((const void *)(pattern + 0));
+    const __m512i p1 = _mm512_loadu_si512((const void *)(pattern + 64));
+    const __m512i p2 = _mm512_loadu_si512((const void *)(pattern + 128));
+    for (; count >= 64; count -= 64, out += 192)
+    {
+      _mm512_storeu_si512((void *)(out + 0), p0);
+      _mm512_storeu_si512((void *)(out + 64), p1);
+      _mm512_storeu_si512((void *)(out + 128), p2);
+    }
+    int left = count * 3;
+    const __m512i parts[3] = { p0, p1, p2 };
+    for (int i = 0; left > 0; ++i, left -= 64, out += 64)
+    {
+      const __mmask64 mask = left >= 64 ? ~0ULL : ~0ULL >> (64 - left);
+      _mm512_mask_storeu_epi8((void *)out, mask, parts[i]);
+    }
+  }
+}
+#endif
@@ -0,0 +1,79 @@
+#include <cstdlib>
+
+#include "PixelKernels.h"
+
+#ifdef CPU_X86
+#include <smmintrin.h>
+
+/*
+The SSE4.1 variants of PixelKernels. Only call them when CpuFeatures says sse41,
+the registry takes care of that.
+*/
+namespace PixelKernelsSSE41
+{
+  TARGET_SSE41 uint64_t sadRow(const uchar *a, const uchar *b, const int bytes)
+  {
+    int x = 0;
+    // _mm_sad_epu8 sums 8 byte differences into each 64 bit half, they can't overflow
+    __m128i sums = _mm_setzero_si128();
+    for (; x + 16 <= bytes; x += 16)
+    {
+      const __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+      const __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+      sums = _mm_add_epi64(sums, _mm_sad_epu8(va, vb));
+    }
+    // A row has far less than 2^32 / 255 bytes, so each half fits in 32 bits (also on x86)
+    uint64_t sum = (uint64_t)(uint32_t)_mm_cvtsi128_si32(sums) + (uint64_t)(uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    for (; x < bytes; ++x)
+      sum += std::abs(a[x] - b[x]);
+    return sum;
+  }
+
+  TARGET_SSE41 void accumulateRow(const uchar *row, uint32_t *sums, const int bytes)
+  {
+    int x = 0;
+    for (; x + 16 <= bytes; x += 16)
+    {
+      // Widen 4 bytes at a time straight to 32 bit
+      const __m128i pixels = _mm_loadu_si128((const __m128i *)(row + x));
+      __m128i *acc = (__m128i *)(sums + x);
+      _mm_storeu_si128(acc + 0, _mm_add_epi32(_mm_loadu_si128(acc + 0), _mm_cvtepu8_epi32(pixels)));
+      _mm_storeu_si128(acc + 1, _mm_add_epi32(_mm_loadu_si128(acc + 1), _mm_cvtepu8_epi32(_mm_srli_si128(pixels, 4))));
+      _mm_storeu_si128(acc + 2, _mm_add_epi32(_mm_loadu_si128(acc + 2), _mm_cvtepu8_epi32(_mm_srli_si128(pixels, 8))));
+      _mm_storeu_si128(acc + 3, _mm_add_epi32(_mm_loadu_si128(acc + 3), _mm_cvtepu8_epi32(_mm_srli_si128(pixels, 12))));
+    }
+    for (; x < bytes; ++x)
+      sums[x] += row[x];
+  }
+
+  // 16 pixels are exactly 48 bytes, so the repeating 3 byte pattern fits in 3 registers
+  TARGET_SSE41 void fillBgr(uchar *out, int count, const uchar *color)
+  {
+    if (count >= 16)
+    {
+      uchar pattern[48];
+      for (int i = 0; i < 16; ++i)
+      {
+        pattern[3 * i + 0] = color[0];
+        pattern[3 * i + 1] = color[1];
+        pattern[3 * i + 2] = color[2];
+      }
+      const __m128i p0 = _mm_loadu_si128((const __m128i *)(pattern + 0));
+      const __m128i p1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+      const __m128i p2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+      for (; count >= 16; count -= 16, out += 48)
+      {
+        _mm_storeu_si128((__m128i *)(out + 0), p0);
+        _mm_storeu_si128((__m128i *)(out + 16), p1);
+        _mm_storeu_si128((__m128i *)(out + 32), p2);
+      }
+    }
+    for (; count > 0; --count, out += 3)
+    {
+      out[0] = color[0];
+      out[1] = color[1];
+      out[2] = color[2];
+    }
+  }
+}
+#endif
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "Pixelate.h"
+#include "PixelKernels.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  // The resize/resize/flip path, for everything the fast kernel doesn't handle
+  void pixelateFlipGeneric(const Mat &src, Mat &dst, const int block, const bool mirror)
+  {
+    if (block <= 1)
+    {
+      if (mirror)
+        flip(src, dst, 1);
+      else if (dst.data != src.data)
+        src.copyTo(dst);
+      return;
+    }
+
+    Mat small;
+    const double scale = 1 / (double)block;
+    resize(src, small, Size(), scale, scale);
+    resize(small, dst, src.size(), 0, 0, INTER_NEAREST);
+    if (mirror)
+      flip(dst, dst, 1);
+  }
+}
+
+void pixelateFlip(const Mat &src, Mat &dst, const int block, const bool mirror, const PixelateMode mode)
+{
+  if (src.type() != CV_8UC3 || block <= 1 || src.empty())
+  {
+    pixelateFlipGeneric(src, dst, block, mirror);
+    return;
+  }
+
+  // When dst is src this does nothing, which is fine: a block row only reads its own rows
+  dst.create(src.size(), src.type());
+
+  const int width = src.cols;
+  const int height = src.rows;
+  const int blocks_x = (width + block - 1) / block;
+  const int row_bytes = width * 3;
+
+  // Scratch space, kept per thread so the workers of the pipeline don't allocate per frame
+  static thread_local vector<Vec3b> colors;
+  static thread_local vector<uint32_t> sums;
+  colors.resize(blocks_x);
+  if (mode == PixelateMode::Average)
+    sums.resize(row_bytes);
+
+  // The variants of the inner loops for this CPU, see PixelKernels
+  const AccumulateRowFunction accumulateRow = PixelKernels::accumulate_row.get();
+  const FillBgrFunction fillPixels = PixelKernels::fill_bgr.get();
+
+  // resize(..) with INTER_LINEAR samples at (i + 0.5) * block - 0.5: the center pixel
+  // for an odd block, the average of the two center pixels for an even block
+  const int center = (block - 1) / 2;
+  const bool even = block % 2 == 0;
+
+  for (int y0 = 0; y0 < height; y0 += block)
+  {
+    const int y1 = std::min(y0 + block, height);
+
+    // 1. One color per block, from the rows of this block row only
+    if (mode == PixelateMode::Sample)
+    {
+      const int sy0 = std::min(y0 + center, height - 1);
+      const int sy1 = even ? std::min(sy0 + 1, height - 1) : sy0;
+      const Vec3b *row0 = src.ptr<Vec3b>(sy0);
+      const Vec3b *row1 = src.ptr<Vec3b>(sy1);
+      for (int bx = 0; bx < blocks_x; ++bx)
+      {
+        const int sx0 = std::min(bx * block + center, width - 1);
+        if (!even)
+        {
+          colors[bx] = row0[sx0];
+          continue;
+        }
+        const int sx1 = std::min(sx0 + 1, width - 1);
+        for (int c = 0; c < 3; ++c)
+          colors[bx][c] = (uchar)((row0[sx0][c] + row0[sx1][c] + row1[sx0][c] + row1[sx1][c] + 2) >> 2);
+      }
+    }
+    else
+    {
+      std::fill(sums.begin(), sums.end(), 0);
+      for (int y = y0; y < y1; ++y)
+        accumulateRow(src.ptr(y), sums.data(), row_bytes);
+
+      for (int bx = 0; bx < blocks_x; ++bx)
+      {
+        const int x0 = bx * block;
+        const int x1 = std::min(x0 + block, width);
+        const uint32_t area = (uint32_t)((x1 - x0) * (y1 - y0));
+        uint32_t total[3] = { 0, 0, 0 };
+        for (int x = x0; x < x1; ++x)
+        {
+          total[0] += sums[3 * x + 0];
+          total[1] += sums[3 * x + 1];
+          total[2] += sums[3 * x + 2];
+        }
+        for (int c = 0; c < 3; ++c)
+          colors[bx][c] = (uchar)((total[c] + area / 2) / area);
+      }
+    }
+
+    // 2. Write the first row of the block row, mirrored if asked
+    uchar *first = dst.ptr(y0);
+    for (int bx = 0; bx < blocks_x; ++bx)
+    {
+      const int x0 = bx * block;
+      const int x1 = std::min(x0 + block, width);
+      const int out_x = mirror ? width - x1 : x0;
+      fillPixels(first + 3 * out_x, x1 - x0, colors[bx].val);
+    }
+
+    // 3. The other rows of the block row are the same
+    for (int y = y0 + 1; y < y1; ++y)
+      memcpy(dst.ptr(y), first, row_bytes);
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+/*!
+  How the color of a block is chosen
+*/
+enum class PixelateMode
+{
+  /*!
+    The pixel(s) in the center of the block, exactly what resize(..) with the
+    default INTER_LINEAR picks when it scales down by the block size. Only the
+    center rows of the source are read, so this is the cheapest mode.
+  */
+  Sample,
+  //! The average of all pixels in the block, smoother but reads every pixel once
+  Average
+};
+
+/*!
+  The block (mosaic) effect of the record loop in a single pass. It replaces
+
+    resize(frame, frame, Size(), 1.0 / block, 1.0 / block);
+    resize(frame, frame, Size(), block, block, INTER_NEAREST);
+    flip(frame, frame, 1);
+
+  Per row of blocks it picks one color per block, writes the first output row
+  (mirrored if asked) and copies that row down for the rest of the block. So every
+  output pixel is written once, there are no temporary images, and the output
+  always has the size of the input (the resize pair rounds it to a multiple of block).
+
+  dst may be the same cv::Mat as src. Other types than CV_8UC3 fall back to the
+  resize/resize/flip path.
+*/
+/*!
+/param src the input image, normally a BGR frame (CV_8UC3)
+/param dst the output image, gets the size and type of src
+/param block the size of a block in pixels, 1 means no pixelation
+/param mirror also flip the image horizontally (like flip(.., .., 1))
+/param mode how the color of a block is chosen
+*/
+void pixelateFlip(const cv::Mat &src, cv::Mat &dst, const int block, const bool mirror = true,
+  const PixelateMode mode = PixelateMode::Sample);
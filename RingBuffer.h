@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+//!  A bounded, lock-free, single-producer/single-consumer ring buffer
+/*!
+  Exactly one thread may call tryPush() and exactly one (other) thread may
+  call tryPop(). Neither side ever takes a lock: the producer only writes
+  m_tail and the consumer only writes m_head, and each side publishes its
+  index with release semantics so the other side sees the slot contents
+  before it sees the new index.
+
+  The indices run freely (they are never wrapped), the slot is found by
+  masking with (capacity - 1), so the capacity is rounded up to a power of two.
+
+  Next to the queue itself, the ring keeps some occupancy counters that any
+  thread may read (they are only approximate while the queue is in use).
+*/
+template<typename T>
+class RingBuffer
+{
+  // Keep the producer and consumer indices on their own cache lines,
+  // otherwise both cores keep stealing the same line from each other.
+  // (Padding instead of alignas, because 'new' doesn't honour alignas before C++17)
+  static const size_t CACHE_LINE = 64;
+
+  std::vector<T> m_slots;
+  const size_t m_mask;
+
+  char m_padding0[CACHE_LINE];
+  std::atomic<size_t> m_head;
+  char m_padding1[CACHE_LINE];
+  std::atomic<size_t> m_tail;
+  char m_padding2[CACHE_LINE];
+
+  std::atomic<size_t> m_high_water;
+  std::atomic<size_t> m_pushed;
+  std::atomic<size_t> m_rejected;
+
+  static size_t roundUpPow2(size_t value)
+  {
+    size_t result = 1;
+    while (result < value)
+      result <<= 1;
+    return result;
+  }
+
+public:
+  /*!
+    Create a ring that can hold at least 'capacity' elements
+  */
+  /*!
+  /param capacity the minimal amount of elements, rounded up to a power of two
+  */
+  explicit RingBuffer(const size_t capacity) :
+    m_slots(roundUpPow2(capacity < 2 ? 2 : capacity)),
+    m_mask(m_slots.size() - 1),
+    m_head(0),
+    m_tail(0),
+    m_high_water(0),
+    m_pushed(0),
+    m_rejected(0)
+  {
+  }
+
+  RingBuffer(const RingBuffer &) = delete;
+  RingBuffer &operator=(const RingBuffer &) = delete;
+
+  /*!
+    Producer side. Moves the value into the ring, returns false (and leaves
+    'value' untouched) if the ring is full.
+  */
+  bool tryPush(T &value)
+  {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    if (tail - head > m_mask)
+    {
+      m_rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    m_slots[tail & m_mask] = std::move(value);
+    m_tail.store(tail + 1, std::memory_order_release);
+
+    m_pushed.fetch_add(1, std::memory_order_relaxed);
+    const size_t occupancy = tail + 1 - head;
+    if (occupancy > m_high_water.load(std::memory_order_relaxed))
+      m_high_water.store(occupancy, std::memory_order_relaxed);
+    return true;
+  }
+
+  /*!
+    Consumer side. Moves the oldest value out of the ring, returns false
+    if the ring is empty.
+  */
+  bool tryPop(T &value)
+  {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    if (head == tail)
+      return false;
+
+    value = std::move(m_slots[head & m_mask]);
+    // Don't keep the moved-from element alive (a cv::Mat would keep its buffer)
+    m_slots[head & m_mask] = T();
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  //! The amount of elements that fit in the ring
+  size_t capacity() const
+  {
+    return m_mask + 1;
+  }
+
+  //! The current amount of elements in the ring
+  size_t size() const
+  {
+    const size_t head = m_head.load(std::memory_order_acquire);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    return tail - head;
+  }
+
+  bool empty() const
+  {
+    return size() == 0;
+  }
+
+  //! The highest occupancy ever seen by the producer
+  size_t highWater() const
+  {
+    return m_high_water.load(std::memory_order_relaxed);
+  }
+
+  //! The amount of elements successfully pushed
+  size_t pushed() const
+  {
+    return m_pushed.load(std::memory_order_relaxed);
+  }
+
+  //! The amount of push attempts that found the ring full
+  size_t rejected() const
+  {
+    return m_rejected.load(std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,491 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "SharedFrameRing.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  const char SHARED_MAGIC[8] = { 'C', 'V', 'S', 'H', 'R', 'N', 'G', '1' };
+  const size_t CACHE_LINE = 64;
+
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs lock-free 64 bit atomics, other processes can't share a lock");
+
+  /*
+  The start of the shared memory. The publisher only writes 'published' and 'closed'
+  after create(..), on a cache line of their own.
+  */
+  struct SharedHeader
+  {
+    char magic[8];
+    uint32_t slot_count;
+    int32_t width;
+    int32_t height;
+    int32_t type;
+    uint64_t step;
+    //! From one slot to the next, a multiple of the cache line
+    uint64_t slot_stride;
+    uint64_t data_offset;
+    //! The process id of the publisher, to tell a ring that was left behind from a running one
+    int64_t owner;
+    alignas(CACHE_LINE) atomic<uint64_t> published;
+    atomic<uint32_t> closed;
+  };
+
+  // In front of the image of every slot, a cache line
+  struct alignas(CACHE_LINE) SlotHeader
+  {
+    //! The seqlock: 2n + 1 while frame n is written, 2n + 2 when it's complete, 0 before the first
+    atomic<uint64_t> sequence;
+    int64_t id;
+    int64_t timestamp;
+  };
+
+  size_t alignUp(const size_t bytes)
+  {
+    return (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  }
+
+  SharedHeader &headerOf(uchar *mapping)
+  {
+    return *reinterpret_cast<SharedHeader *>(mapping);
+  }
+
+  SlotHeader &slotOf(uchar *mapping, const uint64_t frame)
+  {
+    const SharedHeader &header = headerOf(mapping);
+    return *reinterpret_cast<SlotHeader *>(mapping + header.data_offset + (frame % header.slot_count) * header.slot_stride);
+  }
+
+  uchar *imageOf(uchar *mapping, const uint64_t frame)
+  {
+    return reinterpret_cast<uchar *>(&slotOf(mapping, frame)) + sizeof(SlotHeader);
+  }
+
+  uint64_t completeSequence(const uint64_t frame)
+  {
+    return 2 * frame + 2;
+  }
+
+  /*
+  Whether a mapping of 'mapping_size' bytes holds a complete ring: the magic, and a size,
+  type and layout that fit, so no frame a reader makes of a slot reaches past the slot or
+  the mapping. Divisions instead of products, a damaged header can't make them overflow.
+  */
+  bool isValid(const SharedHeader &header, const size_t mapping_size)
+  {
+    if (memcmp(header.magic, SHARED_MAGIC, sizeof(SHARED_MAGIC)) != 0)
+      return false;
+    // The rest of the header was written before the magic
+    atomic_thread_fence(memory_order_acquire);
+    if (header.slot_count < 2 || header.width <= 0 || header.height <= 0 || header.type < 0 ||
+      header.type != CV_MAT_TYPE(header.type))
+      return false;
+    const uint64_t row = (uint64_t)header.width * CV_ELEM_SIZE(header.type);
+    if (header.step < row || header.slot_stride < sizeof(SlotHeader) || header.slot_stride > mapping_size ||
+      header.data_offset < sizeof(SharedHeader) || header.data_offset > mapping_size)
+      return false;
+    // The slot headers hold atomics
+    if (header.data_offset % CACHE_LINE != 0 || header.slot_stride % CACHE_LINE != 0)
+      return false;
+    if (header.step > (header.slot_stride - sizeof(SlotHeader)) / (uint64_t)header.height)
+      return false;
+    return (mapping_size - header.data_offset) / header.slot_stride >= header.slot_count;
+  }
+
+#ifdef _WIN32
+  // Per session, like the POSIX objects are per machine for one user
+  string mappingName(const string &name)
+  {
+    return "Local\\" + name;
+  }
+#else
+  string mappingName(const string &name)
+  {
+    return "/" + name;
+  }
+
+  /*
+  Whether the ring of that name was left behind: closed by its publisher, or its publisher
+  is gone. An object that isn't a (complete) ring is never stale, it may be a publisher
+  that is making it right now.
+  */
+  bool isStale(const string &shared_name)
+  {
+    const int file = shm_open(shared_name.c_str(), O_RDONLY, 0);
+    if (file < 0)
+      return false;
+    struct stat file_stat;
+    void *mapping = MAP_FAILED;
+    if (fstat(file, &file_stat) == 0 && file_stat.st_size >= (off_t)sizeof(SharedHeader))
+      mapping = mmap(nullptr, sizeof(SharedHeader), PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+    if (mapping == MAP_FAILED)
+      return false;
+
+    const SharedHeader &header = *reinterpret_cast<const SharedHeader *>(mapping);
+    bool stale = false;
+    if (memcmp(header.magic, SHARED_MAGIC, sizeof(SHARED_MAGIC)) == 0)
+    {
+      atomic_thread_fence(memory_order_acquire);
+      // kill(.., 0) only asks: EPERM means it runs, as another user. No owner: an older
+      // publisher made it, that can't be told apart
+      const pid_t owner = (pid_t)header.owner;
+      stale = header.closed.load(memory_order_acquire) != 0 || owner <= 0 || (kill(owner, 0) != 0 && errno == ESRCH);
+    }
+    munmap(mapping, sizeof(SharedHeader));
+    return stale;
+  }
+#endif
+
+  void unmap(uchar *mapping, const size_t size, const intptr_t handle)
+  {
+#ifdef _WIN32
+    if (mapping != nullptr)
+      UnmapViewOfFile(mapping);
+    if (handle != -1)
+      CloseHandle((HANDLE)handle);
+#else
+    if (mapping != nullptr)
+      munmap(mapping, size);
+    if (handle != -1)
+      ::close((int)handle);
+#endif
+  }
+}
+
+SharedFramePublisher::SharedFramePublisher() :
+  m_mapping(nullptr),
+  m_mapping_size(0),
+  m_handle(-1),
+  m_next(0),
+  m_claimed(false)
+{
+}
+
+SharedFramePublisher::~SharedFramePublisher()
+{
+  close();
+}
+
+bool SharedFramePublisher::create(const string &name, const Size &size, const int type, const int slots, const int permissions)
+{
+  if (isOpen() || name.empty() || size.area() <= 0 || slots < 2)
+    return false;
+
+  const size_t step = alignUp((size_t)size.width * CV_ELEM_SIZE(type));
+  const size_t slot_stride = alignUp(sizeof(SlotHeader) + step * size.height);
+  const size_t data_offset = alignUp(sizeof(SharedHeader));
+  const size_t mapping_size = data_offset + slot_stride * slots;
+  const string shared_name = mappingName(name);
+
+#ifdef _WIN32
+  (void)permissions;
+  HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)mapping_size >> 32),
+    (DWORD)(mapping_size & 0xFFFFFFFF), shared_name.c_str());
+  if (mapping == nullptr)
+    return false;
+  // A mapping lives as long as a process has it open, this one is of another publisher or
+  // still open in a reader of an old one. It can't be removed from here, see the header
+  if (GetLastError() == ERROR_ALREADY_EXISTS)
+  {
+    CloseHandle(mapping);
+    return false;
+  }
+  m_mapping = (uchar *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mapping_size);
+  if (m_mapping == nullptr)
+  {
+    CloseHandle(mapping);
+    return false;
+  }
+  m_handle = (intptr_t)mapping;
+#else
+  // A new object, a ring of a running publisher is left alone. One that was left behind is
+  // removed: its readers keep the old one, and see it closed
+  int file = shm_open(shared_name.c_str(), O_CREAT | O_EXCL | O_RDWR, (mode_t)permissions);
+  if (file < 0 && errno == EEXIST && isStale(shared_name))
+  {
+    shm_unlink(shared_name.c_str());
+    file = shm_open(shared_name.c_str(), O_CREAT | O_EXCL | O_RDWR, (mode_t)permissions);
+  }
+  if (file < 0)
+    return false;
+  if (ftruncate(file, (off_t)mapping_size) != 0)
+  {
+    ::close(file);
+    shm_unlink(shared_name.c_str());
+    return false;
+  }
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (mapping == MAP_FAILED)
+  {
+    ::close(file);
+    shm_unlink(shared_name.c_str());
+    return false;
+  }
+  m_mapping = (uchar *)mapping;
+  m_handle = file;
+#endif
+  m_mapping_size = mapping_size;
+  m_name = name;
+  m_next = 0;
+  m_claimed = false;
+
+  // The memory is zeroed, the atomics are made in place
+  SharedHeader *header = new (m_mapping) SharedHeader();
+  header->slot_count = (uint32_t)slots;
+  header->width = size.width;
+  header->height = size.height;
+  header->type = type;
+  header->step = step;
+  header->slot_stride = slot_stride;
+  header->data_offset = data_offset;
+#ifdef _WIN32
+  header->owner = (int64_t)GetCurrentProcessId();
+#else
+  header->owner = (int64_t)getpid();
+#endif
+  header->published.store(0, memory_order_relaxed);
+  header->closed.store(0, memory_order_relaxed);
+  for (int slot = 0; slot < slots; ++slot)
+  {
+    SlotHeader *slot_header = new (m_mapping + data_offset + slot * slot_stride) SlotHeader();
+    slot_header->sequence.store(0, memory_order_relaxed);
+  }
+  // The magic last: a reader that opens the ring right now doesn't take it before it's complete
+  atomic_thread_fence(memory_order_release);
+  memcpy(header->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC));
+  return true;
+}
+
+Mat SharedFramePublisher::claim()
+{
+  CV_Assert(isOpen() && !m_claimed);
+  const SharedHeader &header = headerOf(m_mapping);
+  SlotHeader &slot = slotOf(m_mapping, m_next);
+
+  // Odd: readers that use the frame that was in this slot find out it's gone
+  slot.sequence.store(completeSequence(m_next) - 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  m_claimed = true;
+  return Mat(header.height, header.width, header.type, imageOf(m_mapping, m_next), (size_t)header.step);
+}
+
+void SharedFramePublisher::commit(const int64_t id, const int64_t timestamp)
+{
+  CV_Assert(isOpen() && m_claimed);
+  SharedHeader &header = headerOf(m_mapping);
+  SlotHeader &slot = slotOf(m_mapping, m_next);
+  slot.id = id;
+  slot.timestamp = timestamp;
+  slot.sequence.store(completeSequence(m_next), memory_order_release);
+  header.published.store(++m_next, memory_order_release);
+  m_claimed = false;
+}
+
+bool SharedFramePublisher::publish(const Mat &frame, const int64_t id, const int64_t timestamp)
+{
+  if (!isOpen())
+    return false;
+  const SharedHeader &header = headerOf(m_mapping);
+  if (frame.cols != header.width || frame.rows != header.height || frame.type() != header.type)
+    return false;
+
+  Mat slot = claim();
+  frame.copyTo(slot);
+  commit(id, timestamp);
+  return true;
+}
+
+void SharedFramePublisher::close()
+{
+  if (!isOpen())
+    return;
+  headerOf(m_mapping).closed.store(1, memory_order_release);
+  unmap(m_mapping, m_mapping_size, m_handle);
+#ifndef _WIN32
+  // The name is gone, the memory stays as long as a reader has it mapped
+  shm_unlink(mappingName(m_name).c_str());
+#endif
+  m_mapping = nullptr;
+  m_mapping_size = 0;
+  m_handle = -1;
+}
+
+SharedFrameReader::SharedFrameReader() :
+  m_mapping(nullptr),
+  m_mapping_size(0),
+  m_handle(-1),
+  m_next(0)
+{
+}
+
+SharedFrameReader::~SharedFrameReader()
+{
+  close();
+}
+
+bool SharedFrameReader::open(const string &name)
+{
+  if (isOpen())
+    return false;
+  const string shared_name = mappingName(name);
+
+#ifdef _WIN32
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, shared_name.c_str());
+  if (mapping == nullptr)
+    return false;
+  m_mapping = (uchar *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  MEMORY_BASIC_INFORMATION info;
+  if (m_mapping == nullptr || VirtualQuery(m_mapping, &info, sizeof(info)) == 0)
+  {
+    unmap(m_mapping, 0, (intptr_t)mapping);
+    m_mapping = nullptr;
+    return false;
+  }
+  m_mapping_size = info.RegionSize;
+  m_handle = (intptr_t)mapping;
+#else
+  const int file = shm_open(shared_name.c_str(), O_RDONLY, 0);
+  if (file < 0)
+    return false;
+  struct stat file_stat;
+  void *mapping = MAP_FAILED;
+  if (fstat(file, &file_stat) == 0 && file_stat.st_size >= (off_t)sizeof(SharedHeader))
+    mapping = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED, file, 0);
+  if (mapping == MAP_FAILED)
+  {
+    ::close(file);
+    return false;
+  }
+  m_mapping = (uchar *)mapping;
+  m_mapping_size = (size_t)file_stat.st_size;
+  m_handle = file;
+#endif
+
+  // Not a ring, not finished by its publisher yet, or smaller than it says it is
+  const SharedHeader &header = headerOf(m_mapping);
+  if (!isValid(header, m_mapping_size))
+  {
+    close();
+    return false;
+  }
+
+  const uint64_t published = header.published.load(memory_order_acquire);
+  m_next = published > 0 ? published - 1 : 0;
+  m_stats = SharedReaderStats();
+  return true;
+}
+
+void SharedFrameReader::close()
+{
+  unmap(m_mapping, m_mapping_size, m_handle);
+  m_mapping = nullptr;
+  m_mapping_size = 0;
+  m_handle = -1;
+}
+
+bool SharedFrameReader::isClosed() const
+{
+  return !isOpen() || headerOf(m_mapping).closed.load(memory_order_acquire) != 0;
+}
+
+bool SharedFrameReader::next(SharedFrame &frame)
+{
+  if (!isOpen())
+    return false;
+  const SharedHeader &header = headerOf(m_mapping);
+
+  // A few tries: the publisher may lap the slot we're about to take
+  for (int attempt = 0; attempt < 4; ++attempt)
+  {
+    const uint64_t published = header.published.load(memory_order_acquire);
+    if (m_next >= published)
+      return false;
+
+    // The slot of frame published - slots is being overwritten already, skip to the newest
+    if (published - m_next >= header.slot_count)
+    {
+      m_stats.skipped += (int64_t)(published - 1 - m_next);
+      m_next = published - 1;
+    }
+
+    SlotHeader &slot = slotOf(m_mapping, m_next);
+    const uint64_t sequence = slot.sequence.load(memory_order_acquire);
+    if (sequence != completeSequence(m_next))
+      continue;
+
+    frame.sequence = (int64_t)m_next;
+    frame.id = slot.id;
+    frame.timestamp = slot.timestamp;
+    frame.image = Mat(header.height, header.width, header.type, imageOf(m_mapping, m_next), (size_t)header.step);
+    // The id and timestamp are only valid when the slot still holds the same frame
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.sequence.load(memory_order_relaxed) != sequence)
+      continue;
+
+    ++m_next;
+    ++m_stats.received;
+    return true;
+  }
+  return false;
+}
+
+bool SharedFrameReader::isIntact(const SharedFrame &frame)
+{
+  if (!isOpen() || frame.sequence < 0)
+    return false;
+  // Every read of the image happens before the sequence is read again
+  atomic_thread_fence(memory_order_acquire);
+  const bool intact = slotOf(m_mapping, (uint64_t)frame.sequence).sequence.load(memory_order_relaxed) ==
+    completeSequence((uint64_t)frame.sequence);
+  if (!intact)
+    ++m_stats.torn;
+  return intact;
+}
+
+bool SharedFrameReader::read(Mat &image, SharedFrame &frame)
+{
+  while (next(frame))
+  {
+    frame.image.copyTo(image);
+    if (isIntact(frame))
+      return true;
+  }
+  return false;
+}
+
+int64_t SharedFrameReader::getPublished() const
+{
+  return isOpen() ? (int64_t)headerOf(m_mapping).published.load(memory_order_acquire) : 0;
+}
+
+Size SharedFrameReader::getSize() const
+{
+  return isOpen() ? Size(headerOf(m_mapping).width, headerOf(m_mapping).height) : Size();
+}
+
+int SharedFrameReader::getType() const
+{
+  return isOpen() ? headerOf(m_mapping).type : 0;
+}
+
+int SharedFrameReader::getSlotCount() const
+{
+  return isOpen() ? (int)headerOf(m_mapping).slot_count : 0;
+}
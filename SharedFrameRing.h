@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <string>
+
+/*!
+  Frames for other processes on this machine: a ring of frame slots in named shared memory.
+
+  The video file is the only other way out of the process, and whoever wants the frames
+  from it has to decode them again. A SharedFramePublisher writes every frame once into
+  a slot of the ring, any number of SharedFrameReaders in other processes map the same
+  memory read-only and look at the frames right where they are, without a copy. Readers
+  don't slow the publisher down: it never waits for them.
+
+  The memory is an object of shm_open(..) (a file mapping on Windows) of the given name:
+
+    header    size and type of the frames, the amount of slots, the frames published
+    slot 0    sequence, frame id, timestamp, then the image (rows of 'step' bytes)
+    slot 1    ...
+
+  Frame n goes into slot n % slots. The sequence of the slot is a seqlock: 2n + 1 while
+  frame n is written into it, 2n + 2 once it is complete. A reader takes the sequence,
+  uses the image and then takes the sequence again: when it is still the same, nothing
+  was written into the slot in between and what the reader saw is frame n, otherwise it
+  saw (part of) a newer frame and throws away what it did with it. That is isIntact(..).
+
+  A reader that falls more than slots - 1 frames behind skips ahead to the newest frame:
+  the older ones are being overwritten anyway, and a consumer that can't keep up is
+  better off with fresh frames than with a backlog.
+
+  Only SharedFrameRing.h and .cpp are needed in the reading process, and OpenCV core.
+*/
+
+/*!
+  A frame in the ring, from SharedFrameReader::next(..)
+*/
+struct SharedFrame
+{
+  //! A header on the slot in shared memory, read-only, valid until the slot is overwritten
+  cv::Mat image;
+  //! The number of the frame in the ring: 0, 1, 2, ... in the order of publishing
+  int64_t sequence = -1;
+  //! The id and timestamp the publisher gave it
+  int64_t id = -1;
+  int64_t timestamp = 0;
+};
+
+/*!
+  A snapshot of the counters of a SharedFrameReader
+*/
+struct SharedReaderStats
+{
+  //! Frames next(..) returned
+  int64_t received = 0;
+  //! Frames passed over because the reader was too far behind
+  int64_t skipped = 0;
+  //! Frames that were overwritten while the reader used them (isIntact(..) said no)
+  int64_t torn = 0;
+};
+
+//!  Writes frames into a shared memory ring, see above
+/*!
+  One thread publishes: claim(..) and commit(..), or publish(..), are not thread safe.
+*/
+class SharedFramePublisher
+{
+  std::string m_name;
+  uchar *m_mapping;
+  size_t m_mapping_size;
+  //! The handle of the file mapping (Windows) or the descriptor of the shared memory object
+  intptr_t m_handle;
+  uint64_t m_next;
+  bool m_claimed;
+
+public:
+  static const int DEFAULT_SLOTS = 8;
+
+  SharedFramePublisher();
+
+  //! Removes the ring, see close()
+  ~SharedFramePublisher();
+
+  SharedFramePublisher(const SharedFramePublisher &) = delete;
+  SharedFramePublisher &operator=(const SharedFramePublisher &) = delete;
+
+  /*!
+    Make the ring. While a publisher runs with a ring of that name, create(..) fails. A
+    ring that was left behind (closed, or its publisher is gone: it crashed) is removed
+    first, readers that still have it mapped keep the old one. Not on Windows: there a
+    mapping lives until the last process closes it, so while a reader still has the old
+    ring open, create(..) fails. Stop the readers, or take another name.
+  */
+  /*!
+  /param name the name of the ring, e.g. "opencv_tutorial" (no slashes)
+  /param size the size of the frames
+  /param type the type of the frames, e.g. CV_8UC3
+  /param slots the amount of frames in the ring, readers can be slots - 1 frames behind
+  /param permissions who may open it (POSIX), 0600: only this user
+  returns false if it can't be made
+  */
+  bool create(const std::string &name, const cv::Size &size, const int type, const int slots = DEFAULT_SLOTS,
+    const int permissions = 0600);
+
+  /*!
+    The slot of the next frame, to write (or process) the frame straight into shared memory.
+    Readers see it once commit(..) is called.
+  */
+  cv::Mat claim();
+
+  /*!
+    Publish the claimed slot
+  */
+  /*!
+  /param id an id for the readers, e.g. Frame::id
+  /param timestamp a timestamp for the readers, e.g. Frame::timestamp
+  */
+  void commit(const int64_t id, const int64_t timestamp);
+
+  /*!
+    Copy a frame into the next slot and publish it
+  */
+  /*!
+  returns false (and publishes nothing) if the frame doesn't have the size and type of the ring
+  */
+  bool publish(const cv::Mat &frame, const int64_t id, const int64_t timestamp);
+
+  //! Tell the readers the ring is closed and remove it
+  void close();
+
+  bool isOpen() const
+  {
+    return m_mapping != nullptr;
+  }
+
+  //! The amount of frames published
+  int64_t getPublished() const
+  {
+    return (int64_t)m_next;
+  }
+
+  const std::string &getName() const
+  {
+    return m_name;
+  }
+};
+
+typedef std::shared_ptr<SharedFramePublisher> SSharedFramePublisher;
+
+//!  Reads frames from a shared memory ring without copying them, see above
+/*!
+  A reader is used by one thread. Every reader has its own position in the ring, so
+  any number of them (in any number of processes) can read the same ring.
+*/
+class SharedFrameReader
+{
+  uchar *m_mapping;
+  size_t m_mapping_size;
+  intptr_t m_handle;
+  uint64_t m_next;
+  SharedReaderStats m_stats;
+
+public:
+  SharedFrameReader();
+  ~SharedFrameReader();
+
+  SharedFrameReader(const SharedFrameReader &) = delete;
+  SharedFrameReader &operator=(const SharedFrameReader &) = delete;
+
+  /*!
+    Map the ring of a publisher. The reader starts at the newest frame.
+  */
+  /*!
+  returns false if there is no ring of that name, or it isn't one
+  */
+  bool open(const std::string &name);
+
+  void close();
+
+  bool isOpen() const
+  {
+    return m_mapping != nullptr;
+  }
+
+  //! The publisher closed the ring, open(..) it again for the ring of a new publisher
+  bool isClosed() const;
+
+  /*!
+    The next frame, in the order of publishing (skipping ahead when too far behind).
+    Doesn't wait: returns false when there is no new frame yet.
+  */
+  /*!
+  /param frame receives a header on the slot, don't write into it
+  */
+  bool next(SharedFrame &frame);
+
+  /*!
+    Whether the frame is still in its slot: check after using the image, a frame that
+    isn't intact was (partly) overwritten by a newer one while it was used
+  */
+  bool isIntact(const SharedFrame &frame);
+
+  /*!
+    A copy of the next frame that is intact, for a consumer that keeps frames
+  */
+  /*!
+  /param image receives the copy
+  /param frame receives the sequence, id and timestamp (its image is the slot)
+  returns false when there is no new frame
+  */
+  bool read(cv::Mat &image, SharedFrame &frame);
+
+  //! The amount of frames published, the newest one is getPublished() - 1
+  int64_t getPublished() const;
+
+  cv::Size getSize() const;
+  int getType() const;
+  int getSlotCount() const;
+
+  SharedReaderStats getStats() const
+  {
+    return m_stats;
+  }
+};
+
+typedef std::shared_ptr<SharedFrameReader> SSharedFrameReader;
@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+
+#include "SnapshotService.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  int64_t nowNanoseconds()
+  {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // ".jpg" of "snapshots/image.JPG", empty if there is no extension
+  string extension(const string &path)
+  {
+    const size_t dot = path.rfind('.');
+    if (dot == string::npos || path.find_first_of("/\\", dot) != string::npos)
+      return string();
+    string result = path.substr(dot);
+    transform(result.begin(), result.end(), result.begin(), [](const char c) { return (char)tolower((unsigned char)c); });
+    return result;
+  }
+}
+
+SnapshotService::SnapshotService(const SnapshotSettings &settings, const SThreadPool &pool) :
+  m_settings(settings),
+  m_pool(pool != nullptr ? pool : make_shared<ThreadPool>(max(1, settings.threads))),
+  m_backlog(0),
+  m_tasks(0),
+  m_submitted(0),
+  m_written(0),
+  m_failed(0),
+  m_dropped(0),
+  m_high_water(0),
+  m_encode_stage(nullptr),
+  m_write_stage(nullptr)
+{
+  m_settings.queue_depth = max<size_t>(1, m_settings.queue_depth);
+}
+
+SnapshotService::~SnapshotService()
+{
+  // Every task of ours on the pool must be done, it would find the service gone
+  unique_lock<mutex> lock(m_mutex);
+  m_done.wait(lock, [this]() { return m_tasks == 0; });
+  lock.unlock();
+  setMetrics(nullptr);
+}
+
+vector<int> SnapshotService::encodeParameters(const string &path) const
+{
+  const string type = extension(path);
+  if (type == ".jpg" || type == ".jpeg")
+    return { IMWRITE_JPEG_QUALITY, m_settings.jpeg_quality };
+  if (type == ".png")
+    return { IMWRITE_PNG_COMPRESSION, m_settings.png_compression };
+  if (type == ".webp")
+    return { IMWRITE_WEBP_QUALITY, m_settings.webp_quality };
+  return vector<int>();
+}
+
+future<SnapshotResult> SnapshotService::submit(const Mat &image, const string &path)
+{
+  unique_ptr<Job> job(new Job());
+  job->image = image;
+  job->path = path;
+  return enqueue(move(job));
+}
+
+future<SnapshotResult> SnapshotService::submit(const Frame &frame, const string &path)
+{
+  unique_ptr<Job> job(new Job());
+  job->image = frame.image;
+  job->frame = frame;
+  job->path = path;
+  return enqueue(move(job));
+}
+
+future<SnapshotResult> SnapshotService::submit(const FrameView &view, const string &path)
+{
+  unique_ptr<Job> job(new Job());
+  job->image = view.image();
+  job->view = view;
+  job->path = path;
+  return enqueue(move(job));
+}
+
+future<SnapshotResult> SnapshotService::enqueue(unique_ptr<Job> job)
+{
+  future<SnapshotResult> result = job->promise.get_future();
+  job->submitted_ns = nowNanoseconds();
+  ++m_submitted;
+
+  unique_ptr<Job> dropped;
+  bool queued = false;
+  {
+    unique_lock<mutex> lock(m_mutex);
+    if (m_queue.size() >= m_settings.queue_depth)
+    {
+      switch (m_settings.overflow)
+      {
+      case SnapshotOverflow::Block:
+        m_room.wait(lock, [this]() { return m_queue.size() < m_settings.queue_depth; });
+        break;
+      case SnapshotOverflow::DropOldest:
+        dropped = move(m_queue.front());
+        m_queue.pop_front();
+        --m_backlog;
+        break;
+      default:
+        dropped = move(job);
+        break;
+      }
+    }
+
+    if (job != nullptr)
+    {
+      m_queue.push_back(move(job));
+      queued = true;
+      ++m_backlog;
+      ++m_tasks;
+      m_high_water = max<int64_t>(m_high_water, m_backlog);
+    }
+  }
+
+  if (dropped != nullptr)
+  {
+    // The snapshot that lost its place: its future is ready right away
+    SnapshotResult outcome;
+    outcome.path = dropped->path;
+    outcome.dropped = true;
+    outcome.error = "the snapshot queue is full";
+    ++m_dropped;
+    dropped->promise.set_value(outcome);
+  }
+  if (queued)
+  {
+    /*
+    One task per queued snapshot. A task takes whichever snapshot is first in the queue,
+    so after a DropOldest there is a task left over that finds nothing to do.
+    */
+    m_pool->submit([this]()
+    {
+      encodeNext();
+    });
+  }
+  return result;
+}
+
+void SnapshotService::encodeNext()
+{
+  unique_ptr<Job> job;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_queue.empty())
+    {
+      job = move(m_queue.front());
+      m_queue.pop_front();
+    }
+  }
+
+  if (job != nullptr)
+  {
+    m_room.notify_one();
+    SnapshotResult result;
+    result.path = job->path;
+
+    vector<uchar> encoded;
+    try
+    {
+      StageTimer timer(m_metrics.get(), m_encode_stage);
+      if (extension(job->path).empty())
+        result.error = "no file extension to choose a format";
+      else if (!imencode(extension(job->path), job->image, encoded, encodeParameters(job->path)))
+        result.error = "can't encode as " + extension(job->path);
+    }
+    catch (const cv::Exception &exception)
+    {
+      result.error = exception.what();
+    }
+
+    // The image isn't needed anymore, let go of (pooled) buffers before the future is ready
+    job->image.release();
+    job->frame = Frame();
+    job->view.release();
+
+    if (result.error.empty())
+    {
+      StageTimer timer(m_metrics.get(), m_write_stage);
+      ofstream file(job->path, ios::binary);
+      file.write((const char *)encoded.data(), encoded.size());
+      if (file)
+      {
+        result.written = true;
+        result.bytes = encoded.size();
+      }
+      else
+        result.error = "can't write " + job->path;
+    }
+
+    ++(result.written ? m_written : m_failed);
+    result.latency_ns = nowNanoseconds() - job->submitted_ns;
+    job->promise.set_value(result);
+  }
+
+  // Notify with the lock held: once it's released, the destructor may already be done
+  lock_guard<mutex> lock(m_mutex);
+  if (job != nullptr)
+    --m_backlog;
+  --m_tasks;
+  m_done.notify_all();
+}
+
+void SnapshotService::wait()
+{
+  unique_lock<mutex> lock(m_mutex);
+  m_done.wait(lock, [this]() { return m_backlog == 0; });
+}
+
+void SnapshotService::setMetrics(const SMetrics &metrics)
+{
+  if (m_metrics != nullptr)
+    m_metrics->removeGauges("snapshot.");
+  m_metrics = metrics;
+  m_encode_stage = nullptr;
+  m_write_stage = nullptr;
+  if (m_metrics == nullptr)
+    return;
+
+  m_encode_stage = &m_metrics->stage("snapshot.encode");
+  m_write_stage = &m_metrics->stage("snapshot.write");
+  auto addGauge = [this](const string &name, const atomic<int64_t> *counter)
+  {
+    m_metrics->setGauge("snapshot." + name, [counter]() { return (double)counter->load(memory_order_relaxed); });
+  };
+  addGauge("backlog", &m_backlog);
+  addGauge("high_water", &m_high_water);
+  addGauge("written", &m_written);
+  addGauge("failed", &m_failed);
+  addGauge("dropped", &m_dropped);
+}
+
+SnapshotStats SnapshotService::getStats()
+{
+  SnapshotStats stats;
+  stats.submitted = m_submitted;
+  stats.written = m_written;
+  stats.failed = m_failed;
+  stats.dropped = m_dropped;
+  stats.backlog = m_backlog;
+  stats.high_water = m_high_water;
+  return stats;
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <string>
+
+#include "Metrics.h"
+#include "ThreadPool.h"
+#include "Video.h"
+
+/*!
+  What SnapshotService::submit(..) does when the queue is full
+*/
+enum class SnapshotOverflow
+{
+  Block,      //!< Wait until a snapshot is taken from the queue (nothing is lost, the caller stalls)
+  DropNewest, //!< Don't take the new snapshot (the caller never waits)
+  DropOldest  //!< Throw the oldest queued snapshot away to make room (the newest ones are kept)
+};
+
+/*!
+  Settings of a SnapshotService
+*/
+struct SnapshotSettings
+{
+  //! The amount of encoding threads when the service makes its own pool
+  int threads = 2;
+  //! The amount of snapshots that can wait to be encoded
+  size_t queue_depth = 8;
+  SnapshotOverflow overflow = SnapshotOverflow::DropNewest;
+  //! The quality per format, given to imencode(..)
+  int jpeg_quality = 90;
+  //! 0 .. 9, higher is smaller but slower
+  int png_compression = 3;
+  int webp_quality = 90;
+};
+
+/*!
+  The outcome of one snapshot, from the future of SnapshotService::submit(..)
+*/
+struct SnapshotResult
+{
+  std::string path;
+  bool written = false;
+  //! Thrown away because the queue was full (see SnapshotOverflow)
+  bool dropped = false;
+  //! Why it wasn't written, empty if it was
+  std::string error;
+  //! The size of the file
+  size_t bytes = 0;
+  //! From submit(..) until the file was written, in nanoseconds
+  int64_t latency_ns = 0;
+};
+
+/*!
+  A snapshot of the counters of a SnapshotService
+*/
+struct SnapshotStats
+{
+  int64_t submitted = 0;
+  int64_t written = 0;
+  int64_t failed = 0;
+  int64_t dropped = 0;
+  //! Queued and being encoded right now
+  int64_t backlog = 0;
+  //! The largest backlog so far
+  int64_t high_water = 0;
+};
+
+//!  Encodes and writes images to files in the background
+/*!
+  imwrite(..) encodes on the calling thread: a JPEG of a large frame takes tens of
+  milliseconds, and a frame loop that saves a snapshot now and then stutters every
+  time. submit(..) only queues the image and returns a future, the encoding and the
+  file write happen on a small pool of threads.
+
+  The image isn't copied: a cv::Mat, a Frame or a FrameView shares its buffer with the
+  queued snapshot (they are reference counted), it stays alive until the snapshot is
+  written. So don't write into the image until the future is ready, or submit a clone.
+  A FrameView holds a buffer of the capture ring of its Video, the ring makes a new one
+  while it is in use.
+
+  The queue holds at most queue_depth snapshots, what happens with more is the
+  overflow policy. With setMetrics(..) the encode and write times go to the stages
+  "snapshot.encode" and "snapshot.write", the counters to the gauges "snapshot.*".
+*/
+class SnapshotService
+{
+  struct Job
+  {
+    cv::Mat image;
+    //! Keeps the pooled memory of a Frame or FrameView in use
+    Frame frame;
+    FrameView view;
+    std::string path;
+    std::promise<SnapshotResult> promise;
+    int64_t submitted_ns = 0;
+  };
+
+  SnapshotSettings m_settings;
+  SThreadPool m_pool;
+
+  std::mutex m_mutex;
+  std::condition_variable m_room;
+  std::condition_variable m_done;
+  std::deque<std::unique_ptr<Job>> m_queue;
+  //! Queued plus being encoded (changed under the mutex, atomic for the gauge)
+  std::atomic<int64_t> m_backlog;
+  //! Tasks of ours on the pool that haven't finished
+  int64_t m_tasks;
+
+  std::atomic<int64_t> m_submitted;
+  std::atomic<int64_t> m_written;
+  std::atomic<int64_t> m_failed;
+  std::atomic<int64_t> m_dropped;
+  std::atomic<int64_t> m_high_water;
+
+  SMetrics m_metrics;
+  StageMetrics *m_encode_stage;
+  StageMetrics *m_write_stage;
+
+  std::future<SnapshotResult> enqueue(std::unique_ptr<Job> job);
+  void encodeNext();
+  std::vector<int> encodeParameters(const std::string &path) const;
+
+public:
+  /*!
+  /param settings see SnapshotSettings
+  /param pool the threads that encode, nullptr: a pool of settings.threads of its own
+  */
+  explicit SnapshotService(const SnapshotSettings &settings = SnapshotSettings(), const SThreadPool &pool = nullptr);
+
+  //! Writes the snapshots that are still queued
+  ~SnapshotService();
+
+  SnapshotService(const SnapshotService &) = delete;
+  SnapshotService &operator=(const SnapshotService &) = delete;
+
+  /*!
+    Queue an image to be written to a file, the extension of the path decides the format
+    (.jpg, .png, .webp, ... like imwrite(..)). The future is ready when it is written, or
+    right away when it was dropped.
+  */
+  std::future<SnapshotResult> submit(const cv::Mat &image, const std::string &path);
+
+  //! Queue a pooled frame, see submit(const cv::Mat &, ..)
+  std::future<SnapshotResult> submit(const Frame &frame, const std::string &path);
+
+  //! Queue a frame of the capture ring of a Video, see submit(const cv::Mat &, ..)
+  std::future<SnapshotResult> submit(const FrameView &view, const std::string &path);
+
+  //! Block until every snapshot submitted so far is written (or has failed)
+  void wait();
+
+  /*!
+    Report to these metrics (see above), nullptr stops reporting. Call it while no
+    snapshots are queued: before the first submit(..) or after wait().
+  */
+  void setMetrics(const SMetrics &metrics);
+
+  SnapshotStats getStats();
+
+  const SnapshotSettings &getSettings() const
+  {
+    return m_settings;
+  }
+};
+
+typedef std::shared_ptr<SnapshotService> SSnapshotService;
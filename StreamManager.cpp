@@ -0,0 +1,160 @@
+#include <chrono>
+#include <exception>
+
+#include "StreamManager.h"
+
+using namespace cv;
+using namespace std;
+
+StreamManager::StreamManager(const SThreadPool &pool) :
+  m_pool(pool),
+  m_running(false),
+  m_active(0)
+{
+}
+
+StreamManager::~StreamManager()
+{
+  stop();
+  wait();
+}
+
+int StreamManager::addStream(const SFrameSource &source, const FrameProcessor &processor, const string &output)
+{
+  unique_ptr<Stream> stream(new Stream());
+  stream->name = output;
+  stream->video.reset(new Video(output, source));
+  stream->processor = processor;
+  m_streams.push_back(move(stream));
+  return (int)m_streams.size() - 1;
+}
+
+int StreamManager::start()
+{
+  int started = 0;
+  m_running = true;
+  for (const unique_ptr<Stream> &stream : m_streams)
+  {
+    Video &video = *stream->video;
+
+    // The output needs the frame size, so the first frame is read here already
+    video.initializeInput();
+    if (!video.getFrameSource()->isOpened() || !video.read(stream->first_frame) || stream->first_frame.empty())
+    {
+      stream->error = "can't read from " + video.getFrameSource()->describe();
+      stream->finished = true;
+      continue;
+    }
+    if (!video.initializeOutput(stream->first_frame.size()))
+    {
+      stream->error = "can't write to " + stream->name;
+      stream->finished = true;
+      continue;
+    }
+
+    ++m_active;
+    ++started;
+    schedule(*stream);
+  }
+  return started;
+}
+
+void StreamManager::schedule(Stream &stream)
+{
+  Stream *target = &stream;
+  m_pool->submit([this, target]()
+  {
+    runFrame(*target);
+  });
+}
+
+void StreamManager::runFrame(Stream &stream)
+{
+  if (!m_running)
+  {
+    finish(stream, "");
+    return;
+  }
+
+  const auto start = chrono::steady_clock::now();
+  Video &video = *stream.video;
+  try
+  {
+    // The first frame was read by start(), after that decode into pooled buffers
+    if (!stream.first_frame.empty())
+    {
+      stream.frame = Frame();
+      stream.frame.image = stream.first_frame;
+      stream.first_frame = Mat();
+    }
+    else
+    {
+      // Give the previous buffer back first, then the pool hands out that same one again
+      const Size size = stream.frame.image.size();
+      const int type = stream.frame.image.type();
+      stream.frame = Frame();
+      stream.frame = video.getFramePool().acquire(size, type);
+      if (!video.read(stream.frame.image) || stream.frame.image.empty())
+      {
+        finish(stream, "");
+        return;
+      }
+    }
+
+    if (stream.processor)
+      stream.processor(stream.frame.image);
+    video.write(stream.frame.image);
+  }
+  catch (const exception &e)
+  {
+    finish(stream, e.what());
+    return;
+  }
+
+  ++stream.frames;
+  stream.busy_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+  // At the back of the queue, behind the frames of the other streams
+  schedule(stream);
+}
+
+void StreamManager::finish(Stream &stream, const string &error)
+{
+  stream.frame = Frame();
+  const bool closed = stream.video->closeOutput();
+  stream.video->closeInput();
+
+  lock_guard<mutex> lock(m_mutex);
+  stream.error = error.empty() && !closed ? "can't write to " + stream.name : error;
+  stream.finished = true;
+  if (--m_active == 0)
+    m_done.notify_all();
+}
+
+void StreamManager::stop()
+{
+  m_running = false;
+}
+
+void StreamManager::wait()
+{
+  unique_lock<mutex> lock(m_mutex);
+  m_done.wait(lock, [this]() { return m_active == 0; });
+}
+
+vector<StreamStats> StreamManager::getStats() const
+{
+  lock_guard<mutex> lock(m_mutex);
+  vector<StreamStats> all;
+  for (const unique_ptr<Stream> &stream : m_streams)
+  {
+    StreamStats stats;
+    stats.name = stream->name;
+    stats.frames = stream->frames;
+    stats.busy_seconds = stream->busy_ns / 1e9;
+    stats.finished = stream->finished;
+    stats.error = stream->error;
+    all.push_back(stats);
+  }
+  return all;
+}
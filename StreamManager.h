@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FrameSource.h"
+#include "ThreadPool.h"
+#include "Video.h"
+
+/*!
+  A snapshot of the counters of one stream, see StreamManager::getStats()
+*/
+struct StreamStats
+{
+  std::string name;
+  int64_t frames = 0;
+  //! The time the stream spent on its frames (reading, processing and writing), in seconds
+  double busy_seconds = 0;
+  bool finished = false;
+  //! Empty, unless the stream stopped because of an error
+  std::string error;
+};
+
+//!  Runs many Videos side by side on one shared ThreadPool
+/*!
+  Every stream is a Video with its own frame source, processing step and output
+  file. The work of one frame (read, process, write) is one task on the pool.
+
+  Fairness: a stream has at most one frame in flight. When its task is done it
+  queues the task for its next frame at the back, so with more streams than cores
+  every stream gets its turn, and a slow stream can't take more than one core.
+  That also keeps the frames of a stream in order, without any locking in Video.
+
+  Isolation: an exception in the processing of one stream stops that stream only
+  (see StreamStats::error), the others keep running.
+*/
+class StreamManager
+{
+  struct Stream
+  {
+    std::string name;
+    std::unique_ptr<Video> video;
+    FrameProcessor processor;
+    //! The first frame, read when the output is opened, it must be written too
+    cv::Mat first_frame;
+    Frame frame;
+
+    std::atomic<int64_t> frames;
+    std::atomic<int64_t> busy_ns;
+    std::atomic<bool> finished;
+    std::string error;
+
+    Stream() :
+      frames(0),
+      busy_ns(0),
+      finished(false)
+    {
+    }
+  };
+
+  SThreadPool m_pool;
+  std::vector<std::unique_ptr<Stream>> m_streams;
+
+  std::atomic<bool> m_running;
+  std::atomic<int> m_active;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_done;
+
+  void schedule(Stream &stream);
+  void runFrame(Stream &stream);
+  void finish(Stream &stream, const std::string &error);
+
+public:
+  /*!
+  /param pool the pool to run the frames on, shared with whatever else uses it
+  */
+  explicit StreamManager(const SThreadPool &pool);
+
+  //! Stops all streams and closes their files
+  ~StreamManager();
+
+  StreamManager(const StreamManager &) = delete;
+  StreamManager &operator=(const StreamManager &) = delete;
+
+  /*!
+    Add a stream. Add all streams before start().
+  */
+  /*!
+  /param source where the frames come from
+  /param processor the processing step, it is called for one frame of this stream at a time
+  /param output the video file to write to
+  returns the index of the stream
+  */
+  int addStream(const SFrameSource &source, const FrameProcessor &processor, const std::string &output);
+
+  //! The Video of a stream, e.g. to set its fourcc, fps or metrics before start()
+  Video &getVideo(const int index)
+  {
+    return *m_streams[index]->video;
+  }
+
+  //! The amount of streams
+  int size() const
+  {
+    return (int)m_streams.size();
+  }
+
+  /*!
+    Open the inputs and the outputs and start running. A stream that can't be
+    opened is finished right away, with an error.
+  */
+  /*!
+  returns the amount of streams that started
+  */
+  int start();
+
+  //! Let the streams finish the frame they're working on and stop
+  void stop();
+
+  //! Block until every stream reached the end of its input (or stop() was called)
+  void wait();
+
+  //! The counters of every stream
+  std::vector<StreamStats> getStats() const;
+};
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <numeric>
+
+#include "Pixelate.h"
+#include "StripeExecutor.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  /*
+  One run(..): the stripes are claimed one by one from 'next' by the caller and the
+  helper tasks. A helper that starts after all stripes are claimed finds nothing to
+  do, so it may outlive the run, that's why the state is shared.
+  */
+  struct StripeJob
+  {
+    function<void(const int stripe)> process;
+    int count = 0;
+    atomic<int> next;
+
+    mutex done_mutex;
+    condition_variable all_done;
+    int done = 0;
+    exception_ptr error;
+
+    StripeJob() :
+      next(0)
+    {
+    }
+  };
+
+  void runStripes(StripeJob &job)
+  {
+    int processed = 0;
+    exception_ptr error;
+    for (int stripe = job.next++; stripe < job.count; stripe = job.next++)
+    {
+      try
+      {
+        job.process(stripe);
+      }
+      catch (...)
+      {
+        error = current_exception();
+      }
+      ++processed;
+    }
+    if (processed == 0)
+      return;
+
+    lock_guard<mutex> lock(job.done_mutex);
+    if (error && !job.error)
+      job.error = error;
+    job.done += processed;
+    if (job.done == job.count)
+      job.all_done.notify_all();
+  }
+}
+
+StripeExecutor::StripeExecutor(const SThreadPool &pool, const size_t stripe_bytes) :
+  m_pool(pool),
+  m_stripe_bytes(max<size_t>(1, stripe_bytes))
+{
+}
+
+int StripeExecutor::stripeRows(const size_t row_bytes, const vector<StripeFilter> &filters) const
+{
+  // The least common multiple of all alignments
+  int alignment = 1;
+  for (const StripeFilter &filter : filters)
+  {
+    const int a = max(1, filter.alignment);
+    alignment = alignment / gcd(alignment, a) * a;
+  }
+
+  const int rows = (int)max<size_t>(1, m_stripe_bytes / max<size_t>(1, row_bytes));
+  return max(alignment, rows / alignment * alignment);
+}
+
+void StripeExecutor::run(const Mat &src, Mat &dst, const vector<StripeFilter> &filters, const int type) const
+{
+  if (filters.empty())
+  {
+    if (dst.data != src.data)
+      src.copyTo(dst);
+    return;
+  }
+
+  /*
+  The rows a stripe needs above and below itself before step k. Working back from the
+  last step: every step adds its halo, and a filter with an alignment must see its band
+  start (and end) at a multiple of it, just like the stripe does.
+  */
+  vector<int> need(filters.size() + 1, 0);
+  for (size_t k = filters.size(); k-- > 0;)
+  {
+    const int alignment = max(1, filters[k].alignment);
+    const int rows_needed = need[k + 1] + max(0, filters[k].halo);
+    need[k] = (rows_needed + alignment - 1) / alignment * alignment;
+  }
+  const int halo = need[0];
+
+  /*
+  A header of its own keeps the source alive when dst is the same cv::Mat and create(..)
+  gives it a new buffer. Writing the output in place is fine for filters that stay in
+  their row, with halos a stripe would read rows that its neighbour already overwrote.
+  */
+  Mat input = src;
+  if (halo > 0 && !dst.empty() && dst.datastart == src.datastart)
+    input = src.clone();
+  dst.create(src.size(), type < 0 ? src.type() : type);
+  if (src.empty())
+    return;
+
+  const int rows = input.rows;
+  const int stripe_rows = stripeRows(input.cols * input.elemSize(), filters);
+  const int max_band_rows = stripe_rows + 2 * halo;
+
+  shared_ptr<StripeJob> job = make_shared<StripeJob>();
+  job->count = (rows + stripe_rows - 1) / stripe_rows;
+  job->process = [&](const int stripe)
+  {
+    // The output of every step, per thread, so a stripe never allocates once it runs
+    static thread_local vector<Mat> buffers;
+    if (buffers.size() < filters.size())
+      buffers.resize(filters.size());
+
+    const int y0 = stripe * stripe_rows;
+    const int y1 = min(rows, y0 + stripe_rows);
+    // The rows of the band we have, in image coordinates: the stripe and its halo
+    int b0 = max(0, y0 - need[0]);
+    int b1 = min(rows, y1 + need[0]);
+    Mat band = input.rowRange(b0, b1);
+    bool written = false;
+
+    for (size_t k = 0; k < filters.size(); ++k)
+    {
+      const StripeFilter &filter = filters[k];
+      // What we keep of this step: the rows within its halo of a cut are wrong, unless the cut is the image edge
+      const int n0 = max(0, y0 - need[k + 1]);
+      const int n1 = min(rows, y1 + need[k + 1]);
+
+      Mat out;
+      Mat &buffer = buffers[k];
+      const bool direct = k + 1 == filters.size() && n0 == b0 && n1 == b1;
+      if (direct)
+        out = dst.rowRange(b0, b1);
+      else if (buffer.rows >= band.rows && buffer.cols == band.cols)
+        out = buffer.rowRange(0, band.rows);
+
+      filter.apply(band, out, b0);
+
+      if (direct)
+      {
+        // The filter made a different type or size than dst has: it wrote a buffer of its own
+        if (out.data != dst.ptr(b0))
+        {
+          CV_Assert(out.type() == dst.type() && out.rows == b1 - b0 && out.cols == dst.cols);
+          out.copyTo(dst.rowRange(b0, b1));
+        }
+        written = true;
+      }
+      else if (out.datastart != buffer.datastart)
+      {
+        // Now we know what this step makes: from the next stripe on it writes into a buffer of ours
+        buffer.create(max_band_rows, out.cols, out.type());
+      }
+
+      band = out.rowRange(n0 - b0, n1 - b0);
+      b0 = n0;
+      b1 = n1;
+    }
+
+    if (!written)
+      band.copyTo(dst.rowRange(y0, y1));
+  };
+
+  // The caller works too, so with N helpers there are N + 1 threads on it
+  const int helpers = m_pool == nullptr ? 0 : min(m_pool->size(), job->count - 1);
+  for (int i = 0; i < helpers; ++i)
+  {
+    m_pool->submit([job]()
+    {
+      runStripes(*job);
+    });
+  }
+  runStripes(*job);
+
+  unique_lock<mutex> lock(job->done_mutex);
+  job->all_done.wait(lock, [&job]() { return job->done == job->count; });
+  if (job->error)
+    rethrow_exception(job->error);
+}
+
+namespace StripeFilters
+{
+  StripeFilter flipHorizontal()
+  {
+    StripeFilter filter;
+    filter.name = "flip";
+    filter.apply = [](const Mat &in, Mat &out, const int)
+    {
+      flip(in, out, 1);
+    };
+    return filter;
+  }
+
+  StripeFilter pixelate(const int block, const bool mirror)
+  {
+    StripeFilter filter;
+    filter.name = "pixelate";
+    filter.alignment = max(1, block);
+    filter.apply = [block, mirror](const Mat &in, Mat &out, const int)
+    {
+      pixelateFlip(in, out, block, mirror);
+    };
+    return filter;
+  }
+
+  StripeFilter convertColor(const int code)
+  {
+    StripeFilter filter;
+    filter.name = "cvtColor";
+    filter.apply = [code](const Mat &in, Mat &out, const int)
+    {
+      cvtColor(in, out, code);
+    };
+    return filter;
+  }
+
+  StripeFilter gaussianBlur(const int ksize, const double sigma)
+  {
+    StripeFilter filter;
+    filter.name = "gaussianBlur";
+    filter.halo = ksize / 2;
+    filter.apply = [ksize, sigma](const Mat &in, Mat &out, const int)
+    {
+      GaussianBlur(in, out, Size(ksize, ksize), sigma, sigma, BORDER_REPLICATE);
+    };
+    return filter;
+  }
+}
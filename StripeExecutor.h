@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+/*!
+  One step of a filter chain that runs stripe by stripe, see StripeExecutor
+*/
+struct StripeFilter
+{
+  std::string name;
+  /*!
+    Filter a band of rows. 'in' is a band of the output of the previous step (or of
+    the source image), 'out' is created by the filter with the same amount of rows.
+    'y' is the image row of the first row of the band, for anything that draws at
+    image coordinates. The band is treated as if it were the whole image: at its top
+    and bottom the filter uses its normal border handling.
+  */
+  std::function<void(const cv::Mat &in, cv::Mat &out, const int y)> apply;
+  /*!
+    The amount of neighbouring rows above and below that the filter reads for one output
+    row: 0 for anything that works per row (flip, cvtColor, a horizontal filter), the
+    kernel radius for a vertical or 2D filter.
+  */
+  int halo = 0;
+  /*!
+    Stripes start at a multiple of this many rows, for filters that work on fixed
+    blocks of rows, like the pixelation
+  */
+  int alignment = 1;
+};
+
+//!  Runs a chain of filters over horizontal stripes of a frame, in parallel
+/*!
+  A frame of 4K is 24 MB, so a chain of whole-frame filters streams it from memory
+  once per filter. Here the frame is cut into stripes of a few hundred KB and every
+  stripe goes through the whole chain while it is still in the L2 cache of the core
+  that works on it: memory only sees one read and one write per pixel.
+
+  The stripes are shared out dynamically over the threads of a ThreadPool and the
+  calling thread, so a slow stripe doesn't hold up a fixed share of the work.
+
+  A filter with a halo needs rows of the stripes next to it. Those are computed twice:
+  a stripe starts with as many extra rows above and below as all halos of the chain
+  together, and every step uses up its own halo of them. Rows beyond the edges of the
+  image don't exist, so there the filters use their normal border handling and the
+  result is the same as running the chain on the whole frame.
+
+  Filters that move pixels between rows (a vertical flip, a rotation, a resize) can't
+  run on stripes.
+*/
+class StripeExecutor
+{
+  SThreadPool m_pool;
+  size_t m_stripe_bytes;
+
+public:
+  //! The default size of a stripe: fits with its scratch copy in a 512 KB L2 cache
+  static const size_t DEFAULT_STRIPE_BYTES = 192 * 1024;
+
+  /*!
+  /param pool the threads that help the caller, nullptr: the caller does all stripes itself
+  /param stripe_bytes the size of a stripe of the source image, rounded to whole rows
+  */
+  explicit StripeExecutor(const SThreadPool &pool, const size_t stripe_bytes = DEFAULT_STRIPE_BYTES);
+
+  /*!
+    Run the filters over src into dst, returns when all stripes are done. It may be
+    called from several threads at once, and from a task on the pool itself.
+  */
+  /*!
+  /param src the input frame
+  /param dst receives the output, it may be src (then a chain with halos works on a copy of src)
+  /param filters the chain, in order
+  /param type the type of the output, -1: the type of src
+  */
+  void run(const cv::Mat &src, cv::Mat &dst, const std::vector<StripeFilter> &filters, const int type = -1) const;
+
+  /*!
+    The amount of rows per stripe for a frame with rows of 'row_bytes' and the given
+    chain: around the stripe size, at least 1, rounded to the alignment of every filter
+  */
+  int stripeRows(const size_t row_bytes, const std::vector<StripeFilter> &filters) const;
+
+  const SThreadPool &getPool() const
+  {
+    return m_pool;
+  }
+};
+
+typedef std::shared_ptr<StripeExecutor> SStripeExecutor;
+
+/*!
+  Some common steps for a StripeExecutor
+*/
+namespace StripeFilters
+{
+  //! Mirror every row, like flip(.., .., 1)
+  StripeFilter flipHorizontal();
+
+  //! pixelateFlip(..) (see Pixelate.h), the stripes are aligned to the block size
+  StripeFilter pixelate(const int block, const bool mirror = true);
+
+  //! cvtColor(..) with the given conversion code (give run(..) the type of the result)
+  StripeFilter convertColor(const int code);
+
+  //! GaussianBlur(..) with a kernel of ksize x ksize (odd), its halo is ksize / 2
+  StripeFilter gaussianBlur(const int ksize, const double sigma = 0);
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <chrono>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+namespace
+{
+  // Which pool and which worker the current thread belongs to, for submit(..) from a task
+  thread_local const ThreadPool *current_pool = nullptr;
+  thread_local int current_index = -1;
+}
+
+ThreadPool::ThreadPool(const int threads) :
+  m_running(true),
+  m_queued(0),
+  m_unfinished(0),
+  m_next_worker(0),
+  m_executed(0),
+  m_stolen(0)
+{
+  const int count = threads > 0 ? threads : max(1, (int)thread::hardware_concurrency());
+
+  // First create all queues, a worker may try to steal from any of them right away
+  for (int i = 0; i < count; ++i)
+    m_workers.emplace_back(new Worker());
+  for (int i = 0; i < count; ++i)
+    m_workers[i]->thread = thread(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+  try
+  {
+    wait();
+  }
+  catch (...)
+  {
+    // Nobody is left to tell
+  }
+
+  {
+    lock_guard<mutex> lock(m_sleep_mutex);
+    m_running = false;
+  }
+  m_wakeup.notify_all();
+
+  for (const unique_ptr<Worker> &worker : m_workers)
+  {
+    if (worker->thread.joinable())
+      worker->thread.join();
+  }
+}
+
+int ThreadPool::currentWorker() const
+{
+  return current_pool == this ? current_index : -1;
+}
+
+void ThreadPool::submit(Task task)
+{
+  // From a worker: keep it local (the data it works on is probably still in this core's cache)
+  int index = currentWorker();
+  if (index < 0)
+    index = (int)(m_next_worker++ % m_workers.size());
+
+  ++m_unfinished;
+  {
+    Worker &worker = *m_workers[index];
+    lock_guard<mutex> lock(worker.mutex);
+    worker.tasks.push_back(move(task));
+  }
+
+  // Take the sleep lock, so a worker that just found nothing can't miss the wakeup
+  {
+    lock_guard<mutex> lock(m_sleep_mutex);
+    ++m_queued;
+  }
+  m_wakeup.notify_one();
+}
+
+bool ThreadPool::takeTask(const int index, Task &task)
+{
+  // Our own queue first, oldest task first
+  {
+    Worker &own = *m_workers[index];
+    lock_guard<mutex> lock(own.mutex);
+    if (!own.tasks.empty())
+    {
+      task = move(own.tasks.front());
+      own.tasks.pop_front();
+      --m_queued;
+      return true;
+    }
+  }
+
+  // Then steal from the others, starting with the next one so not everybody robs worker 0
+  const int count = (int)m_workers.size();
+  for (int i = 1; i < count; ++i)
+  {
+    Worker &victim = *m_workers[(index + i) % count];
+    lock_guard<mutex> lock(victim.mutex);
+    if (!victim.tasks.empty())
+    {
+      task = move(victim.tasks.back());
+      victim.tasks.pop_back();
+      --m_queued;
+      ++m_stolen;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::workerLoop(const int index)
+{
+  current_pool = this;
+  current_index = index;
+
+  Task task;
+  while (true)
+  {
+    if (takeTask(index, task))
+    {
+      try
+      {
+        task();
+      }
+      catch (...)
+      {
+        // A task that throws mustn't take the worker (and the process) down, wait() rethrows it
+        lock_guard<mutex> lock(m_sleep_mutex);
+        if (!m_error)
+          m_error = current_exception();
+      }
+      task = nullptr; // release what the task holds before we go to sleep
+      ++m_executed;
+
+      if (--m_unfinished == 0)
+      {
+        lock_guard<mutex> lock(m_sleep_mutex);
+        m_idle.notify_all();
+      }
+      continue;
+    }
+
+    // Nothing anywhere: sleep until something is submitted
+    unique_lock<mutex> lock(m_sleep_mutex);
+    m_wakeup.wait(lock, [this]() { return m_queued > 0 || !m_running; });
+    if (!m_running && m_queued == 0)
+      break;
+  }
+}
+
+void ThreadPool::wait()
+{
+  unique_lock<mutex> lock(m_sleep_mutex);
+  m_idle.wait(lock, [this]() { return m_unfinished == 0; });
+  if (m_error)
+  {
+    exception_ptr error = m_error;
+    m_error = nullptr;
+    rethrow_exception(error);
+  }
+}
+
+ThreadPoolStats ThreadPool::getStats() const
+{
+  ThreadPoolStats stats;
+  stats.threads = size();
+  stats.executed = m_executed;
+  stats.stolen = m_stolen;
+  return stats;
+}
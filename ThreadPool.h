@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+  A snapshot of the counters of a ThreadPool
+*/
+struct ThreadPoolStats
+{
+  int threads = 0;
+  //! Tasks run in total
+  int64_t executed = 0;
+  //! Tasks a worker took from the queue of another worker
+  int64_t stolen = 0;
+};
+
+//!  A fixed set of worker threads with a task queue per worker and work stealing
+/*!
+  Every worker has its own queue, so workers don't fight over one lock. A task
+  submitted from a worker goes into that worker's own queue, a task submitted
+  from outside is dealt out round-robin. A worker takes tasks from the front of its
+  own queue (oldest first, so a task that submits a follow-up of itself can't
+  starve the tasks queued before it) and when its queue is empty, it steals from
+  the back of the queue of another worker.
+
+  Idle workers sleep on a condition variable, so an idle pool uses no CPU.
+*/
+class ThreadPool
+{
+public:
+  typedef std::function<void()> Task;
+
+private:
+  struct Worker
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<Worker>> m_workers;
+
+  std::atomic<bool> m_running;
+  //! Tasks that are queued but not taken yet
+  std::atomic<int64_t> m_queued;
+  //! Tasks that are queued or running, for wait()
+  std::atomic<int64_t> m_unfinished;
+  std::atomic<uint32_t> m_next_worker;
+
+  std::atomic<int64_t> m_executed;
+  std::atomic<int64_t> m_stolen;
+
+  std::mutex m_sleep_mutex;
+  std::condition_variable m_wakeup;
+  std::condition_variable m_idle;
+  //! The first exception a task threw since the last wait(), under m_sleep_mutex
+  std::exception_ptr m_error;
+
+  void workerLoop(const int index);
+  bool takeTask(const int index, Task &task);
+
+public:
+  /*!
+    Start the workers
+  */
+  /*!
+  /param threads the amount of worker threads, 0 means one per core
+  */
+  explicit ThreadPool(const int threads = 0);
+
+  //! Runs the tasks that are still queued, then stops the workers (an exception of a task is dropped)
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /*!
+    Queue a task. It may run on any worker, at any time from now on.
+  */
+  void submit(Task task);
+
+  /*!
+    Block until every task that was submitted (and the tasks those submitted) has finished.
+    If a task threw, the other tasks still ran and wait() rethrows the first exception.
+  */
+  void wait();
+
+  //! The amount of worker threads
+  int size() const
+  {
+    return (int)m_workers.size();
+  }
+
+  /*!
+    The index of the worker that runs the calling code, or -1 if it is not a worker of this pool
+  */
+  int currentWorker() const;
+
+  //! The counters, see ThreadPoolStats
+  ThreadPoolStats getStats() const;
+};
+
+typedef std::shared_ptr<ThreadPool> SThreadPool;
@@ -0,0 +1,179 @@
+#include <cstring>
+
+#include "TileCompression.h"
+
+using namespace std;
+
+namespace
+{
+  const int MIN_MATCH = 4;
+  const size_t MAX_OFFSET = 65535;
+  const int HASH_BITS = 13;
+
+  inline uint32_t read32(const uint8_t *p)
+  {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  // Knuth's multiplicative hash of 4 bytes
+  inline uint32_t hash4(const uint32_t value)
+  {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+  }
+
+  // Writes the extra bytes of a length that didn't fit in its nibble
+  inline bool writeLength(size_t length, uint8_t *&out, const uint8_t *end)
+  {
+    for (; length >= 255; length -= 255)
+    {
+      if (out >= end)
+        return false;
+      *out++ = 255;
+    }
+    if (out >= end)
+      return false;
+    *out++ = (uint8_t)length;
+    return true;
+  }
+
+  inline bool readLength(size_t &length, const uint8_t *&in, const uint8_t *end)
+  {
+    uint8_t byte;
+    do
+    {
+      if (in >= end)
+        return false;
+      byte = *in++;
+      length += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  // One sequence: the literals from 'literals' up to the match, then the match (if any)
+  bool writeSequence(const uint8_t *literals, const size_t literal_count, const size_t offset, const size_t match_length,
+    uint8_t *&out, const uint8_t *end)
+  {
+    if (out >= end)
+      return false;
+    uint8_t *token = out++;
+    *token = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15 && !writeLength(literal_count - 15, out, end))
+      return false;
+
+    if ((size_t)(end - out) < literal_count)
+      return false;
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+
+    if (match_length == 0)
+      return true; // the last sequence
+
+    if (end - out < 2)
+      return false;
+    out[0] = (uint8_t)(offset & 0xFF);
+    out[1] = (uint8_t)(offset >> 8);
+    out += 2;
+
+    const size_t length = match_length - MIN_MATCH;
+    *token |= (uint8_t)(length < 15 ? length : 15);
+    return length < 15 || writeLength(length - 15, out, end);
+  }
+}
+
+size_t maxCompressedTileSize(const size_t size)
+{
+  // A token plus one length byte per 255 literals, in the worst case all is literal
+  return size + size / 255 + 16;
+}
+
+size_t compressTile(const uint8_t *source, const size_t size, uint8_t *destination, const size_t capacity)
+{
+  // The last position we found every hash at (+1, so 0 means 'never')
+  uint32_t table[1 << HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  uint8_t *out = destination;
+  const uint8_t *end = destination + capacity;
+  size_t anchor = 0;
+  size_t position = 0;
+
+  while (position + MIN_MATCH <= size)
+  {
+    const uint32_t sequence = read32(source + position);
+    uint32_t &slot = table[hash4(sequence)];
+    const size_t candidate = slot;
+    slot = (uint32_t)(position + 1);
+
+    if (candidate != 0 && position - (candidate - 1) <= MAX_OFFSET && read32(source + candidate - 1) == sequence)
+    {
+      // Extend the match as far as it goes (it may overlap the bytes it produces, that's a run)
+      const size_t match = candidate - 1;
+      size_t length = MIN_MATCH;
+      while (position + length < size && source[match + length] == source[position + length])
+        ++length;
+
+      if (!writeSequence(source + anchor, position - anchor, position - match, length, out, end))
+        return 0;
+      position += length;
+      anchor = position;
+      continue;
+    }
+
+    // Nothing found: skip ahead faster the longer we don't find anything, incompressible
+    // data (camera noise) then costs hardly any time
+    position += 1 + ((position - anchor) >> 6);
+  }
+
+  if (!writeSequence(source + anchor, size - anchor, 0, 0, out, end))
+    return 0;
+  return out - destination;
+}
+
+size_t decompressTile(const uint8_t *source, const size_t size, uint8_t *destination, const size_t capacity)
+{
+  const uint8_t *in = source;
+  const uint8_t *in_end = source + size;
+  uint8_t *out = destination;
+  uint8_t *out_end = destination + capacity;
+
+  while (in < in_end)
+  {
+    const uint8_t token = *in++;
+
+    size_t literal_count = token >> 4;
+    if (literal_count == 15 && !readLength(literal_count, in, in_end))
+      return 0;
+    if ((size_t)(in_end - in) < literal_count || (size_t)(out_end - out) < literal_count)
+      return 0;
+    memcpy(out, in, literal_count);
+    in += literal_count;
+    out += literal_count;
+
+    if (in == in_end)
+      break; // the last sequence has no match
+
+    if (in_end - in < 2)
+      return 0;
+    const size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    size_t length = token & 15;
+    if (length == 15 && !readLength(length, in, in_end))
+      return 0;
+    length += MIN_MATCH;
+
+    if (offset == 0 || offset > (size_t)(out - destination) || (size_t)(out_end - out) < length)
+      return 0;
+
+    // Byte by byte when the match overlaps what it writes (a run), otherwise one copy
+    const uint8_t *match = out - offset;
+    if (offset >= length)
+      memcpy(out, match, length);
+    else
+      for (size_t i = 0; i < length; ++i)
+        out[i] = match[i];
+    out += length;
+  }
+  return out - destination;
+}
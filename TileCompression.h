@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+A small LZ77 compressor in the spirit of LZ4, for the tiles of a chunked
+recording (see ChunkedRecording.h). It's not about the best ratio, it's about
+spending as little CPU as possible while recording: one hash lookup per byte,
+no entropy coding. Frames from a camera hardly compress like that, but
+processed frames do: flat areas, and pixelated blocks are runs of the same
+3 bytes, which are matches at offset 3.
+
+The compressed data is a list of sequences:
+
+  token | [literal length bytes] | literals | offset (16 bit) | [match length bytes]
+
+The high 4 bits of the token are the amount of literals, the low 4 bits the
+match length minus 4. A nibble of 15 means more length follows in extra bytes,
+each one added up until a byte that is not 255. The last sequence has only literals.
+*/
+
+/*!
+  The largest possible compressed size of 'size' bytes (incompressible data grows a little)
+*/
+size_t maxCompressedTileSize(const size_t size);
+
+/*!
+  Compress a block of bytes
+*/
+/*!
+/param source the bytes to compress
+/param size the amount of bytes
+/param destination receives the compressed bytes
+/param capacity the room in 'destination', maxCompressedTileSize(size) is always enough
+returns the compressed size, or 0 if it doesn't fit in 'capacity' (store the tile uncompressed then)
+*/
+size_t compressTile(const uint8_t *source, const size_t size, uint8_t *destination, const size_t capacity);
+
+/*!
+  Decompress a block of bytes made by compressTile(..)
+*/
+/*!
+/param source the compressed bytes
+/param size the amount of compressed bytes
+/param destination receives the original bytes
+/param capacity the original size
+returns the amount of bytes written, which is 'capacity' unless the data is corrupt
+*/
+size_t decompressTile(const uint8_t *source, const size_t size, uint8_t *destination, const size_t capacity);
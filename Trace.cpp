@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "Trace.h"
+
+using namespace std;
+
+namespace
+{
+  // The events of one thread, only that thread writes it
+  struct ThreadBuffer
+  {
+    vector<TraceEvent> events;
+    //! The events written so far, published with release after the event itself
+    atomic<size_t> count;
+    atomic<int64_t> dropped;
+    int tid;
+    //! Guarded by the lock of the Registry
+    string name;
+
+    explicit ThreadBuffer(const size_t capacity) :
+      events(capacity),
+      count(0),
+      dropped(0),
+      tid(0)
+    {
+    }
+  };
+
+  struct Registry
+  {
+    mutex lock;
+    vector<unique_ptr<ThreadBuffer>> buffers;
+    atomic<bool> enabled;
+    atomic<size_t> capacity;
+    //! Goes up with every clear(), the buffers the threads know of are gone then
+    atomic<uint64_t> generation;
+    int next_tid;
+
+    Registry() :
+      enabled(false),
+      capacity(Trace::DEFAULT_EVENTS_PER_THREAD),
+      generation(1),
+      next_tid(1)
+    {
+    }
+  };
+
+  // Made on first use, threads may record while globals are still being constructed
+  Registry &registry()
+  {
+    static Registry instance;
+    return instance;
+  }
+
+  struct ThreadState
+  {
+    ThreadBuffer *buffer = nullptr;
+    uint64_t generation = 0;
+    int64_t frame = -1;
+    string name;
+  };
+
+  thread_local ThreadState thread_state;
+
+  // The buffer of this thread, made (once) under the lock the first time
+  ThreadBuffer &threadBuffer()
+  {
+    Registry &instance = registry();
+    ThreadState &state = thread_state;
+    if (state.buffer != nullptr && state.generation == instance.generation.load(memory_order_acquire))
+      return *state.buffer;
+
+    lock_guard<mutex> lock(instance.lock);
+    unique_ptr<ThreadBuffer> buffer(new ThreadBuffer(instance.capacity.load(memory_order_relaxed)));
+    buffer->tid = instance.next_tid++;
+    buffer->name = state.name.empty() ? "thread " + to_string(buffer->tid) : state.name;
+    state.buffer = buffer.get();
+    state.generation = instance.generation.load(memory_order_relaxed);
+    instance.buffers.push_back(move(buffer));
+    return *state.buffer;
+  }
+
+  void push(const TraceEvent &event)
+  {
+    ThreadBuffer &buffer = threadBuffer();
+    const size_t count = buffer.count.load(memory_order_relaxed);
+    if (count == buffer.events.size())
+    {
+      buffer.dropped.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+    buffer.events[count] = event;
+    buffer.count.store(count + 1, memory_order_release);
+  }
+
+  // Our names are plain, but a thread name may come from anywhere
+  string escapeJSON(const string &text)
+  {
+    string escaped;
+    for (const char c : text)
+    {
+      if (c == '"' || c == '\\')
+        escaped += '\\';
+      if ((unsigned char)c >= 0x20)
+        escaped += c;
+    }
+    return escaped;
+  }
+
+  // The events of one thread, copied under the lock
+  struct ThreadEvents
+  {
+    int tid;
+    string name;
+    vector<TraceEvent> events;
+  };
+}
+
+namespace Trace
+{
+  void start(const size_t events_per_thread)
+  {
+    Registry &instance = registry();
+    instance.capacity.store(max<size_t>(1, events_per_thread), memory_order_relaxed);
+    instance.enabled.store(true, memory_order_release);
+  }
+
+  void stop()
+  {
+    registry().enabled.store(false, memory_order_release);
+  }
+
+  bool isEnabled()
+  {
+    return registry().enabled.load(memory_order_relaxed);
+  }
+
+  int64_t now()
+  {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void record(const char *name, const int64_t frame, const int64_t begin_ns, const int64_t end_ns)
+  {
+    if (!isEnabled())
+      return;
+    TraceEvent event;
+    event.name = name;
+    event.kind = TraceKind::Stage;
+    event.frame = frame;
+    event.begin_ns = begin_ns;
+    event.end_ns = end_ns;
+    push(event);
+  }
+
+  void recordFrame(const int64_t frame, const int64_t captured_ns, const int64_t done_ns)
+  {
+    if (!isEnabled() || frame < 0 || captured_ns == 0)
+      return;
+    TraceEvent event;
+    event.name = "frame";
+    event.kind = TraceKind::Frame;
+    event.frame = frame;
+    event.begin_ns = captured_ns;
+    event.end_ns = done_ns;
+    push(event);
+  }
+
+  void setThreadName(const string &name)
+  {
+    ThreadState &state = thread_state;
+    state.name = name;
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    if (state.buffer != nullptr && state.generation == instance.generation.load(memory_order_relaxed))
+      state.buffer->name = name;
+  }
+
+  int64_t currentFrame()
+  {
+    return thread_state.frame;
+  }
+
+  void setCurrentFrame(const int64_t frame)
+  {
+    thread_state.frame = frame;
+  }
+
+  bool writeChromeJSON(const string &path)
+  {
+    ofstream out(path);
+    if (!out)
+      return false;
+    writeChromeJSON(out);
+    return (bool)out;
+  }
+
+  void writeChromeJSON(ostream &out)
+  {
+    vector<ThreadEvents> threads;
+    {
+      Registry &instance = registry();
+      lock_guard<mutex> lock(instance.lock);
+      for (const unique_ptr<ThreadBuffer> &buffer : instance.buffers)
+      {
+        ThreadEvents thread;
+        thread.tid = buffer->tid;
+        thread.name = buffer->name;
+        const size_t count = buffer->count.load(memory_order_acquire);
+        thread.events.assign(buffer->events.begin(), buffer->events.begin() + count);
+        threads.push_back(move(thread));
+      }
+    }
+
+    // The viewer starts at 0, with microseconds
+    int64_t origin = INT64_MAX;
+    for (const ThreadEvents &thread : threads)
+    {
+      for (const TraceEvent &event : thread.events)
+        origin = min(origin, event.begin_ns);
+    }
+    auto microseconds = [origin](const int64_t ns) { return (ns - origin) / 1e3; };
+
+    out << fixed << setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"OpenCV_Tutorial\"}}";
+    for (const ThreadEvents &thread : threads)
+    {
+      out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread.tid
+        << ", \"args\": {\"name\": \"" << escapeJSON(thread.name) << "\"}}";
+      for (const TraceEvent &event : thread.events)
+      {
+        if (event.kind == TraceKind::Stage)
+        {
+          out << ",\n{\"name\": \"" << escapeJSON(event.name) << "\", \"cat\": \"stage\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+            << thread.tid << ", \"ts\": " << microseconds(event.begin_ns) << ", \"dur\": " << (event.end_ns - event.begin_ns) / 1e3;
+          if (event.frame >= 0)
+            out << ", \"args\": {\"frame\": " << event.frame << "}";
+          out << "}";
+          continue;
+        }
+        // An async pair with the frame as id: one bar per frame, whatever thread it's on
+        out << ",\n{\"name\": \"" << escapeJSON(event.name) << "\", \"cat\": \"frame\", \"ph\": \"b\", \"id\": " << event.frame
+          << ", \"pid\": 1, \"tid\": " << thread.tid << ", \"ts\": " << microseconds(event.begin_ns)
+          << ", \"args\": {\"frame\": " << event.frame << ", \"latency_ms\": " << (event.end_ns - event.begin_ns) / 1e6 << "}}";
+        out << ",\n{\"name\": \"" << escapeJSON(event.name) << "\", \"cat\": \"frame\", \"ph\": \"e\", \"id\": " << event.frame
+          << ", \"pid\": 1, \"tid\": " << thread.tid << ", \"ts\": " << microseconds(event.end_ns) << "}";
+      }
+    }
+    out << "\n]}\n";
+  }
+
+  void clear()
+  {
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    instance.buffers.clear();
+    instance.generation.fetch_add(1, memory_order_release);
+  }
+
+  TraceStats getStats()
+  {
+    TraceStats stats;
+    Registry &instance = registry();
+    lock_guard<mutex> lock(instance.lock);
+    for (const unique_ptr<ThreadBuffer> &buffer : instance.buffers)
+    {
+      stats.events += (int64_t)buffer->count.load(memory_order_acquire);
+      stats.dropped += buffer->dropped.load(memory_order_relaxed);
+      ++stats.threads;
+    }
+    return stats;
+  }
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+/*!
+  What a TraceEvent stands for
+*/
+enum class TraceKind
+{
+  Stage, //!< a stage on one thread, e.g. "encode" of frame 12 on the encoder thread
+  Frame  //!< the whole life of a frame, from capture until it's done, over all threads
+};
+
+/*!
+  One begin/end pair, recorded when the end is known
+*/
+struct TraceEvent
+{
+  //! A name that lives as long as the program, e.g. a string literal
+  const char *name = nullptr;
+  TraceKind kind = TraceKind::Stage;
+  //! The id of the frame (see Frame::id), -1 if it isn't about one frame
+  int64_t frame = -1;
+  //! In nanoseconds of std::chrono::steady_clock, the clock of Frame::timestamp
+  int64_t begin_ns = 0;
+  int64_t end_ns = 0;
+};
+
+/*!
+  A snapshot of the counters of the trace, see Trace::getStats()
+*/
+struct TraceStats
+{
+  int64_t events = 0;
+  //! Events that didn't fit in the buffer of their thread anymore
+  int64_t dropped = 0;
+  int64_t threads = 0;
+};
+
+/*!
+  Where the time of every frame goes, frame by frame: each thread of the frame loop
+  records when a stage of which frame began and ended, and the whole trace is written
+  as Chrome Trace Event JSON. Open it in chrome://tracing or https://ui.perfetto.dev:
+  every thread is a row of stages, and every frame a bar from capture until it's done.
+  A slow frame shows right away which stage (or which queue in between) took the time.
+
+  Every thread records into a buffer of its own, made the first time it records. Only
+  that thread writes it: recording an event is two clock reads, a copy into the next
+  slot and one release store, no lock and no allocation. A full buffer drops the newer
+  events (and counts them), it never grows while the frames run.
+
+  When the trace isn't started, a TraceScope costs one relaxed atomic load.
+*/
+namespace Trace
+{
+  //! The default amount of events per thread, 2.5 MB per thread
+  const size_t DEFAULT_EVENTS_PER_THREAD = 1 << 16;
+
+  /*!
+    Start recording. The buffers of earlier recordings are kept, see clear().
+  */
+  /*!
+  /param events_per_thread the capacity of the buffers made from now on
+  */
+  void start(const size_t events_per_thread = DEFAULT_EVENTS_PER_THREAD);
+
+  //! Stop recording, what was recorded is kept for writeChromeJSON(..)
+  void stop();
+
+  bool isEnabled();
+
+  //! The clock of the trace: nanoseconds of std::chrono::steady_clock, like Frame::timestamp
+  int64_t now();
+
+  /*!
+    Record a stage of a frame on this thread (if the trace is started)
+  */
+  /*!
+  /param name e.g. "encode", it must live as long as the program (a string literal)
+  /param frame the id of the frame, -1 if it isn't about one frame
+  */
+  void record(const char *name, const int64_t frame, const int64_t begin_ns, const int64_t end_ns);
+
+  /*!
+    Record the whole life of a frame, normally when the last stage is done with it
+  */
+  /*!
+  /param captured_ns when it was captured, see Frame::timestamp
+  */
+  void recordFrame(const int64_t frame, const int64_t captured_ns, const int64_t done_ns);
+
+  /*!
+    The name of this thread in the trace, e.g. "capture" or "worker 1"
+  */
+  void setThreadName(const std::string &name);
+
+  /*!
+    The frame this thread works on, see TraceFrame. A TraceScope without a frame id
+    belongs to this frame, so the steps called by a processing step don't need the id.
+  */
+  int64_t currentFrame();
+
+  void setCurrentFrame(const int64_t frame);
+
+  /*!
+    Write all recorded events as Chrome Trace Event JSON. Stop the trace first (or make
+    sure the threads that record are done), the events of a running trace may be cut off.
+  */
+  /*!
+  returns false if the file can't be written
+  */
+  bool writeChromeJSON(const std::string &path);
+
+  //! The same, to a stream
+  void writeChromeJSON(std::ostream &out);
+
+  /*!
+    Forget all events and buffers. Only while no thread records: stop the trace and
+    join the threads of the frame loop first.
+  */
+  void clear();
+
+  TraceStats getStats();
+}
+
+//!  Records a stage from its construction until its destruction
+/*!
+  Like StageTimer for Metrics, both can be used side by side:
+
+    {
+      StageTimer timer(metrics, stage);
+      TraceScope trace("encode");
+      ...
+    }
+*/
+class TraceScope
+{
+  const char *m_name;
+  int64_t m_frame;
+  const int64_t m_begin;
+
+public:
+  /*!
+  /param name see Trace::record(..)
+  /param frame the id of the frame, by default the frame of this thread (see TraceFrame)
+  */
+  explicit TraceScope(const char *name, const int64_t frame = -1) :
+    m_name(Trace::isEnabled() ? name : nullptr),
+    m_frame(frame >= 0 || m_name == nullptr ? frame : Trace::currentFrame()),
+    m_begin(m_name == nullptr ? 0 : Trace::now())
+  {
+  }
+
+  ~TraceScope()
+  {
+    if (m_name != nullptr)
+      Trace::record(m_name, m_frame, m_begin, Trace::now());
+  }
+
+  //! For a stage that only learns which frame it worked on at the end, like a capture
+  void setFrame(const int64_t frame)
+  {
+    m_frame = frame;
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+};
+
+//!  Sets the frame this thread works on, for its lifetime (see Trace::currentFrame())
+class TraceFrame
+{
+  const int64_t m_previous;
+
+public:
+  explicit TraceFrame(const int64_t frame) :
+    m_previous(Trace::currentFrame())
+  {
+    Trace::setCurrentFrame(frame);
+  }
+
+  ~TraceFrame()
+  {
+    Trace::setCurrentFrame(m_previous);
+  }
+
+  TraceFrame(const TraceFrame &) = delete;
+  TraceFrame &operator=(const TraceFrame &) = delete;
+};
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <chrono>
+
+#include "ChunkedRecording.h"
+#include "ThreadPool.h"
+#include "Transcoder.h"
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  // "dir/name.cvchunk" -> "dir/name" + suffix
+  string outputName(const string &input, const string &suffix)
+  {
+    const size_t slash = input.find_last_of("/\\");
+    const size_t dot = input.find_last_of('.');
+    const bool has_extension = dot != string::npos && (slash == string::npos || dot > slash);
+    return (has_extension ? input.substr(0, dot) : input) + suffix;
+  }
+
+  // The average frame rate of a recording, from the first and the last timestamp
+  double measureFPS(const ChunkedFrameReader &reader)
+  {
+    const int64_t count = reader.getFrameCount();
+    if (count < 2)
+      return 30;
+    const double seconds = (reader.getTimestamp(count - 1) - reader.getTimestamp(0)) / 1e9;
+    return seconds > 0 ? (count - 1) / seconds : 30;
+  }
+
+  void transcodePart(TranscodeResult &result, const TranscodeSettings &settings)
+  {
+    const auto start = chrono::steady_clock::now();
+
+    // Every job has its own reader, they don't share a file position
+    ChunkedFrameReader reader;
+    if (!reader.open(result.input))
+    {
+      result.error = "not a chunked recording";
+      return;
+    }
+
+    const double fps = settings.fps > 0 ? settings.fps : measureFPS(reader);
+    VideoWriter writer(result.output, settings.fourcc, fps, reader.getFrameSize());
+    if (!writer.isOpened())
+    {
+      result.error = "can't write " + result.output;
+      return;
+    }
+
+    Mat frame;
+    const int64_t end = result.first_frame + result.frames;
+    for (int64_t i = result.first_frame; i < end; ++i)
+    {
+      if (!reader.read(i, frame))
+      {
+        result.error = "frame " + to_string(i) + " is damaged";
+        result.frames = i - result.first_frame;
+        break;
+      }
+      writer << frame;
+    }
+    writer.release();
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+}
+
+vector<TranscodeResult> transcodeChunkedFiles(const vector<string> &inputs, const TranscodeSettings &settings)
+{
+  // First plan all jobs: which frames of which recording go into which file
+  vector<TranscodeResult> results;
+  const int segments = max(1, settings.segments);
+  for (const string &input : inputs)
+  {
+    ChunkedFrameReader reader;
+    if (!reader.open(input))
+    {
+      TranscodeResult failed;
+      failed.input = input;
+      failed.error = "not a chunked recording";
+      results.push_back(failed);
+      continue;
+    }
+
+    const int64_t count = reader.getFrameCount();
+    const int parts = (int)min<int64_t>(segments, max<int64_t>(1, count));
+    for (int part = 0; part < parts; ++part)
+    {
+      TranscodeResult job;
+      job.input = input;
+      job.output = outputName(input, parts == 1 ? ".avi" : "_part" + to_string(part) + ".avi");
+      job.first_frame = count * part / parts;
+      job.frames = count * (part + 1) / parts - job.first_frame;
+      results.push_back(job);
+    }
+  }
+
+  // Then run them, every job fills in its own result
+  ThreadPool pool(settings.threads);
+  for (TranscodeResult &result : results)
+  {
+    if (!result.error.empty())
+      continue;
+    TranscodeResult *target = &result;
+    pool.submit([target, &settings]()
+    {
+      transcodePart(*target, settings);
+    });
+  }
+  pool.wait();
+  return results;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+/*!
+  Settings for transcodeChunkedFiles(..)
+*/
+struct TranscodeSettings
+{
+  //! The codec of the video files, see Video::setFourCC(..)
+  int fourcc = CV_FOURCC('M', 'P', 'E', 'G');
+  //! The frame rate of the video files, 0 means: measure it from the timestamps of the recording
+  double fps = 0;
+  //! Split every recording into this many video files (part 0, 1, ...) that are encoded at the same time
+  int segments = 1;
+  //! The amount of threads, 0 means one per core
+  int threads = 0;
+};
+
+/*!
+  The outcome of one video file written by transcodeChunkedFiles(..)
+*/
+struct TranscodeResult
+{
+  std::string input;
+  std::string output;
+  int64_t first_frame = 0;
+  int64_t frames = 0;
+  double seconds = 0;
+  //! Empty, unless it failed
+  std::string error;
+};
+
+/*!
+  Convert chunked recordings (see ChunkedRecording.h) to encoded video files, after
+  the recording is done, using all cores.
+
+  A video encoder can't be split over threads from the outside, so the parallel work
+  are whole video files: every recording is one job, or 'segments' jobs that each
+  encode a consecutive part of it into their own file. The jobs run on a ThreadPool,
+  each with its own reader and VideoWriter.
+
+  The output of "name.cvchunk" is "name.avi", or "name_part0.avi", "name_part1.avi", ...
+*/
+/*!
+/param inputs the chunked recordings
+/param settings codec, frame rate, segments and threads
+returns one result per video file, in the order of the inputs and their parts
+*/
+std::vector<TranscodeResult> transcodeChunkedFiles(const std::vector<std::string> &inputs,
+  const TranscodeSettings &settings = TranscodeSettings());
@@ -1,19 +1,159 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "RingBuffer.h"
+#include "Trace.h"
 #include "Video.h"
 
 using namespace cv;
 
+/*
+All the state of the pipelined mode. The capture thread feeds one input ring
+per worker (round-robin), every worker feeds its own output ring and the encoder
+reads the output rings in the same round-robin order. Because each ring has
+exactly one producer and one consumer they can all be lock-free.
+*/
+struct Video::Pipeline
+{
+  //! A frame on its way through the pipeline, with what the scheduler decided for it
+  struct Item
+  {
+    Frame frame;
+    FrameDecision decision;
+  };
+  typedef RingBuffer<Item> ItemRing;
+  typedef RingBuffer<Frame> FrameRing;
+
+  PipelineSettings settings;
+  ScheduledFrameProcessor processor;
+
+  std::vector<std::unique_ptr<ItemRing>> inputs;
+  std::vector<std::unique_ptr<ItemRing>> outputs;
+  std::unique_ptr<FrameRing> preview;
+
+  std::thread capture_thread;
+  std::vector<std::thread> worker_threads;
+  std::thread encoder_thread;
+
+  std::atomic<bool> running;
+  std::atomic<bool> capture_done;
+  std::atomic<bool> finished;
+  std::atomic<int> workers_busy;
+
+  //! Where the threads report to, all null when there are no metrics
+  SMetrics metrics;
+  StageMetrics *capture_stage;
+  StageMetrics *process_stage;
+  StageMetrics *encode_stage;
+  MetricsCounter *dropped_counter;
+
+  std::atomic<int64> captured;
+  std::atomic<int64> processed;
+  std::atomic<int64> encoded;
+  std::atomic<int64> encode_failed;
+  std::atomic<int64> dropped;
+  std::atomic<int64> encode_skipped;
+  std::atomic<int64> display_skipped;
+
+  //! What the processor threw first, a worker that catches it stops the capture
+  mutable std::mutex error_mutex;
+  std::string error;
+
+  Pipeline() :
+    running(false),
+    capture_done(false),
+    finished(false),
+    workers_busy(0),
+    capture_stage(nullptr),
+    process_stage(nullptr),
+    encode_stage(nullptr),
+    dropped_counter(nullptr),
+    captured(0),
+    processed(0),
+    encoded(0),
+    encode_failed(0),
+    dropped(0),
+    encode_skipped(0),
+    display_skipped(0)
+  {
+  }
+
+  //! Keep the first error and stop capturing, the frames in flight still drain
+  void fail(const std::string &what)
+  {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (error.empty())
+      error = what;
+    running = false;
+  }
+};
+
+namespace
+{
+  /*
+  Nothing to do: spin politely for a while, then start sleeping a little so an
+  idle pipeline doesn't burn a whole core per thread
+  */
+  void backoff(int &spins)
+  {
+    if (++spins < 64)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+
+  // The clock of Frame::timestamp
+  int64 steadyNow()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  template<typename T>
+  QueueStats queueStats(const std::string &name, const RingBuffer<T> &ring)
+  {
+    QueueStats stats;
+    stats.name = name;
+    stats.capacity = ring.capacity();
+    stats.size = ring.size();
+    stats.high_water = ring.highWater();
+    stats.pushed = ring.pushed();
+    stats.rejected = ring.rejected();
+    return stats;
+  }
+}
+
 Video::Video(const std::string &output, const int input) :
-  m_video_capture(nullptr),
+  Video(output, std::make_shared<CameraSource>(input))
+{
+}
+
+Video::Video(const std::string &output, const SFrameSource &source) :
+  m_source(source),
   m_video_writer(nullptr),
-  m_input(input),
+  m_chunked_writer(nullptr),
+  m_output_format(OutputFormat::Encoded),
+  m_chunk_compression(ChunkCompression::Tiles),
   m_output(output),
   m_fps(30),
-  m_fourcc(CV_FOURCC('M', 'P', 'E', 'G'))
+  m_fourcc(CV_FOURCC('M', 'P', 'E', 'G')),
+  m_frame_pool(std::make_shared<FramePool>()),
+  m_capture_next(0),
+  m_capture_buffers(3),
+  m_retrieved(0),
+  m_capture_stage(nullptr),
+  m_encode_stage(nullptr)
 {
 }
 
 Video::~Video()
 {
+  // Stop the pipeline threads before the devices they use disappear
+  stopPipeline();
+
   // Stop/close capture/write video
   closeInput();
   closeOutput();
@@ -21,32 +161,442 @@ Video::~Video()
 
 bool Video::initializeInput()
 {
-  if (m_video_capture == nullptr)
-    m_video_capture = std::make_shared<VideoCapture>();
-  else
+  if (m_source->isOpened())
     return false; // already initialized
 
-  m_video_capture->open(m_input);
-
-  // Wait for the webcam to fire up (give 250ms)
-  int timeout = 0;
-  Mat dummy;
-  while (dummy.empty() && timeout++ < 250)
-  {
-    *m_video_capture >> dummy;
-    waitKey(1);
-  }
-
-  return m_video_capture->isOpened();
+  return m_source->open();
 }
 
 bool Video::initializeOutput(const Size &video_size)
 {
-  if (m_video_writer == nullptr)
-    m_video_writer = std::make_shared<VideoWriter>();
-  else
+  if (m_video_writer != nullptr || m_chunked_writer != nullptr)
     return false; // already initialized
 
+  if (m_output_format == OutputFormat::Chunked)
+  {
+    // Like the VideoWriter, we take color frames
+    m_chunked_writer = std::make_shared<ChunkedFrameWriter>();
+    return m_chunked_writer->open(m_output, video_size, CV_8UC3, m_chunk_compression);
+  }
+
+  m_video_writer = std::make_shared<VideoWriter>();
   m_video_writer->open(m_output, m_fourcc, m_fps, video_size);
   return m_video_writer->isOpened();
-}
\ No newline at end of file
+}
+
+bool Video::write(const Mat &frame)
+{
+  StageTimer timer(m_metrics.get(), m_encode_stage);
+  // The frame of this thread, if the caller set it (see TraceFrame)
+  TraceScope trace("encode");
+  if (m_chunked_writer != nullptr)
+    return m_chunked_writer->write(frame, steadyNow());
+  *m_video_writer << frame;
+  return true;
+}
+
+bool Video::retrieve(FrameView &view)
+{
+  StageTimer timer(m_metrics.get(), m_capture_stage);
+  TraceScope trace("capture");
+
+  // Our reference would keep the previous frame in use
+  view.release();
+
+  // Find a buffer of the ring that no view holds anymore, starting after the one used last
+  Frame *target = nullptr;
+  for (size_t i = 0; i < m_capture_ring.size() && target == nullptr; ++i)
+  {
+    Frame &candidate = m_capture_ring[(m_capture_next + i) % m_capture_ring.size()];
+    // The pool and the ring hold every buffer, one more reference is a view that still uses it
+    if (candidate.buffer.use_count() == 2)
+    {
+      // The last view was dropped on another thread, see FramePool::take(..)
+      std::atomic_thread_fence(std::memory_order_acquire);
+      target = &candidate;
+      m_capture_next = (m_capture_next + i + 1) % m_capture_ring.size();
+    }
+  }
+  // All buffers are still in use (or there are none yet): add one of the size of the last frame
+  if (target == nullptr && !m_capture_ring.empty())
+  {
+    const Mat &last = m_capture_ring.front().image;
+    m_capture_ring.push_back(m_frame_pool->acquire(last.size(), last.type()));
+    target = &m_capture_ring.back();
+    m_capture_next = 0;
+  }
+
+  Frame frame;
+  if (target != nullptr)
+  {
+    // Decode straight into the ring buffer
+    const uchar *data = target->image.data;
+    if (!m_source->retrieve(target->image))
+      return false;
+    if (target->image.data == data)
+    {
+      target->timestamp = steadyNow();
+      target->id = m_retrieved;
+      trace.setFrame(m_retrieved);
+      view = FrameView(*target, m_retrieved++);
+      return true;
+    }
+    // The size or type changed, the source allocated a new image: start a new ring below
+    frame.image = target->image;
+  }
+  else if (!m_source->retrieve(frame.image))
+    return false;
+
+  /*
+  The first frame (or the first one of a new size) tells us what the buffers must
+  look like. It is handed out as it is, the ring is allocated for the next ones.
+  */
+  m_capture_ring.clear();
+  m_capture_next = 0;
+  for (size_t i = 0; i < m_capture_buffers; ++i)
+    m_capture_ring.push_back(m_frame_pool->acquire(frame.image.size(), frame.image.type()));
+
+  frame.timestamp = steadyNow();
+  frame.id = m_retrieved;
+  trace.setFrame(m_retrieved);
+  view = FrameView(frame, m_retrieved++);
+  return true;
+}
+
+void Video::setMetrics(const SMetrics &metrics)
+{
+  m_metrics = metrics;
+  m_capture_stage = metrics == nullptr ? nullptr : &metrics->stage("capture");
+  m_encode_stage = metrics == nullptr ? nullptr : &metrics->stage("encode");
+}
+
+bool Video::startPipeline(const FrameProcessor &processor, const PipelineSettings &settings)
+{
+  if (!processor)
+    return startPipeline(ScheduledFrameProcessor(), settings);
+
+  // Without knowing about the decisions it can only do the full work, the pipeline still drops encode and display
+  return startPipeline([processor](Mat &frame, const FrameDecision &)
+  {
+    processor(frame);
+  }, settings);
+}
+
+bool Video::startPipeline(const ScheduledFrameProcessor &processor, const PipelineSettings &settings)
+{
+  if (isPipelineRunning())
+    return false; // already running
+
+  const bool is_output_open = m_chunked_writer != nullptr ? m_chunked_writer->isOpened() :
+    m_video_writer != nullptr && m_video_writer->isOpened();
+  if (!m_source->isOpened() || !is_output_open)
+    return false; // initialize the input and the output first
+
+  // Join the threads of a previous run, if any
+  stopPipeline();
+
+  m_pipeline.reset(new Pipeline());
+  Pipeline &pipeline = *m_pipeline;
+  pipeline.settings = settings;
+  pipeline.settings.workers = std::max(1, settings.workers);
+  pipeline.processor = processor;
+
+  const int workers = pipeline.settings.workers;
+  for (int w = 0; w < workers; ++w)
+  {
+    pipeline.inputs.emplace_back(new Pipeline::ItemRing(pipeline.settings.queue_depth));
+    pipeline.outputs.emplace_back(new Pipeline::ItemRing(pipeline.settings.queue_depth));
+  }
+  // The preview only ever needs the newest frame, so keep it short
+  pipeline.preview.reset(new Pipeline::FrameRing(2));
+
+  if (m_metrics != nullptr)
+  {
+    pipeline.metrics = m_metrics;
+    pipeline.capture_stage = m_capture_stage;
+    pipeline.process_stage = &m_metrics->stage("process");
+    pipeline.encode_stage = m_encode_stage;
+    pipeline.dropped_counter = &m_metrics->counter("dropped");
+
+    // The queue sizes are only read when the metrics take a snapshot, stopPipeline() removes them again
+    auto addGauge = [this](const std::string &name, const Pipeline::ItemRing *ring)
+    {
+      m_metrics->setGauge("queue." + name, [ring]() { return (double)ring->size(); });
+    };
+    for (int w = 0; w < workers; ++w)
+    {
+      addGauge("capture->worker" + std::to_string(w), pipeline.inputs[w].get());
+      addGauge("worker" + std::to_string(w) + "->encoder", pipeline.outputs[w].get());
+    }
+  }
+
+  pipeline.running = true;
+  pipeline.workers_busy = workers;
+
+  // The capture thread: read frames from the source and deal them out round-robin over the workers
+  SFrameSource source = m_source;
+  SFramePool pool = m_frame_pool;
+  pipeline.capture_thread = std::thread([&pipeline, source, pool, workers]()
+  {
+    Trace::setThreadName("capture");
+    // 'sequence' only counts frames that made it into the pipeline, so the
+    // encoder can predict which worker has the next frame, even after drops
+    int64 sequence = 0;
+    // The size and type of the previous frame, the next one most likely is the same
+    Size size;
+    int type = -1;
+    while (pipeline.running)
+    {
+      // Decode straight into a pooled buffer. Only the very first frame (or one
+      // with a new size) makes the source allocate its own buffer.
+      Frame frame;
+      if (type != -1)
+        frame = pool->acquire(size, type);
+      {
+        StageTimer timer(pipeline.metrics.get(), pipeline.capture_stage);
+        TraceScope trace("capture");
+        if (!source->read(frame.image) || frame.image.empty())
+          break;
+        trace.setFrame(pipeline.captured);
+      }
+      frame.timestamp = steadyNow();
+      // Every captured frame gets an id, also the ones that are dropped below
+      frame.id = pipeline.captured++;
+      size = frame.image.size();
+      type = frame.image.type();
+
+      // Decided in capture order, so the scheduler can spread dropped frames evenly
+      Pipeline::Item item;
+      item.frame = std::move(frame);
+      if (pipeline.settings.scheduler != nullptr)
+        item.decision = pipeline.settings.scheduler->decide();
+
+      Pipeline::ItemRing &input = *pipeline.inputs[sequence % workers];
+      bool pushed = input.tryPush(item);
+      if (!pushed && pipeline.settings.back_pressure == BackPressure::Block)
+      {
+        int spins = 0;
+        while (!pushed && pipeline.running)
+        {
+          backoff(spins);
+          pushed = input.tryPush(item);
+        }
+      }
+
+      if (pushed)
+        ++sequence;
+      else
+      {
+        ++pipeline.dropped;
+        if (pipeline.dropped_counter != nullptr)
+          pipeline.dropped_counter->fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    pipeline.capture_done = true;
+  });
+
+  // The workers: process every frame from their own input ring into their own output ring
+  for (int w = 0; w < workers; ++w)
+  {
+    pipeline.worker_threads.emplace_back([&pipeline, w]()
+    {
+      Trace::setThreadName("worker " + std::to_string(w));
+      Pipeline::ItemRing &input = *pipeline.inputs[w];
+      Pipeline::ItemRing &output = *pipeline.outputs[w];
+      int spins = 0;
+      Pipeline::Item item;
+      while (true)
+      {
+        if (!input.tryPop(item))
+        {
+          // Only quit when nothing can arrive anymore
+          if (pipeline.capture_done && input.empty())
+            break;
+          backoff(spins);
+          continue;
+        }
+        spins = 0;
+
+        if (pipeline.processor)
+        {
+          // The steps of the processor trace themselves with this frame, see TraceScope
+          TraceFrame trace_frame(item.frame.id);
+          StageTimer timer(pipeline.metrics.get(), pipeline.process_stage);
+          TraceScope trace("process");
+          bool failed = true;
+          try
+          {
+            pipeline.processor(item.frame.image, item.decision);
+            failed = false;
+          }
+          catch (const std::exception &e)
+          {
+            pipeline.fail(e.what());
+          }
+          catch (...)
+          {
+            pipeline.fail("unknown exception");
+          }
+          if (failed)
+          {
+            // A frame that wasn't processed completely doesn't go to the output or the screen
+            item.decision.encode = false;
+            item.decision.display = false;
+          }
+        }
+        ++pipeline.processed;
+
+        // Never drop here, the encoder expects every sequence number (even of a frame it won't write)
+        while (!output.tryPush(item))
+          backoff(spins);
+      }
+      --pipeline.workers_busy;
+    });
+  }
+
+  // The encoder: collect the frames in sequence order and write them to the video file
+  SVideoWriter writer = m_video_writer;
+  SChunkedFrameWriter chunked_writer = m_chunked_writer;
+  pipeline.encoder_thread = std::thread([&pipeline, writer, chunked_writer, workers]()
+  {
+    Trace::setThreadName("encoder");
+    int64 sequence = 0;
+    int spins = 0;
+    Pipeline::Item item;
+    while (true)
+    {
+      Pipeline::ItemRing &output = *pipeline.outputs[sequence % workers];
+      if (!output.tryPop(item))
+      {
+        if (pipeline.workers_busy == 0 && output.empty())
+          break;
+        backoff(spins);
+        continue;
+      }
+      spins = 0;
+      ++sequence;
+
+      const Frame &frame = item.frame;
+      if (item.decision.encode)
+      {
+        StageTimer timer(pipeline.metrics.get(), pipeline.encode_stage);
+        TraceScope trace("encode", frame.id);
+        bool written = true;
+        if (chunked_writer != nullptr)
+          written = chunked_writer->write(frame.image, frame.timestamp);
+        else
+          *writer << frame.image;
+        if (written)
+          ++pipeline.encoded;
+        else
+          ++pipeline.encode_failed;
+      }
+      else
+        ++pipeline.encode_skipped;
+
+      // Hand a (shallow) copy to the preview, if nobody looks at it anymore it's simply dropped.
+      // The buffer goes back to the pool when the preview is done with it as well.
+      if (item.decision.display)
+      {
+        Frame preview = frame;
+        if (pipeline.settings.display != nullptr)
+          pipeline.settings.display->show(preview);
+        else
+          pipeline.preview->tryPush(preview);
+      }
+      else
+        ++pipeline.display_skipped;
+
+      // The frame for the processes on this machine, a copy into shared memory that never waits for them
+      if (pipeline.settings.publisher != nullptr)
+      {
+        TraceScope trace("publish", frame.id);
+        pipeline.settings.publisher->publish(frame.image, frame.id, frame.timestamp);
+      }
+
+      // The frame is done: tell the scheduler (and the trace) how long it took since it was captured
+      const int64 done = steadyNow();
+      if (pipeline.settings.scheduler != nullptr)
+        pipeline.settings.scheduler->complete((done - frame.timestamp) / 1e6);
+      Trace::recordFrame(frame.id, frame.timestamp, done);
+      item = Pipeline::Item();
+    }
+    pipeline.finished = true;
+  });
+
+  return true;
+}
+
+void Video::stopPipeline()
+{
+  if (m_pipeline == nullptr)
+    return;
+
+  Pipeline &pipeline = *m_pipeline;
+  pipeline.running = false;
+
+  // Join in pipeline order, so every stage can drain what is still queued
+  if (pipeline.capture_thread.joinable())
+    pipeline.capture_thread.join();
+  for (std::thread &worker : pipeline.worker_threads)
+  {
+    if (worker.joinable())
+      worker.join();
+  }
+  if (pipeline.encoder_thread.joinable())
+    pipeline.encoder_thread.join();
+
+  // The queue gauges read the rings of this pipeline
+  if (pipeline.metrics != nullptr)
+    pipeline.metrics->removeGauges("queue.");
+}
+
+bool Video::isPipelineRunning() const
+{
+  return m_pipeline != nullptr && !m_pipeline->finished;
+}
+
+bool Video::pollPreview(Frame &frame)
+{
+  if (m_pipeline == nullptr)
+    return false;
+
+  // Skip to the newest frame
+  bool found = false;
+  Frame newest;
+  while (m_pipeline->preview->tryPop(newest))
+  {
+    frame = newest;
+    found = true;
+  }
+  return found;
+}
+
+PipelineStats Video::getPipelineStats() const
+{
+  PipelineStats stats;
+  if (m_pipeline == nullptr)
+    return stats;
+
+  const Pipeline &pipeline = *m_pipeline;
+  stats.captured = pipeline.captured;
+  stats.processed = pipeline.processed;
+  stats.encoded = pipeline.encoded;
+  stats.encode_failed = pipeline.encode_failed;
+  stats.dropped = pipeline.dropped;
+  stats.encode_skipped = pipeline.encode_skipped;
+  stats.display_skipped = pipeline.display_skipped;
+  {
+    std::lock_guard<std::mutex> lock(pipeline.error_mutex);
+    stats.error = pipeline.error;
+  }
+
+  for (size_t w = 0; w < pipeline.inputs.size(); ++w)
+  {
+    stats.queues.push_back(queueStats("capture->worker" + std::to_string(w), *pipeline.inputs[w]));
+    stats.queues.push_back(queueStats("worker" + std::to_string(w) + "->encoder", *pipeline.outputs[w]));
+  }
+  stats.queues.push_back(queueStats("encoder->preview", *pipeline.preview));
+  stats.pool = m_frame_pool->getStats();
+  return stats;
+}
@@ -1,26 +1,215 @@
 #pragma once
 
+#include <cstddef>
+#include <functional>
 #include <memory>
 #include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "ChunkedRecording.h"
+#include "DisplaySink.h"
+#include "FramePool.h"
+#include "FrameScheduler.h"
+#include "FrameSource.h"
+#include "Metrics.h"
+#include "SharedFrameRing.h"
 
 typedef std::shared_ptr<cv::VideoCapture> SVideoCapture;
 typedef std::shared_ptr<cv::VideoWriter> SVideoWriter;
 
+/*!
+  What Video::initializeOutput(..) writes the frames to
+*/
+enum class OutputFormat
+{
+  Encoded, //!< a video file, encoded right away with cv::VideoWriter (see setFourCC(..))
+  Chunked  //!< a chunked recording, hardly any CPU while recording, transcode it later (see ChunkedRecording.h)
+};
+
+/*!
+  A processing step for the pipelined mode. It gets a frame fresh from the
+  frame source and changes it in place, before it goes to the encoder.
+  With more than one worker it is called from several threads at once!
+*/
+typedef std::function<void(cv::Mat &frame)> FrameProcessor;
+
+/*!
+  The same, but it's also told what a FrameScheduler decided for this frame: whether
+  to paint the overlay and at what resolution to process (see FrameDecision)
+*/
+typedef std::function<void(cv::Mat &frame, const FrameDecision &decision)> ScheduledFrameProcessor;
+
+/*!
+  What the capture thread does when the first queue of the pipeline is full
+*/
+enum class BackPressure
+{
+  Block,      //!< Wait until a worker has room again (nothing is lost, capture slows down)
+  DropNewest  //!< Throw the freshly captured frame away (capture keeps the camera rate)
+};
+
+/*!
+  Settings for Video::startPipeline(..)
+*/
+struct PipelineSettings
+{
+  //! The amount of frames each queue can hold (rounded up to a power of two)
+  size_t queue_depth = 8;
+  //! The amount of processing threads
+  int workers = 1;
+  //! What to do when the processing workers can't keep up
+  BackPressure back_pressure = BackPressure::Block;
+  /*!
+    Decides per frame what to shed when the frames don't make their latency budget,
+    nullptr means every frame is fully processed, encoded and shown (see FrameScheduler.h)
+  */
+  SFrameScheduler scheduler;
+  /*!
+    Where the encoder hands the frames for the screen, it shows the newest one on a thread
+    of its own (see DisplaySink.h). nullptr: they go to pollPreview(..) instead.
+  */
+  SDisplaySink display;
+  /*!
+    Where the encoder publishes every frame for other processes, in capture order, also
+    the ones the scheduler didn't let through to the output (see SharedFrameRing.h).
+    nullptr: the frames don't leave the process.
+  */
+  SSharedFramePublisher publisher;
+};
+
+/*!
+  A snapshot of the occupancy counters of one queue in the pipeline
+*/
+struct QueueStats
+{
+  std::string name;
+  size_t capacity = 0;
+  size_t size = 0;
+  size_t high_water = 0;
+  size_t pushed = 0;
+  size_t rejected = 0;
+};
+
+/*!
+  A snapshot of the pipeline counters, see Video::getPipelineStats()
+*/
+struct PipelineStats
+{
+  int64 captured = 0;
+  int64 processed = 0;
+  int64 encoded = 0;
+  //! Frames the output refused (a chunked recording of another size or type), not in 'encoded'
+  int64 encode_failed = 0;
+  int64 dropped = 0;
+  //! Frames the scheduler didn't let through to the output or to the preview
+  int64 encode_skipped = 0;
+  int64 display_skipped = 0;
+  std::vector<QueueStats> queues;
+  //! The frame buffers in use: 'allocations' must stop growing once the pipeline runs
+  FramePoolStats pool;
+  //! Empty, unless the processor threw: what it threw first. The pipeline stopped capturing then.
+  std::string error;
+};
+
+/*!
+  A read-only, reference counted view on a frame from Video::retrieve(..).
+
+  The buffer behind it is not reused for another frame as long as a copy of the
+  view exists, so a view can be handed to another thread (or kept while the next
+  frame is captured) without a deep copy. Don't write into the image: the buffer
+  belongs to the capture ring of the Video. Process it into an image of your own,
+  most OpenCV functions (and pixelateFlip(..)) can write to a separate destination.
+*/
+class FrameView
+{
+  Frame m_frame;
+  int64 m_sequence;
+
+public:
+  FrameView() :
+    m_sequence(-1)
+  {
+  }
+
+  FrameView(const Frame &frame, const int64 sequence) :
+    m_frame(frame),
+    m_sequence(sequence)
+  {
+  }
+
+  //! The image, read-only
+  const cv::Mat &image() const
+  {
+    return m_frame.image;
+  }
+
+  //! The number of the frame, counting every frame retrieved from the Video (also Frame::id)
+  int64 sequence() const
+  {
+    return m_sequence;
+  }
+
+  //! When the frame was captured, see Frame::timestamp
+  int64 timestamp() const
+  {
+    return m_frame.timestamp;
+  }
+
+  bool empty() const
+  {
+    return m_frame.image.empty();
+  }
+
+  //! Let go of the buffer, so the Video can decode into it again
+  void release()
+  {
+    m_frame = Frame();
+    m_sequence = -1;
+  }
+};
+
 /*
-This class handles video input (from the webcam) and output (to a video file).
-It has a capture device and a writer device, accessible through getters and setters
+This class handles video input (from the webcam, or any other FrameSource) and output
+(to a video file). It has a frame source and a writer device, accessible through getters and setters
+
+Next to that it can run a pipelined mode: a capture thread, one or more processing
+workers and an encoder thread, connected by lock-free ring buffers (see RingBuffer.h).
+That way a frame never waits for the encoder or the GUI of another frame.
+
+Every frame gets an id (Frame::id) and the time it was captured (Frame::timestamp),
+both travel with it to the workers, the encoder and the preview. While a Trace is
+started (see Trace.h), every thread records which stage of which frame it ran when.
 */
 class Video
 {
-  SVideoCapture m_video_capture;
+  struct Pipeline;
+
+  SFrameSource m_source;
   SVideoWriter m_video_writer;
+  SChunkedFrameWriter m_chunked_writer;
+  OutputFormat m_output_format;
+  ChunkCompression m_chunk_compression;
 
-  const int m_input;
   const std::string m_output;
 
   int m_fourcc;
   int m_fps;
 
+  SFramePool m_frame_pool;
+  std::unique_ptr<Pipeline> m_pipeline;
+
+  //! The rotating capture buffers of retrieve(..), a buffer is free when no FrameView uses it anymore
+  std::vector<Frame> m_capture_ring;
+  size_t m_capture_next;
+  size_t m_capture_buffers;
+  int64 m_retrieved;
+
+  //! Where the capture and the encoder report to, may be null (see setMetrics(..))
+  SMetrics m_metrics;
+  StageMetrics *m_capture_stage;
+  StageMetrics *m_encode_stage;
+
 public:
   /*!
     This is the constructor, it requires an input number for 
@@ -34,18 +223,30 @@ public:
   /param input the input device to get images from
   */
   Video(const std::string &output, const int input = 0);
+
+  /*!
+    The same, but the frames come from any frame source: a video file,
+    a directory of images, a synthetic pattern or a raw replay file.
+    See FrameSource.h and createFrameSource(..).
+  */
+  /*!
+  /param output the video file to write to
+  /param source the frame source to get images from
+  */
+  Video(const std::string &output, const SFrameSource &source);
 	~Video();
 
   /*!
-    Initialize the input device
+    Initialize the input device (open the frame source)
   */
   /*!
-  returns false if already initialized (use closeInput() first)
+  returns false if already initialized (use closeInput() first) or if it can't be opened
   */
   bool initializeInput();
 
   /*!
-    Initialize the output file
+    Initialize the output file: a video file or a chunked recording, see setOutputFormat(..).
+    The frames must be color images (CV_8UC3) of the given size.
   */
   /*!
   returns false if already initialized (use closeOutput() first)
@@ -53,15 +254,121 @@ public:
   bool initializeOutput(const cv::Size &video_size);
 
   /*!
-    The input device
+    Read the next frame from the input, see FrameSource::read(..)
+  */
+  /*!
+  /param frame receives the next image
+  returns false at the end of the input
+  */
+  bool read(cv::Mat &frame)
+  {
+    StageTimer timer(m_metrics.get(), m_capture_stage);
+    return m_source->read(frame);
+  }
+
+  /*!
+    Move the input on to the next frame, without decoding it yet. The camera
+    keeps running while the previous frame is processed, call retrieve(..) to
+    decode the grabbed frame when you're ready for it.
+  */
+  /*!
+  returns false at the end of the input
+  */
+  bool grab()
+  {
+    return m_source->grab();
+  }
+
+  /*!
+    Decode the grabbed frame into the next free buffer of the capture ring and
+    get a read-only view on it. The buffers are allocated once (when the frame
+    size is known) and then used in turn, there is no copy and no allocation per
+    frame. Only when every buffer is still held by a view, one more is added.
+  */
+  /*!
+  /param view receives the frame, any frame it held before is let go first
+  returns false if there was no grabbed frame
+  */
+  bool retrieve(FrameView &view);
+
+  /*!
+    The amount of buffers in the capture ring (the default is 3: one being
+    decoded, one being processed and one being encoded). Change it before the first retrieve(..).
+  */
+  void setCaptureBuffers(const size_t count)
+  {
+    m_capture_buffers = count < 1 ? 1 : count;
+  }
+
+  //! The buffers in the capture ring right now, more than setCaptureBuffers(..) only while views are kept
+  size_t getCaptureRingSize() const
+  {
+    return m_capture_ring.size();
+  }
+
+  /*!
+    Write a frame to the output file (don't use this while the pipeline runs)
+  */
+  /*!
+  /param frame an image with the size given to initializeOutput(..)
+  returns false if the output refused it (a chunked recording of a frame of another size or type)
+  */
+  bool write(const cv::Mat &frame);
+
+  /*!
+    The pool the pipeline takes its frame buffers from. Other processing steps
+    can take their scratch buffers from it too.
+  */
+  FramePool &getFramePool()
+  {
+    return *m_frame_pool;
+  }
+
+  /*!
+    Report to these metrics from now on: the "capture" and "encode" stages, and in
+    the pipelined mode also the "process" stage, the "dropped" counter and a
+    "queue.<name>" gauge with the size of every queue. Set it before startPipeline(..).
+  */
+  /*!
+  /param metrics the metrics to report to, or nullptr to stop reporting
+  */
+  void setMetrics(const SMetrics &metrics);
+
+  //! The metrics this video reports to (may be null)
+  const SMetrics &getMetrics() const
+  {
+    return m_metrics;
+  }
+
+  /*!
+    The input, where the frames come from
   */
-  const cv::VideoCapture &getCaptureDevice()
+  const SFrameSource &getFrameSource() const
   {
-    return *m_video_capture;
+    return m_source;
   }
 
   /*!
-    The output device
+    Choose the output: an encoded video file (the default) or a chunked recording.
+    Change it before initializing the output.
+  */
+  /*!
+  /param format the kind of output
+  /param compression for a chunked recording: store the tiles as they are, or compressed
+  */
+  void setOutputFormat(const OutputFormat format, const ChunkCompression compression = ChunkCompression::Tiles)
+  {
+    m_output_format = format;
+    m_chunk_compression = compression;
+  }
+
+  const OutputFormat getOutputFormat() const
+  {
+    return m_output_format;
+  }
+
+  /*!
+    The output device (only for OutputFormat::Encoded)
   */
   const cv::VideoWriter &getWriterDevice()
   {
@@ -119,22 +426,91 @@ public:
     m_fps = fps;
   }
 
+  /*!
+    Start the pipelined mode. Both the input and the output must be initialized.
+    From now on the frame source and the writer are owned by the pipeline threads,
+    so don't read from or write to them yourself until stopPipeline().
+
+    Frames are handed round-robin to the workers and collected again in the same
+    order, so the video file always gets the frames in capture order.
+  */
+  /*!
+  /param processor the processing step that is run on every frame. If it throws, the
+    frame isn't written or shown, capture stops and getPipelineStats() has the error.
+  /param settings queue depth, amount of workers and back-pressure policy
+  returns false if the devices are not ready or the pipeline is already running
+  */
+  bool startPipeline(const FrameProcessor &processor, const PipelineSettings &settings = PipelineSettings());
+
+  /*!
+    The same, with a processing step that follows the decisions of the scheduler in
+    the settings. The scheduler is asked about every frame right after capture, the
+    pipeline itself takes care of the encode and display decisions, and the latency
+    of every frame (capture until it leaves the encoder) is reported back to it.
+  */
+  /*!
+  /param processor the processing step that is run on every frame, see above for when it throws
+  /param settings queue depth, amount of workers, back-pressure policy and scheduler
+  returns false if the devices are not ready or the pipeline is already running
+  */
+  bool startPipeline(const ScheduledFrameProcessor &processor, const PipelineSettings &settings = PipelineSettings());
+
+  /*!
+    Stop capturing, let the workers and the encoder finish the frames that are
+    still in flight and join all threads.
+  */
+  void stopPipeline();
+
+  /*!
+    True while the pipeline threads are running
+  */
+  bool isPipelineRunning() const;
+
+  /*!
+    Get the newest encoded frame for display. Call this from the GUI thread,
+    HighGUI doesn't like imshow from other threads. Nothing arrives here when the
+    pipeline has a display sink (see PipelineSettings::display).
+  */
+  /*!
+  /param frame receives the newest frame, untouched if there is none. Keep the
+  Frame (not only its image) as long as you use the image, see FramePool.h
+  returns true if a new frame was available
+  */
+  bool pollPreview(Frame &frame);
+
+  /*!
+    The frame counters and the occupancy of every queue in the pipeline
+  */
+  PipelineStats getPipelineStats() const;
+
   /*!
     Close the input device.
   */
   void closeInput()
   {
-    m_video_capture->release();
-    m_video_capture = nullptr;
+    m_source->release();
   }
 
   /*!
     Close the output device. Reinitializing will create a new video, overwriting the old one!
+    Returns false if a chunked recording couldn't be written completely.
   */
-  void closeOutput()
+  bool closeOutput()
   {
+    bool closed = true;
+    if (m_chunked_writer != nullptr)
+    {
+      // Writes the frame index at the end of the file
+      closed = m_chunked_writer->close();
+      m_chunked_writer = nullptr;
+    }
+
+    if (m_video_writer == nullptr)
+      return closed;
+
     m_video_writer->release();
     m_video_writer = nullptr;
+    return closed;
   }
 };
 
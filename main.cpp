@@ -3,43 +3,300 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <numeric>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "BatchProcessor.h"
+#include "ChangeDetector.h"
+#include "Compositor.h"
+#include "DisplaySink.h"
+#include "FilterGraph.h"
+#include "FrameScheduler.h"
+#include "GrayConvert.h"
 #include "Helper.h"
+#include "Metrics.h"
+#include "OverlayRenderer.h"
+#include "Pixelate.h"
+#include "SharedFrameRing.h"
+#include "SnapshotService.h"
+#include "StripeExecutor.h"
+#include "Trace.h"
+#include "Transcoder.h"
 #include "Video.h"
 
 using namespace cv;
 using namespace std;
 
-int main()
+/*
+Convert chunked recordings to video files, on all cores:
+  OpenCV_Tutorial --transcode output.cvchunk [more.cvchunk ...] [--segments N] [--threads N]
+*/
+int transcode(int argc, char **argv)
 {
+  vector<string> inputs;
+  TranscodeSettings settings;
+  for (int i = 2; i < argc; ++i)
+  {
+    const string argument = argv[i];
+    if (argument == "--segments" && i + 1 < argc)
+      settings.segments = atoi(argv[++i]);
+    else if (argument == "--threads" && i + 1 < argc)
+      settings.threads = atoi(argv[++i]);
+    else
+      inputs.push_back(argument);
+  }
+
+  int failed = 0;
+  for (const TranscodeResult &result : transcodeChunkedFiles(inputs, settings))
+  {
+    if (!result.error.empty())
+    {
+      cerr << result.input << ": " << result.error << endl;
+      ++failed;
+      continue;
+    }
+    cout << result.input << " [" << result.first_frame << ", " << result.first_frame + result.frames << ") -> "
+      << result.output << " in " << result.seconds << "s" << endl;
+  }
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+Run the filters over many videos and images offline, several files at the same time:
+  OpenCV_Tutorial --batch <file|directory|@list.txt> [...] [--filters "chain"] [--output DIR]
+    [--jobs N] [--queue N] [--manifest FILE] [--restart]
+A run that is stopped continues at the next file when it is started again, --restart
+processes everything again.
+*/
+int batch(int argc, char **argv)
+{
+  vector<string> paths;
+  BatchSettings settings;
+  for (int i = 2; i < argc; ++i)
+  {
+    const string argument = argv[i];
+    if (argument == "--filters" && i + 1 < argc)
+      settings.filters = argv[++i];
+    else if (argument == "--output" && i + 1 < argc)
+      settings.output_directory = argv[++i];
+    else if (argument == "--jobs" && i + 1 < argc)
+      settings.jobs = atoi(argv[++i]);
+    else if (argument == "--queue" && i + 1 < argc)
+      settings.queue_depth = (size_t)max(1, atoi(argv[++i]));
+    else if (argument == "--manifest" && i + 1 < argc)
+      settings.manifest = argv[++i];
+    else if (argument == "--restart")
+      settings.resume = false;
+    else
+      paths.push_back(argument);
+  }
+
+  const vector<string> inputs = collectBatchInputs(paths);
+  const BatchReport report = runBatch(inputs, settings, [](const BatchResult &result, const int done, const int total)
+  {
+    cout << "[" << done << "/" << total << "] " << result.input;
+    if (!result.error.empty())
+      cout << ": " << result.error << endl;
+    else if (result.resumed)
+      cout << " was done already" << endl;
+    else
+      cout << " -> " << result.output << ", " << result.frames << " frames in " << result.seconds << "s" << endl;
+  });
+  if (!report.error.empty())
+  {
+    cerr << report.error << endl;
+    return EXIT_FAILURE;
+  }
+
+  cout << report.processed << " files, " << report.frames << " frames in " << report.seconds << "s: "
+    << report.framesPerSecond() << " frames/s, " << report.megabytesPerSecond() << " MB/s ("
+    << report.resumed << " done before, " << report.failed << " failed)" << endl;
+  return report.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+Look at the frames of a recording that runs with --share NAME, from another process:
+  OpenCV_Tutorial --consume NAME [--duration S]
+The frames are read where they are in shared memory, this is the template for an analytics
+process: it only needs SharedFrameRing.h and SharedFrameRing.cpp.
+*/
+int consume(int argc, char **argv)
+{
+  const string name = argc > 2 ? argv[2] : "opencv_tutorial";
+  double duration = 0;
+  for (int i = 3; i < argc; ++i)
+  {
+    if (string(argv[i]) == "--duration" && i + 1 < argc)
+      duration = atof(argv[++i]);
+  }
+
+  SharedFrameReader reader;
+  if (!reader.open(name))
+  {
+    cerr << "No shared frames called " << name << ", start a recording with --share " << name << endl;
+    return EXIT_FAILURE;
+  }
+  cout << "Reading " << reader.getSize() << " frames from " << name << " (" << reader.getSlotCount() << " slots)" << endl;
+
+  const int64 start = getTickCount();
+  int64 last_report = start;
+  int64_t last_received = 0;
+  double brightness = 0;
+  while (!reader.isClosed())
+  {
+    SharedFrame frame;
+    if (!reader.next(frame))
+    {
+      this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    else
+    {
+      // The analysis runs on the slot itself, and only counts when the slot wasn't overwritten meanwhile
+      const double mean_level = mean(frame.image)[0];
+      if (reader.isIntact(frame))
+        brightness = mean_level;
+    }
+
+    const int64 now = getTickCount();
+    if ((now - last_report) / getTickFrequency() >= 1)
+    {
+      const SharedReaderStats stats = reader.getStats();
+      cout << (stats.received - last_received) / ((now - last_report) / getTickFrequency()) << " frames/s, brightness "
+        << brightness << ", skipped " << stats.skipped << ", torn " << stats.torn << endl;
+      last_report = now;
+      last_received = stats.received;
+    }
+    if (duration > 0 && (now - start) / getTickFrequency() >= duration)
+      break;
+  }
+
+  const SharedReaderStats stats = reader.getStats();
+  cout << "Frames received: " << stats.received << ", skipped: " << stats.skipped << ", torn: " << stats.torn << endl;
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && string(argv[1]) == "--transcode")
+    return transcode(argc, argv);
+  if (argc > 1 && string(argv[1]) == "--batch")
+    return batch(argc, argv);
+  if (argc > 1 && string(argv[1]) == "--consume")
+    return consume(argc, argv);
 
 
 
   // A class with helper functions
   Helper helper;
   
-  // A class with for video input/output. In this case output to "output.avi" and input from device 0 (webcam)
-  Video video("output.avi", 0);
+  /*
+  The input defaults to device 0 (webcam). No webcam? Give another frame source as
+  the first argument, e.g.: synthetic:1280x720, file:movie.avi, images:some/folder
+  or raw:frames.raw (see createFrameSource(..) in FrameSource.h)
+  */
+  const string input = argc > 1 ? argv[1] : "camera:0";
+  /*
+  Encoding MPEG while recording costs a lot of CPU. With --chunked, the frames are stored
+  in a chunked recording instead (see ChunkedRecording.h), which is hardly any work.
+  Convert it to a video afterwards with --transcode output.cvchunk
+
+  The processing of the recorded frames is a chain of filters (see FilterGraph.h), give
+  another one with --filters "chain" or --filters chain.txt, e.g.:
+    --filters "pixelate(block=$block) | blur(ksize=3) | text(text=$label)"
+  A chain that ends in gray is recorded in color (gray frames turned back into BGR).
+
+  With --gate, only the parts of a frame that changed go through the filters (see
+  ChangeGate below). It's lossy: a tile that differs by 2 or less per byte (on average)
+  from the frame before keeps its old result, and the filters run on one frame at a time.
+  Without it, every frame is filtered completely.
+
+  --trace trace.json records which thread ran which stage of which frame, and when (see
+  Trace.h). Open the file in chrome://tracing or https://ui.perfetto.dev to see why a
+  frame was slow: in capture, in a filter, waiting in a queue or in the encoder.
+
+  --headless runs without any window (on a server, or to see how fast the loop can go):
+  the images of the tutorial are only described, and the recording runs until the input
+  ends or for --duration seconds.
+
+  --share NAME puts every recorded frame into shared memory as well, for other processes on
+  this machine (see SharedFrameRing.h). Try it with OpenCV_Tutorial --consume NAME
+  */
+  bool chunked = false;
+  bool gated = false;
+  bool headless = false;
+  double duration = 0;
+  string trace_path;
+  string share_name;
+  string filters = "pixelate(block=$block, mirror=1) | text(text=$label, x=8, y=24, size=0.8)";
+  for (int i = 2; i < argc; ++i)
+  {
+    const string argument = argv[i];
+    if (argument == "--chunked")
+      chunked = true;
+    else if (argument == "--gate")
+      gated = true;
+    else if (argument == "--filters" && i + 1 < argc)
+      filters = argv[++i];
+    else if (argument == "--trace" && i + 1 < argc)
+      trace_path = argv[++i];
+    else if (argument == "--headless")
+      headless = true;
+    else if (argument == "--duration" && i + 1 < argc)
+      duration = atof(argv[++i]);
+    else if (argument == "--share" && i + 1 < argc)
+      share_name = argv[++i];
+  }
+  SFrameSource source = createFrameSource(input);
+  if (source == nullptr)
+  {
+    cerr << "Unknown input: " << input << endl;
+    return EXIT_FAILURE;
+  }
+
+  // Show an image and wait for a key, headless we go on right away
+  auto showAndWait = [headless](const string &window, const Mat &image)
+  {
+    if (headless)
+      return;
+    imshow(window, image);
+    waitKey();
+  };
+
+  // A class with for video input/output. In this case output to "output.avi" and input from the frame source
+  Video video(chunked ? "output.cvchunk" : "output.avi", source);
+  if (chunked)
+    video.setOutputFormat(OutputFormat::Chunked);
 
   // Initialize the input (webcam)
   bool is_open_input = video.initializeInput();
   // Assert that it's really open
   CV_Assert(is_open_input);
-  // Get the webcam caputure device
-  auto video_capture = video.getCaptureDevice();
   // An image is a matrix (cv::Mat) in OpenCV
   Mat frame;
-  // Request an image from the webcam
-  while (frame.empty())
-  	video_capture >> frame;
+  // Request an image from the webcam, a camera can take a moment to deliver the first one
+  const int first_frame_tries = 300;
+  for (int tries = 0; frame.empty() && tries < first_frame_tries; ++tries)
+  {
+    if (!video.read(frame) || frame.empty())
+      this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  if (frame.empty())
+  {
+    cerr << "No frame from the input: " << input << endl;
+    return EXIT_FAILURE;
+  }
 
   // Some matrix properties of the image frame we just pulled from the webcam
   cout << "This is an image of type:        " << helper.showCVMatType(frame.type()) << endl;
@@ -50,36 +307,66 @@ int main()
   cout << "The matrix dimensions amount is: " << frame.dims << endl;
 
   // Open a Window
-  namedWindow(WEBCAM_WINDOW, CV_WINDOW_FREERATIO);
-  // Show the image we pulled from the webcam in the named window
-  imshow(WEBCAM_WINDOW, frame);
+  if (!headless)
+    namedWindow(WEBCAM_WINDOW, CV_WINDOW_FREERATIO);
 
   // Write a message to the console
   cout << "Select the Webcam window and press a key to continue..." << endl << endl;
-  // Wait for any keyboard input
-  waitKey();
-  // Remove the opened window
-  destroyWindow(WEBCAM_WINDOW);
-  // Open a new window, different name
-  namedWindow(IMAGE_WINDOW, CV_WINDOW_FREERATIO);
+  // Show the image we pulled from the webcam in the named window, and wait for any keyboard input
+  showAndWait(WEBCAM_WINDOW, frame);
+  if (!headless)
+  {
+    // Remove the opened window
+    destroyWindow(WEBCAM_WINDOW);
+    // Open a new window, different name
+    namedWindow(IMAGE_WINDOW, CV_WINDOW_FREERATIO);
+  }
 
   /*
    A deep copy means that every value in the matrix is duplicated. This is in contrast to 
    a shallow copy, where only the memory address of the data is copied. A deep copy is slow, 
    but changing values in the deep copied matrix will not change the values in the original.   
   */
-  // Clone (deep copy) the webcam frame image
-  Mat img_matrix = frame.clone();
-  // Shallow copy the webcam image (try it, find out the difference!)
-  //Mat img_matrix = frame;
+
+  /*
+  Further down we stick images together into one big image: the color image with the gray
+  image right of it, and a random image below both. hconcat and vconcat would allocate a
+  new, bigger image for every step and copy everything into it again. Instead a Compositor
+  (see Compositor.h) allocates the big image once, with a panel for every part:
+
+    +-------+-------+
+    | color | gray  |
+    +-------+-------+
+    |    random     |
+    +---------------+
+
+  A panel is a view (a shallow copy of a part) of the big image. copyTo(..) makes the deep
+  copy of the webcam frame straight into the first panel, so img_matrix doesn't change
+  with the frame, and every change to img_matrix is a change to the big image.
+  */
+  const int w = frame.cols, h = frame.rows;
+  Compositor composite(Size(2 * w, 2 * h), { Rect(0, 0, w, h), Rect(w, 0, w, h), Rect(0, h, 2 * w, h) });
+  const int color_panel = 0, gray_panel = 1, random_panel = 2;
+  Mat img_matrix = composite.panel(color_panel);
+  frame.copyTo(img_matrix);
 
   /*
   Create a vector of unique (integer) random numbers. This way is better than using a RNG directly,
-  because we avoid duplicate numbers
+  because we avoid duplicate numbers. We use 8 of them below and 60 for a random matrix, so we
+  only draw those 68 (see Helper::sampleUnique(..)), not a shuffled list of all possible numbers.
   */
-  helper.initRandomIntVector(min<int>(img_matrix.rows, img_matrix.cols));
+  const int random_count = 8 + 3 * 4 * 5;
+  helper.initRandomIntVector(min<int>(img_matrix.rows, img_matrix.cols), 0, random_count);
   auto random_numbers = helper.getRandomIntVector();
 
+  /*
+  Statistics of an image don't need every pixel: the mean color of a few hundred random
+  pixels is already close to the mean of the whole image, at a fraction of the work.
+  */
+  const vector<Point> sample_locations = helper.samplePixels(500, img_matrix.size());
+  cout << "The mean color of the image is:                 " << mean(img_matrix) << endl;
+  cout << "The mean color of 500 random pixels of it is:   " << Helper::sampleMean(img_matrix, sample_locations) << endl;
+
   // Assign some random values for pixel locations, taken from vector positions 0 and 1 of the random numbers vector
   int x0 = random_numbers[0];
   int y0 = random_numbers[1];
@@ -91,18 +378,18 @@ int main()
   // Also paint on some text to go with the red dot
   std::stringstream text;
   text << "[" << x0 << ", " << y0 <<"]";
-  // Paint the text with nice black outline
-  Helper::putPrettyText(text.str(), Point(x0, y0), 0.8, img_matrix);
-  // Paint the colored dot
-  circle(img_matrix, Point(x0, y0), 3, Color_RED_LIGHT, -1, CV_AA);
+  // Queue the text with nice black outline and the colored dot, and paint them in one go
+  OverlayRenderer overlay;
+  overlay.addLabel(text.str(), Point(x0, y0), 0.8);
+  overlay.addCircle(Point(x0, y0), 3, Color_RED_LIGHT);
+  overlay.render(img_matrix);
 
   // Of course now the color value of the R channel at the chosen location is the maximal value (255)
   const int red_channel = 2;
   cout << "The color value of pixel [" << x0 << ", " << y0 << "] at the RED color channel is: " << (int) img_matrix.at<Vec3b>(y0, x0)[red_channel] << endl;
 
-  imshow(IMAGE_WINDOW, img_matrix);
   cout << "Select the Image window and press a key to continue..." << endl << endl;
-  waitKey();
+  showAndWait(IMAGE_WINDOW, img_matrix);
 
   // Convert the 3 channel color image to a 1 channel gray image
   Mat gray_img_matrix;
@@ -119,15 +406,18 @@ int main()
   // Note no vector anymore, just 1 value (cast to integer, otherwise it will show as an ASCII character because its type is unsigned char)
   cout << "The gray value of pixel [" << x1 << ", " << y1 << "] is: " << (int) gray_img_matrix.at<uchar>(y1, x1) << endl;
 
-  imshow(IMAGE_WINDOW, gray_img_matrix);
   cout << "Select the Image window and press a key to continue..." << endl << endl;
-  waitKey();
+  showAndWait(IMAGE_WINDOW, gray_img_matrix);
 
   // Commonly 32 bit (float) images with 1 channel have real values between [0 .. 1]
   // To convert to that, we need to scale 255 to 1
   // imshow will properly show unscaled CV_32F too though (I think... try it!)
+  // This could be gray_img_matrix.convertTo(gray_32bit_image, CV_32F, 1 / 255.0), but that
+  // reads the gray image we just wrote once more. bgrToGray goes from the color frame
+  // straight to floats in one pass (with the same values), see GrayConvert.h. It can also
+  // make half floats or 8.8 fixed point, half the bytes for whatever reads the result next.
   Mat gray_32bit_image;
-  gray_img_matrix.convertTo(gray_32bit_image, CV_32F, 1 / 255.0);
+  bgrToGray(frame, gray_32bit_image, GrayFormat::Float32);
 
   // Gray 32F image properties
   cout << "The gray float image type is: " << helper.showCVMatType(gray_32bit_image.type()) << endl;
@@ -140,13 +430,11 @@ int main()
   // Note no vector anymore, just 1 value (cast to integer, otherwise it will show as an ASCII character)
   cout << "The gray value of pixel [" << x2 << ", " << y2 << "] is: " << gray_32bit_image.at<float>(y2, x2) << endl;
 
-  // Let's concatenate the color image and the gray image horizontally.
-  // You can figure out yourself why we have to use cvtColor here!
-  Mat gray_as_color_matrix;
-  cvtColor(gray_img_matrix, gray_as_color_matrix, COLOR_GRAY2BGR);
-
-  // Concatenate horizontally (stick right to left, must have same height!)
-  hconcat(img_matrix, gray_as_color_matrix, img_matrix);
+  // Let's put the gray image right of the color image.
+  // You can figure out yourself why it needs a cvtColor(.., COLOR_GRAY2BGR) here!
+  // put(..) does that conversion straight into the panel, no gray-as-color copy in between.
+  // (With hconcat it was: cvtColor to a new image, then hconcat to another new image.)
+  composite.put(gray_panel, gray_img_matrix);
 
   // Some common matrix types
   cout << "A 3 channel 8 bit (color image) matrix reports as " << helper.showCVMatType(DataType<Vec3b>::type) << endl;
@@ -193,19 +481,31 @@ int main()
   // Reshape the vector to a 4x5 matrix with 3 color channels
   more_random_image = more_random_image.reshape(3, 4); // This is fast, because it doesn't copy any values!
 
-  // Upscale the image to the size of img_matrix
-  Mat scaled_mrm;
-  resize(more_random_image, scaled_mrm, img_matrix.size());
-  // Stick it to the bottom of img_matrix (must have same width!)
-  vconcat(img_matrix, scaled_mrm, img_matrix);
+  // Upscale the image to the size of the bottom panel, resize(..) writes straight into it
+  // (with vconcat it was: resize to a new image, then vconcat to yet another new image)
+  composite.put(random_panel, more_random_image);
 
+  /*
+  imwrite("image.jpg", ..) would encode the JPEG right here, which takes a while for a big
+  image. The snapshot service does that on threads of its own (see SnapshotService.h): we
+  get a std::future right away and only wait for it when we want to know how it went.
+  The image isn't copied, so we must not change it before the snapshot is written.
+  */
+  SnapshotService snapshots;
   cout << "We will save this beautiful image to a file. The image extension decides the type of image." << endl;
-  imwrite("image.jpg", img_matrix);
+  future<SnapshotResult> image_snapshot = snapshots.submit(composite.getCanvas(), "image.jpg");
 
   cout << "Select the Image window and press a key to continue..." << endl << endl;
-  imshow(IMAGE_WINDOW, img_matrix);
-  waitKey();
-  destroyWindow(IMAGE_WINDOW);
+  showAndWait(IMAGE_WINDOW, composite.getCanvas());
+  if (!headless)
+    destroyWindow(IMAGE_WINDOW);
+
+  // By now it's written for sure, but get() would wait for it otherwise
+  const SnapshotResult image_result = image_snapshot.get();
+  if (image_result.written)
+    cout << "Saved " << image_result.path << " (" << image_result.bytes / 1024 << " KB)" << endl;
+  else
+    cerr << "Could not save " << image_result.path << ": " << image_result.error << endl;
   
   /*
   In this next part we'll write a video
@@ -217,81 +517,294 @@ int main()
   */
   bool is_open_output = video.initializeOutput(frame.size());
   CV_Assert(is_open_output);
-  auto video_writer = video.getWriterDevice();
 
   cout << "A video is a sequence of images. Which means you keep reading images from the webcam in" << endl;
   cout << "a loop with a small delay to catch pressed keys (1 ms)." << endl;
   cout << "We will try to record the sequence and write it to an AVI video file called output.avi" << endl;
+  cout << "Press the <o> key to show or hide the frame rate on the video." << endl;
+  cout << "Press the <s> key to save a snapshot of the video." << endl;
   cout << "Press the <ESC> key to stop the loop and quit." << endl;
 
-  // Location for some writing on the frame
-  Point base_location(8, 24);
-
   // Time measures
-  int64 t, t0 = getTickCount();
-  int64 counter = 0;
+  const int64 t0 = getTickCount();
+
+  /*
+   * All measurements go into one place: the video reports how long capturing and encoding
+   * take, our processing steps report themselves. A background thread writes a snapshot
+   * to metrics.csv every second, the frame rate on the video is just one more reader.
+   */
+  SMetrics metrics = std::make_shared<Metrics>();
+  video.setMetrics(metrics);
+  StageMetrics &process_stage = metrics->stage("process");
+  StageMetrics &filters_stage = metrics->stage("filters");
+  snapshots.setMetrics(metrics);
+  metrics->startExport("metrics.csv", MetricsFormat::Csv);
+  // Toggled with the <o> key on the GUI thread, read by the workers
+  std::atomic<bool> show_overlay(true);
 
   // Keyboard input
   int key = -1;
-  
-  // Open a Window
-  namedWindow(WEBCAM_WINDOW, CV_WINDOW_FREERATIO);
 
   /*
-   * We create a track bar with an integer trackbar_value connected to it by reference.
-   * This means that when trackbar_value is updated by the trackbar, its value
-   * will also change here.
+   * The window of the recording runs on a thread of its own (see DisplaySink.h). Calling
+   * imshow(..) and waitKey(10) in this loop would cap it below 100 frames per second, and
+   * tie it to the events of the window. The encoder hands every frame to the display and
+   * goes on, the display shows the newest one and drops what it couldn't keep up with.
+   * Headless there is no window at all, and not one HighGUI call.
    */
-  int trackbar_value = 0;
-  createTrackbar(TRACKBAR_NAME, WEBCAM_WINDOW, &trackbar_value, 99);
+  SDisplaySink display = std::make_shared<DisplaySink>(WEBCAM_WINDOW, headless);
 
-  // As long as key is not <ESC> loop
-  while (key != 27)
+  /*
+   * We create a track bar in that window, from 0 to 99. HighGUI updates its value on the
+   * display thread, the workers read it with getTrackbar(..) whenever they need it.
+   */
+  const int pixelate_trackbar = display->addTrackbar(TRACKBAR_NAME, 99);
+  display->start();
+
+  /*
+   * When the computer can't keep up (a slow encoder, a large pixelation), frames would
+   * just arrive later and later. The scheduler watches how long every frame takes from
+   * capture until it's written, and when that's over the budget it sheds work in the
+   * order of its ladder: first the overlay, then the resolution, then frames for the
+   * screen and at last frames for the video file. What it did ends up in metrics.csv.
+   */
+  SFrameScheduler scheduler = std::make_shared<FrameScheduler>();
+  scheduler->setMetrics(metrics);
+
+  /*
+   * The processing that is done on every frame. It runs on the worker threads of
+   * the pipeline, while the capture thread already grabs the next frame and the
+   * encoder thread writes the previous one to the video file. The decision tells
+   * what the scheduler wants us to leave out for this frame.
+   */
+  /*
+   * The filters of a frame are a FilterGraph, made from the chain description. It works
+   * out once which steps can share a buffer, and fuses filters that work row by row into
+   * one pass. A file with the chain works too.
+   */
+  FilterGraph graph;
+  string graph_error;
+  const bool is_graph_ok = ifstream(filters).good() ? graph.load(filters, graph_error) : graph.parse(filters, graph_error);
+  if (!is_graph_ok)
+  {
+    cerr << "Wrong --filters: " << graph_error << endl;
+    return EXIT_FAILURE;
+  }
+  // The output takes color frames, a chain that ends in gray gets them back to color
+  if (graph.outputType(frame.type()) != frame.type() && !graph.parse("bgr", graph_error))
   {
-    // Retrieve a frame from the webcam
-    video_capture >> frame;
-    
-    // Use the track bar value to scale the video image
-    if (trackbar_value != 0)
+    cerr << "Wrong --filters: " << graph_error << endl;
+    return EXIT_FAILURE;
+  }
+  cout << "The filters of every frame:" << endl << graph.describe(frame.type(), true);
+
+  // The frames for other processes: a ring of the frames as the filters leave them in shared memory
+  SSharedFramePublisher publisher;
+  if (!share_name.empty())
+  {
+    publisher = std::make_shared<SharedFramePublisher>();
+    if (publisher->create(share_name, frame.size(), graph.outputType(frame.type())))
+      cout << "Sharing the frames as " << share_name << ", read them with --consume " << share_name << endl;
+    else
     {
-      double scale = 1 / (double)(trackbar_value + 1);
-      resize(frame, frame, Size(), scale, scale);
-      // Scale back to original size, now using INTER_NEAREST as interpolation to
-      // create a block effect
-      resize(frame, frame, Size(), 1 / scale, 1 / scale, INTER_NEAREST);
+      cerr << "Could not make the shared frames " << share_name << " (is another publisher using the name?)" << endl;
+      publisher = nullptr;
     }
+  }
 
-    // Flip the image horizontally to get intuitive movement
-    flip(frame, frame, 1);
+  /*
+   * A frame of 4K is too much for one core. The filters of a frame run stripe by stripe
+   * on all cores (see StripeExecutor.h): a stripe stays in the cache of its core while it
+   * goes through all filters, and the frame is done in a fraction of the time.
+   */
+  graph.setExecutor(std::make_shared<StripeExecutor>(std::make_shared<ThreadPool>()));
 
-    // Calculate time running and FPS
-    t = getTickCount();
-    double time_spent = (t - t0) / getTickFrequency();
-    double fps = counter++ / time_spent;
+  /*
+   * A camera on a quiet scene hardly changes from one frame to the next. The change gate
+   * (--gate) compares every frame tile by tile with the frame before (see ChangeDetector.h),
+   * and only the rows with a changed tile go through the filters again, the rest is copied
+   * from the result of an earlier frame. The label changes whatever the camera sees, its
+   * rows are filtered on every frame. How much it skipped goes to metrics.csv.
+   */
+  ChangeGate gate;
+  gate.setMetrics(metrics);
+
+  ScheduledFrameProcessor process_frame = [&](Mat &frame, const FrameDecision &decision)
+  {
+    // The values of the $names in the chain, one set per worker thread that is reused
+    static thread_local GraphValues values;
+
+    /*
+     * Use the track bar value to create a block effect, and flip the image horizontally
+     * to get intuitive movement. This used to be a resize down, a resize back up with
+     * INTER_NEAREST and a flip: three passes over the frame. pixelateFlip(..) gives
+     * the same picture in one pass (see Pixelate.h), with a block of 1 it's just a flip.
+     *
+     * At a reduced resolution the block is at least 1 / scale pixels: that's exactly
+     * processing a smaller image and scaling it back up, and pixelateFlip(..) only
+     * reads the center rows of the blocks, so it's cheaper too.
+     */
+    values.set("block", max(display->getTrackbar(pixelate_trackbar) + 1, cvRound(1 / decision.scale)));
+
+    // No text is no label
+    values.setText("label", "");
+    if (show_overlay && decision.overlay)
+    {
+      // Calculate time running and the FPS of the last second (not since the start,
+      // that would hardly move anymore after a few minutes)
+      int64 t = getTickCount();
+      double time_spent = (t - t0) / getTickFrequency();
+      double fps = metrics->fps(process_stage);
+
+      // A fixed char buffer instead of a std::stringstream, that would allocate (and free)
+      // its memory on every frame
+      char text[64];
+      snprintf(text, sizeof(text), "%ds [%dfps]", cvRound(time_spent), cvRound(fps));
+      values.setText("label", text);
+    }
+
+    StageTimer timer(metrics.get(), &filters_stage);
+    // The pipeline told the trace which frame this worker is on, see TraceFrame
+    TraceScope trace("filters");
+    if (!gated)
+    {
+      graph.run(frame, frame, values);
+      return;
+    }
+    // Another block size changes every pixel, that filters the whole frame again
+    gate.run(frame, frame, values.get("block"), graph.drawnRows(frame.size(), values),
+      [&](const Mat &src, Mat &result, const vector<Range> &rows)
+    {
+      graph.runRows(src, result, rows, values);
+    });
+  };
+
+  /*
+   * Run capture, processing and encoding on their own threads. The queues between
+   * them absorb hiccups of the encoder, so the capture rate doesn't drop with it.
+   */
+  PipelineSettings pipeline_settings;
+  pipeline_settings.queue_depth = 8;
+  /*
+   * The change gate builds every result on the one before, so it takes one frame at a time:
+   * a second worker would only wait for it. The filters still use all cores, stripe by
+   * stripe on the executor of the graph.
+   */
+  pipeline_settings.workers = gated ? 1 : 2;
+  pipeline_settings.back_pressure = BackPressure::Block;
+  pipeline_settings.scheduler = scheduler;
+  pipeline_settings.display = display;
+  pipeline_settings.publisher = publisher;
+  // The trace starts with the pipeline, so the threads get their buffers (and names) right away
+  if (!trace_path.empty())
+  {
+    Trace::setThreadName("gui");
+    Trace::start();
+  }
+  bool is_pipeline_started = video.startPipeline(process_frame, pipeline_settings);
+  CV_Assert(is_pipeline_started);
 
-    // Write on the frame
-    std::stringstream text;
-    text << cvRound(time_spent) << "s [" << cvRound(fps) << "fps]";
+  if (headless && duration > 0)
+    cout << "Recording without a window for " << duration << " seconds" << endl;
+  else if (headless)
+    cout << "Recording without a window until the input ends" << endl;
+  const int64 loop_start = getTickCount();
 
-    // Print the frame rate into the image
-    Helper::putPrettyText(text.str(), base_location, 0.8, frame);
+  // As long as key is not <ESC> loop
+  while (key != 27 && video.isPipelineRunning())
+  {
+    // Wait for a key from the window, but look at the pipeline (and the clock) every 100ms
+    key = display->waitKey(100);
+    if (key == 'o')
+      show_overlay = !show_overlay;
+    // The frame in the window (a Frame keeps its pooled buffer in use until the snapshot is written, see FramePool.h)
+    if (key == 's')
+    {
+      Frame shown = display->getShown();
+      if (!shown.image.empty())
+        snapshots.submit(shown, "snapshot_" + to_string(snapshots.getStats().submitted) + ".jpg");
+    }
+    if (duration > 0 && (getTickCount() - loop_start) / getTickFrequency() >= duration)
+      break;
+  }
 
-    // Write the frame to the video file
-    video_writer << frame;
+  // Stop the pipeline (finish writing the frames that are still queued), then close the window
+  video.stopPipeline();
+  display->stop();
 
-    // Show the frame image
-    imshow(WEBCAM_WINDOW, frame);
+  // All threads of the pipeline are done, so the trace is complete
+  if (!trace_path.empty())
+  {
+    Trace::stop();
+    TraceStats trace_stats = Trace::getStats();
+    if (Trace::writeChromeJSON(trace_path))
+      cout << "Trace of " << trace_stats.events << " events on " << trace_stats.threads << " threads written to " << trace_path
+        << " (" << trace_stats.dropped << " did not fit)" << endl;
+    else
+      cerr << "Could not write the trace " << trace_path << endl;
+  }
 
-    // Get the keyboard input and wait 10ms to allow timely writing
-    key = waitKey(10);
+  // Show how full the queues got, a queue that hit its capacity is a bottleneck behind it
+  PipelineStats pipeline_stats = video.getPipelineStats();
+  cout << "Frames captured: " << pipeline_stats.captured << ", processed: " << pipeline_stats.processed
+    << ", encoded: " << pipeline_stats.encoded << ", dropped: " << pipeline_stats.dropped << endl;
+  if (pipeline_stats.encode_failed > 0)
+    cerr << "Frames the output refused: " << pipeline_stats.encode_failed << endl;
+  if (!pipeline_stats.error.empty())
+    cerr << "The processing of a frame failed, the recording stopped: " << pipeline_stats.error << endl;
+  // The frames the window couldn't keep up with were replaced by newer ones, the recording didn't wait for it
+  DisplayStats display_stats = display->getStats();
+  cout << "Frames for the window: " << display_stats.offered << ", shown: " << display_stats.shown
+    << ", replaced by a newer one: " << display_stats.replaced << endl;
+  // What the scheduler gave up to keep the frames within their latency budget
+  SchedulerStats scheduler_stats = scheduler->getStats();
+  cout << "Frames over the " << scheduler->getSettings().budget_ms << " ms budget: " << scheduler_stats.late
+    << ", levels up: " << scheduler_stats.escalations << ", down: " << scheduler_stats.relaxations << endl;
+  cout << "  overlay skipped: " << scheduler_stats.overlay_skipped << ", resolution reduced: " << scheduler_stats.resolution_reduced
+    << ", not encoded: " << scheduler_stats.encode_dropped << ", not shown: " << scheduler_stats.display_dropped << endl;
+  for (const QueueStats &queue : pipeline_stats.queues)
+    cout << "  " << queue.name << ": high water " << queue.high_water << "/" << queue.capacity
+      << ", pushed " << queue.pushed << ", rejected " << queue.rejected << endl;
+  // Once all queues are full, every frame reuses a buffer: allocations stays at the amount of buffers
+  cout << "Frame buffers: " << pipeline_stats.pool.buffers << " (" << pipeline_stats.pool.bytes_allocated / (1024 * 1024)
+    << " MB), allocations: " << pipeline_stats.pool.allocations << ", reuses: " << pipeline_stats.pool.reuses << endl;
+
+  // How much of the filtering the change gate could skip
+  if (gated)
+  {
+    ChangeStats change_stats = gate.getStats();
+    cout << "Unchanged tiles: " << cvRound(change_stats.tileSkipRatio() * 100) << "%, rows not filtered: "
+      << cvRound(change_stats.skipRatio() * 100) << "%, filtering saved about " << change_stats.savedNanoseconds() / 1000000
+      << " ms for " << change_stats.overhead_ns / 1000000 << " ms of change detection" << endl;
+  }
+
+  // The readers see the ring is closed
+  if (publisher != nullptr)
+  {
+    cout << "Frames shared: " << publisher->getPublished() << endl;
+    publisher->close();
   }
 
-  // Release the video_writer (finish writing)
-  video_writer.release();
+  // The snapshots that are still being written
+  snapshots.wait();
+  SnapshotStats snapshot_stats = snapshots.getStats();
+  cout << "Snapshots written: " << snapshot_stats.written << ", failed: " << snapshot_stats.failed
+    << ", dropped: " << snapshot_stats.dropped << ", most queued: " << snapshot_stats.high_water << endl;
+
+  // Write the last snapshot of the metrics
+  metrics->stopExport();
+  for (const MetricsSnapshot::Stage &stage : metrics->snapshot().stages)
+    cout << "  " << stage.name << ": " << stage.count << " frames, mean " << stage.mean_ms << " ms, p99 " << stage.p99_ms << " ms" << endl;
+
+  // Release the video writer (finish writing)
+  const bool output_closed = video.closeOutput();
+  if (!output_closed)
+    cerr << "The recording couldn't be written completely" << endl;
 
   // Remove all open windows
-  destroyAllWindows();
+  if (!headless)
+    destroyAllWindows();
 
-  // Return error code 0 (no errors) to the console
-  return EXIT_SUCCESS;
+  // Return error code 0 (no errors) to the console, unless the processing failed
+  return pipeline_stats.error.empty() && output_closed ? EXIT_SUCCESS : EXIT_FAILURE;
 }